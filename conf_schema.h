@@ -351,6 +351,7 @@ STRING(256,                 interface_path, "", str_nonempty,, "Path of director
 ATOM(uint32_t,              config_reload_interval_ms, 1000, uint32_nonzero,, "Time interval between configuration reload polls, in milliseconds")
 SUB_STRUCT(watchdog,        watchdog,)
 STRING(120,                 motd,      "", str_nonempty,, "Message Of The Day displayed on HTTPD root page")
+ATOM(int32_t,               worker_threads, 2, int32_nonneg,, "Number of threads for hashing, encrypting and writing payloads, 0 to do this work on the main thread")
 END_STRUCT
 
 STRUCT(monitor)
@@ -363,6 +364,7 @@ ATOM(int32_t,               tick_ms,         -1, int32_nonneg,, "Keep alive inte
 ATOM(int32_t,               packet_interval, -1, int32_nonneg,, "Minimum interval between packets in microseconds")
 ATOM(int32_t,               reachable_timeout_ms, -1, int32_nonneg,, "Inactivity timeout after which node considered unreachable")
 ATOM(int32_t,               transmit_timeout_ms, 1000, int32_nonneg,, "Maximum duration to hold a packet before transmission")
+ATOM(int32_t,               aggregate_ms,    0, int32_nonneg,, "Maximum duration to hold small ordinary frames while waiting for more to fill the packet, 0 to send immediately")
 ATOM(bool_t,                drop,            0, boolean,, "If true, drop all incoming packets")
 ATOM(bool_t,                send,            1, boolean,, "If false, don't send any packets")
 ATOM(bool_t,                route,           1, boolean,, "If false, do not advertise any links")
@@ -372,6 +374,8 @@ END_STRUCT
 STRUCT(mdp)
 ATOM(bool_t,                enable_inet, 0, boolean,, "If true, allow mdp clients to connect over loopback UDP")
 STRING(256,                 filter_rules_path, "", str_nonempty,, "Path of file containing MDP filter rules, either absolute or relative to instance directory")
+ATOM(uint32_t,              nm_cache_entries, 512, uint32_nonzero,, "Maximum number of Curve25519 shared secrets cached for encrypting to and decrypting from peers")
+ATOM(bool_t,                legacy_link_state, 0, boolean,, "If true, send link state without sequence numbers as older versions did, for testing purposes")
 END_STRUCT
 
 STRUCT(vomp)
@@ -436,6 +440,8 @@ STRUCT(rhizome_mdp)
 ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome MDP server is started")
 ATOM(uint64_t,              stall_timeout,      1000, uint64_scaled,, "Timeout to request more data.")
 ATOM(uint64_t,              block_size, 512, uint64_scaled,, "Transfer block size.")
+ATOM(uint32_t,              cache_entries, 64, uint32_nonzero,, "Maximum number of payloads held open for serving blocks")
+ATOM(uint64_t,              cache_size, 64*1024*1024, uint64_scaled,, "Maximum number of payload bytes mapped into memory for serving blocks")
 END_STRUCT
 
 STRUCT(rhizome_advertise)
@@ -443,6 +449,12 @@ ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome advertise
 ATOM(uint32_t,              interval,   500, uint32_nonzero,, "Interval between Rhizome advertisements")
 END_STRUCT
 
+STRUCT(rhizome_wal)
+ATOM(bool_t,                enable,           0, boolean,, "If true, the Rhizome database uses a write-ahead log, so readers are not blocked while the server writes")
+ATOM(uint32_t,              checkpoint_pages, 1000, uint32_nonzero,, "Copy the write-ahead log back into the database once it exceeds this many pages")
+ATOM(bool_t,                truncate_on_close, 1, boolean,, "If true, the server empties the write-ahead log when it closes the database")
+END_STRUCT
+
 STRUCT(rhizome)
 ATOM(bool_t,                enable,         1, boolean,, "If true, server opens Rhizome database when starting")
 ATOM(bool_t,                fetch,          1, boolean,, "If false, no new bundles will be fetched from peers")
@@ -454,6 +466,10 @@ ATOM(uint64_t,              min_free_space, 100*1024*1024, uint64_scaled,, "Mini
 ATOM(uint32_t,              max_blob_size,  128 * 1024, uint32_scaled,, "Store payloads larger than this in files not SQLite blobs")
 ATOM(uint64_t,              idle_timeout,   RHIZOME_IDLE_TIMEOUT, uint64_scaled,, "Rhizome transfer timeout if no data received.")
 ATOM(uint32_t,              fetch_delay_ms, 50, uint32_nonzero,, "Delay from receiving first bundle advert to initiating fetch")
+ATOM(uint32_t,              commit_bundles, 32, uint32_nonzero,, "Maximum number of received bundles to store in one database transaction, 1 to commit each bundle")
+ATOM(uint32_t,              commit_interval_ms, 100, uint32_nonzero,, "Maximum time to wait before committing received bundles to the database")
+ATOM(bool_t,                rollback_batches, 0, boolean,, "If true, roll back every batch of received bundles instead of committing it, for testing purposes")
+SUB_STRUCT(rhizome_wal,     wal,)
 SUB_STRUCT(rhizome_direct,  direct,)
 SUB_STRUCT(rhizome_api,     api,)
 SUB_STRUCT(rhizome_http,    http,)
@@ -498,6 +514,7 @@ ATOM(bool_t,                debug,           0, boolean,, "If true, log details
 ATOM(bool_t,                point_to_point,  0, boolean,, "If true, assume there will only be two devices on this interface")
 ATOM(bool_t,                ctsrts,          0, boolean,, "If true, enable CTS/RTS hardware handshaking")
 ATOM(int32_t,               uartbps,         57600, int32_rs232baudrate,, "Speed of serial UART link speed (which may be different to serial device link speed)")
+ATOM(uint16_t,              rx_batch,        16, uint16_nonzero,, "Maximum number of packets to read from a dgram interface each time it becomes readable")
 END_STRUCT
 
 ARRAY(interface_list, NO_DUPLICATES)
@@ -46,23 +46,409 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
   POSSIBILITY OF SUCH DAMAGE.
 */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <inttypes.h> // for PRIu64
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <pthread.h>
+#endif
 #include "fdqueue.h"
 #include "conf.h"
 #include "net.h"
+#include "mem.h"
 #include "str.h"
 #include "strbuf.h"
 #include "strbuf_helpers.h"
 #include "debug.h"
 
-#define MAX_WATCHED_FDS 128
-__thread struct pollfd fds[MAX_WATCHED_FDS];
+// The fds[] and fd_callbacks[] arrays grow in chunks of this many slots.
+#define WATCHED_FDS_CHUNK 64
+
+__thread struct pollfd *fds=NULL;
 __thread int fdcount=0;
-__thread struct sched_ent *fd_callbacks[MAX_WATCHED_FDS];
+__thread struct sched_ent **fd_callbacks=NULL;
+static __thread int fd_capacity=0;
+
+// More than one alarm may watch the same file descriptor (eg, separate input and output
+// alarms on one socket).  fd_index[fd] is the index in fds[] of the first alarm watching fd, or
+// -1, and fd_next[index] links to the next alarm watching the same file descriptor.
+static __thread int *fd_index=NULL;
+static __thread int fd_index_size=0;
+static __thread int *fd_next=NULL;
+
+// File descriptors reported as ready by the last call to the backend's wait function.
+struct fd_ready {
+  int fd;
+  short revents;
+};
+static __thread struct fd_ready *ready=NULL;
+
+/* Scheduled alarms are kept in three binary min-heaps, so that scheduling and unscheduling an
+ * alarm is O(log n) in the number of pending alarms:
+ *  - wake_list, ordered by wake_at, of alarms that must wake the CPU;
+ *  - run_soon, ordered by run_after, of alarms that are not yet runnable;
+ *  - run_now, ordered by run_before, of runnable alarms.
+ * Every scheduled alarm is in exactly one of run_soon or run_now.  Alarms with equal times are
+ * run in the order they were scheduled.
+ */
+struct alarm_heap {
+  struct sched_ent **alarms;
+  unsigned count;
+  unsigned size;
+  // the time field that orders this heap
+  size_t key_offset;
+};
+
+#define HEAP_KEY(HEAP, ALARM) (*(const time_ms_t *)((const char *)(ALARM) + (HEAP)->key_offset))
+#define ALARM_HEAP(KEY) {.key_offset = offsetof(struct sched_ent, KEY)}
+
+__thread struct alarm_heap wake_list = ALARM_HEAP(wake_at);
+__thread struct alarm_heap run_soon = ALARM_HEAP(run_after);
+__thread struct alarm_heap run_now = ALARM_HEAP(run_before);
+static __thread uint64_t schedule_sequence = 0;
+// counts the watched file descriptors dispatched by fd_poll2(), see sched_ent._io_pass
+static __thread uint64_t io_pass = 0;
+
+static int get_fd_index(int fd)
+{
+  if (fd < 0 || fd >= fd_index_size)
+    return -1;
+  return fd_index[fd];
+}
+
+// the union of the events that all alarms watching fd are interested in
+static short fd_events(int fd)
+{
+  short events = 0;
+  int i;
+  for (i = get_fd_index(fd); i != -1; i = fd_next[i])
+    events |= fds[i].events;
+  return events;
+}
+
+/* A readiness backend tells fd_poll2() which watched file descriptors have pending events, so
+ * that only those need to be dispatched.  The poll(2) backend is always available and simply
+ * scans fds[].  On Linux the epoll(7) backend keeps the kernel informed of every change, so
+ * waiting costs nothing per idle file descriptor.
+ */
+struct fd_backend {
+  const char *name;
+  // the events wanted for fd have changed from old_events to events; zero means not watched
+  int (*update)(int fd, short old_events, short events);
+  // wait for IO, fill ready[] and return the number of ready file descriptors, or -1 on error
+  int (*wait)(int timeout_ms);
+};
+
+static int poll_wait(int timeout_ms)
+{
+  int r = poll(fds, fdcount, timeout_ms);
+  if (r<=0)
+    return r;
+  int i, n=0;
+  for (i = fdcount - 1; i >= 0 && n < r; i--){
+    if (!fds[i].revents)
+      continue;
+    short revents = fds[i].revents;
+    int j = get_fd_index(fds[i].fd);
+    if (j != -1 && fd_next[j] != -1){
+      // report a shared file descriptor once, on the first watcher we encounter with events
+      int first = 1;
+      for (; j != -1; j = fd_next[j]){
+	if (j > i && fds[j].revents)
+	  first = 0;
+	revents |= fds[j].revents;
+      }
+      if (!first)
+	continue;
+    }
+    ready[n].fd = fds[i].fd;
+    ready[n].revents = revents;
+    n++;
+  }
+  return n;
+}
+
+static struct fd_backend poll_backend = {
+  .name = "poll",
+  .wait = poll_wait,
+};
+
+#ifdef HAVE_SYS_EPOLL_H
+static struct fd_backend epoll_backend;
+static __thread struct fd_backend *backend = &epoll_backend;
+
+static __thread int epoll_fd=-1;
+static __thread struct epoll_event *epoll_events=NULL;
+static __thread int epoll_events_size=0;
+// File descriptors that epoll(7) refuses to watch (eg, regular files) are always ready, just as
+// poll(2) would report them.  Indexed by file descriptor number.
+static __thread uint8_t *epoll_always_ready=NULL;
+static __thread int epoll_always_ready_size=0;
+static __thread int epoll_always_ready_count=0;
+// A child forked without exec shares the parent's epoll set, so it builds its own on first use.
+static __thread uint8_t epoll_forked=0;
+static uint8_t epoll_atfork_registered=0;
+
+static uint32_t epoll_events_from_poll(short events)
+{
+  uint32_t ret = 0;
+  if (events & POLLIN) ret |= EPOLLIN;
+  if (events & POLLPRI) ret |= EPOLLPRI;
+  if (events & POLLOUT) ret |= EPOLLOUT;
+  return ret;
+}
+
+static short poll_events_from_epoll(uint32_t events)
+{
+  short ret = 0;
+  if (events & EPOLLIN) ret |= POLLIN;
+  if (events & EPOLLPRI) ret |= POLLPRI;
+  if (events & EPOLLOUT) ret |= POLLOUT;
+  if (events & EPOLLERR) ret |= POLLERR;
+  if (events & EPOLLHUP) ret |= POLLHUP;
+  return ret;
+}
+
+static int is_always_ready(int fd)
+{
+  return fd < epoll_always_ready_size && epoll_always_ready[fd];
+}
+
+static int set_always_ready(int fd)
+{
+  if (fd >= epoll_always_ready_size){
+    int size = epoll_always_ready_size ? epoll_always_ready_size : WATCHED_FDS_CHUNK;
+    while (size <= fd)
+      size *= 2;
+    uint8_t *new_always_ready = erealloc(epoll_always_ready, size);
+    if (!new_always_ready)
+      return -1;
+    bzero(new_always_ready + epoll_always_ready_size, size - epoll_always_ready_size);
+    epoll_always_ready = new_always_ready;
+    epoll_always_ready_size = size;
+  }
+  epoll_always_ready[fd] = 1;
+  epoll_always_ready_count++;
+  return 0;
+}
+
+static void epoll_atfork_child()
+{
+  if (epoll_fd != -1){
+    close(epoll_fd);
+    epoll_fd = -1;
+    epoll_forked = 1;
+  }
+}
 
-__thread struct sched_ent *wake_list=NULL;
-__thread struct sched_ent *run_soon=NULL;
-__thread struct sched_ent *run_now=NULL;
+static int epoll_update(int fd, short old_events, short events);
+
+// add every watched file descriptor to a new epoll set, with the events wanted now
+static int epoll_rebuild()
+{
+  epoll_forked = 0;
+  if (epoll_always_ready)
+    bzero(epoll_always_ready, epoll_always_ready_size);
+  epoll_always_ready_count = 0;
+  int i;
+  for (i = 0; i < fdcount; i++)
+    if (get_fd_index(fds[i].fd) == i && epoll_update(fds[i].fd, 0, fd_events(fds[i].fd)) == -1)
+      return -1;
+  return 0;
+}
+
+static int epoll_update(int fd, short old_events, short events)
+{
+  if (epoll_forked)
+    return epoll_rebuild();
+  if (epoll_fd == -1){
+    if (!epoll_atfork_registered){
+      int r = pthread_atfork(NULL, NULL, epoll_atfork_child);
+      if (r)
+	WARNF("pthread_atfork: %s", strerror(r));
+      epoll_atfork_registered = 1;
+    }
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1){
+      // nothing has been added to an epoll set yet, so poll(2) can take over completely
+      WARN_perror("epoll_create1");
+      WARN("Falling back to poll(2)");
+      backend = &poll_backend;
+      return 0;
+    }
+  }
+  if (is_always_ready(fd)){
+    if (!events){
+      epoll_always_ready[fd] = 0;
+      epoll_always_ready_count--;
+    }
+    return 0;
+  }
+  struct epoll_event ev = {
+    .events = epoll_events_from_poll(events),
+    .data.fd = fd
+  };
+  if (!old_events){
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1){
+      if (errno != EPERM)
+	return WHYF_perror("epoll_ctl(%d, EPOLL_CTL_ADD, %d)", epoll_fd, fd);
+      DEBUGF(io, "#%d cannot be watched by epoll, treating it as always ready", fd);
+      return set_always_ready(fd);
+    }
+  }else if(!events){
+    // the file descriptor may already have been closed, which removes it from the epoll set
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev) == -1 && errno != EBADF && errno != ENOENT)
+      return WHYF_perror("epoll_ctl(%d, EPOLL_CTL_DEL, %d)", epoll_fd, fd);
+  }else{
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1)
+      return WHYF_perror("epoll_ctl(%d, EPOLL_CTL_MOD, %d)", epoll_fd, fd);
+  }
+  return 0;
+}
+
+static int epoll_wait_ready(int timeout_ms)
+{
+  if (epoll_forked && epoll_rebuild() == -1)
+    return -1;
+  if (epoll_always_ready_count)
+    timeout_ms = 0;
+  int n = 0;
+  if (epoll_fd != -1){
+    if (epoll_events_size < fd_capacity){
+      struct epoll_event *e = erealloc(epoll_events, sizeof(struct epoll_event) * fd_capacity);
+      if (!e)
+	return -1;
+      epoll_events = e;
+      epoll_events_size = fd_capacity;
+    }
+    int r = epoll_wait(epoll_fd, epoll_events, epoll_events_size, timeout_ms);
+    if (r == -1)
+      return -1;
+    for (; n < r; n++){
+      ready[n].fd = epoll_events[n].data.fd;
+      ready[n].revents = poll_events_from_epoll(epoll_events[n].events);
+    }
+  }else if(timeout_ms > 0){
+    sleep_ms(timeout_ms);
+  }
+  if (epoll_always_ready_count){
+    int i;
+    for (i = 0; i < fdcount; i++){
+      if (is_always_ready(fds[i].fd) && get_fd_index(fds[i].fd) == i){
+	ready[n].fd = fds[i].fd;
+	ready[n].revents = fd_events(fds[i].fd) & (POLLIN|POLLOUT);
+	n++;
+      }
+    }
+  }
+  return n;
+}
+
+static struct fd_backend epoll_backend = {
+  .name = "epoll",
+  .update = epoll_update,
+  .wait = epoll_wait_ready,
+};
+
+#else
+static __thread struct fd_backend *backend = &poll_backend;
+#endif
+
+const char *fd_backend_name()
+{
+  return backend->name;
+}
+
+// Choose the readiness backend by name; only possible while no file descriptors are watched.
+int fd_select_backend(const char *name)
+{
+  if (fdcount)
+    return WHY("Cannot change IO backend while file descriptors are being watched");
+  if (strcmp(name, poll_backend.name) == 0){
+    backend = &poll_backend;
+    return 0;
+  }
+#ifdef HAVE_SYS_EPOLL_H
+  if (strcmp(name, epoll_backend.name) == 0){
+    backend = &epoll_backend;
+    return 0;
+  }
+#endif
+  return WHYF("Unsupported IO backend %s", alloca_str_toprint(name));
+}
+
+static int grow_watched_fds()
+{
+  int capacity = fd_capacity + WATCHED_FDS_CHUNK;
+  struct pollfd *new_fds = erealloc(fds, sizeof(struct pollfd) * capacity);
+  if (!new_fds)
+    return -1;
+  fds = new_fds;
+  struct sched_ent **new_callbacks = erealloc(fd_callbacks, sizeof(struct sched_ent *) * capacity);
+  if (!new_callbacks)
+    return -1;
+  fd_callbacks = new_callbacks;
+  int *new_next = erealloc(fd_next, sizeof(int) * capacity);
+  if (!new_next)
+    return -1;
+  fd_next = new_next;
+  struct fd_ready *new_ready = erealloc(ready, sizeof(struct fd_ready) * capacity);
+  if (!new_ready)
+    return -1;
+  ready = new_ready;
+  fd_capacity = capacity;
+  return 0;
+}
+
+// add fds[index] to the list of alarms watching its file descriptor
+static int link_fd_index(int index)
+{
+  int fd = fds[index].fd;
+  if (fd < 0)
+    return WHYF("Invalid file descriptor %d", fd);
+  if (fd >= fd_index_size){
+    int size = fd_index_size ? fd_index_size : WATCHED_FDS_CHUNK;
+    while (size <= fd)
+      size *= 2;
+    int *new_index = erealloc(fd_index, sizeof(int) * size);
+    if (!new_index)
+      return -1;
+    int i;
+    for (i = fd_index_size; i < size; i++)
+      new_index[i] = -1;
+    fd_index = new_index;
+    fd_index_size = size;
+  }
+  fd_next[index] = fd_index[fd];
+  fd_index[fd] = index;
+  return 0;
+}
+
+// remove fds[index] from the list of alarms watching its file descriptor, or move it to a new index
+static void relink_fd_index(int index, int new_index)
+{
+  int *p = &fd_index[fds[index].fd];
+  while (*p != index)
+    p = &fd_next[*p];
+  if (new_index == -1){
+    *p = fd_next[index];
+  }else{
+    *p = new_index;
+    fd_next[new_index] = fd_next[index];
+  }
+}
+
+static int backend_update(int fd, short old_events)
+{
+  short events = fd_events(fd);
+  if (backend->update && events != old_events)
+    return backend->update(fd, old_events, events);
+  return 0;
+}
 
 struct profile_total poll_stats={NULL,0,"Idle (in poll)",0,0,0,0};
 
@@ -74,27 +460,32 @@ int list_alarms(int log_level)
   time_ms_t now = gettime_ms();
   struct sched_ent *alarm;
   
+  unsigned i;
+  
+  // heaps are listed in heap order, so only the first alarm of each is sure to be the earliest
   LOGF(log_level, "Run now;");
-  for (alarm = run_now; alarm; alarm=alarm->_next_run){
+  for (i = 0; i < run_now.count; i++){
+    alarm = run_now.alarms[i];
     count ++;
     LOGF(log_level, "%p %s deadline in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->run_before - now);
   }
     
   LOGF(log_level, "Run soon;");
-  for (alarm = run_soon; alarm; alarm=alarm->_next_run){
+  for (i = 0; i < run_soon.count; i++){
+    alarm = run_soon.alarms[i];
     count ++;
     LOGF(log_level, "%p %s run in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->run_after - now);
   }
 
   LOGF(log_level, "Wake at;");
-  for (alarm = wake_list; alarm; alarm = alarm->_next_wake){
+  for (i = 0; i < wake_list.count; i++){
+    alarm = wake_list.alarms[i];
     count ++;
     LOGF(log_level, "%p %s wake in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->wake_at - now);
   }
 
   LOGF(log_level, "File handles;");
-  int i;
-  for (i = 0; i < fdcount; ++i){
+  for (i = 0; i < (unsigned)fdcount; ++i){
     count ++;
     LOGF(log_level, "%s watching #%d for %x", alloca_alarm_name(fd_callbacks[i]), fds[i].fd, fds[i].events);
   }
@@ -102,89 +493,111 @@ int list_alarms(int log_level)
   return count;
 }
 
-static void insert_run_now(struct sched_ent *alarm)
+// the heap position of an alarm is stored in the alarm, 1-based so that zero means absent
+static unsigned *heap_position(struct alarm_heap *heap, struct sched_ent *alarm)
 {
-  struct sched_ent **list = &run_now;
-  
-  while(*list){
-    if ((*list)->run_before > alarm->run_before)
+  return heap == &wake_list ? &alarm->_wake_position : &alarm->_run_position;
+}
+
+static int heap_before(struct alarm_heap *heap, struct sched_ent *a, struct sched_ent *b)
+{
+  time_ms_t ka = HEAP_KEY(heap, a);
+  time_ms_t kb = HEAP_KEY(heap, b);
+  return ka < kb || (ka == kb && a->_sequence < b->_sequence);
+}
+
+static void heap_set(struct alarm_heap *heap, unsigned i, struct sched_ent *alarm)
+{
+  heap->alarms[i] = alarm;
+  *heap_position(heap, alarm) = i + 1;
+}
+
+static void heap_sift_up(struct alarm_heap *heap, unsigned i)
+{
+  struct sched_ent *alarm = heap->alarms[i];
+  while (i > 0){
+    unsigned parent = (i - 1) / 2;
+    if (!heap_before(heap, alarm, heap->alarms[parent]))
       break;
-    list = &(*list)->_next_run;
+    heap_set(heap, i, heap->alarms[parent]);
+    i = parent;
   }
-  alarm->_next_run = *list;
-  *list = alarm;
+  heap_set(heap, i, alarm);
 }
 
-static void insert_run_soon(struct sched_ent *alarm)
+static void heap_sift_down(struct alarm_heap *heap, unsigned i)
 {
-  struct sched_ent **list = &run_soon;
-  
-  while(*list){
-    if ((*list)->run_after > alarm->run_after)
+  struct sched_ent *alarm = heap->alarms[i];
+  while (1){
+    unsigned child = i * 2 + 1;
+    if (child >= heap->count)
       break;
-    list = &(*list)->_next_run;
+    if (child + 1 < heap->count && heap_before(heap, heap->alarms[child + 1], heap->alarms[child]))
+      child++;
+    if (!heap_before(heap, heap->alarms[child], alarm))
+      break;
+    heap_set(heap, i, heap->alarms[child]);
+    i = child;
   }
-  alarm->_next_run = *list;
-  *list = alarm;
+  heap_set(heap, i, alarm);
 }
 
-static void remove_run_list(struct sched_ent *alarm, struct sched_ent **list)
+static void heap_insert(struct alarm_heap *heap, struct sched_ent *alarm)
 {
-  while(*list){
-    if (*list==alarm){
-      *list = alarm->_next_run;
-      list = &alarm->_next_run;
-      alarm->_next_run=NULL;
-      return;
-    }else{
-      list = &(*list)->_next_run;
-    }
+  if (heap->count >= heap->size){
+    unsigned size = heap->size ? heap->size * 2 : 64;
+    struct sched_ent **alarms = erealloc(heap->alarms, sizeof(struct sched_ent *) * size);
+    // schedule() cannot fail, and an alarm that is never run would stall whatever it drives
+    if (!alarms)
+      FATALF("Cannot grow the alarm heap to %u alarms", size);
+    heap->alarms = alarms;
+    heap->size = size;
   }
+  heap->alarms[heap->count++] = alarm;
+  heap_sift_up(heap, heap->count - 1);
 }
 
-static void insert_wake_list(struct sched_ent *alarm)
+static void heap_remove(struct alarm_heap *heap, struct sched_ent *alarm)
 {
-  if (alarm->wake_at == TIME_MS_NEVER_WILL)
+  unsigned *position = heap_position(heap, alarm);
+  // run_soon and run_now share a position field, so check that the alarm is in this heap
+  if (!*position || *position > heap->count || heap->alarms[*position - 1] != alarm)
     return;
-  struct sched_ent **list = &wake_list, *last = NULL;
-  while(*list){
-    if ((*list)->wake_at > alarm->wake_at)
-      break;
-    last = (*list);
-    list = &last->_next_wake;
-  }
-  alarm->_next_wake = *list;
-  if (*list)
-    (*list)->_prev_wake = alarm;
-  alarm->_prev_wake = last;
-  *list = alarm;
+  unsigned i = *position - 1;
+  *position = 0;
+  heap->count--;
+  if (i == heap->count)
+    return;
+  heap_set(heap, i, heap->alarms[heap->count]);
+  if (i > 0 && heap_before(heap, heap->alarms[i], heap->alarms[(i - 1) / 2]))
+    heap_sift_up(heap, i);
+  else
+    heap_sift_down(heap, i);
 }
 
-static void remove_wake_list(struct sched_ent *alarm)
+static struct sched_ent *heap_first(struct alarm_heap *heap)
 {
-  struct sched_ent *prev = alarm->_prev_wake;
-  struct sched_ent *next = alarm->_next_wake;
-  
-  if (prev)
-    prev->_next_wake = next;
-  else if(wake_list==alarm)
-    wake_list = next;
-    
-  if (next)
-    next->_prev_wake = prev;
-  
-  alarm->_prev_wake = NULL;
-  alarm->_next_wake = NULL;
+  return heap->count ? heap->alarms[0] : NULL;
+}
+
+// remove and return the next alarm to run, which must be overdue or runnable
+static struct sched_ent *take_run_now()
+{
+  struct sched_ent *alarm = heap_first(&run_now);
+  heap_remove(&run_now, alarm);
+  alarm->_scheduled=0;
+  alarm->run_after = TIME_MS_NEVER_WILL;
+  return alarm;
 }
 
 // move alarms from run_soon to run_now
 static void move_run_list(){
   time_ms_t now = gettime_ms();
-  while(run_soon && run_soon->run_after <= now){
-    struct sched_ent *alarm = run_soon;
-    run_soon = run_soon->_next_run;
-    remove_wake_list(alarm);
-    insert_run_now(alarm);
+  struct sched_ent *alarm;
+  while((alarm = heap_first(&run_soon)) && alarm->run_after <= now){
+    heap_remove(&run_soon, alarm);
+    heap_remove(&wake_list, alarm);
+    heap_insert(&run_now, alarm);
     DEBUGF(io, "Moved %s from run_soon to run_now", alloca_alarm_name(alarm));
   }
 }
@@ -223,8 +636,10 @@ void _schedule(struct __sourceloc __whence, struct sched_ent *alarm)
   // don't bother to schedule an alarm that will (by definition) never run
   // not an error as it simplifies calling API use
   if (alarm->run_after != TIME_MS_NEVER_WILL){
-    insert_wake_list(alarm);
-    insert_run_soon(alarm);
+    alarm->_sequence = schedule_sequence++;
+    if (alarm->wake_at != TIME_MS_NEVER_WILL)
+      heap_insert(&wake_list, alarm);
+    heap_insert(&run_soon, alarm);
     alarm->_scheduled=1;
   }
 }
@@ -238,9 +653,9 @@ void _unschedule(struct __sourceloc __whence, struct sched_ent *alarm)
     
   DEBUGF(io, "unschedule(alarm=%s)", alloca_alarm_name(alarm));
 
-  remove_run_list(alarm, &run_now);
-  remove_run_list(alarm, &run_soon);
-  remove_wake_list(alarm);
+  heap_remove(&wake_list, alarm);
+  heap_remove(&run_soon, alarm);
+  heap_remove(&run_now, alarm);
   alarm->_scheduled=0;
   alarm->run_after = TIME_MS_NEVER_WILL;
 }
@@ -257,26 +672,45 @@ int _watch(struct __sourceloc __whence, struct sched_ent *alarm)
   if (!alarm->poll.events)
     FATAL("Can't watch if you haven't set any poll flags");
   
-  if (alarm->_poll_index>=0 && fd_callbacks[alarm->_poll_index]==alarm){
+  int index = alarm->_poll_index;
+  if (index>=0 && index<fdcount && fd_callbacks[index]==alarm){
     // updating event flags
     DEBUGF(io, "Updating watch %s, #%d for %s", alloca_alarm_name(alarm), alarm->poll.fd, alloca_poll_events(alarm->poll.events));
-  }else{
-    DEBUGF(io, "Adding watch %s, #%d for %s", alloca_alarm_name(alarm), alarm->poll.fd, alloca_poll_events(alarm->poll.events));
-    if (fdcount>=MAX_WATCHED_FDS)
-      return WHY("Too many file handles to watch");
-    set_nonblock(alarm->poll.fd);
-    fd_callbacks[fdcount]=alarm;
-    alarm->poll.revents = 0;
-    alarm->_poll_index=fdcount;
-    fdcount++;
+    int old_fd = fds[index].fd;
+    if (old_fd != alarm->poll.fd){
+      short old_events = fd_events(old_fd);
+      relink_fd_index(index, -1);
+      backend_update(old_fd, old_events);
+      short new_old_events = fd_events(alarm->poll.fd);
+      fds[index]=alarm->poll;
+      if (link_fd_index(index) == -1)
+	return -1;
+      return backend_update(alarm->poll.fd, new_old_events);
+    }
+    short old_events = fd_events(old_fd);
+    fds[index]=alarm->poll;
+    return backend_update(alarm->poll.fd, old_events);
   }
-  fds[alarm->_poll_index]=alarm->poll;
-  return 0;
+
+  DEBUGF(io, "Adding watch %s, #%d for %s", alloca_alarm_name(alarm), alarm->poll.fd, alloca_poll_events(alarm->poll.events));
+  if (fdcount>=fd_capacity && grow_watched_fds()==-1)
+    return WHY("Too many file handles to watch");
+  set_nonblock(alarm->poll.fd);
+  short old_events = fd_events(alarm->poll.fd);
+  index = fdcount;
+  alarm->poll.revents = 0;
+  fds[index]=alarm->poll;
+  if (link_fd_index(index) == -1)
+    return -1;
+  fd_callbacks[index]=alarm;
+  alarm->_poll_index=index;
+  fdcount++;
+  return backend_update(alarm->poll.fd, old_events);
 }
 
 int is_watching(struct sched_ent *alarm)
 {
-  if (alarm->_poll_index <0 || fds[alarm->_poll_index].fd!=alarm->poll.fd)
+  if (alarm->_poll_index <0 || alarm->_poll_index >= fdcount || fds[alarm->_poll_index].fd!=alarm->poll.fd)
     return 0;
   return 1;
 }
@@ -287,12 +721,16 @@ int _unwatch(struct __sourceloc __whence, struct sched_ent *alarm)
   DEBUGF(io, "unwatch(alarm=%s)", alloca_alarm_name(alarm));
 
   int index = alarm->_poll_index;
-  if (index <0 || fds[index].fd!=alarm->poll.fd)
+  if (index <0 || index >= fdcount || fds[index].fd!=alarm->poll.fd)
     return WHY("Attempted to unwatch a handle that is not being watched");
   
+  short old_events = fd_events(alarm->poll.fd);
+  relink_fd_index(index, -1);
+  backend_update(alarm->poll.fd, old_events);
   fdcount--;
   if (index!=fdcount){
     // squash fds
+    relink_fd_index(fdcount, index);
     fds[index] = fds[fdcount];
     fd_callbacks[index] = fd_callbacks[fdcount];
     fd_callbacks[index]->_poll_index=index;
@@ -341,32 +779,28 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
   IN();
   
   // clear the run now list of any alarms that are overdue
-  if (run_now && run_now->run_before <= gettime_ms()){
-    struct sched_ent *alarm = run_now;
-    run_now = alarm->_next_run;
-    alarm->_scheduled=0;
-    alarm->run_after = TIME_MS_NEVER_WILL;
-    call_alarm(alarm, 0);
+  if (run_now.count && heap_first(&run_now)->run_before <= gettime_ms()){
+    call_alarm(take_run_now(), 0);
     RETURN(1);
   }
   
   // return 0 when there's nothing to do, it doesn't make sense to wait for infinity
-  if (!run_now && !wake_list && fdcount==0)
+  if (!run_now.count && !wake_list.count && fdcount==0)
     RETURN(0);
   
   time_ms_t now = gettime_ms();
   time_ms_t wait_until=TIME_MS_NEVER_WILL;
   uint8_t called_waiting = 0;
   
-  if (run_now){
+  if (run_now.count){
     wait_until = now;
   }else{
     time_ms_t next_run=TIME_MS_NEVER_WILL;
-    if(run_soon)
-      next_run = run_soon->run_after;
+    if(run_soon.count)
+      next_run = heap_first(&run_soon)->run_after;
     
-    if (wake_list)
-      wait_until = wake_list->wake_at;
+    if (wake_list.count)
+      wait_until = heap_first(&wake_list)->wake_at;
       
     if (waiting && wait_until > now){
       wait_until = waiting(now, next_run, wait_until);
@@ -391,27 +825,27 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
       wait = wait_until - now;
     
     if (fdcount){
-      DEBUGF(io, "Calling poll with %dms wait", wait);
+      DEBUGF(io, "Calling %s with %dms wait", backend->name, wait);
 	
       fd_func_enter(__HERE__, &call_stats);
-      r = poll(fds, fdcount, wait);
+      r = backend->wait(wait);
       fd_func_exit(__HERE__, &call_stats);
       
       if (r==-1 && errno!=EINTR)
-	WHY_perror("poll");
+	WHYF_perror("%s", backend->name);
       
       if (IF_DEBUG(io)) {
 	strbuf b = strbuf_alloca(1024);
 	int i;
-	for (i = 0; i < fdcount; ++i) {
+	for (i = 0; i < r; ++i) {
 	  if (i)
 	    strbuf_puts(b, ", ");
-	  strbuf_sprintf(b, "%d:", fds[i].fd);
-	  strbuf_append_poll_events(b, fds[i].events);
+	  strbuf_sprintf(b, "%d:", ready[i].fd);
+	  strbuf_append_poll_events(b, fd_events(ready[i].fd));
 	  strbuf_puts(b, "->");
-	  strbuf_append_poll_events(b, fds[i].revents);
+	  strbuf_append_poll_events(b, ready[i].revents);
 	}
-	DEBUGF(io, "poll(fds=(%s), fdcount=%d, ms=%d) -> %d", strbuf_str(b), fdcount, wait, r);
+	DEBUGF(io, "%s(fdcount=%d, ms=%d) -> %d (%s)", backend->name, fdcount, wait, r, strbuf_str(b));
       }
       
     }else if(wait>0){
@@ -429,32 +863,43 @@ int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeu
   
   // We don't want a single alarm to be able to reschedule itself and starve all IO
   // So we only check for new overdue alarms if we attempted to sleep
-  if (wait && run_now && run_now->run_before <= gettime_ms())
+  if (wait && run_now.count && heap_first(&run_now)->run_before <= gettime_ms())
     RETURN(1);
   
-  // process all watched IO handles once (we need to be fair)
+  // process all ready IO handles once (we need to be fair)
   if (r>0) {
     int i;
-    for(i=fdcount -1;i>=0;i--){
-      if (fd_callbacks[i] && fd_callbacks[i]->poll.fd == fds[i].fd && fds[i].revents) {
-	errno=0;
-	// Work around OSX behaviour that doesn't set POLLERR on 
-	// devices that have been deconfigured, e.g., a USB serial adapter
-	// that has been removed.
-	if (errno == ENXIO) fds[i].revents|=POLLERR;
-	call_alarm(fd_callbacks[i], fds[i].revents);
+    for(i=0;i<r;i++){
+      int fd = ready[i].fd;
+      // Call each alarm watching this handle.  Any callback may stop watching (and free) any
+      // alarm, so rescan the watchers after each call, skipping those already called in this pass.
+      uint64_t pass = ++io_pass;
+      int index = get_fd_index(fd);
+      while (index != -1) {
+	struct sched_ent *alarm = fd_callbacks[index];
+	if (alarm->_io_pass == pass) {
+	  index = fd_next[index];
+	  continue;
+	}
+	alarm->_io_pass = pass;
+	short revents = ready[i].revents & (fds[index].events | POLLERR | POLLHUP | POLLNVAL);
+	if (revents) {
+	  errno=0;
+	  // Work around OSX behaviour that doesn't set POLLERR on 
+	  // devices that have been deconfigured, e.g., a USB serial adapter
+	  // that has been removed.
+	  if (errno == ENXIO) revents|=POLLERR;
+	  call_alarm(alarm, revents);
+	}
+	index = get_fd_index(fd);
       }
     }
     // time may have passed while processing IO, or processing IO could trigger a new overdue alarm
     move_run_list();
     
-  }else if (run_now){
+  }else if (run_now.count){
     // No IO, no overdue alarms but another alarm is runnable? run a single alarm before polling again
-    struct sched_ent *alarm = run_now;
-    run_now = alarm->_next_run;
-    alarm->_scheduled=0;
-    alarm->run_after = TIME_MS_NEVER_WILL;
-    call_alarm(alarm, 0);
+    call_alarm(take_run_now(), 0);
   }
   
   RETURN(1);
@@ -82,9 +82,10 @@ struct sched_ent;
 typedef void (*ALARM_FUNCP) (struct sched_ent *alarm);
 
 struct sched_ent{
-  struct sched_ent *_next_wake;
-  struct sched_ent *_prev_wake;
-  struct sched_ent *_next_run;
+  // positions in the scheduler's heaps (see fdqueue.c), zero when not present
+  unsigned _wake_position;
+  unsigned _run_position;
+  uint64_t _sequence;
   uint8_t _scheduled;
   
   ALARM_FUNCP function;
@@ -105,6 +106,8 @@ struct sched_ent{
   
   struct profile_total *stats;
   int _poll_index;
+  // the last fd_poll2() dispatch that called this alarm
+  uint64_t _io_pass;
 };
 
 #define STRUCT_SCHED_ENT_UNUSED {\
@@ -155,6 +158,10 @@ int _unwatch(struct __sourceloc, struct sched_ent *alarm);
 int fd_poll2(time_ms_t (*waiting)(time_ms_t, time_ms_t, time_ms_t), void (*wokeup)());
 #define fd_poll() fd_poll2(NULL, NULL)
 
+/* IO readiness backend ("poll" or "epoll") */
+const char *fd_backend_name();
+int fd_select_backend(const char *name);
+
 /* function timing routines */
 int fd_clearstats();
 int fd_showstats();
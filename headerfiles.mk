@@ -76,6 +76,8 @@ PRIVATE_HDRS= \
 	httpd.h \
 	msp_common.h \
 	overlay_interface.h \
+	test_cli.h \
+	worker.h \
 
 # All header files, useful for writing dependency rules with total coverage.
 ALL_HDRS = $(LIB_HDRS) $(PUBLIC_HDRS) $(PRIVATE_HDRS) $(SQLITE3_HDRS)
@@ -17,9 +17,16 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <assert.h>
 #include <inttypes.h>
 #include <time.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include "lang.h" // for FALLTHROUGH
 #include "serval_types.h"
 #include "http_server.h"
@@ -38,6 +45,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "version_servald.h"
 
 #define BOUNDARY_STRING_MAXLEN  70 // legislated limit from RFC-1341
+#define HTTP_SENDFILE_MAX       (1024 * 1024) // most content sent by one sendfile(2) call
+#define HTTP_FILE_READ_SIZE     (64 * 1024) // read size if sendfile(2) cannot be used
 
 /* The (struct http_request).verb field points to one of these static strings, so that a simple
  * equality test can be used, eg, (r->verb == HTTP_VERB_GET) instead of a strcmp().
@@ -120,6 +129,7 @@ void http_request_init(struct http_request *r, int sockfd)
   r->response.header.content_length = CONTENT_LENGTH_UNKNOWN;
   r->response.header.resource_length = CONTENT_LENGTH_UNKNOWN;
   r->response.header.minor_version = 1;
+  r->response.content_fd = -1;
   r->alarm.stats = &http_server_stats;
   r->alarm.function = http_server_poll;
   assert(r->idle_timeout >= 0);
@@ -1954,6 +1964,75 @@ static void http_request_receive(struct http_request *r)
  *
  * @author Andrew Bettison <andrew@servalproject.com>
  */
+/* Send the next part of the content directly from r->response.content_fd, using sendfile(2) where
+ * the system supports it, otherwise by reading the file into the response buffer to be sent like any
+ * other content.  Returns 1 if some content was sent or buffered, 0 if the socket will not accept
+ * any more yet, or -1 if the connection should be closed.
+ */
+static int http_request_send_file(struct http_request *r, http_size_t remaining)
+{
+  assert(r->response.header.content_length != CONTENT_LENGTH_UNKNOWN);
+  assert(remaining <= r->response.header.content_length);
+  off_t offset = (off_t)(r->response.header.content_range_start + r->response.header.content_length - remaining);
+#ifdef HAVE_SYS_SENDFILE_H
+  if (!r->response_sendfile_failed) {
+    size_t len = remaining < HTTP_SENDFILE_MAX ? (size_t) remaining : HTTP_SENDFILE_MAX;
+    sigPipeFlag = 0;
+    ssize_t written = sendfile(r->alarm.poll.fd, r->response.content_fd, &offset, len);
+    if (written == -1) {
+      switch (errno) {
+	case EINTR:
+	case EAGAIN:
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+	case EWOULDBLOCK:
+#endif
+	  return 0;
+	case EINVAL:
+	case ENOSYS:
+	  // this file or socket cannot be used with sendfile(2)
+	  IDEBUGF(r->debug, "sendfile(%d,%d) not supported, reading file instead", r->alarm.poll.fd, r->response.content_fd);
+	  r->response_sendfile_failed = 1;
+	  break;
+	default:
+	  IDEBUGF(r->debug, "HTTP sendfile(%d,%d,%zu) error: %s, closing connection",
+	      r->alarm.poll.fd, r->response.content_fd, len, strerror(errno));
+	  return -1;
+      }
+    } else {
+      if (sigPipeFlag) {
+	IDEBUG(r->debug, "Received SIGPIPE on HTTP socket sendfile, closing connection");
+	return -1;
+      }
+      if (written == 0) {
+	WHYF("HTTP response file ended prematurely at offset %"PRIhttp_size_t, r->response_sent);
+	return -1;
+      }
+      r->response_sent += (size_t) written;
+      IDEBUGF(r->debug, "Sent %zu bytes from fd %d to HTTP socket, total %"PRIhttp_size_t", remaining=%"PRIhttp_size_t,
+	    (size_t) written, r->response.content_fd, r->response_sent, r->response_length - r->response_sent);
+      http_request_set_idle_timeout(r);
+      return (size_t) written < len ? 0 : 1;
+    }
+  }
+#endif
+  assert(r->response_buffer_sent == r->response_buffer_length);
+  size_t len = remaining < HTTP_FILE_READ_SIZE ? (size_t) remaining : HTTP_FILE_READ_SIZE;
+  if (r->response_buffer_size < len && http_request_set_response_bufsize(r, len) == -1)
+    len = r->response_buffer_size;
+  ssize_t n = pread(r->response.content_fd, r->response_buffer, len, offset);
+  if (n == -1) {
+    WHYF_perror("pread(%d,%p,%zu,%"PRId64")", r->response.content_fd, r->response_buffer, len, (int64_t) offset);
+    return -1;
+  }
+  if (n == 0) {
+    WHYF("HTTP response file ended prematurely at offset %"PRIhttp_size_t, r->response_sent);
+    return -1;
+  }
+  r->response_buffer_sent = 0;
+  r->response_buffer_length = (size_t) n;
+  return 1;
+}
+
 static void http_request_send_response(struct http_request *r)
 {
   IN();
@@ -2031,6 +2110,18 @@ static void http_request_send_response(struct http_request *r)
 	  r->response.content_generator = NULL; // ensure we never invoke again
 	continue;
       }
+    } else if (r->response.content_fd != -1) {
+      // Once the buffered headers have been sent, send the content straight from the file.
+      if (unsent == 0) {
+	int ret = http_request_send_file(r, remaining);
+	if (ret == -1) {
+	  http_request_finalise(r);
+	  RETURNVOID;
+	}
+	if (ret == 0)
+	  RETURNVOID;
+	continue;
+      }
     } else if (remaining != CONTENT_LENGTH_UNKNOWN && unsent < remaining) {
       WHYF("HTTP response generator finished prematurely at offset %"PRIhttp_size_t"/%"PRIhttp_size_t" (%"PRIhttp_size_t" bytes remaining)",
 	  r->response_sent, r->response_length, remaining);
@@ -2311,13 +2402,15 @@ static int _render_response(struct http_request *r)
   if (!hr.reason)
     hr.reason = http_reason_phrase(hr.status_code);
   strbuf sb = strbuf_local(r->response_buffer, r->response_buffer_size);
-  // Cannot specify both static (pre-rendered) content AND generated content.
-  assert(!(hr.content && hr.content_generator));
-  if (hr.content || hr.content_generator) {
-    // With static (pre-rendered) content, the content length is mandatory (so we know how much data
-    // follows the 'hr.content' pointer.  Generated content will generally not send a Content-Length
-    // header, nor send partial content, but they might.
-    if (hr.content)
+  // Cannot specify more than one of static (pre-rendered) content, generated content or file
+  // content.
+  assert((hr.content ? 1 : 0) + (hr.content_generator ? 1 : 0) + (hr.content_fd != -1 ? 1 : 0) <= 1);
+  if (hr.content || hr.content_generator || hr.content_fd != -1) {
+    // With static (pre-rendered) or file content, the content length is mandatory (so we know how
+    // much data follows the 'hr.content' pointer, or how much to send from the file).  Generated
+    // content will generally not send a Content-Length header, nor send partial content, but they
+    // might.
+    if (hr.content || hr.content_fd != -1)
       assert(hr.header.content_length != CONTENT_LENGTH_UNKNOWN);
     // Ensure that all partial content fields are consistent.  If content length or resource length
     // are unknown, there can be no range field.
@@ -2428,7 +2521,7 @@ static int _render_response(struct http_request *r)
     if (r->response_buffer_need < r->response_length)
       r->response_buffer_need = r->response_length;
   } else
-    assert(hr.content_generator);
+    assert(hr.content_generator || hr.content_fd != -1);
   if (r->response_buffer_size < r->response_buffer_need)
     return 0; // doesn't fit
   assert(!strbuf_overrun(sb));
@@ -2489,6 +2582,7 @@ static void http_request_start_response(struct http_request *r)
     r->response.status_code = 500;
     r->response.content = NULL;
     r->response.content_generator = NULL;
+    r->response.content_fd = -1;
   }
   // If the response cannot be rendered, then render a 500 Server Error instead.  If that fails,
   // then just close the connection.
@@ -2498,6 +2592,7 @@ static void http_request_start_response(struct http_request *r)
     r->response.status_code = 500;
     r->response.content = NULL;
     r->response.content_generator = NULL;
+    r->response.content_fd = -1;
     http_request_render_response(r);
     if (r->response_buffer == NULL) {
       WHY("Cannot render HTTP 500 Server Error response, closing connection");
@@ -2532,6 +2627,7 @@ void http_request_response_static(struct http_request *r, int result, const stru
   r->response.header.content_length = r->response.header.resource_length = bytes;
   r->response.content = body;
   r->response.content_generator = NULL;
+  r->response.content_fd = -1;
   http_request_start_response(r);
 }
 
@@ -2548,6 +2644,27 @@ void http_request_response_generated(struct http_request *r, int result, const s
   http_request_start_response(r);
 }
 
+/* Start sending a response whose content is read directly from an open file, using sendfile(2)
+ * where possible so that the content is never copied into the response buffer.  The caller must set
+ * the content length and range (eg, using the request's Range: header) before calling this, and
+ * remains responsible for closing the file once the request is finalised.
+ */
+void http_request_response_file(struct http_request *r, int result, const struct mime_content_type *content_type, int fd)
+{
+  assert(r->phase == RECEIVE);
+  assert(content_type != NULL);
+  assert(content_type->type[0]);
+  assert(content_type->subtype[0]);
+  assert(fd != -1);
+  assert(r->response.header.content_length != CONTENT_LENGTH_UNKNOWN);
+  r->response.status_code = result;
+  r->response.header.content_type = content_type;
+  r->response.content = NULL;
+  r->response.content_generator = NULL;
+  r->response.content_fd = fd;
+  http_request_start_response(r);
+}
+
 /* Start sending a short response back to the client.  The result code must be either a success
  * (2xx), redirection (3xx) or client error (4xx) or server error (5xx) code.  The 'reason_phrase'
  * argument is an optional, nul-terminated string which will be placed in the first line of the
@@ -2576,6 +2693,7 @@ void http_request_simple_response(struct http_request *r, uint16_t result, const
     r->response.content = strbuf_str(h);
   }
   r->response.content_generator = NULL;
+  r->response.content_fd = -1;
   http_request_start_response(r);
 }
 
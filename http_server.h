@@ -141,6 +141,7 @@ struct http_response {
   struct http_response_headers header;
   const char *content;
   HTTP_CONTENT_GENERATOR *content_generator; // callback to produce more content
+  int content_fd; // file to send content from, resource starts at offset zero
 };
 
 #define MIME_FILENAME_MAXLEN 127
@@ -184,6 +185,7 @@ void http_request_pause_response(struct http_request *r, time_ms_t until);
 void http_request_resume_response(struct http_request *r);
 void http_request_response_static(struct http_request *r, int result, const struct mime_content_type *content_type, const char *body, uint64_t bytes);
 void http_request_response_generated(struct http_request *r, int result, const struct mime_content_type *content_type, HTTP_CONTENT_GENERATOR *);
+void http_request_response_file(struct http_request *r, int result, const struct mime_content_type *content_type, int fd);
 void http_request_simple_response(struct http_request *r, uint16_t result, const char *body);
 
 typedef int (HTTP_CONTENT_GENERATOR_STRBUF_CHUNKER)(struct http_request *, strbuf);
@@ -260,6 +262,7 @@ struct http_request {
   size_t response_buffer_length;
   size_t response_buffer_sent;
   void (*response_free_buffer)(void*);
+  bool_t response_sendfile_failed;
   // This buffer is used during RECEIVE and TRANSMIT phase.
   char buffer[8 * 1024];
 };
@@ -296,6 +296,7 @@ int accumulate_text(httpd_request *r, const char *partname, char *textbuf, size_
 int rhizome_response_content_init_filehash(httpd_request *r, const rhizome_filehash_t *hash);
 int rhizome_response_content_init_payload(httpd_request *r, rhizome_manifest *);
 HTTP_CONTENT_GENERATOR rhizome_payload_content;
+void rhizome_payload_response(httpd_request *r, int result, const struct mime_content_type *content_type);
 
 struct http_response_parts {
   uint16_t code;
@@ -33,6 +33,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "rotbuf.h"
 #include "route_link.h"
 #include "commandline.h"
+#include "worker.h"
 #include "debug.h"
 
 static keyring_file *keyring_open_or_create(const char *path, int writeable);
@@ -170,53 +171,59 @@ static int keyring_load(keyring_file *k, const char *pin)
   return 0;
 }
 
+/* Each slab of KEYRING_BAM_BITS slots starts with a slot that holds its BAM, so slot numbers that
+ * are a multiple of KEYRING_BAM_BITS never hold an identity.
+ */
+static keyring_bam *keyring_slot_bam(const keyring_file *k, unsigned slot, uint8_t *mask)
+{
+  assert(slot % KEYRING_BAM_BITS != 0);
+  keyring_bam *b = k->bam;
+  unsigned slab;
+  for (slab = slot / KEYRING_BAM_BITS; b && slab; --slab)
+    b = b->next;
+  *mask = 1 << (slot & 7);
+  return b;
+}
+
+#define BAM_BYTE(slot) (((slot) & (KEYRING_BAM_BITS - 1)) >> 3)
+
 static unsigned is_slot_allocated(const keyring_file *k, unsigned slot)
 {
-  assert(slot != 0);
-  assert(slot < KEYRING_BAM_BITS);
-  unsigned position = slot & (KEYRING_BAM_BITS - 1);
-  unsigned byte = position >> 3;
-  uint8_t mask = 1 << (position & 7);
-  return (k->bam->allocmap[byte] & mask) ? 1 : 0;
+  uint8_t mask;
+  keyring_bam *b = keyring_slot_bam(k, slot, &mask);
+  return b && (b->allocmap[BAM_BYTE(slot)] & mask) ? 1 : 0;
 }
 
 static unsigned is_slot_loadable(const keyring_file *k, unsigned slot)
 {
-  assert(slot != 0);
-  assert(slot < KEYRING_BAM_BITS);
-  unsigned position = slot & (KEYRING_BAM_BITS - 1);
-  unsigned byte = position >> 3;
-  uint8_t mask = 1 << (position & 7);
-  return (k->bam->allocmap[byte] & mask) && !(k->bam->loadmap[byte] & mask);
+  uint8_t mask;
+  keyring_bam *b = keyring_slot_bam(k, slot, &mask);
+  return b && (b->allocmap[BAM_BYTE(slot)] & mask) && !(b->loadmap[BAM_BYTE(slot)] & mask);
 }
 
 static void mark_slot_allocated(keyring_file *k, unsigned slot, int allocated)
 {
-  assert(slot != 0);
-  assert(slot < KEYRING_BAM_BITS);
-  unsigned position = slot & (KEYRING_BAM_BITS - 1);
-  unsigned byte = position >> 3;
-  uint8_t mask = 1 << (position & 7);
+  uint8_t mask;
+  keyring_bam *b = keyring_slot_bam(k, slot, &mask);
+  assert(b);
   if (allocated) {
-    k->bam->allocmap[byte] |= mask;
+    b->allocmap[BAM_BYTE(slot)] |= mask;
   } else {
-    assert(k->bam->allocmap[byte] & mask); // already marked as allocated
-    k->bam->allocmap[byte] &= ~mask;
+    assert(b->allocmap[BAM_BYTE(slot)] & mask); // already marked as allocated
+    b->allocmap[BAM_BYTE(slot)] &= ~mask;
   }
 }
 
 static void mark_slot_loaded(keyring_file *k, unsigned slot, int loaded)
 {
-  assert(slot != 0);
-  assert(slot < KEYRING_BAM_BITS);
-  unsigned position = slot & (KEYRING_BAM_BITS - 1);
-  unsigned byte = position >> 3;
-  uint8_t mask = 1 << (position & 7);
+  uint8_t mask;
+  keyring_bam *b = keyring_slot_bam(k, slot, &mask);
+  assert(b);
   if (loaded) {
-    k->bam->loadmap[byte] |= mask;
+    b->loadmap[BAM_BYTE(slot)] |= mask;
   } else {
-    assert(k->bam->loadmap[byte] & mask); // already marked as loaded
-    k->bam->loadmap[byte] &= ~mask;
+    assert(b->loadmap[BAM_BYTE(slot)] & mask); // already marked as loaded
+    b->loadmap[BAM_BYTE(slot)] &= ~mask;
   }
 }
 
@@ -266,32 +273,205 @@ keypair *keyring_identity_keytype(const keyring_identity *id, enum keyring_keyty
   return kp;
 }
 
+/* Unlocked identities are indexed in open addressed hash tables that use linear probing, and are
+ * kept at most half full.  SIDs and signing keys can be chosen by anyone, including peers whose
+ * keys end up in the shared secret cache, so they are hashed with a random key chosen once per
+ * process.  DIDs are hashed ignoring case, and any number of identities may share one.
+ */
+typedef uint32_t (*INDEX_HASH)(const keyring_identity *id);
+
+static unsigned char key_hash_key[crypto_shorthash_KEYBYTES];
+static char key_hash_keyed = 0;
+
+static uint32_t key_hash(const uint8_t *key, size_t len)
+{
+  if (!key_hash_keyed) {
+    randombytes_buf(key_hash_key, sizeof key_hash_key);
+    key_hash_keyed = 1;
+  }
+  uint64_t h;
+  crypto_shorthash((unsigned char *)&h, key, len, key_hash_key);
+  return (uint32_t)h;
+}
+
+static uint32_t did_hash(const char *did)
+{
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (; *did; ++did)
+    h = (h ^ (uint8_t)tolower((unsigned char)*did)) * 16777619u;
+  return h;
+}
+
+static const char *identity_did(const keyring_identity *id)
+{
+  keypair *kp = keyring_identity_keytype(id, KEYTYPE_DID);
+  return kp ? (const char *)kp->private_key : NULL;
+}
+
+static uint32_t identity_sid_hash(const keyring_identity *id)
+{
+  return key_hash(id->box_pk->binary, SID_SIZE);
+}
+
+static uint32_t identity_sign_hash(const keyring_identity *id)
+{
+  return key_hash(id->sign_keypair->public_key.binary, IDENTITY_SIZE);
+}
+
+static uint32_t identity_did_hash(const keyring_identity *id)
+{
+  return did_hash(identity_did(id));
+}
+
+static void index_put(struct keyring_index *index, keyring_identity *id, INDEX_HASH hash)
+{
+  unsigned i = hash(id) & (index->size - 1);
+  while (index->table[i])
+    i = (i + 1) & (index->size - 1);
+  index->table[i] = id;
+  index->count++;
+}
+
+static int index_add(struct keyring_index *index, keyring_identity *id, INDEX_HASH hash)
+{
+  if ((index->count + 1) * 2 > index->size) {
+    unsigned old_size = index->size;
+    keyring_identity **old = index->table;
+    unsigned new_size = old_size ? old_size * 2 : 16;
+    keyring_identity **new = (keyring_identity **) emalloc_zero(new_size * sizeof *new);
+    if (!new)
+      return -1;
+    index->table = new;
+    index->size = new_size;
+    index->count = 0;
+    unsigned i;
+    for (i = 0; i < old_size; ++i)
+      if (old[i])
+	index_put(index, old[i], hash);
+    free(old);
+  }
+  index_put(index, id, hash);
+  return 0;
+}
+
+static void index_remove(struct keyring_index *index, keyring_identity *id, INDEX_HASH hash)
+{
+  if (!index->size)
+    return;
+  unsigned mask = index->size - 1;
+  unsigned i = hash(id) & mask;
+  while (index->table[i] != id) {
+    if (!index->table[i])
+      return;
+    i = (i + 1) & mask;
+  }
+  index->count--;
+  // move later entries back into the gap, unless that would put them before their home slot
+  unsigned j = i;
+  while (1) {
+    index->table[i] = NULL;
+    keyring_identity *e;
+    unsigned home;
+    do {
+      j = (j + 1) & mask;
+      if (!(e = index->table[j]))
+	return;
+      home = hash(e) & mask;
+    } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+    index->table[i] = e;
+    i = j;
+  }
+}
+
+static void index_free(struct keyring_index *index)
+{
+  if (index->table)
+    free(index->table);
+  bzero(index, sizeof *index);
+}
+
+static int keyring_index_identity(keyring_file *k, keyring_identity *id)
+{
+  if (id->box_pk && index_add(&k->sid_index, id, identity_sid_hash) == -1)
+    return -1;
+  if (id->sign_keypair && index_add(&k->sign_index, id, identity_sign_hash) == -1) {
+    if (id->box_pk)
+      index_remove(&k->sid_index, id, identity_sid_hash);
+    return -1;
+  }
+  if (identity_did(id) && index_add(&k->did_index, id, identity_did_hash) == -1) {
+    if (id->box_pk)
+      index_remove(&k->sid_index, id, identity_sid_hash);
+    if (id->sign_keypair)
+      index_remove(&k->sign_index, id, identity_sign_hash);
+    return -1;
+  }
+  return 0;
+}
+
+static void keyring_unindex_identity(keyring_file *k, keyring_identity *id)
+{
+  if (id->box_pk)
+    index_remove(&k->sid_index, id, identity_sid_hash);
+  if (id->sign_keypair)
+    index_remove(&k->sign_index, id, identity_sign_hash);
+  if (identity_did(id))
+    index_remove(&k->did_index, id, identity_did_hash);
+}
+
 keypair *keyring_find_did(keyring_iterator *it, const char *did)
 {
-  keypair *kp;
-  while((kp=keyring_next_keytype(it, KEYTYPE_DID))){
-    if ((!did[0])
-	||(did[0]=='*'&&did[1]==0)
-	||(!strcasecmp(did,(char *)kp->private_key))
-    ) {
-      return kp;
+  if ((!did[0]) || (did[0]=='*' && did[1]==0))
+    return keyring_next_keytype(it, KEYTYPE_DID);
+
+  struct keyring_index *index = &it->file->did_index;
+  if (index->size) {
+    unsigned mask = index->size - 1;
+    // carry on probing after the last match
+    unsigned i = it->identity ? (it->index_pos + 1) & mask : did_hash(did) & mask;
+    keyring_identity *id;
+    while ((id = index->table[i])) {
+      if (!strcasecmp(did, identity_did(id))) {
+	it->identity = id;
+	it->keypair = keyring_identity_keytype(id, KEYTYPE_DID);
+	it->index_pos = i;
+	return it->keypair;
+      }
+      i = (i + 1) & mask;
     }
   }
+  it->identity = NULL;
+  it->keypair = NULL;
   return NULL;
 }
 
 keyring_identity *keyring_find_identity_sid(keyring_file *k, const sid_t *sidp){
-  keyring_identity *id = k->identities;
-  while(id && (!id->box_pk || cmp_sid_t(id->box_pk,sidp)!=0))
-    id = id->next;
-  return id;
+  struct keyring_index *index = &k->sid_index;
+  if (!index->size)
+    return NULL;
+  unsigned i = key_hash(sidp->binary, SID_SIZE) & (index->size - 1);
+  keyring_identity *id;
+  while ((id = index->table[i])) {
+    if (cmp_sid_t(id->box_pk, sidp) == 0)
+      return id;
+    i = (i + 1) & (index->size - 1);
+  }
+  return NULL;
 }
 
 keyring_identity *keyring_find_identity(keyring_file *k, const identity_t *sign){
-  keyring_identity *id = k->identities;
-  while(id && (!id->box_pk || cmp_identity_t(&id->sign_keypair->public_key, sign)!=0))
-    id = id->next;
-  return id;
+  struct keyring_index *index = &k->sign_index;
+  if (!index->size)
+    return NULL;
+  unsigned i = key_hash(sign->binary, IDENTITY_SIZE) & (index->size - 1);
+  keyring_identity *id;
+  while ((id = index->table[i])) {
+    if (cmp_identity_t(&id->sign_keypair->public_key, sign) == 0)
+      return id;
+    i = (i + 1) & (index->size - 1);
+  }
+  return NULL;
 }
 
 static void add_subscriber(keyring_identity *id)
@@ -328,8 +508,12 @@ static void wipestr(char *str)
  * free(3).  The identity must not be linked into any keyring, but this function does not check
  * that, so it is only for internal use within keyring.c.
  */
+static void nm_cache_forget(const sid_t *known_key);
+
 static void free_identity(keyring_identity *id)
 {
+  if (id->box_pk)
+    nm_cache_forget(id->box_pk);
   if (id->PKRPin) {
     wipestr(id->PKRPin);
     free(id->PKRPin);
@@ -382,6 +566,9 @@ void keyring_free(keyring_file *k)
   }
   
   /* Wipe out any loaded identities */
+  index_free(&k->sid_index);
+  index_free(&k->sign_index);
+  index_free(&k->did_index);
   while(k->identities){
     keyring_identity *i = k->identities;
     k->identities=i->next;
@@ -409,6 +596,7 @@ void keyring_release_identities_by_pin(keyring_file *k, const char *pin)
     if (id->PKRPin && strcmp(id->PKRPin, pin) == 0) {
       INFOF("release identity slot=%u SID=%s", id->slot, alloca_tohex_sid_t(*id->box_pk));
       *i = id->next;
+      keyring_unindex_identity(k, id);
       mark_slot_loaded(k, id->slot, 0);
       free_identity(id);
     }else{
@@ -440,6 +628,7 @@ void keyring_release_identity(keyring_file *k, keyring_identity *id)
   assert(prev); // the identity being released must be in the keyring
   (*prev) = id->next;
   id->next = NULL;
+  keyring_unindex_identity(k, id);
   mark_slot_loaded(k, id->slot, 0);
 }
 
@@ -452,14 +641,11 @@ void keyring_release_identity(keyring_file *k, keyring_identity *id)
 int keyring_release_subscriber(keyring_file *k, const sid_t *sid)
 {
   INFOF("release identity SID=%s", alloca_tohex_sid_t(*sid));
-  keyring_identity **i;
-  for (i = &k->identities; *i; i = &(*i)->next) {
-    keyring_identity *iid = *i;
-    if (cmp_sid_t(iid->box_pk, sid) == 0) {
-      keyring_release_identity(k, iid);
-      free_identity(iid);
-      return 0;
-    }
+  keyring_identity *iid = keyring_find_identity_sid(k, sid);
+  if (iid) {
+    keyring_release_identity(k, iid);
+    free_identity(iid);
+    return 0;
   }
   return WHYF("cannot release non-existent keyring entry SID=%s", alloca_tohex_sid_t(*sid));
 }
@@ -481,23 +667,11 @@ void keyring_free_identity(keyring_file *k, keyring_identity *id)
   used to verify the validity of the block.  The verification occurs in a higher
   level function, and all we need to know here is that we shouldn't decrypt the
   first 96 bytes of the block.
-*/
-static int keyring_munge_block(
-  unsigned char *block, int len /* includes the first 96 bytes */,
-  unsigned char *KeyRingSalt, int KeyRingSaltLen,
-  const char *KeyRingPin, const char *PKRPin)
-{
-  DEBUGF(keyring, "KeyRingPin=%s PKRPin=%s", alloca_str_toprint(KeyRingPin), alloca_str_toprint(PKRPin));
-  int exit_code=1;
-  unsigned char hashKey[crypto_hash_sha512_BYTES];
-  unsigned char hashNonce[crypto_hash_sha512_BYTES];
-
-  unsigned char work[65536];
-
-  if (len<96) return WHY("block too short");
 
-  unsigned char *PKRSalt=&block[0];
-  int PKRSaltLen=32;
+  The nonce only depends on the keyring and the PIN, so it is formed once and then
+  used for every slot that is tried with that PIN.  None of these functions log, so
+  slots can be munged on a worker thread.
+*/
 
 #if crypto_box_SECRETKEYBYTES>crypto_hash_sha512_BYTES
 #error crypto primitive key size too long -- hash needs to be expanded
@@ -506,52 +680,105 @@ static int keyring_munge_block(
 #error crypto primitive nonce size too long -- hash needs to be expanded
 #endif
 
-  /* Generate key and nonce hashes from the various inputs */
-  unsigned ofs;
-#define APPEND(buf, len) { \
-    assert(ofs <= sizeof work); \
-    unsigned __len = (len); \
-    if (__len > sizeof work - ofs) { \
-      WHY("Input too long"); \
-      goto kmb_safeexit; \
-    } \
-    bcopy((buf), &work[ofs], __len); \
-    ofs += __len; \
-  }
+static void keyring_munge_nonce(const keyring_file *k, const char *PKRPin, unsigned char hashNonce[crypto_hash_sha512_BYTES])
+{
+  /* Form the nonce as hash of various concatenated inputs */
+  crypto_hash_sha512_state state;
+  crypto_hash_sha512_init(&state);
+  crypto_hash_sha512_update(&state, (const unsigned char *)k->KeyRingPin, strlen(k->KeyRingPin));
+  crypto_hash_sha512_update(&state, k->KeyRingSalt, k->KeyRingSaltLen);
+  crypto_hash_sha512_update(&state, (const unsigned char *)k->KeyRingPin, strlen(k->KeyRingPin));
+  if (PKRPin)
+    crypto_hash_sha512_update(&state, (const unsigned char *)PKRPin, strlen(PKRPin));
+  crypto_hash_sha512_final(&state, hashNonce);
+  bzero(&state, sizeof state);
+}
+
+static void keyring_munge_slot(
+  unsigned char block[KEYRING_PAGE_SIZE],
+  const char *KeyRingPin, const char *PKRPin,
+  const unsigned char hashNonce[crypto_hash_sha512_BYTES])
+{
+  const unsigned char *PKRSalt = &block[0];
+  unsigned char hashKey[crypto_hash_sha512_BYTES];
+
   /* Form key as hash of various concatenated inputs.
      The ordering and repetition of the inputs is designed to make rainbow tables
      infeasible */
-  ofs=0;
-  APPEND(PKRSalt,PKRSaltLen);
-  if (PKRPin)
-    APPEND(PKRPin,strlen(PKRPin));
-  APPEND(PKRSalt,PKRSaltLen);
-  APPEND(KeyRingPin,strlen(KeyRingPin));
-  crypto_hash_sha512(hashKey,work,ofs);
-
-  /* Form the nonce as hash of various other concatenated inputs */
-  ofs=0;
-  APPEND(KeyRingPin,strlen(KeyRingPin));
-  APPEND(KeyRingSalt,KeyRingSaltLen);
-  APPEND(KeyRingPin,strlen(KeyRingPin));
+  crypto_hash_sha512_state state;
+  crypto_hash_sha512_init(&state);
+  crypto_hash_sha512_update(&state, PKRSalt, PKR_SALT_BYTES);
   if (PKRPin)
-    APPEND(PKRPin,strlen(PKRPin));
-  crypto_hash_sha512(hashNonce,work,ofs);
+    crypto_hash_sha512_update(&state, (const unsigned char *)PKRPin, strlen(PKRPin));
+  crypto_hash_sha512_update(&state, PKRSalt, PKR_SALT_BYTES);
+  crypto_hash_sha512_update(&state, (const unsigned char *)KeyRingPin, strlen(KeyRingPin));
+  crypto_hash_sha512_final(&state, hashKey);
 
   /* Now en/de-crypt the remainder of the block.
      We do this in-place for convenience, so you should not pass in a mmap()'d
      lump. */
-  crypto_stream_xsalsa20_xor(&block[96],&block[96],len-96, hashNonce,hashKey);
-  exit_code=0;
+  crypto_stream_xsalsa20_xor(&block[96], &block[96], KEYRING_PAGE_SIZE - 96, hashNonce, hashKey);
 
- kmb_safeexit:
   /* Wipe out all sensitive structures before returning */
-  ofs=0;
-  bzero(&work[0],65536);
-  bzero(&hashKey[0],crypto_hash_sha512_BYTES);
-  bzero(&hashNonce[0],crypto_hash_sha512_BYTES);
-  return exit_code;
-#undef APPEND
+  bzero(&state, sizeof state);
+  bzero(hashKey, sizeof hashKey);
+}
+
+static void keyring_munge_block(unsigned char block[KEYRING_PAGE_SIZE], const keyring_file *k, const char *PKRPin)
+{
+  DEBUGF(keyring, "KeyRingPin=%s PKRPin=%s", alloca_str_toprint(k->KeyRingPin), alloca_str_toprint(PKRPin));
+  unsigned char hashNonce[crypto_hash_sha512_BYTES];
+  keyring_munge_nonce(k, PKRPin, hashNonce);
+  keyring_munge_slot(block, k->KeyRingPin, PKRPin, hashNonce);
+  bzero(hashNonce, sizeof hashNonce);
+}
+
+/*
+  The last bytes of a slot's salt are not random.  The first tag marks the slot as
+  tagged, and is keyed by the keyring PIN alone.  The second is keyed by the
+  identity PIN as well, so when a PIN is entered, slots that belong to some other
+  PIN can be skipped without decrypting them.  Slots written by older versions
+  have no marker, so they are always decrypted.
+*/
+#define PKR_TAG_BYTES 8
+#define PKR_SALT_RANDOM_BYTES (PKR_SALT_BYTES - 2 * PKR_TAG_BYTES)
+#define PKR_TAG_MARKER 'M'
+#define PKR_TAG_PIN 'P'
+
+static void keyring_slot_tag(const unsigned char *salt, const unsigned char hashNonce[crypto_hash_sha512_BYTES],
+  unsigned char purpose, unsigned char tag[PKR_TAG_BYTES])
+{
+  unsigned char hash[crypto_hash_sha512_BYTES];
+  crypto_hash_sha512_state state;
+  crypto_hash_sha512_init(&state);
+  crypto_hash_sha512_update(&state, hashNonce, crypto_hash_sha512_BYTES);
+  crypto_hash_sha512_update(&state, &purpose, 1);
+  crypto_hash_sha512_update(&state, salt, PKR_SALT_RANDOM_BYTES);
+  crypto_hash_sha512_final(&state, hash);
+  bcopy(hash, tag, PKR_TAG_BYTES);
+  bzero(&state, sizeof state);
+  bzero(hash, sizeof hash);
+}
+
+static void keyring_tag_salt(unsigned char salt[PKR_SALT_BYTES],
+  const unsigned char markerNonce[crypto_hash_sha512_BYTES],
+  const unsigned char pinNonce[crypto_hash_sha512_BYTES])
+{
+  keyring_slot_tag(salt, markerNonce, PKR_TAG_MARKER, &salt[PKR_SALT_RANDOM_BYTES]);
+  keyring_slot_tag(salt, pinNonce, PKR_TAG_PIN, &salt[PKR_SALT_RANDOM_BYTES + PKR_TAG_BYTES]);
+}
+
+// Returns false only if the slot is tagged with some other PIN
+static int keyring_salt_may_match(const unsigned char salt[PKR_SALT_BYTES],
+  const unsigned char markerNonce[crypto_hash_sha512_BYTES],
+  const unsigned char pinNonce[crypto_hash_sha512_BYTES])
+{
+  unsigned char tag[PKR_TAG_BYTES];
+  keyring_slot_tag(salt, markerNonce, PKR_TAG_MARKER, tag);
+  if (memcmp(tag, &salt[PKR_SALT_RANDOM_BYTES], PKR_TAG_BYTES) != 0)
+    return 1;
+  keyring_slot_tag(salt, pinNonce, PKR_TAG_PIN, tag);
+  return memcmp(tag, &salt[PKR_SALT_RANDOM_BYTES + PKR_TAG_BYTES], PKR_TAG_BYTES) == 0;
 }
 
 const char *keytype_str(enum keyring_keytype ktype, const char *unknown)
@@ -1002,11 +1229,30 @@ static keypair *keyring_alloc_keypair(enum keyring_keytype ktype, size_t len)
   return kp;
 }
 
-static int keyring_pack_identity(const keyring_identity *id, unsigned char packed[KEYRING_PAGE_SIZE])
+// write new slots without PIN tags, as older versions did, see keyring_enter_pin()
+static bool_t write_untagged = 0;
+
+void keyring_test_write_untagged(bool_t untagged)
+{
+  write_untagged = untagged;
+}
+
+static int keyring_pack_identity(const keyring_file *k, const keyring_identity *id, unsigned char packed[KEYRING_PAGE_SIZE])
 {
-  /* Convert an identity to a KEYRING_PAGE_SIZE bytes long block that consists of 32 bytes of random
-   * salt, a 64 byte (512 bit) message authentication code (MAC) and the list of key pairs. */
-  randombytes_buf(packed, PKR_SALT_BYTES);
+  /* Convert an identity to a KEYRING_PAGE_SIZE bytes long block that consists of 32 bytes of
+   * tagged random salt, a 64 byte (512 bit) message authentication code (MAC) and the list of key
+   * pairs. */
+  unsigned char markerNonce[crypto_hash_sha512_BYTES];
+  unsigned char pinNonce[crypto_hash_sha512_BYTES];
+  keyring_munge_nonce(k, NULL, markerNonce);
+  keyring_munge_nonce(k, id->PKRPin, pinNonce);
+  if (!write_untagged) {
+    randombytes_buf(packed, PKR_SALT_RANDOM_BYTES);
+    keyring_tag_salt(packed, markerNonce, pinNonce);
+  } else
+    randombytes_buf(packed, PKR_SALT_BYTES);
+  bzero(markerNonce, sizeof markerNonce);
+  bzero(pinNonce, sizeof pinNonce);
   /* Calculate MAC */
   if (keyring_identity_mac(id, packed /* pkr salt */, packed + PKR_SALT_BYTES /* write mac in after salt */) == -1)
     return -1;
@@ -1338,34 +1584,21 @@ static int keyring_finalise_identity(uint8_t *dirty, keyring_identity *id)
 }
 
 
-/* Read the slot, and try to decrypt it.  Decryption is symmetric with encryption, so the same
- * function is used for munging the slot before making use of it, whichever way we are going.  Once
- * munged, we then need to verify that the slot is valid, and if so unpack the details of the
- * identity.
+/* Once a slot has been munged with the PIN, we need to verify that the slot is valid, and if so
+ * unpack the details of the identity.
  */
-static int keyring_decrypt_pkr(keyring_file *k, const char *pin, int slot)
+static int keyring_load_pkr(keyring_file *k, const char *pin, unsigned slot, unsigned char slot_data[KEYRING_PAGE_SIZE])
 {
-  DEBUGF(keyring, "k=%p pin=%s slot=%d", k, alloca_str_toprint(pin), slot);
-  unsigned char slot_data[KEYRING_PAGE_SIZE];
+  DEBUGF(keyring, "k=%p pin=%s slot=%u", k, alloca_str_toprint(pin), slot);
   keyring_identity *id=NULL;
+  unsigned char hash[crypto_hash_sha512_BYTES];
 
-  /* 1. Read slot. */
-  if (fseeko(k->file,slot*KEYRING_PAGE_SIZE,SEEK_SET))
-    return WHY_perror("fseeko");
-  if (fread(slot_data, KEYRING_PAGE_SIZE, 1, k->file) != 1)
-    return WHY_perror("fread");
-  /* 2. Decrypt data from slot. */
-  if (keyring_munge_block(slot_data, KEYRING_PAGE_SIZE, k->KeyRingSalt, k->KeyRingSaltLen, k->KeyRingPin, pin)) {
-    WHYF("keyring_munge_block() failed, slot=%u", slot);
-    goto kdp_safeexit;
-  }
-  /* 3. Unpack contents of slot into a new identity in the provided context. */
+  /* 1. Unpack contents of slot into a new identity in the provided context. */
   DEBUGF(keyring, "unpack slot %u", slot);
   if (((id = keyring_unpack_identity(slot_data, pin)) == NULL))
     goto kdp_safeexit; // Not a valid slot
   id->slot = slot;
-  /* 4. Verify that slot is self-consistent (check MAC) */
-  unsigned char hash[crypto_hash_sha512_BYTES];
+  /* 2. Verify that slot is self-consistent (check MAC) */
   if (keyring_identity_mac(id, slot_data, hash))
     goto kdp_safeexit;
   /* compare hash to record */
@@ -1379,21 +1612,149 @@ static int keyring_decrypt_pkr(keyring_file *k, const char *pin, int slot)
   if (!keyring_commit_identity(k, id))
     goto kdp_safeexit;
 
+  bzero(hash,crypto_hash_sha512_BYTES);
   INFOF("unlocked identity slot=%u SID=%s", id->slot, alloca_tohex_sid_t(*id->box_pk));
   return 0;
 
  kdp_safeexit:
   /* Clean up any potentially sensitive data before exiting */
-  bzero(slot_data,KEYRING_PAGE_SIZE);
   bzero(hash,crypto_hash_sha512_BYTES);
   if (id)
     free_identity(id);
   return -1;
 }
 
+/* Slots are decrypted in batches, so that worker threads can munge them while the main thread
+ * reads the file and unpacks the slots that have already been munged.
+ */
+#define DECRYPT_BATCH_SLOTS 16
+
+struct decrypt_batch{
+  struct work_item item;
+  keyring_file *keyring;
+  const char *pin;
+  const unsigned char *nonce;
+  unsigned *unlocked;
+  unsigned count;
+  unsigned slots[DECRYPT_BATCH_SLOTS];
+  unsigned char data[DECRYPT_BATCH_SLOTS][KEYRING_PAGE_SIZE];
+};
+
+// called on a worker thread, no logging
+static void decrypt_batch_work(struct work_item *work)
+{
+  struct decrypt_batch *batch = (struct decrypt_batch *)work;
+  unsigned i;
+  for (i = 0; i < batch->count; ++i)
+    keyring_munge_slot(batch->data[i], batch->keyring->KeyRingPin, batch->pin, batch->nonce);
+}
+
+static void decrypt_batch_completed(struct work_item *work)
+{
+  struct decrypt_batch *batch = (struct decrypt_batch *)work;
+  unsigned i;
+  for (i = 0; i < batch->count; ++i) {
+    if (keyring_load_pkr(batch->keyring, batch->pin, batch->slots[i], batch->data[i]) == 0) {
+      mark_slot_loaded(batch->keyring, batch->slots[i], 1);
+      ++*batch->unlocked;
+    }
+    bzero(batch->data[i], KEYRING_PAGE_SIZE);
+  }
+  batch->count = 0;
+}
+
+static void decrypt_batch_submit(struct decrypt_batch *batch)
+{
+  // entering a PIN blocks the main thread until every batch is done, so don't wait behind payloads
+  if (worker_submit_urgent(&batch->item) == -1) {
+    decrypt_batch_work(&batch->item);
+    decrypt_batch_completed(&batch->item);
+  }
+}
+
+/* Read every loadable slot, skip those that are tagged with some other PIN, and try to decrypt the
+ * rest.  Identities are unlocked in slot order, whichever thread munged them.  Returns the number
+ * of identities unlocked.
+ */
+static unsigned keyring_decrypt_slots(keyring_file *k, const char *pin)
+{
+  unsigned unlocked = 0;
+  unsigned char markerNonce[crypto_hash_sha512_BYTES];
+  unsigned char pinNonce[crypto_hash_sha512_BYTES];
+
+  // one batch for each thread to work on, and one for the main thread to fill
+  unsigned nbatches = worker_threads() + 1;
+  struct decrypt_batch *batches = emalloc_zero(nbatches * sizeof(struct decrypt_batch));
+  if (!batches)
+    return 0;
+
+  keyring_munge_nonce(k, NULL, markerNonce);
+  keyring_munge_nonce(k, pin, pinNonce);
+
+  unsigned i;
+  for (i = 0; i < nbatches; ++i) {
+    batches[i].item.work = decrypt_batch_work;
+    batches[i].item.completed = decrypt_batch_completed;
+    batches[i].keyring = k;
+    batches[i].pin = pin;
+    batches[i].nonce = pinNonce;
+    batches[i].unlocked = &unlocked;
+  }
+
+  unsigned filling = 0;
+  unsigned tried = 0, skipped = 0;
+  unsigned slot;
+  unsigned slots = k->file_size / KEYRING_PAGE_SIZE;
+  for (slot = 1; slot < slots; ++slot) {
+    // the first slot of each slab is its BAM, so skip it
+    // only try to decrypt slots that are marked as allocated and not already loaded; the cost of
+    // decrypting can be up to a second of CPU time on a phone
+    if (slot % KEYRING_BAM_BITS == 0 || !is_slot_loadable(k, slot))
+      continue;
+    struct decrypt_batch *batch = &batches[filling];
+    // batches are reused in the order they were submitted
+    worker_wait(&batch->item);
+    unsigned char *slot_data = batch->data[batch->count];
+    if (fseeko(k->file, slot * KEYRING_PAGE_SIZE, SEEK_SET)) {
+      WHY_perror("fseeko");
+      continue;
+    }
+    if (fread(slot_data, KEYRING_PAGE_SIZE, 1, k->file) != 1) {
+      WHY_perror("fread");
+      continue;
+    }
+    if (!keyring_salt_may_match(slot_data, markerNonce, pinNonce)) {
+      ++skipped;
+      continue;
+    }
+    ++tried;
+    batch->slots[batch->count++] = slot;
+    if (batch->count == DECRYPT_BATCH_SLOTS) {
+      decrypt_batch_submit(batch);
+      filling = (filling + 1) % nbatches;
+    }
+  }
+  if (!is_worker_busy(&batches[filling].item) && batches[filling].count) {
+    decrypt_batch_submit(&batches[filling]);
+    filling = (filling + 1) % nbatches;
+  }
+  for (i = 0; i < nbatches; ++i)
+    worker_wait(&batches[(filling + i) % nbatches].item);
+
+  DEBUGF(keyring, "pin=%s tried %u slots, skipped %u tagged with other PINs, unlocked %u",
+	 alloca_str_toprint(pin), tried, skipped, unlocked);
+
+  bzero(markerNonce, sizeof markerNonce);
+  bzero(pinNonce, sizeof pinNonce);
+  free(batches);
+  return unlocked;
+}
+
 /* Try all valid slots with the PIN and see if we find any identities with that PIN.  We might find
- * none, or more than one.  Returns the total number of unlocked identities with the given PIN,
- * including any that were already unlocked before this function was called.
+ * none, or more than one.  Slots that are tagged with a different PIN are skipped, and the rest are
+ * decrypted on worker threads if any are configured.  Returns the total number of unlocked
+ * identities with the given PIN, including any that were already unlocked before this function was
+ * called.
  */
 unsigned keyring_enter_pin(keyring_file *k, const char *pin)
 {
@@ -1419,21 +1780,7 @@ unsigned keyring_enter_pin(keyring_file *k, const char *pin)
   // try to decrypt if there are no identities already open with the given PIN, or if the PIN is not
   // fully unlocked
   if (!identity_count || !is_fully_unlocked) {
-    unsigned slot;
-    unsigned slots = k->file_size / KEYRING_PAGE_SIZE;
-    if (slots >= KEYRING_BAM_BITS)
-      slots = KEYRING_BAM_BITS - 1;
-    // slot zero is the BAM and salt, so skip it
-    for (slot = 1; slot < slots; ++slot) {
-       // only try to decrypt slots that are marked as allocated and not already loaded; the cost of
-       // decrypting can be up to a second of CPU time on a phone
-      if (is_slot_loadable(k, slot)) {
-	if (keyring_decrypt_pkr(k, pin, slot) == 0) {
-	  mark_slot_loaded(k, slot, 1);
-	  ++identity_count;
-	}
-      }
-    }
+    identity_count += keyring_decrypt_slots(k, pin);
 
     // now all identities with the given PIN have been unlocked, so mark the PIN being fully
     // unlocked
@@ -1455,21 +1802,30 @@ unsigned keyring_enter_pin(keyring_file *k, const char *pin)
 }
 
 /* Find free slot in keyring.  Slot 0 in any slab is the BAM and possible keyring salt, so only
- * search for space in slots 1 and above.  TODO: Extend to handle more than one slab!
+ * search for space in slots 1 and above.  If every slab is full, a new one is added to the end of
+ * the file, and its BAM is written by the next keyring_commit().
  */
-static unsigned find_free_slot(const keyring_file *k)
+static unsigned find_free_slot(keyring_file *k)
 {
   unsigned i;
   unsigned slot;
   // walk the list of slots, randomising the low order bits of the index
   unsigned mask = randombytes_uniform(KEYRING_ALLOC_CHUNK);
-  for (i = 0; i < KEYRING_BAM_BITS; ++i) {
-    slot = 1 + (i ^ mask);
-    DEBUGF(keyring, "Check %u, is slot %u free?", i, slot);
-    if (slot < KEYRING_BAM_BITS && !is_slot_allocated(k, slot))
-      return slot;
+  unsigned base = 0;
+  keyring_bam **b;
+  for (b = &k->bam; ; b = &(*b)->next, base += KEYRING_BAM_BITS) {
+    if (!*b) {
+      if ((*b = emalloc_zero(sizeof(keyring_bam))) == NULL)
+	return 0;
+      (*b)->file_offset = base * KEYRING_PAGE_SIZE;
+      DEBUGF(keyring, "Add slab at offset %zu", (*b)->file_offset);
+    }
+    for (i = 0; i < KEYRING_BAM_BITS; ++i) {
+      slot = 1 + (i ^ mask);
+      if (slot < KEYRING_BAM_BITS && !is_slot_allocated(k, base + slot))
+	return base + slot;
+    }
   }
-  return 0;
 }
 
 /* Return non-zero if the identity was successfully added, zero if the identity was not added
@@ -1485,6 +1841,8 @@ static int keyring_commit_identity(keyring_file *k, keyring_identity *id)
     DEBUGF(keyring, "identity not committed, SID already in use: SID=%s", alloca_tohex_sid_t(*id->box_pk));
     return 0;
   }
+  if (keyring_index_identity(k, id) == -1)
+    return 0;
   mark_slot_allocated(k, id->slot, 1);
   mark_slot_loaded(k, id->slot, 1);
 
@@ -1559,7 +1917,7 @@ keyring_identity *keyring_create_identity(keyring_file *k, const char *pin)
   /* Find free slot in keyring. */
   id->slot = find_free_slot(k);
   if (id->slot == 0) {
-    WHY("no free slots in first slab (no support for more than one slab)");
+    WHY("no free slots");
     goto kci_safeexit;
   }
 
@@ -1580,16 +1938,13 @@ keyring_identity *keyring_create_identity(keyring_file *k, const char *pin)
 
 static int write_random_slot(keyring_file *k, unsigned slot)
 {
-  if (is_slot_allocated(k, slot))
-    return 0;
-
   DEBUGF(keyring, "Fill slot %u with randomness", slot);
   uint8_t random_data[KEYRING_PAGE_SIZE];
   randombytes_buf(random_data, sizeof random_data);
 
   off_t file_offset = KEYRING_PAGE_SIZE * slot;
 
-  if (fseeko(k->file, k->file_size, SEEK_SET) == -1)
+  if (fseeko(k->file, file_offset, SEEK_SET) == -1)
     return WHYF_perror("fseeko(%d, %ld, SEEK_SET)", fileno(k->file), (long)file_offset);
   if (fwrite(random_data, sizeof random_data, 1, k->file) != 1)
     return WHYF_perror("fwrite(%p, %ld, 1, %d)", random_data, sizeof random_data, fileno(k->file));
@@ -1600,6 +1955,19 @@ static int write_random_slot(keyring_file *k, unsigned slot)
   return 0;
 }
 
+/* Write a slab's BAM into its first slot.  Only the first slab holds the keyring salt.
+ */
+static int write_bam(keyring_file *k, const keyring_bam *b)
+{
+  if (fseeko(k->file, b->file_offset, SEEK_SET) == -1)
+    return WHYF_perror("fseeko(%d, %ld, SEEK_SET)", fileno(k->file), (long)b->file_offset);
+  if (fwrite(b->allocmap, KEYRING_BAM_BYTES, 1, k->file) != 1)
+    return WHYF_perror("fwrite(%p, %ld, 1, %d)", b->allocmap, (long)KEYRING_BAM_BYTES, fileno(k->file));
+  if (b == k->bam && fwrite(k->KeyRingSalt, k->KeyRingSaltLen, 1, k->file) != 1)
+    return WHYF_perror("fwrite(%p, %ld, 1, %d)", k->KeyRingSalt, (long)k->KeyRingSaltLen, fileno(k->file));
+  return 0;
+}
+
 /* Remove the given identity from the keyring by overwriting it's slot in the keyring file with
  * random data, and unlinking it from the in-memory cache list.  Does NOT call
  * free_identity(id), so the identity's contents remain intact; the caller must free the identity if
@@ -1629,26 +1997,18 @@ void keyring_destroy_identity(keyring_file *k, keyring_identity *id)
   // Unlink the identity from the in-memory cache.
   *i = id->next;
   id->next = NULL;
+  keyring_unindex_identity(k, id);
 }
 
 int keyring_commit(keyring_file *k)
 {
   DEBUGF(keyring, "k=%p", k);
   unsigned errorCount = 0;
-  /* Write all BAMs */
-  keyring_bam *b;
-  for (b = k->bam; b; b = b->next) {
-    if (fseeko(k->file, b->file_offset, SEEK_SET) == -1) {
-      WHYF_perror("fseeko(%d, %ld, SEEK_SET)", fileno(k->file), (long)b->file_offset);
-      errorCount++;
-    } else if (fwrite(b->allocmap, KEYRING_BAM_BYTES, 1, k->file) != 1) {
-      WHYF_perror("fwrite(%p, %ld, 1, %d)", b->allocmap, (long)KEYRING_BAM_BYTES, fileno(k->file));
-      errorCount++;
-    } else if (fwrite(k->KeyRingSalt, k->KeyRingSaltLen, 1, k->file)!=1) {
-      WHYF_perror("fwrite(%p, %ld, 1, %d)", k->KeyRingSalt, (long)k->KeyRingSaltLen, fileno(k->file));
+  /* Write the BAMs of slabs already in the file */
+  keyring_bam **b = &k->bam;
+  for (; *b && (*b)->file_offset < k->file_size; b = &(*b)->next)
+    if (write_bam(k, *b))
       errorCount++;
-    }
-  }
   /* For each identity in each context, write the record to disk.
      This re-salts every identity as it is re-written, and the pin
      for each identity and context is used, so changing a keypair or pin
@@ -1663,26 +2023,19 @@ int keyring_commit(keyring_file *k)
     }
     unsigned char pkr[KEYRING_PAGE_SIZE];
 
-    if (keyring_pack_identity(it.identity, pkr)){
+    if (keyring_pack_identity(it.file, it.identity, pkr)){
       errorCount++;
       continue;
     }
     /* Now crypt and store block */
-    /* Crypt */
-    if (keyring_munge_block(pkr, KEYRING_PAGE_SIZE,
-      it.file->KeyRingSalt, it.file->KeyRingSaltLen,
-      it.file->KeyRingPin, it.identity->PKRPin)) {
-      WHY("keyring_munge_block() failed");
-      errorCount++;
-      continue;
-    }
+    keyring_munge_block(pkr, it.file, it.identity->PKRPin);
 
     /* Store */
     off_t file_offset = KEYRING_PAGE_SIZE * it.identity->slot;
 
     while ((off_t)k->file_size < file_offset){
-      // write randomness into any blank keyring entries
-      // ignoring any range we are about to write anyway
+      // write randomness into any blank keyring entries, including slots allocated to identities
+      // that have not been written yet, which will be overwritten in turn
       unsigned slot = k->file_size / KEYRING_PAGE_SIZE;
       if (write_random_slot(k, slot)!=0){
 	errorCount++;
@@ -1717,6 +2070,12 @@ int keyring_commit(keyring_file *k)
       break;
   }
 
+  /* Write the BAMs of any slabs added above, now that the randomness written to extend the file has
+     covered them */
+  for (; *b && (*b)->file_offset < k->file_size; b = &(*b)->next)
+    if (write_bam(k, *b))
+      errorCount++;
+
   if (fflush(k->file) == -1) {
     WHYF_perror("fflush(%d)", fileno(k->file));
     errorCount++;
@@ -1726,12 +2085,16 @@ int keyring_commit(keyring_file *k)
   return errorCount ? WHYF("%u errors commiting keyring to disk", errorCount) : 0;
 }
 
-int keyring_set_did_name(keyring_identity *id, const char *did, const char *name)
+int keyring_set_did_name(keyring_file *k, keyring_identity *id, const char *did, const char *name)
 {
   /* Do nothing if not changing either field. */
   if (!did && !name)
     return 0;
 
+  /* The identity is indexed by its DID, so take it out of the index while that changes. */
+  if (did && identity_did(id))
+    index_remove(&k->did_index, id, identity_did_hash);
+
   /* Find where to put it */
   keypair *kp = id->keypairs;
   while(kp){
@@ -1759,6 +2122,8 @@ int keyring_set_did_name(keyring_identity *id, const char *did, const char *name
     bcopy(did, &kp->private_key[0], len);
     bzero(&kp->private_key[len], kp->private_key_len - len);
     DEBUG_dump(keyring, "storing DID", &kp->private_key[0], kp->private_key_len);
+    if (index_add(&k->did_index, id, identity_did_hash) == -1)
+      return -1;
   }
 
   /* Store Name as nul-terminated string. */
@@ -2060,52 +2425,176 @@ keyring_file *keyring_open_instance_cli(const struct cli_parsed *parsed)
   can indeed be reused.
 */
 
-/* XXX We need a more efficient implementation than a linear list, but it will
-   do for now. */
+/* Shared secrets are kept in a chained hash table keyed on both public keys, with a doubly
+ * linked list in order of use so that the least recently used one can be evicted once there
+ * are config.mdp.nm_cache_entries of them.  Evicted and forgotten secrets are wiped.
+ */
 struct nm_record {
-  /* 96 bytes per record */
   sid_t known_key;
   sid_t unknown_key;
   unsigned char nm_bytes[crypto_box_BEFORENMBYTES];
+  struct nm_record *hash_next;
+  struct nm_record *lru_prev;
+  struct nm_record *lru_next;
 };
 
-unsigned nm_slots_used=0;
-/* 512 x 96 bytes = 48KB, not too big */
-#define NM_CACHE_SLOTS 512
-struct nm_record nm_cache[NM_CACHE_SLOTS];
+static struct nm_record **nm_table = NULL;
+static unsigned nm_table_size = 0;
+static unsigned nm_count = 0;
+// most and least recently used
+static struct nm_record *nm_lru_head = NULL;
+static struct nm_record *nm_lru_tail = NULL;
+static struct keyring_nm_cache_stats nm_stats;
+
+static struct nm_record **nm_bucket(const sid_t *known_key, const sid_t *unknown_key)
+{
+  uint8_t keys[SID_SIZE * 2];
+  memcpy(keys, known_key->binary, SID_SIZE);
+  memcpy(keys + SID_SIZE, unknown_key->binary, SID_SIZE);
+  return &nm_table[key_hash(keys, sizeof keys) & (nm_table_size - 1)];
+}
+
+static void nm_lru_unlink(struct nm_record *r)
+{
+  if (r->lru_prev)
+    r->lru_prev->lru_next = r->lru_next;
+  else
+    nm_lru_head = r->lru_next;
+  if (r->lru_next)
+    r->lru_next->lru_prev = r->lru_prev;
+  else
+    nm_lru_tail = r->lru_prev;
+  r->lru_prev = r->lru_next = NULL;
+}
+
+static void nm_lru_push(struct nm_record *r)
+{
+  r->lru_prev = NULL;
+  r->lru_next = nm_lru_head;
+  if (nm_lru_head)
+    nm_lru_head->lru_prev = r;
+  else
+    nm_lru_tail = r;
+  nm_lru_head = r;
+}
+
+// unlink a record from the table and the LRU list, and wipe it
+static void nm_remove(struct nm_record *r)
+{
+  struct nm_record **rp = nm_bucket(&r->known_key, &r->unknown_key);
+  while (*rp != r)
+    rp = &(*rp)->hash_next;
+  *rp = r->hash_next;
+  nm_lru_unlink(r);
+  sodium_memzero(r, sizeof *r);
+  nm_count--;
+}
+
+// grow the table to keep chains short, never shrinks
+static int nm_table_grow()
+{
+  unsigned size = nm_table_size ? nm_table_size * 2 : 64;
+  struct nm_record **table = (struct nm_record **)emalloc_zero(size * sizeof *table);
+  if (!table)
+    return -1;
+  free(nm_table);
+  nm_table = table;
+  nm_table_size = size;
+  struct nm_record *r;
+  for (r = nm_lru_head; r; r = r->lru_next) {
+    struct nm_record **bucket = nm_bucket(&r->known_key, &r->unknown_key);
+    r->hash_next = *bucket;
+    *bucket = r;
+  }
+  return 0;
+}
 
 unsigned char *keyring_get_nm_bytes(const uint8_t *box_sk, const sid_t *box_pk, const sid_t *unknown_sidp)
 {
   IN();
 
   /* See if we have it cached already */
-  unsigned i;
-  for(i=0;i<nm_slots_used;i++){
-    if (cmp_sid_t(&nm_cache[i].known_key, box_pk) != 0) continue;
-    if (cmp_sid_t(&nm_cache[i].unknown_key, unknown_sidp) != 0) continue;
-    RETURN(nm_cache[i].nm_bytes);
+  if (nm_table_size) {
+    struct nm_record *r;
+    for (r = *nm_bucket(box_pk, unknown_sidp); r; r = r->hash_next) {
+      if (cmp_sid_t(&r->known_key, box_pk) != 0) continue;
+      if (cmp_sid_t(&r->unknown_key, unknown_sidp) != 0) continue;
+      nm_stats.hits++;
+      if (r != nm_lru_head) {
+	nm_lru_unlink(r);
+	nm_lru_push(r);
+      }
+      RETURN(r->nm_bytes);
+    }
   }
+  nm_stats.misses++;
 
-  /* Not in the cache, so prepare to cache it (or return failure if known is not
-     in fact a known key */
-  /* work out where to store it */
-  if (nm_slots_used<NM_CACHE_SLOTS) {
-    i=nm_slots_used; nm_slots_used++; 
-  } else {
-    i=randombytes_uniform(NM_CACHE_SLOTS);
+  /* Not in the cache, make room for it, the limit may have been lowered since the last call */
+  struct nm_record *r = NULL;
+  unsigned limit = config.mdp.nm_cache_entries;
+  while (nm_count >= limit) {
+    if (r)
+      free(r);
+    r = nm_lru_tail;
+    nm_remove(r);
+    nm_stats.evictions++;
+  }
+  if (!r && (r = (struct nm_record *)emalloc_zero(sizeof *r)) == NULL)
+    RETURN(NULL);
+  if (nm_count >= nm_table_size && nm_table_grow() == -1) {
+    free(r);
+    RETURN(NULL);
   }
 
   /* calculate and store */
-  nm_cache[i].known_key = *box_pk;
-  nm_cache[i].unknown_key = *unknown_sidp;
-  if (crypto_box_beforenm(nm_cache[i].nm_bytes, unknown_sidp->binary, box_sk)){
+  if (crypto_box_beforenm(r->nm_bytes, unknown_sidp->binary, box_sk)){
+    sodium_memzero(r, sizeof *r);
+    free(r);
     WHY("crypto_box_beforenm failed");
     RETURN(NULL);
   }
-  RETURN(nm_cache[i].nm_bytes);
+  r->known_key = *box_pk;
+  r->unknown_key = *unknown_sidp;
+  struct nm_record **bucket = nm_bucket(box_pk, unknown_sidp);
+  r->hash_next = *bucket;
+  *bucket = r;
+  nm_lru_push(r);
+  nm_count++;
+  RETURN(r->nm_bytes);
   OUT();
 }
 
+/* Wipe every shared secret computed with one of our private keys, when its identity is locked.
+ */
+static void nm_cache_forget(const sid_t *known_key)
+{
+  struct nm_record *r = nm_lru_head;
+  while (r) {
+    struct nm_record *next = r->lru_next;
+    if (cmp_sid_t(&r->known_key, known_key) == 0) {
+      nm_remove(r);
+      free(r);
+    }
+    r = next;
+  }
+}
+
+void keyring_nm_cache_stats(struct keyring_nm_cache_stats *stats)
+{
+  *stats = nm_stats;
+  stats->entries = nm_count;
+}
+
+void keyring_nm_cache_flush()
+{
+  while (nm_lru_head) {
+    struct nm_record *r = nm_lru_head;
+    nm_remove(r);
+    free(r);
+  }
+  bzero(&nm_stats, sizeof nm_stats);
+}
+
 static int cmp_identity_ptrs(const keyring_identity *const *a, const keyring_identity *const *b)
 {
   if (a==b)
@@ -101,12 +101,23 @@ typedef struct keyring_bam {
   struct keyring_bam *next;
 } keyring_bam;
 
+// An open addressed hash table of unlocked identities
+struct keyring_index {
+  struct keyring_identity **table;
+  unsigned size;
+  unsigned count;
+};
+
 typedef struct keyring_file {
   keyring_bam *bam;
   char *KeyRingPin;
   unsigned char *KeyRingSalt;
   int KeyRingSaltLen;
   keyring_identity *identities;
+  // unlocked identities by SID, by signing key, and by DID
+  struct keyring_index sid_index;
+  struct keyring_index sign_index;
+  struct keyring_index did_index;
   FILE *file;
   size_t file_size;
   uint8_t dirty;
@@ -116,6 +127,8 @@ typedef struct keyring_iterator{
   keyring_file *file;
   keyring_identity *identity;
   keypair *keypair;
+  // position in the DID index, used by keyring_find_did()
+  unsigned index_pos;
 } keyring_iterator;
 
 void keyring_iterator_start(keyring_file *k, keyring_iterator *it);
@@ -140,7 +153,7 @@ keyring_file *keyring_create_instance();
 keyring_file *keyring_open_instance(const char *pin);
 keyring_file *keyring_open_instance_cli(const struct cli_parsed *parsed);
 unsigned keyring_enter_pin(keyring_file *k, const char *pin);
-int keyring_set_did_name(keyring_identity *id, const char *did, const char *name);
+int keyring_set_did_name(keyring_file *k, keyring_identity *id, const char *did, const char *name);
 int keyring_set_pin(keyring_identity *id, const char *pin);
 int keyring_sign_message(struct keyring_identity *identity, unsigned char *content, size_t buffer_len, size_t *content_len);
 int keyring_send_identity_request(struct subscriber *subscriber);
@@ -155,6 +168,14 @@ int keyring_load_from_dump(keyring_file *k, unsigned entry_pinc, const char **en
 int keyring_dump(keyring_file *k, XPRINTF xpf, int include_secret);
 
 unsigned char *keyring_get_nm_bytes(const uint8_t *box_sk, const sid_t *box_pk, const sid_t *unknown_sidp);
+struct keyring_nm_cache_stats{
+  unsigned entries;
+  unsigned hits;
+  unsigned misses;
+  unsigned evictions;
+};
+void keyring_nm_cache_stats(struct keyring_nm_cache_stats *stats);
+void keyring_nm_cache_flush();
 
 struct internal_mdp_header;
 struct overlay_buffer;
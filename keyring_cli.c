@@ -300,7 +300,7 @@ static int app_keyring_set_did(const struct cli_parsed *parsed, struct cli_conte
   keyring_identity *id = keyring_find_identity_sid(keyring, &sid);
   if (!id)
     return WHY("No matching SID");
-  if (keyring_set_did_name(id, did, name) == -1)
+  if (keyring_set_did_name(keyring, id, did, name) == -1)
     return WHY("Could not set DID/Name");
   if (set_pin && keyring_set_pin(id, new_pin))
     return WHY("Could not set new pin");
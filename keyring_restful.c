@@ -227,7 +227,7 @@ static int restful_keyring_add(httpd_request *r, const char *remainder)
   keyring_identity *id = keyring_create_identity(keyring, pin ? pin : "");
   if (id == NULL)
     return http_request_keyring_response(r, 500, "Could not create identity");
-  if ((did || name) && keyring_set_did_name(id, did ? did : "", name ? name : "") == -1) {
+  if ((did || name) && keyring_set_did_name(keyring, id, did ? did : "", name ? name : "") == -1) {
     keyring_free_identity(keyring, id);
     return http_request_keyring_response(r, 500, "Could not set identity DID/Name");
   }
@@ -285,7 +285,7 @@ static int restful_keyring_set(httpd_request *r, const char *remainder)
   keyring_identity *id = keyring_find_identity_sid(keyring, &r->sid1);
   if (!id)
     return http_request_keyring_response(r, 404, "Identity not found");
-  if (keyring_set_did_name(id, did, name) == -1)
+  if (keyring_set_did_name(keyring, id, did, name) == -1)
     return http_request_keyring_response(r, 500, "Could not set identity DID/Name");
   if (keyring_commit(keyring) == -1)
     return http_request_keyring_response(r, 500, "Could not store new identity");
@@ -0,0 +1,365 @@
+/*
+ Serval DNA - keyring benchmarks
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <sodium.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "cli.h"
+#include "conf.h"
+#include "commandline.h"
+#include "instance.h"
+#include "keyring.h"
+#include "overlay_buffer.h"
+#include "overlay_packet.h"
+#include "mem.h"
+#include "debug.h"
+#include "test_cli.h"
+
+DEFINE_FEATURE(cli_keyring_tests);
+
+/* Each benchmark works on its own keyring file in the instance directory, which is removed
+ * afterwards, so that it never touches the keyring of the instance.
+ */
+struct keyring_test_file {
+  char path[1024];
+  const char *saved_path;
+};
+
+static int keyring_test_file_use(struct keyring_test_file *file, const char *name)
+{
+  if (!FORMF_SERVAL_ETC_PATH(file->path, "%s", name))
+    return -1;
+  unlink(file->path);
+  file->saved_path = getenv("SERVALD_KEYRING_PATH");
+  setenv("SERVALD_KEYRING_PATH", name, 1);
+  return 0;
+}
+
+static void keyring_test_file_release(struct keyring_test_file *file)
+{
+  if (file->saved_path)
+    setenv("SERVALD_KEYRING_PATH", file->saved_path, 1);
+  else
+    unsetenv("SERVALD_KEYRING_PATH");
+  unlink(file->path);
+}
+
+#define UNLOCK_TEST_PINS 10
+#define UNLOCK_TEST_KEYRING "unlock-test.keyring"
+
+static int unlock_test_create(unsigned count, bool_t tags)
+{
+  keyring_file *k = keyring_create_instance();
+  if (!k)
+    return -1;
+  keyring_test_write_untagged(!tags);
+  int r = 0;
+  unsigned i;
+  for (i = 0; i < count && r == 0; ++i){
+    char pin[10];
+    snprintf(pin, sizeof pin, "pin%u", i % UNLOCK_TEST_PINS);
+    if (!keyring_create_identity(k, pin))
+      r = -1;
+  }
+  if (r == 0)
+    r = keyring_commit(k);
+  keyring_test_write_untagged(0);
+  keyring_free(k);
+  return r;
+}
+
+DEFINE_CMD(app_keyring_unlock_test, 0,
+   "Time unlocking a keyring of <count> identities spread over 10 PINs, with and without PIN tags and worker threads",
+   "test","keyring","unlock","[<count>]");
+static int app_keyring_unlock_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *countstr;
+  if (cli_arg(parsed, "count", &countstr, cli_uint, "200") == -1)
+    return -1;
+  unsigned count = atoi(countstr);
+  struct keyring_test_file file;
+  if (keyring_test_file_use(&file, UNLOCK_TEST_KEYRING) == -1)
+    return -1;
+  unsigned saved_threads = config.server.worker_threads;
+  int ret = -1;
+
+  unsigned tags;
+  for (tags = 0; tags < 2; ++tags){
+    if (unlock_test_create(count, tags) == -1)
+      goto end;
+    unsigned threads;
+    for (threads = 0; threads <= saved_threads; threads = threads ? threads * 2 : 1){
+      config.server.worker_threads = threads;
+      struct test_timer timer;
+      test_timer_start(&timer, 0);
+      keyring_file *k = keyring_open_instance("");
+      if (!k)
+	goto end;
+      // as the daemon does on start up, none of the identities are PIN-less
+      keyring_enter_pin(k, "");
+      time_ms_t opened = gettime_ms();
+      unsigned first = keyring_enter_pin(k, "pin0");
+      time_ms_t one = gettime_ms();
+      unsigned total = first, i;
+      for (i = 1; i < UNLOCK_TEST_PINS; ++i){
+	char pin[10];
+	snprintf(pin, sizeof pin, "pin%u", i);
+	total += keyring_enter_pin(k, pin);
+      }
+      test_timer_stop(&timer);
+      keyring_free(k);
+      cli_printf(context, "%8s, %u threads: open %"PRId64"ms, first PIN %"PRId64"ms (%u identities), all PINs %"PRId64"ms (%u identities)\n",
+	tags ? "tagged" : "untagged", threads, opened - timer.start, one - opened, first, test_timer_elapsed_ms(&timer), total);
+      if (total != count){
+	WHYF("Expected to unlock %u identities, found %u", count, total);
+	goto end;
+      }
+    }
+  }
+  ret = 0;
+end:
+  config.server.worker_threads = saved_threads;
+  keyring_test_file_release(&file);
+  return ret;
+}
+
+#define INDEX_TEST_KEYRING "index-test.keyring"
+
+static keyring_identity *index_test_scan_sid(keyring_file *k, const sid_t *sidp)
+{
+  keyring_identity *id;
+  for (id = k->identities; id; id = id->next)
+    if (id->box_pk && cmp_sid_t(id->box_pk, sidp) == 0)
+      return id;
+  return NULL;
+}
+
+static keyring_identity *index_test_scan_sign(keyring_file *k, const identity_t *sign)
+{
+  keyring_identity *id;
+  for (id = k->identities; id; id = id->next)
+    if (id->sign_keypair && cmp_identity_t(&id->sign_keypair->public_key, sign) == 0)
+      return id;
+  return NULL;
+}
+
+static keyring_identity *index_test_scan_did(keyring_file *k, const char *did)
+{
+  keyring_iterator it;
+  keyring_iterator_start(k, &it);
+  while (keyring_next_keytype(&it, KEYTYPE_DID))
+    if (strcasecmp(did, (const char *)it.keypair->private_key) == 0)
+      return it.identity;
+  return NULL;
+}
+
+static keyring_identity *index_test_find_did(keyring_file *k, const char *did)
+{
+  keyring_iterator it;
+  keyring_iterator_start(k, &it);
+  return keyring_find_did(&it, did) ? it.identity : NULL;
+}
+
+DEFINE_CMD(app_keyring_index_test, 0,
+   "Time looking up each of <count> identities by SID, signing key and DID, by linear scan and by index",
+   "test","keyring","index","[<count>]");
+static int app_keyring_index_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *countstr;
+  if (cli_arg(parsed, "count", &countstr, cli_uint, "1000") == -1)
+    return -1;
+  unsigned count = atoi(countstr);
+  struct keyring_test_file file;
+  if (keyring_test_file_use(&file, INDEX_TEST_KEYRING) == -1)
+    return -1;
+  int ret = -1;
+  keyring_file *k = NULL;
+  keyring_identity **ids = NULL;
+
+  // create and reload the keyring, more than 16383 identities will span several slabs
+  time_ms_t start = gettime_ms();
+  if ((k = keyring_create_instance()) == NULL)
+    goto end;
+  unsigned i;
+  for (i = 0; i < count; ++i){
+    keyring_identity *id = keyring_create_identity(k, "");
+    if (!id)
+      goto end;
+    char did[20], name[20];
+    snprintf(did, sizeof did, "555%u", i);
+    snprintf(name, sizeof name, "Agent %u", i);
+    if (keyring_set_did_name(k, id, did, name) == -1)
+      goto end;
+  }
+  if (keyring_commit(k) == -1)
+    goto end;
+  keyring_free(k);
+  time_ms_t created = gettime_ms();
+  if ((k = keyring_open_instance("")) == NULL)
+    goto end;
+  unsigned unlocked = keyring_enter_pin(k, "");
+  time_ms_t opened = gettime_ms();
+  cli_printf(context, "created %u identities in %"PRId64"ms, unlocked %u in %"PRId64"ms\n",
+    count, created - start, unlocked, opened - created);
+  if (unlocked != count){
+    WHYF("Expected to unlock %u identities, found %u", count, unlocked);
+    goto end;
+  }
+
+  // look up in a different order than the identity list
+  if ((ids = emalloc(sizeof *ids * count)) == NULL)
+    goto end;
+  keyring_identity *id = k->identities;
+  for (i = 0; i < count; ++i, id = id->next)
+    ids[count - 1 - i] = id;
+
+  const char *names[] = {"scan", "index"};
+  unsigned pass;
+  for (pass = 0; pass < NELS(names); ++pass){
+    unsigned found[3] = {0, 0, 0};
+    time_ms_t t[4];
+    t[0] = gettime_ms();
+    for (i = 0; i < count; ++i)
+      if ((pass ? keyring_find_identity_sid(k, ids[i]->box_pk) : index_test_scan_sid(k, ids[i]->box_pk)) == ids[i])
+	found[0]++;
+    t[1] = gettime_ms();
+    for (i = 0; i < count; ++i){
+      const identity_t *sign = &ids[i]->sign_keypair->public_key;
+      if ((pass ? keyring_find_identity(k, sign) : index_test_scan_sign(k, sign)) == ids[i])
+	found[1]++;
+    }
+    t[2] = gettime_ms();
+    for (i = 0; i < count; ++i){
+      keypair *kp = keyring_identity_keytype(ids[i], KEYTYPE_DID);
+      const char *did = kp ? (const char *)kp->private_key : "";
+      if ((pass ? index_test_find_did(k, did) : index_test_scan_did(k, did)) == ids[i])
+	found[2]++;
+    }
+    t[3] = gettime_ms();
+    cli_printf(context, "%5s: by SID %"PRId64"ms, by signing key %"PRId64"ms, by DID %"PRId64"ms\n",
+      names[pass], t[1] - t[0], t[2] - t[1], t[3] - t[2]);
+    if (found[0] != count || found[1] != count || found[2] != count){
+      WHYF("Expected to find %u identities, found %u by SID, %u by signing key, %u by DID",
+	count, found[0], found[1], found[2]);
+      goto end;
+    }
+  }
+  ret = 0;
+end:
+  free(ids);
+  if (k)
+    keyring_free(k);
+  keyring_test_file_release(&file);
+  return ret;
+}
+
+#define ENCRYPT_TEST_KEYRING "encrypt-test.keyring"
+#define ENCRYPT_TEST_ROUNDS 4
+
+static int encrypt_test_round(keyring_identity *self, keyring_identity **peers, unsigned count)
+{
+  uint8_t plain[200];
+  randombytes_buf(plain, sizeof plain);
+  unsigned i;
+  for (i = 0; i < count; ++i){
+    struct overlay_buffer *b = ob_new();
+    if (!b)
+      return -1;
+    overlay_mdp_encode_ports(b, MDP_PORT_ECHO, MDP_PORT_NOREPLY);
+    ob_append_bytes(b, plain, sizeof plain);
+    struct overlay_buffer *cipher = overlay_mdp_encrypt(self->subscriber, peers[i]->subscriber, ob_ptr(b), ob_position(b));
+    ob_free(b);
+    if (!cipher)
+      return -1;
+    ob_flip(cipher);
+    struct internal_mdp_header header;
+    bzero(&header, sizeof header);
+    header.source = self->subscriber;
+    header.destination = peers[i]->subscriber;
+    struct overlay_buffer *clear = overlay_mdp_decrypt(&header, cipher);
+    ob_free(cipher);
+    if (!clear)
+      return -1;
+    int ok = header.destination_port == MDP_PORT_ECHO
+      && ob_remaining(clear) == sizeof plain
+      && memcmp(ob_current_ptr(clear), plain, sizeof plain) == 0;
+    ob_free(clear);
+    if (!ok)
+      return WHYF("Decrypted payload from %s does not match", alloca_tohex_sid_t(peers[i]->subscriber->sid));
+  }
+  return 0;
+}
+
+DEFINE_CMD(app_mdp_encrypt_test, 0,
+   "Time encrypting to, and decrypting from, <count> distinct peers with different shared secret cache sizes",
+   "test","mdp","encrypt","[<count>]");
+static int app_mdp_encrypt_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *countstr;
+  if (cli_arg(parsed, "count", &countstr, cli_uint, "1000") == -1)
+    return -1;
+  unsigned count = atoi(countstr);
+  if (count == 0)
+    return WHY("Need at least one peer");
+  struct keyring_test_file file;
+  if (keyring_test_file_use(&file, ENCRYPT_TEST_KEYRING) == -1)
+    return -1;
+  uint32_t saved_entries = config.mdp.nm_cache_entries;
+  int ret = -1;
+  keyring_identity **peers = NULL;
+
+  // every peer is a local identity, so that we can decrypt what was sent to it
+  keyring_file *k = keyring_create_instance();
+  if (!k)
+    goto end;
+  keyring_identity *self = keyring_create_identity(k, "");
+  if (!self)
+    goto end;
+  if ((peers = emalloc(sizeof *peers * count)) == NULL)
+    goto end;
+  unsigned i;
+  for (i = 0; i < count; ++i)
+    if ((peers[i] = keyring_create_identity(k, "")) == NULL)
+      goto end;
+
+  // each peer needs one shared secret to encrypt and another to decrypt
+  uint32_t sizes[] = {count * 2, count, saved_entries};
+  for (i = 0; i < NELS(sizes); ++i){
+    config.mdp.nm_cache_entries = sizes[i] ? sizes[i] : 1;
+    keyring_nm_cache_flush();
+    struct test_timer timer;
+    test_timer_start(&timer, 0);
+    unsigned round;
+    for (round = 0; round < ENCRYPT_TEST_ROUNDS; ++round)
+      if (encrypt_test_round(self, peers, count) == -1)
+	goto end;
+    test_timer_stop(&timer);
+    struct keyring_nm_cache_stats stats;
+    keyring_nm_cache_stats(&stats);
+    cli_printf(context, "cache %u: %u peers x %u rounds %"PRId64"ms, %u hits, %u misses, %u evictions\n",
+      config.mdp.nm_cache_entries, count, ENCRYPT_TEST_ROUNDS, test_timer_elapsed_ms(&timer), stats.hits, stats.misses, stats.evictions);
+  }
+  ret = 0;
+end:
+  free(peers);
+  // also wipes the shared secrets of every identity
+  keyring_free(k);
+  config.mdp.nm_cache_entries = saved_entries;
+  keyring_test_file_release(&file);
+  return ret;
+}
@@ -17,9 +17,12 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#include <assert.h>
 #include <string.h>
 #include "mem.h"
 
+static struct mem_pool *pools = NULL;
+
 void *_emalloc(struct __sourceloc __whence, size_t bytes)
 {
   char *new = malloc(bytes);
@@ -60,3 +63,53 @@ char *_str_edup(struct __sourceloc __whence, const char *str)
 {
   return _strn_edup(__whence, str, strlen(str));
 }
+
+void *_pool_alloc(struct __sourceloc __whence, struct mem_pool *pool)
+{
+  void *ret;
+  if (!pool->_registered){
+    assert(pool->size >= sizeof(void *));
+    pool->_next = pools;
+    pools = pool;
+    pool->_registered = 1;
+  }
+  if (pool->free_list){
+    ret = pool->free_list;
+    pool->free_list = *(void **)ret;
+    pool->free_count--;
+    pool->reuses++;
+  }else if((ret = _emalloc(__whence, pool->size)) == NULL)
+    return NULL;
+  pool->allocs++;
+  if (++pool->live > pool->high_water)
+    pool->high_water = pool->live;
+  return ret;
+}
+
+void pool_free(struct mem_pool *pool, void *ptr)
+{
+  assert(pool->live > 0);
+  pool->live--;
+  if (pool->free_count >= pool->max_free){
+    free(ptr);
+    return;
+  }
+  *(void **)ptr = pool->free_list;
+  pool->free_list = ptr;
+  pool->free_count++;
+}
+
+void pool_trim(struct mem_pool *pool)
+{
+  while(pool->free_list){
+    void *ptr = pool->free_list;
+    pool->free_list = *(void **)ptr;
+    free(ptr);
+  }
+  pool->free_count = 0;
+}
+
+struct mem_pool *pool_next(struct mem_pool *pool)
+{
+  return pool ? pool->_next : pools;
+}
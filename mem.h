@@ -53,10 +53,41 @@ void *_emalloc_zero(struct __sourceloc, size_t bytes) __attribute__ ((__ATTRIBUT
 char *_str_edup(struct __sourceloc, const char *str) __attribute__ ((__ATTRIBUTE_malloc));
 char *_strn_edup(struct __sourceloc, const char *str, size_t len) __attribute__ ((__ATTRIBUTE_malloc));
 
+/* A free list of fixed size objects, to avoid the cost of malloc(3) and free(3)
+ * for objects that are created and destroyed at a high rate.  Up to max_free
+ * released objects are kept for reuse.  Pools are registered on first use so
+ * their counters can be reported.  Not thread safe.
+ */
+struct mem_pool {
+  const char *name;
+  size_t size;
+  unsigned max_free;
+  void *free_list;
+  unsigned free_count;
+  // objects currently in use (never released = leaked), and the most ever in use at once
+  unsigned live;
+  unsigned high_water;
+  // total allocations, and how many were satisfied from the free list
+  unsigned long allocs;
+  unsigned long reuses;
+  struct mem_pool *_next;
+  char _registered;
+};
+
+#define MEM_POOL_INIT(NAME, SIZE, MAX_FREE) { .name = (NAME), .size = (SIZE), .max_free = (MAX_FREE) }
+
+void *_pool_alloc(struct __sourceloc, struct mem_pool *pool) __attribute__ ((__ATTRIBUTE_malloc));
+void pool_free(struct mem_pool *pool, void *ptr);
+// release all objects held in the free list
+void pool_trim(struct mem_pool *pool);
+// iterate over all pools that have been used
+struct mem_pool *pool_next(struct mem_pool *pool);
+
 #define emalloc(bytes)       _emalloc(__HERE__, (bytes))
 #define erealloc(ptr, bytes) _erealloc(__HERE__, (ptr), (bytes))
 #define emalloc_zero(bytes)  _emalloc_zero(__HERE__, (bytes))
 #define str_edup(str)        _str_edup(__HERE__, (str))
 #define strn_edup(str, len)  _strn_edup(__HERE__, (str), (len))
+#define pool_alloc(pool)     _pool_alloc(__HERE__, (pool))
 
 #endif // __SERVAL_DNA__MEM_H
@@ -641,6 +641,7 @@ int meshmb_open(keyring_identity *id, struct meshmb_feeds **feeds)
   *feeds = emalloc_zero(sizeof(struct meshmb_feeds));
   if (*feeds){
     (*feeds)->root.index_size_bytes = sizeof(rhizome_bid_t);
+    (*feeds)->root.sparse = 1;
     (*feeds)->id = id;
     rhizome_manifest *m = rhizome_new_manifest();
     if (m){
@@ -87,87 +87,79 @@ static enum meshms_status get_my_conversation_bundle(const keyring_identity *id,
   return MESHMS_STATUS_OK;
 }
 
-static struct meshms_conversations *add_conv(struct meshms_conversations **conv, const sid_t *them)
+static int cmp_conv(const void *a, const void *b)
 {
-  struct meshms_conversations **ptr = conv;
-  while (*ptr) {
-    int cmp = cmp_sid_t(&(*ptr)->them, them);
-    if (cmp == 0)
-      return *ptr;
-    ptr=&(*ptr)->_next;
-  }
-  struct meshms_conversations *n = emalloc_zero(sizeof(struct meshms_conversations));
-  if (n){
-    n->them = *them;
-    n->_next = *conv;
-    *conv = n;
-  }
-  return n;
+  return cmp_sid_t(&(*(struct meshms_conversations **)a)->them, &(*(struct meshms_conversations **)b)->them);
+}
+
+static void read_ply_row(struct message_ply *ply, sqlite3_stmt *statement, int column)
+{
+  if (sqlite_column_bid(statement, column, &ply->bundle_id) == -1)
+    return;
+  ply->found = ply->known_bid = 1;
+  ply->version = sqlite3_column_int64(statement, column + 1);
+  ply->size = sqlite3_column_int64(statement, column + 2);
+  ply->tail = sqlite3_column_int64(statement, column + 3);
 }
 
-// find matching conversations
-// if their_sid == my_sid, return all conversations with any recipient
-static enum meshms_status get_database_conversations(const keyring_identity *id, struct meshms_conversations **conv)
+// merge the plies of every conversation we take part in into the list, from the rhizome index
+enum meshms_status meshms_database_conversations(const sid_t *me, struct meshms_conversations **conv)
 {
+  // the list may hold thousands of conversations, so find them by binary search
+  size_t count = 0;
+  struct meshms_conversations *n;
+  for (n = *conv; n; n = n->_next)
+    count++;
+  struct meshms_conversations **sorted = NULL;
+  if (count){
+    if ((sorted = emalloc(sizeof(struct meshms_conversations *) * count)) == NULL)
+      return MESHMS_STATUS_ERROR;
+    size_t i = 0;
+    for (n = *conv; n; n = n->_next)
+      sorted[i++] = n;
+    qsort(sorted, count, sizeof *sorted, cmp_conv);
+  }
+
+  enum meshms_status status = MESHMS_STATUS_ERROR;
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
   sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
-      "SELECT id, version, filesize, tail, sender, recipient"
-      " FROM manifests"
-      " WHERE service = ?2"
-      " AND (sender=?1 or recipient=?1)",
-      SID_T, id->box_pk,
-      STATIC_TEXT, RHIZOME_SERVICE_MESHMS2,
+      "SELECT them, my_id, my_version, my_size, my_tail, their_id, their_version, their_size, their_tail"
+      " FROM meshms_conversations"
+      " WHERE me = ?",
+      SID_T, me,
       END
     );
   if (!statement)
-    return MESHMS_STATUS_ERROR;
-  DEBUGF(meshms, "Looking for conversations for %s", alloca_tohex_sid_t(*id->box_pk));
+    goto end;
+  DEBUGF(meshms, "Looking for conversations for %s", alloca_tohex_sid_t(*me));
   int r;
   while ((r=sqlite_step_retry(&retry, statement)) == SQLITE_ROW) {
-    const char *id_hex = (const char *)sqlite3_column_text(statement, 0);
-    uint64_t version = sqlite3_column_int64(statement, 1);
-    int64_t size = sqlite3_column_int64(statement, 2);
-    int64_t tail = sqlite3_column_int64(statement, 3);
-    const char *sender = (const char *)sqlite3_column_text(statement, 4);
-    const char *recipient = (const char *)sqlite3_column_text(statement, 5);
-    DEBUGF(meshms, "found id %s, sender %s, recipient %s, size %"PRId64, id_hex, sender, recipient, size);
-    rhizome_bid_t bid;
-    if (str_to_rhizome_bid_t(&bid, id_hex) == -1) {
-      WHYF("invalid Bundle ID hex: %s -- skipping", alloca_str_toprint(id_hex));
+    struct meshms_conversations key;
+    if (sqlite_column_sid(statement, 0, &key.them) == -1) {
+      WHY("invalid SID in conversation index -- skipping");
       continue;
     }
-    const char *them = sender;
-    sid_t their_sid;
-    if (str_to_sid_t(&their_sid, them) == -1) {
-      WHYF("invalid SID hex: %s -- skipping", alloca_str_toprint(them));
-      continue;
-    }
-    if (cmp_sid_t(&their_sid, id->box_pk) == 0) {
-      them = recipient;
-      if (str_to_sid_t(&their_sid, them) == -1) {
-	WHYF("invalid SID hex: %s -- skipping", alloca_str_toprint(them));
-	continue;
-      }
-    }
-    struct meshms_conversations *ptr = add_conv(conv, &their_sid);
-    if (!ptr)
+    struct meshms_conversations *ptr = &key;
+    struct meshms_conversations **found = count ? bsearch(&ptr, sorted, count, sizeof *sorted, cmp_conv) : NULL;
+    if (found)
+      ptr = *found;
+    else if ((ptr = emalloc_zero(sizeof(struct meshms_conversations))) != NULL){
+      ptr->them = key.them;
+      ptr->_next = *conv;
+      *conv = ptr;
+    }else
       break;
-    struct message_ply *p;
-    if (them==sender){
-      p=&ptr->their_ply;
-    }else{
-      p=&ptr->my_ply;
-    }
-    p->found = p->known_bid = 1;
-    p->bundle_id = bid;
-    p->version = version;
-    p->tail = tail;
-    p->size = size;
+    read_ply_row(&ptr->my_ply, statement, 1);
+    read_ply_row(&ptr->their_ply, statement, 5);
+    DEBUGF(meshms, "found conversation with %s, my size %"PRIu64", their size %"PRIu64,
+	   alloca_tohex_sid_t(ptr->them), ptr->my_ply.size, ptr->their_ply.size);
   }
-  sqlite3_finalize(statement);
-  if (!sqlite_code_ok(r))
-    return MESHMS_STATUS_ERROR;
-  return MESHMS_STATUS_OK;
+  sqlite_finalize(statement);
+  if (sqlite_code_ok(r))
+    status = MESHMS_STATUS_OK;
+end:
+  free(sorted);
+  return status;
 }
 
 static enum meshms_status open_ply(struct message_ply *ply, struct message_ply_read *reader)
@@ -623,7 +615,7 @@ static enum meshms_status meshms_open_list(const keyring_identity *id, rhizome_m
   // read conversations payload
   if (meshms_failed(status = read_known_conversations(m, conv)))
     goto end;
-  status = get_database_conversations(id, conv);
+  status = meshms_database_conversations(id->box_pk, conv);
 end:
   return status;
 }
@@ -86,6 +86,11 @@ struct meshms_conversations {
 enum meshms_status meshms_conversations_list(const struct keyring_identity *id, const sid_t *my_sid, struct meshms_conversations **conv);
 void meshms_free_conversations(struct meshms_conversations *conv);
 
+/* Add the details of every ply stored in Rhizome to the conversations in the
+ * list, adding any conversations that are missing.
+ */
+enum meshms_status meshms_database_conversations(const sid_t *me, struct meshms_conversations **conv);
+
 /* For iterating over a binary tree of all MeshMS conversations, as created by
  * meshms_conversations_list().
  *
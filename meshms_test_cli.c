@@ -0,0 +1,154 @@
+/*
+ Serval DNA - MeshMS benchmarks
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <sodium.h>
+#include "cli.h"
+#include "commandline.h"
+#include "rhizome.h"
+#include "meshms.h"
+#include "mem.h"
+#include "debug.h"
+#include "test_cli.h"
+
+DEFINE_FEATURE(cli_meshms_tests);
+
+// how conversations were found before the index, by scanning MANIFESTS for either end of each ply
+static int conversations_from_manifests(const sid_t *me, struct meshms_conversations **conv)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+      "SELECT id, version, filesize, tail, sender, recipient FROM manifests"
+      " WHERE service = ?2 AND (sender = ?1 OR recipient = ?1)",
+      SID_T, me, STATIC_TEXT, RHIZOME_SERVICE_MESHMS2, END);
+  if (!statement)
+    return -1;
+  int r;
+  while ((r = sqlite_step_retry(&retry, statement)) == SQLITE_ROW){
+    sid_t sender, them;
+    rhizome_bid_t bid;
+    if (sqlite_column_bid(statement, 0, &bid) == -1
+      || sqlite_column_sid(statement, 4, &sender) == -1
+      || sqlite_column_sid(statement, 5, &them) == -1)
+      continue;
+    int from_me = cmp_sid_t(&sender, me) == 0;
+    if (!from_me)
+      them = sender;
+    struct meshms_conversations **ptr = conv;
+    while (*ptr && cmp_sid_t(&(*ptr)->them, &them) != 0)
+      ptr = &(*ptr)->_next;
+    if (!*ptr){
+      struct meshms_conversations *n = emalloc_zero(sizeof(struct meshms_conversations));
+      if (!n)
+	break;
+      n->them = them;
+      n->_next = *conv;
+      *conv = n;
+      ptr = conv;
+    }
+    struct message_ply *p = from_me ? &(*ptr)->my_ply : &(*ptr)->their_ply;
+    p->found = p->known_bid = 1;
+    p->bundle_id = bid;
+    p->version = sqlite3_column_int64(statement, 1);
+    p->size = sqlite3_column_int64(statement, 2);
+    p->tail = sqlite3_column_int64(statement, 3);
+  }
+  sqlite_finalize(statement);
+  return sqlite_code_ok(r) ? 0 : -1;
+}
+
+// the conversation list as it would be read back from our conversation bundle, in no useful order
+static struct meshms_conversations *conversations_known(const sid_t *them, unsigned count)
+{
+  struct meshms_conversations *conv = NULL;
+  unsigned i;
+  for (i = 0; i < count; ++i){
+    struct meshms_conversations *n = emalloc_zero(sizeof(struct meshms_conversations));
+    if (!n)
+      break;
+    n->them = them[(i * 7919) % count];
+    n->_next = conv;
+    conv = n;
+  }
+  return conv;
+}
+
+DEFINE_CMD(app_meshms_conversations_test, 0,
+   "Time listing the MeshMS conversations of an identity with <count> correspondents",
+   "test","meshms","conversations","[<count>]");
+static int app_meshms_conversations_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *countstr;
+  if (cli_arg(parsed, "count", &countstr, cli_uint, "1000") == -1)
+    return -1;
+  unsigned count = atoi(countstr);
+  if (count == 0)
+    return WHY("count must be positive");
+  sid_t *them = emalloc(sizeof(sid_t) * count);
+  if (!them)
+    return -1;
+  int ret = -1;
+  sid_t me;
+  randombytes_buf(me.binary, sizeof me.binary);
+  randombytes_buf(them, sizeof(sid_t) * count);
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (rhizome_test_begin(&retry) == -1)
+    goto end;
+  unsigned i;
+  for (i = 0; i < count * 2; ++i){
+    rhizome_bid_t bid;
+    randombytes_buf(bid.binary, sizeof bid.binary);
+    const sid_t *sender = (i & 1) ? &them[i / 2] : &me;
+    const sid_t *recipient = (i & 1) ? &me : &them[i / 2];
+    if (sqlite_exec_void_retry(&retry,
+	  "INSERT INTO MANIFESTS(id, version, inserttime, filesize, service, sender, recipient, tail) "
+	  "VALUES(?, 1, ?, 100, ?, ?, ?, 0);",
+	  RHIZOME_BID_T, &bid, INT64, gettime_ms(), STATIC_TEXT, RHIZOME_SERVICE_MESHMS2,
+	  SID_T, sender, SID_T, recipient, END) == -1)
+      goto rollback;
+  }
+  unsigned known;
+  for (known = 0; known <= 1; ++known){
+    unsigned method;
+    for (method = 0; method <= 1; ++method){
+      struct meshms_conversations *conv = known ? conversations_known(them, count) : NULL;
+      struct test_timer timer;
+      test_timer_start(&timer, 0);
+      int r = method ? (meshms_failed(meshms_database_conversations(&me, &conv)) ? -1 : 0)
+		     : conversations_from_manifests(&me, &conv);
+      test_timer_stop(&timer);
+      unsigned listed = 0;
+      struct meshms_conversations *n;
+      for (n = conv; n; n = n->_next)
+	if (n->my_ply.found && n->their_ply.found)
+	  listed++;
+      meshms_free_conversations(conv);
+      if (r == -1)
+	goto rollback;
+      cli_printf(context, "%-18s %-13s %u conversations in %"PRId64"ms\n",
+	method ? "conversation index" : "manifests scan",
+	known ? "(known list)" : "(empty list)",
+	listed, test_timer_elapsed_ms(&timer));
+    }
+  }
+  ret = 0;
+rollback:
+  rhizome_test_rollback(&retry);
+end:
+  free(them);
+  return ret;
+}
@@ -19,6 +19,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <stdint.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <assert.h>
 #include <string.h>
@@ -35,11 +36,106 @@ static unsigned get_nibble(const uint8_t *binary, int pos)
   return byte&0xF;
 }
 
+// count the bits set in a 16 bit mask, without relying on a popcount instruction being available
+static inline unsigned count_bits(uint16_t mask)
+{
+#ifdef __POPCNT__
+  return __builtin_popcount(mask);
+#else
+  unsigned v = mask - ((mask >> 1) & 0x5555);
+  v = (v & 0x3333) + ((v >> 2) & 0x3333);
+  v = (v + (v >> 4)) & 0x0F0F;
+  return (v + (v >> 8)) & 0x1F;
+#endif
+}
+
+static inline unsigned slot_index(const struct tree_node *node, unsigned nibble)
+{
+  return count_bits(node->present & ((1u << nibble) - 1));
+}
+
+// return the address of the slot for nibble, or NULL if a sparse node has no slot for it
+static void **get_slot(struct tree_node *node, unsigned nibble)
+{
+  if (!node->sparse)
+    return &node->slot[nibble];
+  if (!(node->present & (1 << nibble)))
+    return NULL;
+  return &node->slot[slot_index(node, nibble)];
+}
+
+static size_t node_size(const struct tree_node *node)
+{
+  if (!node->sparse)
+    return sizeof(struct tree_node);
+  return offsetof(struct tree_node, slot) + node->capacity * sizeof(void *);
+}
+
+static struct tree_node *new_node(bool_t sparse)
+{
+  struct tree_node proto = {.sparse = sparse, .capacity = sparse ? 2 : 16};
+  struct tree_node *node = (struct tree_node *) emalloc_zero(node_size(&proto));
+  if (node){
+    node->sparse = proto.sparse;
+    node->capacity = proto.capacity;
+  }
+  return node;
+}
+
+// return the address of the slot for nibble in *nodep, making room for it in a sparse node.
+// A full sparse node is moved to a larger allocation, and any iterators within it follow.
+// Once it would need room for every slot, it may as well become a dense node.
+static void **make_slot(struct tree_root *root, struct tree_node **nodep, unsigned nibble)
+{
+  struct tree_node *node = *nodep;
+  void **slotp = get_slot(node, nibble);
+  if (slotp)
+    return slotp;
+  unsigned count = count_bits(node->present);
+  if (count == node->capacity) {
+    struct tree_node *old = node;
+    struct tree_node grown = {.sparse = old->capacity * 2 < 16, .capacity = old->capacity * 2};
+    if ((node = (struct tree_node *) emalloc_zero(node_size(&grown))) == NULL)
+      return NULL;
+    node->ref_count = old->ref_count;
+    node->is_tree = old->is_tree;
+    node->sparse = grown.sparse;
+    node->capacity = grown.capacity;
+    if (node->sparse) {
+      node->present = old->present;
+      memcpy(node->slot, old->slot, count * sizeof(void *));
+    } else {
+      unsigned n, i = 0;
+      for (n = 0; n < 16; ++n)
+	if (old->present & (1 << n))
+	  node->slot[n] = old->slot[i++];
+    }
+    tree_iterator *it;
+    for (it = root->_iterators; it; it = it->_next) {
+      tree_node_iterator *nit;
+      for (nit = it->stack; nit; nit = nit->down)
+	if (nit->node == old)
+	  nit->node = node;
+    }
+    *nodep = node;
+    free(old);
+    if (!node->sparse)
+      return &node->slot[nibble];
+  }
+  unsigned i = slot_index(node, nibble);
+  memmove(&node->slot[i + 1], &node->slot[i], (count - i) * sizeof(void *));
+  node->slot[i] = NULL;
+  node->present |= 1 << nibble;
+  return &node->slot[i];
+}
+
 enum tree_error_reason tree_find(struct tree_root *root, void **result, const uint8_t *binary, size_t binary_size_bytes,
   tree_create_callback create_node, void *context)
 {
   assert(binary_size_bytes <= root->index_size_bytes);
   struct tree_node *ptr = &root->_root_node;
+  // the slot in the parent node that points to ptr, the root node never moves
+  struct tree_node **ptrp = NULL;
 
   if (result)
     *result = NULL;
@@ -50,15 +146,19 @@ enum tree_error_reason tree_find(struct tree_root *root, void **result, const ui
       return TREE_NOT_UNIQUE;
 
     unsigned nibble = get_nibble(binary, pos++);
-    void *node_ptr = ptr->slot[nibble];
+    void **slotp = get_slot(ptr, nibble);
+    void *node_ptr = slotp ? *slotp : NULL;
 
     if (ptr->is_tree & (1<<nibble)){
       // search the next level of the tree
+      ptrp = (struct tree_node **)slotp;
       ptr = (struct tree_node *)node_ptr;
 
     }else if(!node_ptr){
       // allow caller to provide a node constructor
       if (create_node && binary_size_bytes == root->index_size_bytes){
+	if (!slotp && (slotp = make_slot(root, ptrp ? ptrp : &ptr, nibble)) == NULL)
+	  return TREE_ERROR;
 	node_ptr = create_node(context, binary, binary_size_bytes);
 	if (!node_ptr)
 	  return TREE_ERROR;
@@ -67,7 +167,7 @@ enum tree_error_reason tree_find(struct tree_root *root, void **result, const ui
 	tree_record->binary_size_bits = pos*4;
 	if (result)
 	  *result = node_ptr;
-	ptr->slot[nibble] = node_ptr;
+	*slotp = node_ptr;
 	return TREE_FOUND;
       }
       return TREE_NOT_FOUND;
@@ -86,18 +186,22 @@ enum tree_error_reason tree_find(struct tree_root *root, void **result, const ui
 	return TREE_NOT_FOUND;
 
       // no match? we need to bump this leaf node down a level so we can create a new record
-      struct tree_node *new_node = (struct tree_node *) emalloc_zero(sizeof(struct tree_node));
-      if (!new_node)
+      struct tree_node *child = new_node(root->sparse);
+      if (!child)
 	return TREE_ERROR;
 
-      ptr->slot[nibble] = new_node;
-      ptr->is_tree |= (1<<nibble);
-      ptr = new_node;
-
       // get the nibble of the existing node
-      nibble = get_nibble(tree_record->binary, pos);
+      unsigned child_nibble = get_nibble(tree_record->binary, pos);
+      // a new node has room for two slots, so this can't move it
+      void **childp = make_slot(root, &child, child_nibble);
+      assert(childp);
+      *childp = node_ptr;
       tree_record->binary_size_bits = (pos+1)*4;
-      ptr->slot[nibble] = node_ptr;
+
+      *slotp = child;
+      ptr->is_tree |= (1<<nibble);
+      ptrp = (struct tree_node **)slotp;
+      ptr = child;
     }
   }
 }
@@ -109,12 +213,16 @@ void tree_iterator_start(tree_iterator *it, struct tree_root *root)
   it->bottom.node = &root->_root_node;
   it->bottom.slotnum = 0;
   root->_root_node.ref_count++;
+  if ((it->_next = root->_iterators))
+    it->_next->_prevp = &it->_next;
+  it->_prevp = &root->_iterators;
+  root->_iterators = it;
 }
 
 static bool_t push(tree_iterator *it)
 {
   assert(it->stack->node->is_tree & (1 << it->stack->slotnum));
-  struct tree_node *child = it->stack->node->slot[it->stack->slotnum];
+  struct tree_node *child = *get_slot(it->stack->node, it->stack->slotnum);
   assert(child);
   tree_node_iterator *nit = (tree_node_iterator *) emalloc_zero(sizeof(tree_node_iterator));
   if (!nit)
@@ -129,8 +237,9 @@ static bool_t push(tree_iterator *it)
 
 static inline bool_t is_empty(struct tree_node *node)
 {
+  unsigned count = node->sparse ? count_bits(node->present) : 16;
   unsigned i;
-  for (i = 0; i < 16; ++i)
+  for (i = 0; i < count; ++i)
     if (node->slot[i])
       return 0;
   return 1;
@@ -145,7 +254,8 @@ static void pop(tree_iterator *it)
   if (--popped->node->ref_count == 0 && it->stack && is_empty(popped->node)) {
     assert(it->stack->slotnum < 16);
     assert(it->stack->node->is_tree & (1 << it->stack->slotnum));
-    assert(it->stack->node->slot[it->stack->slotnum] == popped->node);
+    void **slotp = get_slot(it->stack->node, it->stack->slotnum);
+    assert(*slotp == popped->node);
     if (it->stack) {
       assert(popped != &it->bottom);
       assert(popped->node != it->bottom.node);
@@ -156,7 +266,7 @@ static void pop(tree_iterator *it)
       assert(popped->node == it->bottom.node);
     }
     popped->node = NULL;
-    it->stack->node->slot[it->stack->slotnum] = NULL;
+    *slotp = NULL;
     it->stack->node->is_tree &= ~(1 << it->stack->slotnum);
   }
   if (it->stack) {
@@ -190,8 +300,8 @@ void **tree_iterator_get_node(tree_iterator *it)
 	  return NULL;
       }
       else {
-	void **childp = &it->stack->node->slot[it->stack->slotnum];
-	if (*childp)
+	void **childp = get_slot(it->stack->node, it->stack->slotnum);
+	if (childp && *childp)
 	  return childp;
 	else
 	  it->stack->slotnum++;
@@ -218,6 +328,11 @@ void tree_iterator_free(tree_iterator *it)
 {
   while (it->stack)
     pop(it);
+  if (it->_prevp) {
+    if ((*it->_prevp = it->_next))
+      it->_next->_prevp = it->_prevp;
+    it->_prevp = NULL;
+  }
 }
 
 // start enumerating the tree from binary, and continue until the end
@@ -258,16 +373,19 @@ int tree_walk_prefix(struct tree_root *root, const uint8_t *binary, size_t binar
 static void walk_statistics(struct tree_node *node, unsigned depth, struct tree_statistics *stats)
 {
   stats->node_count++;
+  stats->node_bytes += node_size(node);
   if (depth > stats->maximum_depth)
     stats->maximum_depth = depth;
   if (is_empty(node))
     stats->empty_node_count++;
   unsigned i;
-  for (i = 0; i < 16; ++i)
+  for (i = 0; i < 16; ++i) {
+    void **slotp = get_slot(node, i);
     if (node->is_tree & (1 << i))
-      walk_statistics(node->slot[i], depth + 1, stats);
-    else if (node->slot[i])
+      walk_statistics(*slotp, depth + 1, stats);
+    else if (slotp && *slotp)
       stats->record_count++;
+  }
 }
 
 struct tree_statistics tree_compute_statistics(struct tree_root *root)
@@ -22,6 +22,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define __SERVAL_DNA__NIBBLE_TREE_H
 
 #include <stdint.h> // for uint8_t, size_t
+#include "lang.h" // for bool_t
 
 // Every record in a nibble tree has the following structure:
 // - a count of the number of bits in the binary index
@@ -35,6 +36,14 @@ struct tree_record {
 
 // Each node in the nibble tree has 16 slots based on the next 4 bits of the
 // binary value.
+//
+// A dense node holds all 16 slots.  A sparse node is allocated with room for
+// only 'capacity' slots, holding the used slots in nibble order, so a slot is
+// found by counting the bits set in 'present' below its nibble.  Random keys
+// leave most nodes below the first couple of levels with only two or three
+// children, so sparse nodes use a fraction of the memory.  A sparse node is
+// moved to a larger allocation when it fills up, and becomes a dense node
+// instead of growing to hold all 16 slots.
 struct tree_node {
   // A reference count that is incremented by an iterator while it has a
   // pointer to the node, and decremented when it discards the pointer.  The
@@ -46,16 +55,26 @@ struct tree_node {
   // slot points to a sub-tree.
   uint16_t is_tree;
 
+  // Sparse nodes only: a bitmask that has the bit (1 << slot_number) set if
+  // the corresponding slot has an entry in 'slot'.
+  uint16_t present;
+  uint8_t sparse;
+  uint8_t capacity;
+
   // Each slot either points to another tree node or a data record, depending
   // on its corresponding bit in 'is_tree'.
   void *slot[16];
 };
 
 // The root of a nibble tree specifies the binary index size, in bytes, and
-// contains the root node.
+// contains the root node.  The root node is always dense; if 'sparse' is set,
+// every other node is sparse.
 struct tree_root {
   size_t index_size_bytes;
+  bool_t sparse;
   struct tree_node _root_node;
+  // iterators that must follow any sparse node that is moved
+  struct tree_iterator *_iterators;
 };
 
 enum tree_error_reason {
@@ -112,6 +131,12 @@ enum tree_error_reason tree_find(struct tree_root *root, void **result, const ui
 // iterator is currently traversing the node.  If there are several iterators
 // positioned within an empty node, then only the last one to advance out of it
 // will free() the node.
+//
+// An iterator must not be moved in memory between tree_iterator_start() and
+// tree_iterator_free(), as the tree keeps a pointer to it.  In a sparse tree,
+// adding a record may move other slots, so the pointer returned by
+// tree_iterator_get_node() must be fetched again after calling tree_find()
+// with a create_node callback.
 
 typedef struct tree_node_iterator {
   struct tree_node_iterator *down;
@@ -122,6 +147,8 @@ typedef struct tree_node_iterator {
 typedef struct tree_iterator {
   struct tree_node_iterator bottom;
   struct tree_node_iterator *stack;
+  struct tree_iterator *_next;
+  struct tree_iterator **_prevp;
 } tree_iterator;
 
 void tree_iterator_start(tree_iterator *it, struct tree_root *root);
@@ -151,6 +178,7 @@ struct tree_statistics {
   size_t node_count;
   size_t empty_node_count;
   size_t maximum_depth;
+  size_t node_bytes;
 };
 
 struct tree_statistics tree_compute_statistics(struct tree_root *root);
@@ -54,7 +54,78 @@ static struct broadcast bpilist[MAX_BPIS];
 #define OA_CODE_P2P_ME 0xfc
 #define OA_CODE_SIGNKEY 0xfb // full sign key of an identity, from which a SID can be derived
 
-static __thread struct tree_root root={.index_size_bytes=SID_SIZE};
+static __thread struct tree_root root={.index_size_bytes=SID_SIZE, .sparse=1};
+
+// Every subscriber in the tree is also indexed by its whole SID in an open addressed hash table,
+// so full SID lookups on the receive path don't need to walk the tree.
+// SIDs arrive in packets from peers, who could choose them to collide, so the slot is a keyed
+// hash with a random key chosen whenever the table is first allocated.  The hash is NH, from
+// UMAC: each 32 bit word of the SID is added to a word of the key and pairs of words are
+// multiplied, which is universal and much cheaper than a general purpose keyed hash.
+static __thread struct subscriber **sid_index = NULL;
+static __thread unsigned sid_index_size = 0;
+static __thread unsigned sid_index_count = 0;
+static __thread uint32_t sid_index_key[SID_SIZE / 4];
+
+static inline unsigned sid_index_slot(const uint8_t *sidp)
+{
+  uint32_t w[SID_SIZE / 4];
+  memcpy(w, sidp, SID_SIZE);
+  uint64_t h = 0;
+  unsigned i;
+  for (i = 0; i < SID_SIZE / 4; i += 2)
+    h += (uint64_t)(w[i] + sid_index_key[i]) * (w[i + 1] + sid_index_key[i + 1]);
+  // the low bits of each product only depend on the low bits of its words
+  return (unsigned)(h >> 32) & (sid_index_size - 1);
+}
+
+static struct subscriber *sid_index_find(const uint8_t *sidp)
+{
+  if (!sid_index_size)
+    return NULL;
+  unsigned i = sid_index_slot(sidp);
+  struct subscriber *s;
+  while ((s = sid_index[i])){
+    if (memcmp(s->sid.binary, sidp, SID_SIZE) == 0)
+      return s;
+    i = (i + 1) & (sid_index_size - 1);
+  }
+  return NULL;
+}
+
+static void sid_index_put(struct subscriber *subscriber)
+{
+  unsigned i = sid_index_slot(subscriber->sid.binary);
+  while (sid_index[i])
+    i = (i + 1) & (sid_index_size - 1);
+  sid_index[i] = subscriber;
+  sid_index_count++;
+}
+
+static int sid_index_add(struct subscriber *subscriber)
+{
+  // keep the table at most half full
+  if ((sid_index_count + 1) * 2 > sid_index_size){
+    unsigned old_size = sid_index_size;
+    struct subscriber **old = sid_index;
+    unsigned new_size = old_size ? old_size * 2 : 256;
+    struct subscriber **new = (struct subscriber **) emalloc_zero(new_size * sizeof *new);
+    if (!new)
+      return -1;
+    if (!old_size)
+      randombytes_buf(sid_index_key, sizeof sid_index_key);
+    sid_index = new;
+    sid_index_size = new_size;
+    sid_index_count = 0;
+    unsigned i;
+    for (i = 0; i < old_size; i++)
+      if (old[i])
+	sid_index_put(old[i]);
+    free(old);
+  }
+  sid_index_put(subscriber);
+  return 0;
+}
 
 static __thread bool_t primary_sid_written = 0;
 static __thread struct subscriber *primary_sid = NULL;
@@ -143,6 +214,11 @@ void free_subscribers()
   if (serverMode != SERVER_NOT_RUNNING)
     FATAL("Freeing subscribers from a running daemon is not supported");
   tree_walk(&root, NULL, 0, free_node, NULL);
+  if (sid_index)
+    free(sid_index);
+  sid_index = NULL;
+  sid_index_size = 0;
+  sid_index_count = 0;
 }
 
 static void *create_subscriber(void *UNUSED(context), const uint8_t *binary, size_t bin_length)
@@ -160,8 +236,13 @@ static void *create_subscriber(void *UNUSED(context), const uint8_t *binary, siz
 struct subscriber *find_subscriber(const uint8_t *sidp, int len, int create)
 {
   struct subscriber *result;
+  if (len == SID_SIZE && (result = sid_index_find(sidp)))
+    return result;
   tree_find(&root, (void**)&result, sidp, len, create && len == SID_SIZE ? create_subscriber : NULL, NULL);
   // ignore return code, just return the result
+  // if the index couldn't grow, we'll try again on the next lookup
+  if (result && len == SID_SIZE)
+    sid_index_add(result);
   return result;
 }
 
@@ -289,10 +370,10 @@ static int add_explain_response(void **record, void *context)
   subscriber->last_explained = now;
 
   if (!response->please_explain){
-    if ((response->please_explain = emalloc_zero(sizeof(struct overlay_frame))) == NULL)
+    if ((response->please_explain = op_new()) == NULL)
       return 1; // stop walking
     if ((response->please_explain->payload = ob_new()) == NULL) {
-      free(response->please_explain);
+      op_free(response->please_explain);
       response->please_explain = NULL;
       return 1; // stop walking
     }
@@ -356,7 +437,7 @@ static int find_subscr_buffer(struct decode_context *context, struct overlay_buf
       
       // add the abbreviation you told me about
       if (!context->please_explain){
-	context->please_explain = calloc(sizeof(struct overlay_frame),1);
+	context->please_explain = op_new();
 	if ((context->please_explain->payload = ob_new()) == NULL)
 	  return -1;
 	ob_limitsize(context->please_explain->payload, MDP_MTU);
@@ -431,7 +512,7 @@ int overlay_address_parse(struct decode_context *context, struct overlay_buffer
 	if ((context->flags & DECODE_FLAG_DONT_EXPLAIN) == 0){
 	  // add the abbreviation you told me about
 	  if (!context->please_explain){
-	    context->please_explain = calloc(sizeof(struct overlay_frame),1);
+	    context->please_explain = op_new();
 	    if ((context->please_explain->payload = ob_new()) == NULL)
 	      return -1;
 	    ob_limitsize(context->please_explain->payload, MDP_MTU);
@@ -33,9 +33,54 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  In either case, functions that don't take an offset use and advance the position.
  */
 
+/*
+ Every packet sent, received or forwarded creates several buffers, so buffer
+ headers and small byte arrays are recycled through free lists instead of
+ going back to malloc(3) each time. Byte arrays up to 2KB are rounded up to a
+ power of two so they can be shared between buffers.
+ */
+static struct mem_pool buffer_pool = MEM_POOL_INIT("overlay_buffer", sizeof(struct overlay_buffer), 256);
+static struct mem_pool byte_pools[] = {
+  MEM_POOL_INIT("overlay_buffer 64", 64, 256),
+  MEM_POOL_INIT("overlay_buffer 128", 128, 128),
+  MEM_POOL_INIT("overlay_buffer 256", 256, 64),
+  MEM_POOL_INIT("overlay_buffer 512", 512, 64),
+  MEM_POOL_INIT("overlay_buffer 1024", 1024, 32),
+  MEM_POOL_INIT("overlay_buffer 2048", 2048, 64),
+};
+
+static struct overlay_buffer *buffer_alloc()
+{
+  struct overlay_buffer *ret = pool_alloc(&buffer_pool);
+  if (ret){
+    bzero(ret, sizeof *ret);
+    ret->refs = 1;
+  }
+  return ret;
+}
+
+// find the pool for a byte array of exactly this size
+static struct mem_pool *byte_pool(size_t size)
+{
+  unsigned i;
+  for (i=0;i<NELS(byte_pools);i++)
+    if (byte_pools[i].size == size)
+      return &byte_pools[i];
+  return NULL;
+}
+
+static void bytes_free(unsigned char *bytes, size_t size)
+{
+  struct mem_pool *pool = byte_pool(size);
+  if (pool)
+    pool_free(pool, bytes);
+  else
+    free(bytes);
+}
+
 struct overlay_buffer *_ob_new(struct __sourceloc __whence)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = buffer_alloc();
   DEBUGF(overlaybuffer, "ob_new() return %p", ret);
   if (ret == NULL)
     return NULL;
@@ -47,7 +92,7 @@ struct overlay_buffer *_ob_new(struct __sourceloc __whence)
 // and allow other callers to use the ob_ convenience methods for reading and writing up to size bytes.
 struct overlay_buffer *_ob_static(struct __sourceloc __whence, unsigned char *bytes, size_t size)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = buffer_alloc();
   DEBUGF(overlaybuffer, "ob_static(bytes=%p, size=%zu) return %p", bytes, size, ret);
   if (ret == NULL)
     return NULL;
@@ -60,27 +105,30 @@ struct overlay_buffer *_ob_static(struct __sourceloc __whence, unsigned char *by
 
 // create a new overlay buffer from an existing piece of another buffer.
 // Both buffers will point to the same memory region.
-// It is up to the caller to ensure this buffer is not used after the parent buffer is freed.
+// The parent buffer will not be released until this slice has been freed,
+// but it is up to the caller to ensure the parent's memory is not static, reused or resized.
 struct overlay_buffer *_ob_slice(struct __sourceloc __whence, struct overlay_buffer *b, size_t offset, size_t length)
 {
   if (offset + length > b->allocSize) {
     WHY("Buffer isn't long enough to slice");
     return NULL;
   }
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = buffer_alloc();
   DEBUGF(overlaybuffer, "ob_slice(b=%p, offset=%zu, length=%zu) return %p", b, offset, length, ret);
   if (ret == NULL)
       return NULL;
   ret->bytes = b->bytes + offset;
   ret->allocSize = length;
   ret->allocated = NULL;
+  ret->parent = b;
+  b->refs++;
   ob_unlimitsize(ret);
   return ret;
 }
 
 struct overlay_buffer *_ob_dup(struct __sourceloc __whence, struct overlay_buffer *b)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = buffer_alloc();
   DEBUGF(overlaybuffer, "ob_dup(b=%p) return %p", b, ret);
   if (ret == NULL)
     return NULL;
@@ -102,13 +150,43 @@ struct overlay_buffer *_ob_dup(struct __sourceloc __whence, struct overlay_buffe
   return ret;
 }
 
+// Like ob_dup, but if the bytes are held in allocated memory, share them instead of copying.
+// The returned buffer is read only.
+struct overlay_buffer *_ob_share(struct __sourceloc __whence, struct overlay_buffer *b)
+{
+  struct overlay_buffer *root = b;
+  while(root->parent)
+    root = root->parent;
+  if (!root->allocated || b->position || b->sizeLimit == SIZE_MAX || b->sizeLimit > b->allocSize)
+    return _ob_dup(__whence, b);
+  struct overlay_buffer *ret = buffer_alloc();
+  DEBUGF(overlaybuffer, "ob_share(b=%p) return %p", b, ret);
+  if (ret == NULL)
+    return NULL;
+  ret->bytes = b->bytes;
+  ret->allocSize = b->sizeLimit;
+  ret->allocated = NULL;
+  ret->parent = b;
+  b->refs++;
+  // as for ob_dup, all of the shared bytes are content
+  ret->sizeLimit = b->sizeLimit;
+  ret->position = b->sizeLimit;
+  return ret;
+}
+
 void _ob_free(struct __sourceloc __whence, struct overlay_buffer *b)
 {
   assert(b != NULL);
-  DEBUGF(overlaybuffer, "ob_free(b=%p)", b);
+  assert(b->refs > 0);
+  DEBUGF(overlaybuffer, "ob_free(b=%p) refs=%u", b, b->refs);
+  if (--b->refs)
+    return;
+  struct overlay_buffer *parent = b->parent;
   if (b->allocated)
-    free(b->allocated);
-  free(b);
+    bytes_free(b->allocated, b->allocSize);
+  pool_free(&buffer_pool, b);
+  if (parent)
+    _ob_free(__whence, parent);
 }
 
 int _ob_checkpoint(struct __sourceloc __whence, struct overlay_buffer *b)
@@ -183,21 +261,28 @@ ssize_t _ob_makespace(struct __sourceloc __whence, struct overlay_buffer *b, siz
     return 0;
   }
   size_t newSize = b->position + bytes;
-  if (newSize<64) newSize=64;
-  if (newSize&63) newSize+=64-(newSize&63);
-  if (newSize>1024 && (newSize&1023))
-    newSize+=1024-(newSize&1023);
-  if (newSize>65536 && (newSize&65535))
-    newSize+=65536-(newSize&65535);
+  struct mem_pool *pool = NULL;
+  if (newSize <= byte_pools[NELS(byte_pools)-1].size){
+    unsigned i;
+    for (i=0;byte_pools[i].size < newSize;i++)
+      ;
+    pool = &byte_pools[i];
+    newSize = pool->size;
+  }else{
+    if (newSize&1023)
+      newSize+=1024-(newSize&1023);
+    if (newSize>65536 && (newSize&65535))
+      newSize+=65536-(newSize&65535);
+  }
   DEBUGF(overlaybuffer, "realloc(b->bytes=%p, newSize=%zu)", b->bytes, newSize);
-  unsigned char *new = emalloc(newSize);
+  unsigned char *new = pool ? pool_alloc(pool) : emalloc(newSize);
   if (!new)
     return 0;
   if (b->position)
     bcopy(b->bytes,new,b->position);
   if (b->allocated) {
     assert(b->allocated == b->bytes);
-    free(b->allocated);
+    bytes_free(b->allocated, b->allocSize);
   }
   b->bytes=new;
   b->allocated=new;
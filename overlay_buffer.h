@@ -41,12 +41,17 @@ struct overlay_buffer {
   
   // is this an allocated buffer? can it be resized? Should it be freed?
   unsigned char * allocated;
+  
+  // slices keep the buffer they point into alive until they are freed
+  struct overlay_buffer *parent;
+  unsigned refs;
 };
 
 struct overlay_buffer *_ob_new(struct __sourceloc __whence);
 struct overlay_buffer *_ob_static(struct __sourceloc __whence, unsigned char *bytes, size_t size);
 struct overlay_buffer *_ob_slice(struct __sourceloc __whence, struct overlay_buffer *b, size_t offset, size_t length);
 struct overlay_buffer *_ob_dup(struct __sourceloc __whence, struct overlay_buffer *b);
+struct overlay_buffer *_ob_share(struct __sourceloc __whence, struct overlay_buffer *b);
 void _ob_free(struct __sourceloc __whence, struct overlay_buffer *b);
 int _ob_checkpoint(struct __sourceloc __whence, struct overlay_buffer *b);
 int _ob_rewind(struct __sourceloc __whence, struct overlay_buffer *b);
@@ -76,6 +81,7 @@ void _ob_append_strn(struct __sourceloc whence, struct overlay_buffer *b, const
 #define ob_static(bytes, size) _ob_static(__WHENCE__, bytes, size)
 #define ob_slice(b, off, len) _ob_slice(__WHENCE__, b, off, len)
 #define ob_dup(b) _ob_dup(__WHENCE__, b)
+#define ob_share(b) _ob_share(__WHENCE__, b)
 #define ob_free(b) _ob_free(__WHENCE__, b)
 #define ob_checkpoint(b) _ob_checkpoint(__WHENCE__, b)
 #define ob_rewind(b) _ob_rewind(__WHENCE__, b)
@@ -167,6 +167,25 @@ void interface_state_html(struct strbuf *b, struct overlay_interface *interface)
   }
   strbuf_sprintf(b, "TX: %d<br>", interface->tx_count);
   strbuf_sprintf(b, "RX: %d<br>", interface->recv_count);
+  strbuf_sprintf(b, "Routing overhead: %u bytes/s, %"PRIu64" bytes total<br>",
+    interface->overhead_rate, interface->overhead_bytes);
+}
+
+#define OVERHEAD_WINDOW_MS (10000)
+
+void overlay_interface_count_overhead(overlay_interface *interface, size_t bytes, time_ms_t now)
+{
+  if (interface->overhead_window_start == 0)
+    interface->overhead_window_start = now;
+  time_ms_t elapsed = now - interface->overhead_window_start;
+  if (elapsed >= OVERHEAD_WINDOW_MS){
+    interface->overhead_rate = interface->overhead_window_bytes * 1000 / elapsed;
+    DEBUGF(linkstate, "Routing overhead on %s; %u bytes/s", interface->name, interface->overhead_rate);
+    interface->overhead_window_bytes = 0;
+    interface->overhead_window_start = now;
+  }
+  interface->overhead_window_bytes += bytes;
+  interface->overhead_bytes += bytes;
 }
 
 static int
@@ -685,23 +704,124 @@ cleanup:
   return cleanup_ret;
 }
 
+#define OVERLAY_INTERFACE_DGRAM_SIZE 8096
+#define OVERLAY_INTERFACE_RX_BATCH_MAX 32
+
+#ifdef HAVE_RECVMMSG
+/* Packets are received into allocated buffers, so frames we forward can share the
+ * received bytes instead of copying them. A buffer is reused for the next read unless
+ * a forwarded frame is still holding on to it. Anything too large for the buffer
+ * spills into a static overflow area, and is copied. */
+#define OVERLAY_INTERFACE_RX_BUFFER_SIZE 2048
+static struct overlay_buffer *rx_buffers[OVERLAY_INTERFACE_RX_BATCH_MAX];
+
+static struct overlay_buffer *rx_buffer(unsigned i)
+{
+  if (!rx_buffers[i]){
+    struct overlay_buffer *b = ob_new();
+    if (!b)
+      return NULL;
+    if (!ob_makespace(b, OVERLAY_INTERFACE_RX_BUFFER_SIZE)){
+      ob_free(b);
+      return NULL;
+    }
+    rx_buffers[i] = b;
+  }
+  ob_clear(rx_buffers[i]);
+  return rx_buffers[i];
+}
+
+static void rx_packet(struct overlay_interface *interface, unsigned i, size_t len,
+		      const unsigned char *overflow, struct socket_address *recvaddr)
+{
+  struct overlay_buffer *b = rx_buffers[i];
+  if (len > OVERLAY_INTERFACE_RX_BUFFER_SIZE){
+    struct overlay_buffer *whole = ob_new();
+    if (!whole)
+      return;
+    ob_append_bytes(whole, ob_ptr(b), OVERLAY_INTERFACE_RX_BUFFER_SIZE);
+    ob_append_bytes(whole, overflow, len - OVERLAY_INTERFACE_RX_BUFFER_SIZE);
+    if (!ob_overrun(whole)){
+      ob_flip(whole);
+      packetOkOverlayBuffer(interface, whole, recvaddr);
+    }
+    ob_free(whole);
+    return;
+  }
+  ob_limitsize(b, len);
+  packetOkOverlayBuffer(interface, b, recvaddr);
+  if (b->refs > 1){
+    // a forwarded frame still needs these bytes
+    rx_buffers[i] = NULL;
+    ob_free(b);
+  }
+}
+#endif
+
 static void interface_read_dgram(struct overlay_interface *interface)
 {
-  int plen=0;
-  unsigned char packet[8096];
-  
-  struct socket_address recvaddr;
-  recvaddr.addrlen = sizeof recvaddr.store;
-
-  /* Read only one UDP packet per call to share resources more fairly, and also
-   enable stats to accurately count packets received */
-  int recvttl=1;
-  plen = recv_message(interface->alarm.poll.fd, &recvaddr, &recvttl, packet, sizeof(packet));
-  if (plen == -1) {
+  /* Read at most rx_batch packets per call, so that a busy interface can't starve any other file
+   descriptors. Any remaining packets will be read next time we poll. */
+  unsigned budget = interface->ifconfig.rx_batch;
+  if (budget > OVERLAY_INTERFACE_RX_BATCH_MAX)
+    budget = OVERLAY_INTERFACE_RX_BATCH_MAX;
+#ifdef HAVE_RECVMMSG
+  // only ever used from the main thread
+  static unsigned char overflow[OVERLAY_INTERFACE_RX_BATCH_MAX][OVERLAY_INTERFACE_DGRAM_SIZE - OVERLAY_INTERFACE_RX_BUFFER_SIZE];
+  struct socket_address recvaddr[OVERLAY_INTERFACE_RX_BATCH_MAX];
+  struct iovec iov[OVERLAY_INTERFACE_RX_BATCH_MAX][2];
+  struct mmsghdr msgs[OVERLAY_INTERFACE_RX_BATCH_MAX];
+  unsigned i;
+  for (i = 0; i < budget; ++i) {
+    struct overlay_buffer *b = rx_buffer(i);
+    if (!b)
+      break;
+    bzero(&recvaddr[i], sizeof recvaddr[i]);
+    iov[i][0].iov_base = ob_ptr(b);
+    iov[i][0].iov_len = OVERLAY_INTERFACE_RX_BUFFER_SIZE;
+    iov[i][1].iov_base = overflow[i];
+    iov[i][1].iov_len = sizeof overflow[i];
+    bzero(&msgs[i], sizeof msgs[i]);
+    msgs[i].msg_hdr.msg_name = &recvaddr[i].addr;
+    msgs[i].msg_hdr.msg_namelen = sizeof recvaddr[i].raw;
+    msgs[i].msg_hdr.msg_iov = iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 2;
+  }
+  budget = i;
+  if (budget == 0)
+    return;
+  int count = recvmmsg(interface->alarm.poll.fd, msgs, budget, MSG_DONTWAIT, NULL);
+  if (count == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return;
+    WHYF_perror("recvmmsg(%d, %u)", interface->alarm.poll.fd, budget);
     overlay_interface_close(interface);
     return;
   }
-  packetOkOverlay(interface, packet, plen, &recvaddr);
+  DEBUGF(verbose_io, "recvmmsg(%d, %u) -> %d", interface->alarm.poll.fd, budget, count);
+  for (i = 0; i < (unsigned)count && interface->state == INTERFACE_STATE_UP; ++i) {
+    if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      WARNF("Dropping oversized packet on interface %s", interface->name);
+      continue;
+    }
+    recvaddr[i].addrlen = msgs[i].msg_hdr.msg_namelen;
+    rx_packet(interface, i, msgs[i].msg_len, overflow[i], &recvaddr[i]);
+  }
+#else
+  unsigned char packet[OVERLAY_INTERFACE_DGRAM_SIZE];
+  while (budget-- && interface->state == INTERFACE_STATE_UP) {
+    struct socket_address recvaddr;
+    recvaddr.addrlen = sizeof recvaddr.store;
+    int recvttl=1;
+    ssize_t plen = recv_message(interface->alarm.poll.fd, &recvaddr, &recvttl, packet, sizeof(packet));
+    if (plen == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	overlay_interface_close(interface);
+      return;
+    }
+    packetOkOverlay(interface, packet, plen, &recvaddr);
+  }
+#endif
 }
 
 struct file_packet{
@@ -924,33 +1044,63 @@ static void overlay_interface_poll(struct sched_ent *alarm)
   }  
 }
 
-static int send_local_packet(int fd, const uint8_t *bytes, size_t len, const char *folder, const char *file)
+static int local_socket_address(struct socket_address *addr, const char *folder, const char *file)
 {
-  struct socket_address addr;
-  
-  strbuf d = strbuf_local_buf(addr.local.sun_path);
+  strbuf d = strbuf_local_buf(addr->local.sun_path);
   strbuf_path_join(d, folder, file, NULL);
   if (strbuf_overrun(d))
     return WHYF("interface file name overrun: %s", alloca_str_toprint(strbuf_str(d)));
   
   struct stat st;
-  if (lstat(addr.local.sun_path, &st))
+  if (lstat(addr->local.sun_path, &st))
     return 1;
   if (!S_ISSOCK(st.st_mode))
     return 1;
     
-  addr.local.sun_family = AF_UNIX;
-  addr.addrlen = offsetof(struct sockaddr_un, sun_path) + strlen(addr.local.sun_path)+1;
+  addr->local.sun_family = AF_UNIX;
+  addr->addrlen = offsetof(struct sockaddr_un, sun_path) + strlen(addr->local.sun_path)+1;
+  return 0;
+}
+
+static int send_local_packet(int fd, const uint8_t *bytes, size_t len, const char *folder, const char *file)
+{
+  struct socket_address addr;
+  int r = local_socket_address(&addr, folder, file);
+  if (r)
+    return r;
   
   ssize_t sent = sendto(fd, bytes, len, 0, 
 	    &addr.addr, addr.addrlen);
   if (sent == -1){
-    if (errno != EAGAIN && errno != EWOULDBLOCK)
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
       return WHYF_perror("sendto(%d, %zu, %s)", fd, len, alloca_socket_address(&addr));
   }
   return 0;
 }
 
+#ifdef HAVE_SENDMMSG
+#define LOCAL_BROADCAST_BATCH 32
+
+// send the same packet to every socket in the batch, with as few system calls as possible
+static void send_local_batch(int fd, struct mmsghdr *msgs, struct socket_address *addrs, unsigned count)
+{
+  unsigned i = 0;
+  while (i < count){
+    int sent = sendmmsg(fd, &msgs[i], count - i, 0);
+    if (sent == -1){
+      // interrupted before anything was sent, try the same socket again
+      if (errno == EINTR)
+	continue;
+      // skip the socket that failed, and carry on with the rest
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+	WHYF_perror("sendmmsg(%d, %s)", fd, alloca_socket_address(&addrs[i]));
+      sent = 1;
+    }
+    i += sent;
+  }
+}
+#endif
+
 static int send_local_broadcast(int fd, const uint8_t *bytes, size_t len, const char *folder)
 {
   if (send_local_packet(fd, bytes, len, folder, "broadcast")==0)
@@ -962,9 +1112,31 @@ static int send_local_broadcast(int fd, const uint8_t *bytes, size_t len, const
     WARNF_perror("opendir(%s)", alloca_str_toprint(folder));
     return -1;
   }
+#ifdef HAVE_SENDMMSG
+  struct socket_address addrs[LOCAL_BROADCAST_BATCH];
+  struct mmsghdr msgs[LOCAL_BROADCAST_BATCH];
+  struct iovec iov = {.iov_base = (void *)bytes, .iov_len = len};
+  unsigned count = 0;
+  while ((dp = readdir(dir)) != NULL) {
+    if (local_socket_address(&addrs[count], folder, dp->d_name))
+      continue;
+    bzero(&msgs[count], sizeof msgs[count]);
+    msgs[count].msg_hdr.msg_name = &addrs[count].addr;
+    msgs[count].msg_hdr.msg_namelen = addrs[count].addrlen;
+    msgs[count].msg_hdr.msg_iov = &iov;
+    msgs[count].msg_hdr.msg_iovlen = 1;
+    if (++count == LOCAL_BROADCAST_BATCH){
+      send_local_batch(fd, msgs, addrs, count);
+      count = 0;
+    }
+  }
+  if (count)
+    send_local_batch(fd, msgs, addrs, count);
+#else
   while ((dp = readdir(dir)) != NULL) {
     send_local_packet(fd, bytes, len, folder, dp->d_name);
   }
+#endif
   closedir(dir);
   return 0;
 }
@@ -24,6 +24,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "os.h" // for time_ms_t
 #include "socket.h"
 #include "limit.h"
+#include "constants.h" // for OQ_MAX
+
+struct packet_destination;
 
 #define INTERFACE_STATE_DOWN 0
 #define INTERFACE_STATE_UP 1
@@ -63,6 +66,23 @@ struct network_destination {
 
   // rate limit for outgoing packets
   struct limit_state transfer_limit;
+
+  // frames queued for this destination in each QOS queue, in the order they were queued
+  struct packet_destination *queued_first[OQ_MAX];
+  struct packet_destination *queued_last[OQ_MAX];
+
+  // totals of the frames queued for this destination that may be held to share a packet, kept up
+  // to date as frames are queued, sent and removed, and linked into a list of every destination
+  // that has any, so the send alarm can decide whether to wait without walking the queues
+  struct network_destination *_hold_next;
+  struct network_destination *_hold_prev;
+  // frames that have not been sent yet, and enqueued_at of the oldest of them (or earlier)
+  unsigned hold_frames;
+  size_t hold_bytes;
+  time_ms_t hold_since;
+  // frames that are waiting to be retransmitted, in the order they were last sent
+  struct packet_destination *resend_first;
+  struct packet_destination *resend_last;
 };
 
 typedef struct overlay_interface {
@@ -90,6 +110,13 @@ typedef struct overlay_interface {
   int recv_count;
   int tx_count;
   
+  // bytes of mesh management frames (link state, acks, probes) sent on this interface,
+  // in total and per second over the last complete window
+  uint64_t overhead_bytes;
+  unsigned overhead_window_bytes;
+  time_ms_t overhead_window_start;
+  unsigned overhead_rate;
+
   struct radio_link_state *radio_link_state;
 
   struct config_network_interface ifconfig; // copy
@@ -138,6 +165,7 @@ overlay_interface_init(const char *name,
 		       const struct socket_address *broadcast,
 		       const struct config_network_interface *ifconfig);
 void overlay_interface_close(overlay_interface *interface);
+void overlay_interface_count_overhead(overlay_interface *interface, size_t bytes, time_ms_t now);
 
 int overlay_interface_register(const char *name,
 			   struct socket_address *addr,
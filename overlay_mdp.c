@@ -437,7 +437,7 @@ static void overlay_mdp_decode_header(struct internal_mdp_header *header, struct
   header->source_port = port;
 }
 
-static struct overlay_buffer *overlay_mdp_decrypt(struct internal_mdp_header *header, struct overlay_buffer *payload)
+struct overlay_buffer *overlay_mdp_decrypt(struct internal_mdp_header *header, struct overlay_buffer *payload)
 {
   IN();
 
@@ -772,7 +772,7 @@ static int generate_nonce(uint8_t *nonce, size_t bytes)
   return 0;
 }
 
-static struct overlay_buffer * encrypt_payload(
+struct overlay_buffer *overlay_mdp_encrypt(
   struct subscriber *source, 
   struct subscriber *dest, 
   const unsigned char *buffer,
@@ -850,7 +850,7 @@ int _overlay_send_frame(struct __sourceloc whence, struct internal_mdp_header *h
          header->destination?alloca_tohex_sid_t(header->destination->sid):"broadcast", header->destination_port);
       
   /* Prepare the overlay frame for dispatch */
-  struct overlay_frame *frame = emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   if (!frame)
     return -1;
   
@@ -904,7 +904,7 @@ int _overlay_send_frame(struct __sourceloc whence, struct internal_mdp_header *h
     }
   
     /* crypted and signed (using CryptoBox authcryption primitive) */
-    frame->payload = encrypt_payload(frame->source, frame->destination, ob_ptr(plaintext), ob_position(plaintext));
+    frame->payload = overlay_mdp_encrypt(frame->source, frame->destination, ob_ptr(plaintext), ob_position(plaintext));
     ob_free(plaintext);
     if (!frame->payload){
       op_free(frame);
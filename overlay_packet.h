@@ -40,6 +40,14 @@ struct packet_destination{
   struct network_destination *destination;
   // next hop in the route
   struct subscriber *next_hop;
+  // the frame, while it is queued, and its neighbours in the destination's list of queued frames
+  struct overlay_frame *frame;
+  struct packet_destination *_queued_prev;
+  struct packet_destination *_queued_next;
+  // payload bytes counted in the destination's hold totals
+  size_t _hold_bytes;
+  struct packet_destination *_resend_prev;
+  struct packet_destination *_resend_next;
 };
 
 struct overlay_frame {
@@ -68,6 +76,13 @@ struct overlay_frame {
   
   // when should we send it?
   time_ms_t delay_until;
+  // earliest time any destination could accept this frame, and its position (+1) in the queue's ready heap
+  time_ms_t ready_at;
+  unsigned ready_slot;
+  // tie breaker so frames that become ready together are sent in the order they were queued
+  uint32_t queue_seq;
+  // temporary list of frames to requeue after building a packet
+  struct overlay_frame *ready_next;
   // where should we send it?
   struct packet_destination destinations[MAX_PACKET_DESTINATIONS];
   int destination_count;
@@ -122,6 +137,7 @@ struct internal_mdp_header{
 };
 
 
+struct overlay_frame *op_new(void);
 int op_free(struct overlay_frame *p);
 struct overlay_frame *op_dup(struct overlay_frame *f);
 
@@ -131,6 +147,8 @@ void frame_add_destination(struct overlay_frame *frame, struct subscriber *next_
 
 void mdp_init_response(const struct internal_mdp_header *in, struct internal_mdp_header *out);
 void overlay_mdp_encode_ports(struct overlay_buffer *plaintext, mdp_port_t dst_port, mdp_port_t src_port);
+struct overlay_buffer *overlay_mdp_encrypt(struct subscriber *source, struct subscriber *dest, const unsigned char *buffer, size_t msg_len);
+struct overlay_buffer *overlay_mdp_decrypt(struct internal_mdp_header *header, struct overlay_buffer *payload);
 int overlay_mdp_dnalookup_reply(struct subscriber *dest, mdp_port_t dest_port, 
     struct subscriber *resolved_sid, const char *uri, const char *did, const char *name);
 
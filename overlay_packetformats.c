@@ -320,6 +320,21 @@ int parseEnvelopeHeader(struct decode_context *context, struct overlay_interface
 
 int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, size_t len,
 		    struct socket_address *recvaddr)
+{
+  struct overlay_buffer *b = ob_static(packet, len);
+  if (!b)
+    return -1;
+  ob_limitsize(b, len);
+  int ret = packetOkOverlayBuffer(interface, b, recvaddr);
+  ob_free(b);
+  return ret;
+}
+
+/* Decode a received packet held in b.
+ * If the buffer owns its bytes, forwarded frames will share them instead of taking a copy.
+ */
+int packetOkOverlayBuffer(struct overlay_interface *interface, struct overlay_buffer *b,
+		    struct socket_address *recvaddr)
 {
   IN();
   /* 
@@ -374,8 +389,8 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
   */
 
   if (IF_DEBUG(packetrx) || interface->ifconfig.debug) {
-    _DEBUGF("Received on %s, len %d", interface->name, (int)len);
-    DEBUG_packet_visualise("Received packet",packet,len);
+    _DEBUGF("Received on %s, len %d", interface->name, (int)ob_limit(b));
+    DEBUG_packet_visualise("Received packet",ob_ptr(b),ob_limit(b));
   }
   
   struct overlay_frame f;
@@ -384,16 +399,12 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
   bzero(&f,sizeof f);
   
   time_ms_t now = gettime_ms();
-  struct overlay_buffer *b = ob_static(packet, len);
-  ob_limitsize(b, len);
   
   f.interface = interface;
   
   int ret=parseEnvelopeHeader(&context, interface, recvaddr, b);
-  if (ret){
-    ob_free(b);
+  if (ret)
     RETURN(ret);
-  }
   f.sender_interface = context.sender_interface;
   interface->recv_count++;
   
@@ -423,7 +434,7 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
 	  unsigned char *current = ob_ptr(b)+ob_position(b);
 	  DEBUG_dump(overlayframes, "Payload Header", header_start, current - header_start);
 	  ret = WHYF("Payload length %zd suggests frame should be %zd bytes, but was only %zd",
-	             payload_len, ob_position(b)+payload_len, len);
+	             payload_len, ob_position(b)+payload_len, ob_limit(b));
 	  // TODO signal reduced MTU?
 	  goto end;
 	}
@@ -477,8 +488,6 @@ int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, s
 end:
   send_please_explain(&context, get_my_subscriber(1), context.sender);
   
-  ob_free(b);
-  
   RETURN(ret);
   OUT();
 }
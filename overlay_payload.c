@@ -20,6 +20,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "serval.h"
 #include "conf.h"
 #include "str.h"
+#include "mem.h"
 #include "overlay_buffer.h"
 #include "overlay_packet.h"
 
@@ -114,6 +115,17 @@ cleanup:
   return -1;
 }
 
+// frames are created for every packet we send or forward, so keep some to reuse
+static struct mem_pool frame_pool = MEM_POOL_INIT("overlay_frame", sizeof(struct overlay_frame), 128);
+
+struct overlay_frame *op_new()
+{
+  struct overlay_frame *ret = pool_alloc(&frame_pool);
+  if (ret)
+    bzero(ret, sizeof(struct overlay_frame));
+  return ret;
+}
+
 int op_free(struct overlay_frame *p)
 {
   if (!p) return WHY("Asked to free NULL");
@@ -123,7 +135,7 @@ int op_free(struct overlay_frame *p)
   p->next=NULL;
   if (p->payload) ob_free(p->payload);
   p->payload=NULL;
-  free(p);
+  pool_free(&frame_pool, p);
   return 0;
 }
 
@@ -132,7 +144,7 @@ struct overlay_frame *op_dup(struct overlay_frame *in)
   if (!in) return NULL;
 
   /* clone the frame */
-  struct overlay_frame *out = emalloc(sizeof(struct overlay_frame));
+  struct overlay_frame *out = pool_alloc(&frame_pool);
   if (out == NULL)
     return NULL;
 
@@ -140,8 +152,9 @@ struct overlay_frame *op_dup(struct overlay_frame *in)
   bcopy(in,out,sizeof(struct overlay_frame));
 
   if (in->payload) {
-    if ((out->payload = ob_dup(in->payload)) == NULL) {
-      free(out);
+    // share the received bytes when we can, the payload will not be modified
+    if ((out->payload = ob_share(in->payload)) == NULL) {
+      pool_free(&frame_pool, out);
       return NULL;
     }
   }
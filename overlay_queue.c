@@ -20,6 +20,7 @@
 #include <assert.h>
 #include "serval.h"
 #include "conf.h"
+#include "mem.h"
 #include "overlay_buffer.h"
 #include "overlay_interface.h"
 #include "overlay_packet.h"
@@ -30,6 +31,9 @@
 #include "server.h"
 #include "debug.h"
 
+// histogram buckets are powers of two; [0]=0, [1]=1, [2]=2-3, [3]=4-7, ...
+#define QUEUE_HISTOGRAM_BUCKETS 13
+
 typedef struct overlay_txqueue {
   struct overlay_frame *first;
   struct overlay_frame *last;
@@ -39,9 +43,23 @@ typedef struct overlay_txqueue {
   /* Latency target in ms for this traffic class.
    Frames older than the latency target will get dropped. */
   int latencyTarget;
+  /* Min-heap of frames ordered by ready_at, so we can find frames that
+   might be sent now without walking the whole queue. */
+  struct overlay_frame **ready;
+  unsigned ready_count;
+  unsigned ready_size;
+  // # frames in the queue when each new frame arrives
+  unsigned depth_histogram[QUEUE_HISTOGRAM_BUCKETS];
+  // ms from enqueue until the first transmission of each frame
+  unsigned latency_histogram[QUEUE_HISTOGRAM_BUCKETS];
+  unsigned dropped;
 } overlay_txqueue;
 
 overlay_txqueue overlay_tx[OQ_MAX];
+static const char *queue_names[OQ_MAX]={
+  "voice", "mesh management", "video", "ordinary", "opportunistic"
+};
+static uint32_t queue_seq=0;
 
 // short lived data while we are constructing an outgoing packet
 struct outgoing_packet{
@@ -51,8 +69,24 @@ struct outgoing_packet{
   int header_length;
   struct overlay_buffer *buffer;
   struct decode_context context;
+  unsigned frame_count;
+  // when we started holding frames for this packet, 0 if it was never held
+  time_ms_t held_since;
+  unsigned frames_waiting;
+  unsigned frames_joined;
 };
 
+// destinations with frames that we might hold back, while waiting for more to fill the packet
+static struct network_destination *held_destinations=NULL;
+
+static struct {
+  unsigned packets;
+  unsigned frames;
+  unsigned holds;
+  unsigned saved;
+  time_ms_t held_since;
+} aggregate_stats;
+
 #define SMALL_PACKET_SIZE (400)
 
 int32_t mdp_sequence=0;
@@ -80,9 +114,257 @@ int overlay_queue_init(){
   return 0;
 }
 
+static unsigned histogram_bucket(uint64_t value)
+{
+  unsigned bucket = 0;
+  while(value && bucket < QUEUE_HISTOGRAM_BUCKETS - 1){
+    value>>=1;
+    bucket++;
+  }
+  return bucket;
+}
+
+static int ready_before(const struct overlay_frame *a, const struct overlay_frame *b)
+{
+  if (a->ready_at != b->ready_at)
+    return a->ready_at < b->ready_at;
+  return (int32_t)(a->queue_seq - b->queue_seq) < 0;
+}
+
+static void ready_set(overlay_txqueue *queue, unsigned i, struct overlay_frame *frame)
+{
+  queue->ready[i]=frame;
+  frame->ready_slot=i+1;
+}
+
+static void ready_sift_up(overlay_txqueue *queue, unsigned i)
+{
+  struct overlay_frame *frame = queue->ready[i];
+  while(i>0){
+    unsigned parent = (i-1)/2;
+    if (!ready_before(frame, queue->ready[parent]))
+      break;
+    ready_set(queue, i, queue->ready[parent]);
+    i=parent;
+  }
+  ready_set(queue, i, frame);
+}
+
+static void ready_sift_down(overlay_txqueue *queue, unsigned i)
+{
+  struct overlay_frame *frame = queue->ready[i];
+  while(1){
+    unsigned child = i*2+1;
+    if (child >= queue->ready_count)
+      break;
+    if (child+1 < queue->ready_count && ready_before(queue->ready[child+1], queue->ready[child]))
+      child++;
+    if (!ready_before(queue->ready[child], frame))
+      break;
+    ready_set(queue, i, queue->ready[child]);
+    i=child;
+  }
+  ready_set(queue, i, frame);
+}
+
+static void ready_remove(overlay_txqueue *queue, struct overlay_frame *frame)
+{
+  if (!frame->ready_slot)
+    return;
+  unsigned i = frame->ready_slot - 1;
+  frame->ready_slot = 0;
+  if (--queue->ready_count == i)
+    return;
+  ready_set(queue, i, queue->ready[queue->ready_count]);
+  ready_sift_up(queue, i);
+  ready_sift_down(queue, queue->ready[i]->ready_slot - 1);
+}
+
+// make sure the ready heap can hold every frame in the queue, so a queued frame can always be found
+static int ready_reserve(overlay_txqueue *queue, unsigned count)
+{
+  if (count <= queue->ready_size)
+    return 0;
+  unsigned size = queue->ready_size ? queue->ready_size * 2 : 32;
+  while (size < count)
+    size *= 2;
+  struct overlay_frame **ready = erealloc(queue->ready, sizeof(struct overlay_frame *) * size);
+  if (!ready)
+    return -1;
+  queue->ready = ready;
+  queue->ready_size = size;
+  return 0;
+}
+
+// (re)insert a frame into the ready heap after its ready_at has been updated
+static void ready_update(overlay_txqueue *queue, struct overlay_frame *frame)
+{
+  if (frame->ready_slot){
+    unsigned i = frame->ready_slot - 1;
+    ready_sift_up(queue, i);
+    ready_sift_down(queue, frame->ready_slot - 1);
+    return;
+  }
+  assert(queue->ready_count < queue->ready_size);
+  queue->ready[queue->ready_count]=frame;
+  ready_sift_up(queue, queue->ready_count++);
+}
+
+// remove and return the first frame that might be sendable now
+static struct overlay_frame *ready_pop(overlay_txqueue *queue, time_ms_t now)
+{
+  if (queue->ready_count==0 || queue->ready[0]->ready_at > now)
+    return NULL;
+  struct overlay_frame *frame = queue->ready[0];
+  ready_remove(queue, frame);
+  return frame;
+}
+
+static int frame_is_queued(struct overlay_frame *frame)
+{
+  return frame->prev || overlay_tx[frame->queue].first == frame;
+}
+
+// don't hold up isochronous traffic, or link state acks that peers are waiting on
+static int queue_may_hold(int queue)
+{
+  return overlay_tx[queue].latencyTarget==0 && queue!=OQ_MESH_MANAGEMENT;
+}
+
+static void hold_list_update(struct network_destination *dest)
+{
+  char listed = dest->_hold_prev || held_destinations == dest;
+  char wanted = dest->hold_frames || dest->resend_first;
+  if (wanted && !listed){
+    dest->_hold_prev = NULL;
+    dest->_hold_next = held_destinations;
+    if (held_destinations)
+      held_destinations->_hold_prev = dest;
+    held_destinations = dest;
+  }else if (listed && !wanted){
+    if (dest->_hold_prev)
+      dest->_hold_prev->_hold_next = dest->_hold_next;
+    else
+      held_destinations = dest->_hold_next;
+    if (dest->_hold_next)
+      dest->_hold_next->_hold_prev = dest->_hold_prev;
+    dest->_hold_prev = dest->_hold_next = NULL;
+  }
+}
+
+// count a queued frame destination in the destination's hold totals
+static void hold_add(struct overlay_frame *frame, struct packet_destination *pd)
+{
+  if (pd->frame != frame || !queue_may_hold(frame->queue))
+    return;
+  struct network_destination *dest = pd->destination;
+  if (pd->transmit_time){
+    // transmit times only move forward, so the oldest is always at the head
+    pd->_resend_next = NULL;
+    pd->_resend_prev = dest->resend_last;
+    if (pd->_resend_prev)
+      pd->_resend_prev->_resend_next = pd;
+    else
+      dest->resend_first = pd;
+    dest->resend_last = pd;
+  }else{
+    pd->_hold_bytes = ob_position(frame->payload);
+    dest->hold_bytes += pd->_hold_bytes;
+    if (dest->hold_frames++ == 0 || frame->enqueued_at < dest->hold_since)
+      dest->hold_since = frame->enqueued_at;
+  }
+  hold_list_update(dest);
+}
+
+static void hold_remove(struct overlay_frame *frame, struct packet_destination *pd)
+{
+  if (pd->frame != frame || !queue_may_hold(frame->queue))
+    return;
+  struct network_destination *dest = pd->destination;
+  if (pd->transmit_time){
+    if (pd->_resend_prev)
+      pd->_resend_prev->_resend_next = pd->_resend_next;
+    else
+      dest->resend_first = pd->_resend_next;
+    if (pd->_resend_next)
+      pd->_resend_next->_resend_prev = pd->_resend_prev;
+    else
+      dest->resend_last = pd->_resend_prev;
+    pd->_resend_prev = pd->_resend_next = NULL;
+  }else{
+    // hold_since is left alone until there is nothing left, so it may be earlier than the oldest frame
+    dest->hold_bytes -= pd->_hold_bytes;
+    dest->hold_frames--;
+  }
+  hold_list_update(dest);
+}
+
+// add a frame's destination to the end of that destination's list of queued frames
+static void queued_link(struct overlay_frame *frame, struct packet_destination *pd)
+{
+  struct network_destination *dest = pd->destination;
+  pd->frame = frame;
+  pd->_queued_next = NULL;
+  pd->_queued_prev = dest->queued_last[frame->queue];
+  if (pd->_queued_prev)
+    pd->_queued_prev->_queued_next = pd;
+  else
+    dest->queued_first[frame->queue] = pd;
+  dest->queued_last[frame->queue] = pd;
+  hold_add(frame, pd);
+}
+
+static void queued_unlink(struct overlay_frame *frame, struct packet_destination *pd)
+{
+  if (pd->frame != frame)
+    return;
+  hold_remove(frame, pd);
+  struct network_destination *dest = pd->destination;
+  if (pd->_queued_prev)
+    pd->_queued_prev->_queued_next = pd->_queued_next;
+  else
+    dest->queued_first[frame->queue] = pd->_queued_next;
+  if (pd->_queued_next)
+    pd->_queued_next->_queued_prev = pd->_queued_prev;
+  else
+    dest->queued_last[frame->queue] = pd->_queued_prev;
+  pd->frame = NULL;
+  pd->_queued_prev = pd->_queued_next = NULL;
+}
+
+// point the list at a linked frame destination that has been copied to another slot
+static void queued_moved(struct overlay_frame *frame, struct packet_destination *pd)
+{
+  if (pd->frame != frame)
+    return;
+  struct network_destination *dest = pd->destination;
+  if (pd->_queued_prev)
+    pd->_queued_prev->_queued_next = pd;
+  else
+    dest->queued_first[frame->queue] = pd;
+  if (pd->_queued_next)
+    pd->_queued_next->_queued_prev = pd;
+  else
+    dest->queued_last[frame->queue] = pd;
+  if (pd->transmit_time && queue_may_hold(frame->queue)){
+    if (pd->_resend_prev)
+      pd->_resend_prev->_resend_next = pd;
+    else
+      dest->resend_first = pd;
+    if (pd->_resend_next)
+      pd->_resend_next->_resend_prev = pd;
+    else
+      dest->resend_last = pd;
+  }
+}
+
 /* remove and free a payload from the queue */
 static struct overlay_frame *
 overlay_queue_remove(overlay_txqueue *queue, struct overlay_frame *frame){
+  ready_remove(queue, frame);
+  int i;
+  for (i=0;i<frame->destination_count;i++)
+    queued_unlink(frame, &frame->destinations[i]);
   struct overlay_frame *prev = frame->prev;
   struct overlay_frame *next = frame->next;
   if (prev)
@@ -110,6 +392,9 @@ static void overlay_queue_release(){
   for(i=0;i<OQ_MAX;i++) {
     while(overlay_tx[i].first)
       overlay_queue_remove(&overlay_tx[i], overlay_tx[i].first);
+    free(overlay_tx[i].ready);
+    overlay_tx[i].ready = NULL;
+    overlay_tx[i].ready_size = 0;
   }
 }
 DEFINE_TRIGGER(shutdown, overlay_queue_release);
@@ -180,6 +465,9 @@ int _overlay_payload_enqueue(struct __sourceloc __whence, struct overlay_frame *
 
   if (queue->length>=queue->maxLength) 
     return WHYF("Queue #%d congested (size = %d)",p->queue,queue->maxLength);
+  
+  if (ready_reserve(queue, queue->length + 1) == -1)
+    return WHYF("Queue #%d cannot grow", p->queue);
     
   // it should be safe to try sending all packets with an mdp sequence
   if (p->packet_version<=0)
@@ -190,19 +478,19 @@ int _overlay_payload_enqueue(struct __sourceloc __whence, struct overlay_frame *
 	   p->destination?alloca_tohex_sid_t_trunc(p->destination->sid, 14): "broadcast");
   
   if (p->destination_count==0){
-    if (!p->destination){
-      // hook to allow for flooding via olsr
+    // hook to allow for flooding via olsr
+    if (!p->destination)
       olsr_send(p);
-      
-      link_add_destinations(p);
-
-      // just drop it now
-      if (p->destination_count == 0){
-	DEBUGF(mdprequests, "Not transmitting, as we have nowhere to send it");
-	// free the packet and return success.
-	op_free(p);
-	return 0;
-      }
+    
+    // find the next hop now, so the frame is listed with any packet already going that way
+    link_add_destinations(p);
+
+    // just drop it now
+    if (!p->destination && p->destination_count == 0){
+      DEBUGF(mdprequests, "Not transmitting, as we have nowhere to send it");
+      // free the packet and return success.
+      op_free(p);
+      return 0;
     }
     
     // allow the packet to be resent
@@ -221,14 +509,22 @@ int _overlay_payload_enqueue(struct __sourceloc __whence, struct overlay_frame *
 	     p->destinations[i].destination->interface->name);
   }
   
+  // stamp the frame before its destinations count it as held
+  p->enqueued_at=gettime_ms();
   struct overlay_frame *l=queue->last;
+  for (i=0;i<p->destination_count;i++){
+    p->destinations[i].frame=NULL;
+    queued_link(p, &p->destinations[i]);
+  }
   if (l) l->next=p;
   p->prev=l;
   p->next=NULL;
-  p->enqueued_at=gettime_ms();
   p->mdp_sequence = -1;
+  p->ready_slot = 0;
+  p->queue_seq = queue_seq++;
   queue->last=p;
   if (!queue->first) queue->first=p;
+  queue->depth_histogram[histogram_bucket(queue->length)]++;
   queue->length++;
   if (p->queue==OQ_ISOCHRONOUS_VOICE)
     rhizome_saw_voice_traffic();
@@ -293,10 +589,13 @@ void frame_remove_destination(struct overlay_frame *frame, int i){
 	 frame->destinations[i].destination->unicast?"unicast":"broadcast",
 	 frame->destinations[i].destination->interface->name
 	);
+  queued_unlink(frame, &frame->destinations[i]);
   release_destination_ref(frame->destinations[i].destination);
   frame->destination_count --;
-  if (i<frame->destination_count)
+  if (i<frame->destination_count){
     frame->destinations[i]=frame->destinations[frame->destination_count];
+    queued_moved(frame, &frame->destinations[i]);
+  }
 }
 
 void frame_add_destination(struct overlay_frame *frame, struct subscriber *next_hop, struct network_destination *dest){
@@ -307,23 +606,34 @@ void frame_add_destination(struct overlay_frame *frame, struct subscriber *next_
   frame->destinations[i].destination=add_destination_ref(dest);
   frame->destinations[i].next_hop = next_hop;
   frame->destinations[i].sent_sequence=-1;
+  frame->destinations[i].transmit_time=0;
+  frame->destinations[i].frame=NULL;
+  if (frame_is_queued(frame))
+    queued_link(frame, &frame->destinations[i]);
   DEBUGF(overlayframes, "Add %s destination on interface %s", 
 	 frame->destinations[i].destination->unicast?"unicast":"broadcast",
 	 frame->destinations[i].destination->interface->name
 	);
 }
 
-// update the alarm time and return 1 if changed
+// update the alarm time and the frame's position in the ready heap
 static int
 overlay_calc_queue_time(struct overlay_frame *frame)
 {
+  overlay_txqueue *queue = &overlay_tx[frame->queue];
+  // until we know better, look at this frame every time we build a packet
+  frame->ready_at = 0;
   
   time_ms_t next_allowed_packet=0;
+  time_ms_t expires=0;
   // check all interfaces
   if (frame->destination_count>0){
     int i;
     for(i=0;i<frame->destination_count;i++)
     {
+      time_ms_t timeout = frame->enqueued_at + frame->destinations[i].destination->ifconfig.transmit_timeout_ms;
+      if (expires==0 || timeout < expires)
+	expires = timeout;
       if (radio_link_is_busy(frame->destinations[i].destination->interface))
 	continue;
       time_ms_t next_packet = limit_next_allowed(&frame->destinations[i].destination->transfer_limit);
@@ -337,10 +647,12 @@ overlay_calc_queue_time(struct overlay_frame *frame)
     }
     
     if (next_allowed_packet==0){
+      ready_update(queue, frame);
       return 0;
     }
   }else{
     if (!frame->destination){
+      ready_update(queue, frame);
       return 0;
     }
   }
@@ -350,6 +662,14 @@ overlay_calc_queue_time(struct overlay_frame *frame)
   if (next_allowed_packet < frame->enqueued_at)
     next_allowed_packet = frame->enqueued_at;
 
+  // the frame needs to be looked at again when it can be sent, or when it should be dropped
+  frame->ready_at = next_allowed_packet;
+  if (queue->latencyTarget && (expires==0 || frame->enqueued_at + queue->latencyTarget < expires))
+    expires = frame->enqueued_at + queue->latencyTarget;
+  if (expires && expires + 1 < frame->ready_at)
+    frame->ready_at = expires + 1;
+  ready_update(queue, frame);
+
   if (ob_position(frame->payload)<SMALL_PACKET_SIZE &&
       next_allowed_packet < frame->enqueued_at + overlay_tx[frame->queue].small_packet_grace_interval)
     next_allowed_packet = frame->enqueued_at + overlay_tx[frame->queue].small_packet_grace_interval;
@@ -359,184 +679,292 @@ overlay_calc_queue_time(struct overlay_frame *frame)
   return 0;
 }
 
-static void
-overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, time_ms_t now, strbuf debug){
-  struct overlay_frame *frame = queue->first;
-  
-  // TODO stop when the packet is nearly full?
-  while(frame){
-    if (queue->latencyTarget!=0 && frame->enqueued_at + queue->latencyTarget < now){
-      DEBUGF(ack,"Dropping frame (%p) type %x (length %zu) for %s due to expiry timeout", 
-	     frame, frame->type, frame->payload->checkpointLength,
-	     frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All"
-	    );
-      frame = overlay_queue_remove(queue, frame);
+/* Should we wait for more frames before building a packet?
+ * Small ordinary and opportunistic frames are held for up to the destination's
+ * aggregate_ms (0 unless configured), unless there is already enough data to
+ * fill most of the packet.
+ * Returns the time to wait until, or 0 to send now.
+ */
+static time_ms_t
+overlay_aggregate_hold(time_ms_t now)
+{
+  unsigned i;
+  for (i=0;i<OVERLAY_MAX_INTERFACES;i++)
+    if (overlay_interfaces[i].state==INTERFACE_STATE_UP
+      && (overlay_interfaces[i].ifconfig.broadcast.aggregate_ms>0
+	|| overlay_interfaces[i].ifconfig.unicast.aggregate_ms>0))
+      break;
+  if (i>=OVERLAY_MAX_INTERFACES)
+    return 0;
+  
+  for (i=0;i<OQ_MAX;i++){
+    overlay_txqueue *queue = &overlay_tx[i];
+    if (!queue_may_hold(i) && queue->ready_count && queue->ready[0]->ready_at <= now)
+      return 0;
+  }
+  
+  time_ms_t hold_until=0;
+  struct network_destination *dest;
+  for (dest = held_destinations; dest; dest = dest->_hold_next){
+    if (dest->interface->state!=INTERFACE_STATE_UP
+      || radio_link_is_busy(dest->interface)
+      || limit_next_allowed(&dest->transfer_limit) > now)
       continue;
-    }
-    
-    /* Note, once we queue a broadcast packet we are currently 
-     * committed to sending it to every destination, 
-     * even if we hear it from somewhere else in the mean time
-     */
-    
-    // ignore payloads that are waiting for ack / nack resends
-    if (frame->delay_until > now)
-      goto skip;
-
-    if (packet->buffer && packet->destination->ifconfig.encapsulation==ENCAP_SINGLE)
-      goto skip;
-      
-    // quickly skip payloads that have no chance of fitting
-    if (packet->buffer && ob_position(frame->payload) > ob_remaining(packet->buffer))
-      goto skip;
-    
-    if (!frame->manual_destinations)
-      link_add_destinations(frame);
-    
-    if(frame->mdp_sequence != -1 && ((mdp_sequence - frame->mdp_sequence)&0xFFFF) >= 64){
-      // too late, we've sent too many packets for the next hop to correctly de-duplicate
-      DEBUGF(overlayframes, "Retransmition of frame %p mdp seq %d, is too late to be de-duplicated", 
-	     frame, frame->mdp_sequence);
-      frame = overlay_queue_remove(queue, frame);
+    // retransmissions are already late
+    if (dest->resend_first && dest->resend_first->transmit_time + dest->resend_delay <= now)
+      return 0;
+    if (!dest->hold_frames)
       continue;
-    }
+    // wait no longer than the aggregation budget, and never beyond the transmit timeout
+    time_ms_t deadline = dest->hold_since + dest->ifconfig.aggregate_ms;
+    if (deadline > dest->hold_since + dest->ifconfig.transmit_timeout_ms - 1)
+      deadline = dest->hold_since + dest->ifconfig.transmit_timeout_ms - 1;
+    if (deadline <= now || dest->hold_bytes * 4 >= (size_t)dest->ifconfig.mtu * 3)
+      return 0;
+    if (hold_until==0 || deadline < hold_until)
+      hold_until = deadline;
+  }
+  return hold_until;
+}
+
+// try to add one frame to the packet, returns 0 if the frame was removed from the queue
+static int
+overlay_stuff_frame(struct outgoing_packet *packet, overlay_txqueue *queue, struct overlay_frame *frame, time_ms_t now, strbuf debug)
+{
+  if (queue->latencyTarget!=0 && frame->enqueued_at + queue->latencyTarget < now){
+    DEBUGF(ack,"Dropping frame (%p) type %x (length %zu) for %s due to expiry timeout", 
+	   frame, frame->type, frame->payload->checkpointLength,
+	   frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All"
+	  );
+    queue->dropped++;
+    overlay_queue_remove(queue, frame);
+    return 0;
+  }
+  
+  /* Note, once we queue a broadcast packet we are currently 
+   * committed to sending it to every destination, 
+   * even if we hear it from somewhere else in the mean time
+   */
+  
+  // ignore payloads that are waiting for ack / nack resends
+  if (frame->delay_until > now)
+    return 1;
+
+  if (packet->buffer && packet->destination->ifconfig.encapsulation==ENCAP_SINGLE)
+    return 1;
     
-    int destination_index=-1;
-    {
-      int i;
-      for (i=frame->destination_count -1;i>=0;i--){
-	struct network_destination *dest = frame->destinations[i].destination;
-	if (!dest)
-	  FATALF("Destination %d is NULL", i);
-	if (!dest->interface)
-	  FATALF("Destination interface %d is NULL", i);
-	if (dest->interface->state!=INTERFACE_STATE_UP){
-	  // remove this destination
-	  frame_remove_destination(frame, i);
-	  continue;
-	}
-	if (frame->enqueued_at + dest->ifconfig.transmit_timeout_ms < now){
-	  DEBUGF(ack,"Dropping %p, %s packet destination for %s sent w. seq %d, %dms ago", 
-	    frame, dest->unicast?"unicast":"broadcast",
-	    frame->whence.function, frame->destinations[i].sent_sequence,
-	    (int)(gettime_ms() - frame->destinations[i].transmit_time));
-	  frame_remove_destination(frame, i);
-	  continue;
-	}
-	if (ob_position(frame->payload) > (unsigned)dest->ifconfig.mtu){
-	  WARNF("Skipping packet destination as size %zu > destination mtu %zd", 
-	  ob_position(frame->payload), dest->ifconfig.mtu);
-	  frame_remove_destination(frame, i);
+  // quickly skip payloads that have no chance of fitting
+  if (packet->buffer && ob_position(frame->payload) > ob_remaining(packet->buffer))
+    return 1;
+  
+  if (!frame->manual_destinations)
+    link_add_destinations(frame);
+  
+  if(frame->mdp_sequence != -1 && ((mdp_sequence - frame->mdp_sequence)&0xFFFF) >= 64){
+    // too late, we've sent too many packets for the next hop to correctly de-duplicate
+    DEBUGF(overlayframes, "Retransmition of frame %p mdp seq %d, is too late to be de-duplicated", 
+	   frame, frame->mdp_sequence);
+    queue->dropped++;
+    overlay_queue_remove(queue, frame);
+    return 0;
+  }
+  
+  int destination_index=-1;
+  {
+    int i;
+    for (i=frame->destination_count -1;i>=0;i--){
+      struct network_destination *dest = frame->destinations[i].destination;
+      if (!dest)
+	FATALF("Destination %d is NULL", i);
+      if (!dest->interface)
+	FATALF("Destination interface %d is NULL", i);
+      if (dest->interface->state!=INTERFACE_STATE_UP){
+	// remove this destination
+	frame_remove_destination(frame, i);
+	continue;
+      }
+      if (frame->enqueued_at + dest->ifconfig.transmit_timeout_ms < now){
+	DEBUGF(ack,"Dropping %p, %s packet destination for %s sent w. seq %d, %dms ago", 
+	  frame, dest->unicast?"unicast":"broadcast",
+	  frame->whence.function, frame->destinations[i].sent_sequence,
+	  (int)(gettime_ms() - frame->destinations[i].transmit_time));
+	frame_remove_destination(frame, i);
+	continue;
+      }
+      if (ob_position(frame->payload) > (unsigned)dest->ifconfig.mtu){
+	WARNF("Skipping packet destination as size %zu > destination mtu %zd", 
+	ob_position(frame->payload), dest->ifconfig.mtu);
+	frame_remove_destination(frame, i);
+	continue;
+      }
+      // degrade packet version if required to reach the destination
+      if (frame->destinations[i].next_hop 
+	&& frame->packet_version > frame->destinations[i].next_hop->max_packet_version)
+	frame->packet_version = frame->destinations[i].next_hop->max_packet_version;
+      
+      if (frame->destinations[i].transmit_time && 
+	frame->destinations[i].transmit_time + frame->destinations[i].destination->resend_delay > now)
+	continue;
+      
+      if (packet->buffer){
+	if (frame->packet_version!=packet->packet_version)
 	  continue;
-	}
-	// degrade packet version if required to reach the destination
-	if (frame->destinations[i].next_hop 
-	  && frame->packet_version > frame->destinations[i].next_hop->max_packet_version)
-	  frame->packet_version = frame->destinations[i].next_hop->max_packet_version;
 	
-	if (frame->destinations[i].transmit_time && 
-	  frame->destinations[i].transmit_time + frame->destinations[i].destination->resend_delay > now)
+	// is this packet going our way?
+	if (dest==packet->destination){
+	  destination_index=i;
+	  break;
+	}
+      }else{
+	// skip this interface if the stream tx buffer has data
+	if (radio_link_is_busy(dest->interface))
 	  continue;
-	
-	if (packet->buffer){
-	  if (frame->packet_version!=packet->packet_version)
-	    continue;
 	  
-	  // is this packet going our way?
-	  if (dest==packet->destination){
-	    destination_index=i;
-	    break;
-	  }
-	}else{
-	  // skip this interface if the stream tx buffer has data
-	  if (radio_link_is_busy(dest->interface))
-	    continue;
-	    
-	  // can we send a packet to this destination now?
-	  if (limit_is_allowed(&dest->transfer_limit))
-	    continue;
-      
-	  // send a packet to this destination
-	  if (frame->source_full)
-	    get_my_subscriber(1)->send_full=1;
-	  if (overlay_init_packet(packet, frame->packet_version, dest) != -1) {
-	    if (debug){
-	      strbuf_sprintf(debug, "building packet %s %s %d [", 
-		packet->destination->interface->name, 
-		alloca_socket_address(&packet->destination->address),
-		packet->seq);
-	    }
-	    destination_index=i;
-	    frame->destinations[i].sent_sequence = dest->sequence_number;
-	    break;
+	// can we send a packet to this destination now?
+	if (limit_is_allowed(&dest->transfer_limit))
+	  continue;
+    
+	// send a packet to this destination
+	if (frame->source_full)
+	  get_my_subscriber(1)->send_full=1;
+	if (overlay_init_packet(packet, frame->packet_version, dest) != -1) {
+	  if (debug){
+	    strbuf_sprintf(debug, "building packet %s %s %d [", 
+	      packet->destination->interface->name, 
+	      alloca_socket_address(&packet->destination->address),
+	      packet->seq);
 	  }
+	  destination_index=i;
+	  frame->destinations[i].sent_sequence = dest->sequence_number;
+	  break;
 	}
       }
     }
-    
-    if (frame->destination_count==0){
-      frame = overlay_queue_remove(queue, frame);
-      continue;
-    }
-    
-    if (destination_index==-1)
-      goto skip;
-    
-    if (frame->send_hook){
-      // last minute check if we really want to send this frame, or track when we sent it
-      if (frame->send_hook(frame, packet->destination, packet->seq, frame->send_context)){
-        // drop packet
-        frame = overlay_queue_remove(queue, frame);
-        continue;
-      }
-    }
-    
-    if (frame->mdp_sequence == -1){
-      frame->mdp_sequence = mdp_sequence = (mdp_sequence+1)&0xFFFF;
+  }
+  
+  if (frame->destination_count==0){
+    overlay_queue_remove(queue, frame);
+    return 0;
+  }
+  
+  if (destination_index==-1)
+    return 1;
+  
+  if (frame->send_hook){
+    // last minute check if we really want to send this frame, or track when we sent it
+    if (frame->send_hook(frame, packet->destination, packet->seq, frame->send_context)){
+      // drop packet
+      overlay_queue_remove(queue, frame);
+      return 0;
     }
-    
-    char will_retransmit=1;
-    if (frame->packet_version<1 || frame->resend<=0 || packet->seq==-1)
-      will_retransmit=0;
-    
-    if (overlay_frame_append_payload(&packet->context, packet->destination->ifconfig.encapsulation, frame, 
-	frame->destinations[destination_index].next_hop, packet->buffer, will_retransmit)){
-      // payload was not queued, delay the next attempt slightly
-      frame->delay_until = now + 5;
-      goto skip;
+  }
+  
+  if (frame->mdp_sequence == -1){
+    frame->mdp_sequence = mdp_sequence = (mdp_sequence+1)&0xFFFF;
+  }
+  
+  char will_retransmit=1;
+  if (frame->packet_version<1 || frame->resend<=0 || packet->seq==-1)
+    will_retransmit=0;
+  
+  size_t frame_start = ob_position(packet->buffer);
+  if (overlay_frame_append_payload(&packet->context, packet->destination->ifconfig.encapsulation, frame, 
+      frame->destinations[destination_index].next_hop, packet->buffer, will_retransmit)){
+    // payload was not queued, delay the next attempt slightly
+    frame->delay_until = now + 5;
+    return 1;
+  }
+  if (frame->queue == OQ_MESH_MANAGEMENT)
+    overlay_interface_count_overhead(packet->destination->interface, ob_position(packet->buffer) - frame_start, now);
+  
+  if (frame->transmit_count==0)
+    queue->latency_histogram[histogram_bucket(now - frame->enqueued_at)]++;
+  frame->transmit_count++;
+  packet->frame_count++;
+  if (packet->held_since){
+    if (frame->enqueued_at > packet->held_since)
+      packet->frames_joined++;
+    else
+      packet->frames_waiting++;
+  }
+  
+  {
+    struct packet_destination *dest = &frame->destinations[destination_index];
+    dest->sent_sequence = dest->destination->sequence_number;
+    hold_remove(frame, dest);
+    dest->transmit_time = now;
+    hold_add(frame, dest);
+    if (debug)
+      strbuf_sprintf(debug, "%d(%s), ", frame->mdp_sequence, frame->whence.function);
+    DEBUGF(overlayframes, "Appended payload %p, %d type %x len %zd for %s via %s", 
+	   frame, frame->mdp_sequence,
+	   frame->type, ob_position(frame->payload),
+	   frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All",
+	   dest->next_hop?alloca_tohex_sid_t(dest->next_hop->sid):alloca_tohex(frame->broadcast_id.id, BROADCAST_LEN)
+	  );
+  }
+  
+  
+  // dont retransmit if we aren't sending sequence numbers, or we've been asked not to
+  if (!will_retransmit){
+    DEBUGF(overlayframes, "Not waiting for retransmission (%d, %d, %d)", frame->packet_version, frame->resend, packet->seq);
+    frame_remove_destination(frame, destination_index);
+    if (frame->destination_count==0){
+      overlay_queue_remove(queue, frame);
+      return 0;
     }
-    
-    frame->transmit_count++;
-    
-    {
-      struct packet_destination *dest = &frame->destinations[destination_index];
-      dest->sent_sequence = dest->destination->sequence_number;
-      dest->transmit_time = now;
-      if (debug)
-	strbuf_sprintf(debug, "%d(%s), ", frame->mdp_sequence, frame->whence.function);
-      DEBUGF(overlayframes, "Appended payload %p, %d type %x len %zd for %s via %s", 
-	     frame, frame->mdp_sequence,
-	     frame->type, ob_position(frame->payload),
-	     frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All",
-	     dest->next_hop?alloca_tohex_sid_t(dest->next_hop->sid):alloca_tohex(frame->broadcast_id.id, BROADCAST_LEN)
-	    );
+  }
+  return 1;
+}
+
+static void
+overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, time_ms_t now, strbuf debug){
+  struct overlay_frame *frame;
+  struct overlay_frame *requeue = NULL;
+  
+  // only look at frames that might be sent now, anything waiting for an ack or a rate limit is left alone
+  while(!packet->buffer && (frame = ready_pop(queue, now))){
+    if (overlay_stuff_frame(packet, queue, frame, now, debug)){
+      frame->ready_next = requeue;
+      requeue = frame;
     }
-    
-    
-    // dont retransmit if we aren't sending sequence numbers, or we've been asked not to
-    if (!will_retransmit){
-      DEBUGF(overlayframes, "Not waiting for retransmission (%d, %d, %d)", frame->packet_version, frame->resend, packet->seq);
-      frame_remove_destination(frame, destination_index);
-      if (frame->destination_count==0){
-	frame = overlay_queue_remove(queue, frame);
+  }
+  
+  // once a packet is open, only look at frames that are going the same way
+  if (packet->buffer && packet->destination->ifconfig.encapsulation!=ENCAP_SINGLE){
+    // take them out of the heap first, as sending a frame may remove its destinations from the list
+    struct overlay_frame *same_way = NULL;
+    struct overlay_frame **tail = &same_way;
+    struct packet_destination *pd;
+    for (pd = packet->destination->queued_first[queue - overlay_tx]; pd; pd = pd->_queued_next){
+      frame = pd->frame;
+      // skip frames that were popped above, or listed twice
+      if (!frame->ready_slot || frame->ready_at > now)
 	continue;
+      ready_remove(queue, frame);
+      frame->ready_next = NULL;
+      *tail = frame;
+      tail = &frame->ready_next;
+    }
+    while(same_way){
+      frame = same_way;
+      same_way = frame->ready_next;
+      if (overlay_stuff_frame(packet, queue, frame, now, debug)){
+	frame->ready_next = requeue;
+	requeue = frame;
       }
     }
-    
-  skip:
-    // if we can't send the payload now, check when we should try next
+  }
+  
+  // wake up when the next waiting frame becomes ready
+  if (queue->ready_count)
+    overlay_queue_schedule_next(queue->ready[0]->ready_at);
+  
+  // if we can't send these payloads now, check when we should try next
+  while(requeue){
+    frame = requeue;
+    requeue = frame->ready_next;
     overlay_calc_queue_time(frame);
-    frame = frame->next;
   }
 }
 
@@ -562,6 +990,13 @@ overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now, strbuf d
       strbuf_sprintf(debug, "]");
       _DEBUGF("%s", strbuf_str(debug));
     }
+    if (packet->frame_count){
+      aggregate_stats.packets++;
+      aggregate_stats.frames+=packet->frame_count;
+      // frames that were waiting and frames that arrived during the hold would otherwise have been sent separately
+      if (packet->frames_waiting && packet->frames_joined)
+        aggregate_stats.saved++;
+    }
 
     overlay_broadcast_ensemble(packet->destination, packet->buffer);
   }
@@ -573,11 +1008,24 @@ overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now, strbuf d
 // when the queue timer elapses, send a packet
 static void overlay_send_packet(struct sched_ent *UNUSED(alarm))
 {
+  time_ms_t now = gettime_ms();
+  time_ms_t hold_until = overlay_aggregate_hold(now);
+  if (hold_until){
+    // wait a little longer for more frames to share this packet
+    aggregate_stats.holds++;
+    if (!aggregate_stats.held_since)
+      aggregate_stats.held_since = now;
+    next_packet.alarm=0;
+    overlay_queue_schedule_next(hold_until);
+    return;
+  }
   struct outgoing_packet packet;
   bzero(&packet, sizeof(struct outgoing_packet));
   packet.seq=-1;
+  packet.held_since=aggregate_stats.held_since;
+  aggregate_stats.held_since=0;
   strbuf debug = IF_DEBUG(packets_sent) ? strbuf_alloca(256) : NULL;
-  overlay_fill_send_packet(&packet, gettime_ms(), debug);
+  overlay_fill_send_packet(&packet, now, debug);
 }
 
 int overlay_send_tick_packet(struct network_destination *destination)
@@ -670,3 +1118,40 @@ int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *
   }
   return 0;
 }
+
+static void histogram_html(struct strbuf *b, const char *name, const unsigned *histogram)
+{
+  strbuf_puts(b, name);
+  unsigned i;
+  for (i=0;i<QUEUE_HISTOGRAM_BUCKETS;i++){
+    if (!histogram[i])
+      continue;
+    if (i<2)
+      strbuf_sprintf(b, " %u: %u,", i, histogram[i]);
+    else if (i == QUEUE_HISTOGRAM_BUCKETS - 1)
+      strbuf_sprintf(b, " %u+: %u,", 1u<<(i-1), histogram[i]);
+    else
+      strbuf_sprintf(b, " %u-%u: %u,", 1u<<(i-1), (1u<<i)-1, histogram[i]);
+  }
+  strbuf_puts(b, "<br />");
+}
+
+void overlay_queue_status_html(struct strbuf *b)
+{
+  strbuf_sprintf(b, "Packets: %u, frames: %u, packets saved by aggregation: %u, held: %u<br />",
+    aggregate_stats.packets, aggregate_stats.frames,
+    aggregate_stats.saved, aggregate_stats.holds);
+  unsigned i;
+  for (i=0;i<OQ_MAX;i++){
+    overlay_txqueue *queue = &overlay_tx[i];
+    strbuf_sprintf(b, "<h3>%s</h3>Length: %d/%d, waiting: %u, expired: %u<br />",
+      queue_names[i], queue->length, queue->maxLength, queue->ready_count, queue->dropped);
+    histogram_html(b, "Depth on enqueue;", queue->depth_histogram);
+    histogram_html(b, "Latency to first send (ms);", queue->latency_histogram);
+  }
+  strbuf_puts(b, "<h3>Memory pools</h3>");
+  struct mem_pool *pool = NULL;
+  while((pool = pool_next(pool)))
+    strbuf_sprintf(b, "%s: in use %u, high water %u, cached %u, allocations %lu, reused %lu<br />",
+      pool->name, pool->live, pool->high_water, pool->free_count, pool->allocs, pool->reuses);
+}
@@ -0,0 +1,470 @@
+/*
+ Serval DNA - overlay network benchmarks
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <sodium.h>
+#include <time.h>
+#include "cli.h"
+#include "conf.h"
+#include "commandline.h"
+#include "serval.h"
+#include "mem.h"
+#include "debug.h"
+#include "str.h"
+#include "strbuf.h"
+#include "overlay_buffer.h"
+#include "overlay_packet.h"
+#include "overlay_address.h"
+#include "overlay_interface.h"
+#include "route_link.h"
+#include "keyring.h"
+#include "server.h"
+#include "test_cli.h"
+
+DEFINE_FEATURE(cli_overlay_tests);
+
+// receive a packet of frames, duplicate each one for forwarding, then pack them into an outgoing packet
+static int forward_packets(unsigned packets, unsigned frame_count, unsigned char *packet, size_t frame_len)
+{
+  struct overlay_frame *queued[frame_count];
+  unsigned p, i;
+  for (p = 0; p < packets; ++p){
+    struct overlay_buffer *b = ob_static(packet, frame_count * frame_len);
+    if (!b)
+      return -1;
+    ob_limitsize(b, frame_count * frame_len);
+    for (i = 0; i < frame_count; ++i){
+      struct overlay_frame f;
+      bzero(&f, sizeof f);
+      if ((f.payload = ob_slice(b, i * frame_len, frame_len)) == NULL)
+	return -1;
+      ob_limitsize(f.payload, frame_len);
+      queued[i] = op_dup(&f);
+      ob_free(f.payload);
+      if (!queued[i])
+	return -1;
+    }
+    ob_free(b);
+    struct overlay_buffer *out = ob_new();
+    if (!out)
+      return -1;
+    ob_limitsize(out, frame_count * (frame_len + 2));
+    for (i = 0; i < frame_count; ++i){
+      ob_append_ui16(out, ob_position(queued[i]->payload));
+      ob_append_bytes(out, ob_ptr(queued[i]->payload), ob_position(queued[i]->payload));
+      queued[i]->prev = queued[i]->next = NULL;
+      op_free(queued[i]);
+    }
+    ob_free(out);
+  }
+  return 0;
+}
+
+DEFINE_CMD(app_forward_test, 0,
+   "Measure the rate that received packets of <frames> frames can be copied for forwarding",
+   "test","forward","[<frames>]");
+static int app_forward_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *framesstr;
+  if (cli_arg(parsed, "frames", &framesstr, cli_uint, "8") == -1)
+    return -1;
+  unsigned frame_count = atoi(framesstr);
+  if (frame_count < 1 || frame_count > 64)
+    return WHY("Frame count must be between 1 and 64");
+  const size_t frame_len = 1000 / frame_count;
+  unsigned char packet[frame_count * frame_len];
+  unsigned i;
+  for (i = 0; i < sizeof packet; ++i)
+    packet[i] = random();
+
+  // first pass registers the pools
+  if (forward_packets(1, frame_count, packet, frame_len) == -1)
+    return -1;
+  const char *names[] = {"malloc", "pooled"};
+  unsigned limits[16];
+  unsigned run;
+  for (run = 0; run < NELS(names); ++run){
+    struct mem_pool *pool = NULL;
+    for (i = 0; (pool = pool_next(pool)) && i < NELS(limits); ++i){
+      if (run == 0){
+	limits[i] = pool->max_free;
+	pool->max_free = 0;
+	pool_trim(pool);
+      }else
+	pool->max_free = limits[i];
+    }
+    struct test_timer timer;
+    for (test_timer_start(&timer, 1000); test_timer_running(&timer); timer.count += 1000)
+      if (forward_packets(1000, frame_count, packet, frame_len) == -1)
+	return -1;
+    cli_printf(context, "%s: %u packets of %u frames in %"PRId64"ms, %.0f packets per second\n",
+      names[run], timer.count, frame_count, test_timer_elapsed_ms(&timer), test_timer_per_second(&timer));
+  }
+  struct mem_pool *pool = NULL;
+  while ((pool = pool_next(pool))){
+    cli_printf(context, "%s: in use %u, high water %u, allocations %lu, reused %lu\n",
+      pool->name, pool->live, pool->high_water, pool->allocs, pool->reuses);
+    if (pool->live)
+      return WHYF("Leaked %u objects from %s", pool->live, pool->name);
+  }
+  return 0;
+}
+
+// parse every address in the stream, returning the number that resolved
+static int parse_addresses(unsigned char *stream, size_t len, unsigned *resolved)
+{
+  struct overlay_buffer *b = ob_static(stream, len);
+  if (!b)
+    return -1;
+  ob_limitsize(b, len);
+  struct decode_context context;
+  bzero(&context, sizeof context);
+  context.flags = DECODE_FLAG_DONT_EXPLAIN;
+  while (ob_remaining(b) > 0){
+    struct subscriber *subscriber = NULL;
+    if (overlay_address_parse(&context, b, &subscriber) == -1){
+      ob_free(b);
+      return -1;
+    }
+    if (subscriber)
+      (*resolved)++;
+  }
+  ob_free(b);
+  return 0;
+}
+
+DEFINE_CMD(app_subscriber_test, 0,
+   "Measure the rate that addresses of <count> known subscribers can be parsed",
+   "test","subscribers","[<count>]");
+static int app_subscriber_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *countstr;
+  if (cli_arg(parsed, "count", &countstr, cli_uint, "5000") == -1)
+    return -1;
+  unsigned count = atoi(countstr);
+  if (count < 1 || count > 1000000)
+    return WHY("Subscriber count must be between 1 and 1000000");
+  struct subscriber **subscribers = (struct subscriber **) emalloc(count * sizeof *subscribers);
+  unsigned char *stream = (unsigned char *) emalloc(count * (SID_SIZE + 1));
+  if (!subscribers || !stream){
+    free(subscribers);
+    free(stream);
+    return -1;
+  }
+  unsigned i;
+  for (i = 0; i < count; ++i){
+    sid_t sid;
+    randombytes_buf(sid.binary, sizeof sid.binary);
+    if ((subscribers[i] = find_subscriber(sid.binary, SID_SIZE, 1)) == NULL){
+      free(subscribers);
+      free(stream);
+      return -1;
+    }
+  }
+
+  // full SIDs are resolved from the hash index, abbreviations by walking the tree
+  const char *names[] = {"full", "abbreviated"};
+  unsigned run;
+  int ret = 0;
+  for (run = 0; run < NELS(names) && ret == 0; ++run){
+    size_t len = 0;
+    for (i = 0; i < count; ++i){
+      struct subscriber *s = subscribers[(i * 7919UL) % count];
+      unsigned abbrev = run == 0 ? SID_SIZE : (s->tree_depth >> 3) + 1;
+      stream[len++] = abbrev;
+      memcpy(&stream[len], s->sid.binary, abbrev);
+      len += abbrev;
+    }
+    unsigned resolved = 0;
+    struct test_timer timer;
+    for (test_timer_start(&timer, 1000); test_timer_running(&timer); timer.count += count){
+      if (parse_addresses(stream, len, &resolved) == -1){
+	test_timer_stop(&timer);
+	ret = -1;
+	break;
+      }
+    }
+    cli_printf(context, "%s: %u addresses of %u subscribers in %"PRId64"ms, %.0f addresses per second\n",
+      names[run], timer.count, count, test_timer_elapsed_ms(&timer), test_timer_per_second(&timer));
+    if (ret == 0 && resolved != timer.count)
+      ret = WHYF("Only resolved %u of %u addresses", resolved, timer.count);
+  }
+  free(subscribers);
+  free(stream);
+  free_subscribers();
+  return ret;
+}
+
+#define ROUTE_TEST_NEIGHBOURS 6
+#define ROUTE_TEST_DEGREE 8
+
+struct route_test {
+  unsigned count;
+  struct subscriber *me;
+  struct subscriber **nodes;
+  unsigned (*adjacent)[ROUTE_TEST_DEGREE];
+  unsigned *degree;
+  unsigned neighbour[ROUTE_TEST_NEIGHBOURS];
+  // each neighbour's shortest path tree, as the parent and depth of every node, and the version of each link
+  int *parent[ROUTE_TEST_NEIGHBOURS];
+  unsigned *depth[ROUTE_TEST_NEIGHBOURS];
+  uint8_t *version[ROUTE_TEST_NEIGHBOURS];
+};
+
+static void route_test_connect(struct route_test *t, unsigned a, unsigned b)
+{
+  unsigned i;
+  if (a == b || t->degree[a] >= ROUTE_TEST_DEGREE || t->degree[b] >= ROUTE_TEST_DEGREE)
+    return;
+  for (i = 0; i < t->degree[a]; ++i)
+    if (t->adjacent[a][i] == b)
+      return;
+  t->adjacent[a][t->degree[a]++] = b;
+  t->adjacent[b][t->degree[b]++] = a;
+}
+
+// breadth first search from neighbour n, as if it were routing without us
+static void route_test_tree(struct route_test *t, unsigned n, unsigned *queue)
+{
+  unsigned head = 0, tail = 0, i;
+  for (i = 0; i < t->count; ++i)
+    t->parent[n][i] = -2;
+  t->parent[n][t->neighbour[n]] = -1;
+  t->depth[n][t->neighbour[n]] = 1;
+  queue[tail++] = t->neighbour[n];
+  while (head < tail){
+    unsigned v = queue[head++];
+    for (i = 0; i < t->degree[v]; ++i){
+      unsigned u = t->adjacent[v][i];
+      if (t->parent[n][u] == -2){
+	t->parent[n][u] = v;
+	t->depth[n][u] = t->depth[n][v] + 1;
+	queue[tail++] = u;
+      }
+    }
+  }
+}
+
+// append a link state record, in the format that route_link.c sends
+static void route_test_append(struct route_test *t, struct overlay_buffer *b, unsigned n, unsigned v)
+{
+  size_t start = ob_position(b);
+  ob_append_byte(b, 0);
+  int parent = t->parent[n][v];
+  if (parent == -1)
+    ob_append_byte(b, 1 /* FLAG_HAS_INTERFACE */);
+  else if (parent == -2)
+    ob_append_byte(b, 2 /* FLAG_NO_PATH */);
+  else
+    ob_append_byte(b, 0);
+  ob_append_byte(b, SID_SIZE);
+  ob_append_bytes(b, t->nodes[v]->sid.binary, SID_SIZE);
+  ob_append_byte(b, t->version[n][v]);
+  if (parent != -2){
+    struct subscriber *transmitter = parent == -1 ? t->me : t->nodes[parent];
+    ob_append_byte(b, SID_SIZE);
+    ob_append_bytes(b, transmitter->sid.binary, SID_SIZE);
+  }
+  if (parent == -1)
+    ob_append_byte(b, 0);
+  ob_set(b, start, ob_position(b) - start);
+}
+
+static int route_test_send(struct route_test *t, unsigned n, unsigned *records, unsigned record_count)
+{
+  struct internal_binding *binding;
+  for (binding = SECTION_START(bindings); binding < SECTION_END(bindings); ++binding)
+    if (binding->port == MDP_PORT_LINKSTATE)
+      break;
+  if (binding >= SECTION_END(bindings))
+    return WHY("No link state binding");
+  struct overlay_buffer *b = ob_new();
+  if (!b)
+    return -1;
+  unsigned i;
+  for (i = 0; i < record_count; ++i)
+    route_test_append(t, b, n, records[i]);
+  if (ob_overrun(b)){
+    ob_free(b);
+    return WHY("Link state overrun");
+  }
+  ob_flip(b);
+  struct internal_mdp_header header;
+  bzero(&header, sizeof header);
+  header.source = t->nodes[t->neighbour[n]];
+  header.destination_port = MDP_PORT_LINKSTATE;
+  header.receive_interface = &overlay_interfaces[0];
+  binding->function(&header, b);
+  ob_free(b);
+  return 0;
+}
+
+DEFINE_CMD(app_route_test, 0,
+   "Measure incremental route recalculation over a random topology of <nodes> nodes",
+   "test","routing","[<nodes>]","[<changes>]");
+static int app_route_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *nodestr, *changestr;
+  if (cli_arg(parsed, "nodes", &nodestr, cli_uint, "500") == -1
+    || cli_arg(parsed, "changes", &changestr, cli_uint, "1000") == -1)
+    return -1;
+  struct route_test t;
+  bzero(&t, sizeof t);
+  t.count = atoi(nodestr);
+  unsigned changes = atoi(changestr);
+  if (t.count < ROUTE_TEST_NEIGHBOURS * 2 || t.count > 100000)
+    return WHYF("Node count must be between %u and 100000", ROUTE_TEST_NEIGHBOURS * 2);
+
+  // route_link needs a running server's identity and an interface to hear neighbours on
+  serverMode = SERVER_RUNNING;
+  if (!keyring && !(keyring = keyring_create_instance()))
+    return WHY("Cannot open keyring");
+  if (!(t.me = get_my_subscriber(1)))
+    return WHY("No identity");
+  overlay_interface *interface = &overlay_interfaces[0];
+  strbuf_sprintf(strbuf_local_buf(interface->name), "routetest");
+  interface->state = INTERFACE_STATE_UP;
+  if (!(interface->destination = new_destination(interface)))
+    return -1;
+  interface->destination->ifconfig.reachable_timeout_ms = 3600000;
+  interface->destination->ifconfig.route = 1;
+
+  int ret = -1;
+  unsigned *queue = NULL;
+  unsigned i, n;
+  t.nodes = (struct subscriber **) emalloc(t.count * sizeof *t.nodes);
+  t.adjacent = emalloc_zero(t.count * sizeof *t.adjacent);
+  t.degree = emalloc_zero(t.count * sizeof *t.degree);
+  queue = emalloc(t.count * sizeof *queue);
+  if (!t.nodes || !t.adjacent || !t.degree || !queue)
+    goto end;
+  for (n = 0; n < ROUTE_TEST_NEIGHBOURS; ++n){
+    if ((t.parent[n] = emalloc(t.count * sizeof *t.parent[n])) == NULL
+      || (t.depth[n] = emalloc_zero(t.count * sizeof *t.depth[n])) == NULL
+      || (t.version[n] = emalloc_zero(t.count)) == NULL)
+      goto end;
+  }
+  for (i = 0; i < t.count; ++i){
+    sid_t sid;
+    randombytes_buf(sid.binary, sizeof sid.binary);
+    if ((t.nodes[i] = find_subscriber(sid.binary, SID_SIZE, 1)) == NULL)
+      goto end;
+    // don't ask newly reachable nodes for their signing keys
+    t.nodes[i]->id_valid = 1;
+  }
+
+  // a connected random mesh, every node joins a random earlier node, then add a few more random links
+  for (i = 1; i < t.count; ++i)
+    route_test_connect(&t, i, randombytes_uniform(i));
+  for (i = 0; i < t.count; ++i)
+    route_test_connect(&t, i, randombytes_uniform(t.count));
+  for (n = 0; n < ROUTE_TEST_NEIGHBOURS; ++n){
+    t.neighbour[n] = n * (t.count / ROUTE_TEST_NEIGHBOURS);
+    route_test_tree(&t, n, queue);
+  }
+
+  clock_t start = clock();
+  for (n = 0; n < ROUTE_TEST_NEIGHBOURS; ++n){
+    unsigned count = 0;
+    for (i = 0; i < t.count; ++i)
+      if (t.parent[n][i] != -2)
+	queue[count++] = i;
+    if (route_test_send(&t, n, queue, count) == -1)
+      goto end;
+  }
+  unsigned initial = link_update_routes(0);
+  clock_t end = clock();
+  unsigned reachable = 0;
+  for (i = 0; i < t.count; ++i)
+    if (t.nodes[i]->reachable & REACHABLE)
+      reachable++;
+  cli_printf(context, "initial: %u of %u nodes reachable, %u routes calculated in %.2fms\n",
+    reachable, t.count, initial, (end - start) * 1000.0 / CLOCKS_PER_SEC);
+
+  // move one node in one neighbour's tree at a time, as if a single link had changed
+  struct subscriber **next_hops = emalloc(t.count * sizeof *next_hops);
+  if (!next_hops)
+    goto end;
+  clock_t incremental_time = 0, full_time = 0;
+  unsigned long incremental_routes = 0, full_routes = 0;
+  unsigned c, mismatched = 0;
+  for (c = 0; c < changes; ++c){
+    n = randombytes_uniform(ROUTE_TEST_NEIGHBOURS);
+    unsigned v = randombytes_uniform(t.count);
+    if (v == t.neighbour[n])
+      continue;
+    int parent = -2;
+    unsigned options = 0;
+    for (i = 0; i < t.degree[v]; ++i){
+      unsigned u = t.adjacent[v][i];
+      // never choose one of its own descendants
+      if (t.parent[n][u] != -2 && t.depth[n][u] <= t.depth[n][v] && (int)u != t.parent[n][v]
+	&& randombytes_uniform(++options) == 0)
+	parent = u;
+    }
+    t.parent[n][v] = parent;
+    if (parent >= 0)
+      t.depth[n][v] = t.depth[n][parent] + 1;
+    t.version[n][v]++;
+
+    start = clock();
+    if (route_test_send(&t, n, &v, 1) == -1){
+      free(next_hops);
+      goto end;
+    }
+    incremental_routes += link_update_routes(0);
+    end = clock();
+    incremental_time += end - start;
+
+    for (i = 0; i < t.count; ++i)
+      next_hops[i] = t.nodes[i]->next_hop;
+    start = clock();
+    full_routes += link_update_routes(1);
+    end = clock();
+    full_time += end - start;
+    for (i = 0; i < t.count; ++i)
+      if (next_hops[i] != t.nodes[i]->next_hop)
+	mismatched++;
+  }
+  free(next_hops);
+  cli_printf(context, "incremental: %.1f routes, %.3fms per change\n",
+    (double) incremental_routes / changes, incremental_time * 1000.0 / CLOCKS_PER_SEC / changes);
+  cli_printf(context, "full: %.1f routes, %.3fms per change\n",
+    (double) full_routes / changes, full_time * 1000.0 / CLOCKS_PER_SEC / changes);
+  if (mismatched)
+    ret = WHYF("%u next hops differ from a full recalculation", mismatched);
+  else
+    ret = 0;
+end:
+  // losing the interface drops every neighbour and frees the routing table
+  interface->state = INTERFACE_STATE_DOWN;
+  CALL_TRIGGER(iupdown, interface, 0);
+  release_destination_ref(interface->destination);
+  interface->destination = NULL;
+  release_my_subscriber();
+  serverMode = SERVER_NOT_RUNNING;
+  for (n = 0; n < ROUTE_TEST_NEIGHBOURS; ++n){
+    free(t.parent[n]);
+    free(t.depth[n]);
+    free(t.version[n]);
+  }
+  free(t.nodes);
+  free(t.adjacent);
+  free(t.degree);
+  free(queue);
+  return ret;
+}
@@ -508,6 +508,7 @@ void rhizome_authenticate_author(rhizome_manifest *m);
 struct rhizome_bundle_result rhizome_manifest_finalise(rhizome_manifest *m, rhizome_manifest **m_out, int deduplicate);
 enum rhizome_bundle_status rhizome_manifest_check_stored(rhizome_manifest *m, rhizome_manifest **m_out);
 enum rhizome_bundle_status rhizome_add_manifest_to_store(rhizome_manifest *m_in, rhizome_manifest **m_out);
+enum rhizome_bundle_status rhizome_add_manifest_to_batch(rhizome_manifest *m);
 
 void rhizome_bytes_to_hex_upper(unsigned const char *in, char *out, int byteCount);
 int rhizome_find_privatekey(rhizome_manifest *m);
@@ -554,12 +555,16 @@ enum sqlbind_type {
 };
 
 sqlite3_stmt *_sqlite_prepare(struct __sourceloc, int log_level, sqlite_retry_state *retry, const char *sqltext);
+void sqlite_finalize(sqlite3_stmt *statement);
 int _sqlite_bind(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, ...);
 int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, va_list ap);
 sqlite3_stmt *_sqlite_prepare_bind(struct __sourceloc, int log_level, sqlite_retry_state *retry, const char *sqltext, ...);
 int _sqlite_retry(struct __sourceloc, sqlite_retry_state *retry, const char *action);
 void _sqlite_retry_done(struct __sourceloc, sqlite_retry_state *retry, const char *action);
 int _sqlite_step(struct __sourceloc, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement);
+// read a binary SID or Bundle ID column, returns -1 if it is NULL or malformed
+int sqlite_column_sid(sqlite3_stmt *statement, int column, sid_t *sidp);
+int sqlite_column_bid(sqlite3_stmt *statement, int column, rhizome_bid_t *bidp);
 int _sqlite_exec_code(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, int *rowcount);
 int _sqlite_exec(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement);
 int _sqlite_exec_void(struct __sourceloc, int log_level, const char *sqltext, ...);
@@ -626,6 +631,23 @@ int _sqlite_blob_close(struct __sourceloc, int log_level, sqlite3_blob *blob);
 
 double rhizome_manifest_get_double(rhizome_manifest *m,char *var,double default_value);
 int rhizome_manifest_extract_signature(rhizome_manifest *m, unsigned *ofs);
+
+/* Verify the self-signature of a manifest on a worker thread, so that a later call to
+ * rhizome_manifest_verify() finds the result in the signature cache.  Returns 1 if the
+ * manifest was queued, 0 if it will be verified when needed, -1 on error.
+ */
+int rhizome_manifest_queue_verify(const rhizome_manifest *m);
+// wait for every queued signature to be verified
+void rhizome_verify_wait();
+
+struct rhizome_signature_cache_stats{
+  unsigned hits;
+  unsigned misses;
+  unsigned evictions;
+  unsigned batched;
+};
+void rhizome_signature_cache_stats(struct rhizome_signature_cache_stats *stats);
+void rhizome_signature_cache_flush();
 enum rhizome_bundle_status rhizome_find_duplicate(const rhizome_manifest *m, rhizome_manifest **found);
 int rhizome_manifest_to_bar(rhizome_manifest *m, rhizome_bar_t *bar);
 enum rhizome_bundle_status rhizome_is_bar_interesting(const rhizome_bar_t *bar);
@@ -704,6 +726,8 @@ struct rhizome_write
   uint64_t file_length;
   struct rhizome_write_buffer *buffer_list;
   size_t buffer_size;
+  // in order data being hashed, encrypted and written by a worker thread
+  struct rhizome_store_job *job;
   
   struct crypto_hash_sha512_state sha512_context;
   uint64_t blob_rowid;
@@ -732,6 +756,8 @@ struct rhizome_read
   
   uint64_t blob_rowid;
   int blob_fd;
+  // external blob mapped into memory, shared with other readers, see rhizome_read_map()
+  struct rhizome_blob_map *blob_map;
   
   uint64_t tail;
   uint64_t offset;
@@ -875,6 +901,7 @@ int rhizome_fetch_has_queue_space(unsigned char log2_size);
 /* Rhizome storage methods */
 
 enum rhizome_payload_status rhizome_exists(const rhizome_filehash_t *hashp);
+int rhizome_delete_external(const rhizome_filehash_t *id);
 enum rhizome_payload_status rhizome_open_write(struct rhizome_write *write, const rhizome_filehash_t *expectedHashp, uint64_t file_length);
 int rhizome_write_buffer(struct rhizome_write *write_state, uint8_t *buffer, size_t data_size);
 int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, uint8_t *buffer, size_t data_size);
@@ -899,6 +926,8 @@ int rhizome_crypt_xor_block(unsigned char *buffer, size_t buffer_size, uint64_t
 			    const unsigned char *key, const unsigned char *nonce);
 enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const rhizome_filehash_t *hashp);
 ssize_t rhizome_read(struct rhizome_read *read, unsigned char *buffer, size_t buffer_length);
+int rhizome_read_map(struct rhizome_read *read);
+int rhizome_read_verify(struct rhizome_read *read);
 ssize_t rhizome_read_buffered(struct rhizome_read *read, struct rhizome_read_buffer *buffer, unsigned char *data, size_t len);
 void rhizome_read_close(struct rhizome_read *read);
 enum rhizome_payload_status rhizome_open_decrypt_read(rhizome_manifest *m, struct rhizome_read *read_state);
@@ -907,16 +936,28 @@ enum rhizome_payload_status rhizome_dump_file(const rhizome_filehash_t *hashp, c
 ssize_t rhizome_read_cached(const rhizome_bid_t *bid, uint64_t version, time_ms_t timeout, 
                             uint64_t fileOffset, unsigned char *buffer, size_t length);
 int rhizome_cache_close();
+int rhizome_cache_status_html(struct strbuf *b);
 
 int rhizome_database_filehash_from_id(const rhizome_bid_t *bidp, uint64_t version, rhizome_filehash_t *hashp);
 
 void rhizome_process_added_bundles(uint64_t up_to_rowid);
+int rhizome_db_begin(sqlite_retry_state *retry);
+int rhizome_db_commit(sqlite_retry_state *retry);
+void rhizome_db_rollback(sqlite_retry_state *retry);
+int rhizome_batch_begin();
+void rhizome_batch_end();
+void rhizome_batch_add_blob(const rhizome_filehash_t *id);
+int rhizome_batch_commit();
 void rhizome_sync_status();
+struct sync_state;
+int rhizome_sync_keys_load(struct sync_state *tree, uint64_t *rowid, unsigned limit);
 
 DECLARE_ALARM(rhizome_fetch_status);
 
 /* Rhizome triggers */
 
 DECLARE_TRIGGER(bundle_add, rhizome_manifest*);
+// a batch of received bundles could not be committed, so they must be fetched again
+DECLARE_TRIGGER(batch_rollback);
 
 #endif //__SERVAL_DNA__RHIZOME_H
@@ -30,6 +30,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "keyring.h"
 #include "dataformats.h"
 #include "debug.h"
+#include "worker.h"
 
 int rhizome_manifest_createid(rhizome_manifest *m)
 {
@@ -401,19 +402,28 @@ int rhizome_apply_bundle_secret(rhizome_manifest *m, const rhizome_bk_t *bsk)
   OUT();
 }
 
+#define SIGNATURE_BLOCK_BYTES (crypto_sign_BYTES + crypto_sign_PUBLICKEYBYTES)
+
+/* Results of recent signature verifications, so that a manifest heard from many peers (or
+ * parsed many times) only pays for one Ed25519 verification.  The cache is 4-way set
+ * associative, with the least recently used entry of a set being replaced.
+ */
 typedef struct manifest_signature_block_cache {
   unsigned char manifest_hash[crypto_hash_sha512_BYTES];
-  unsigned char signature_bytes[256];
+  unsigned char signature_bytes[SIGNATURE_BLOCK_BYTES];
   size_t signature_length;
   int signature_valid;
+  unsigned last_used;
 } manifest_signature_block_cache;
 
-#define SIG_CACHE_SIZE 1024
-manifest_signature_block_cache sig_cache[SIG_CACHE_SIZE];
+#define SIG_CACHE_WAYS 4
+#define SIG_CACHE_SETS 512
+static manifest_signature_block_cache sig_cache[SIG_CACHE_SETS][SIG_CACHE_WAYS];
+static unsigned sig_cache_clock = 0;
+static struct rhizome_signature_cache_stats sig_cache_stats;
 
-static int rhizome_manifest_lookup_signature_validity(const unsigned char *hash, const unsigned char *sig, size_t sig_len)
+static unsigned sig_cache_set(const unsigned char *hash, const unsigned char *sig, size_t sig_len)
 {
-  IN();
   unsigned slot=0;
   unsigned i;
 
@@ -425,20 +435,235 @@ static int rhizome_manifest_lookup_signature_validity(const unsigned char *hash,
     slot=(slot<<1)+(slot&0x80000000?1:0);
     slot+=sig[i];
   }
-  slot%=SIG_CACHE_SIZE;
-
-  if (sig_cache[slot].signature_length!=sig_len || 
-      memcmp(hash, sig_cache[slot].manifest_hash, crypto_hash_sha512_BYTES) ||
-      memcmp(sig, sig_cache[slot].signature_bytes, sig_len)){
-    bcopy(hash, sig_cache[slot].manifest_hash, crypto_hash_sha512_BYTES);
-    bcopy(sig, sig_cache[slot].signature_bytes, sig_len);
-    sig_cache[slot].signature_length=sig_len;
-
-    sig_cache[slot].signature_valid=
-      crypto_sign_verify_detached(sig, hash, crypto_hash_sha512_BYTES, &sig[crypto_sign_BYTES])
-      ? -1 : 0;
+  return slot % SIG_CACHE_SETS;
+}
+
+static manifest_signature_block_cache *sig_cache_find(const unsigned char *hash, const unsigned char *sig, size_t sig_len)
+{
+  manifest_signature_block_cache *set = sig_cache[sig_cache_set(hash, sig, sig_len)];
+  unsigned i;
+  for (i=0;i<SIG_CACHE_WAYS;i++){
+    if (set[i].signature_length==sig_len
+      && memcmp(hash, set[i].manifest_hash, crypto_hash_sha512_BYTES)==0
+      && memcmp(sig, set[i].signature_bytes, sig_len)==0){
+      set[i].last_used = ++sig_cache_clock;
+      return &set[i];
+    }
+  }
+  return NULL;
+}
+
+static void sig_cache_store(const unsigned char *hash, const unsigned char *sig, size_t sig_len, int valid)
+{
+  assert(sig_len <= SIGNATURE_BLOCK_BYTES);
+  manifest_signature_block_cache *set = sig_cache[sig_cache_set(hash, sig, sig_len)];
+  manifest_signature_block_cache *victim = &set[0];
+  unsigned i;
+  for (i=0;i<SIG_CACHE_WAYS;i++){
+    if (set[i].signature_length==0){
+      victim = &set[i];
+      break;
+    }
+    if (set[i].last_used < victim->last_used)
+      victim = &set[i];
+  }
+  if (victim->signature_length)
+    sig_cache_stats.evictions++;
+  bcopy(hash, victim->manifest_hash, crypto_hash_sha512_BYTES);
+  bcopy(sig, victim->signature_bytes, sig_len);
+  victim->signature_length=sig_len;
+  victim->signature_valid=valid;
+  victim->last_used = ++sig_cache_clock;
+}
+
+void rhizome_signature_cache_stats(struct rhizome_signature_cache_stats *stats)
+{
+  *stats = sig_cache_stats;
+}
+
+void rhizome_signature_cache_flush()
+{
+  bzero(sig_cache, sizeof sig_cache);
+  bzero(&sig_cache_stats, sizeof sig_cache_stats);
+}
+
+/* Manifests that arrive in bulk (eg, during Rhizome sync) are queued with
+ * rhizome_manifest_queue_verify(), and verified a batch at a time on a worker thread.
+ * Each queued item is a private copy of the manifest body and self-signature, so the
+ * caller is free to release the manifest at any time.  Completed batches only fill the
+ * signature cache, rhizome_manifest_verify() still makes every decision on the main thread.
+ */
+#define VERIFY_BATCH_SIZE 64
+
+struct verify_item{
+  unsigned char *body;
+  size_t body_len;
+  unsigned char signature[SIGNATURE_BLOCK_BYTES];
+  unsigned char hash[crypto_hash_sha512_BYTES];
+  int valid;
+};
+
+struct verify_batch{
+  struct work_item item;
+  struct verify_batch *_next;
+  unsigned count;
+  struct verify_item items[VERIFY_BATCH_SIZE];
+};
+
+// the batch being filled, and batches that have been handed to worker threads
+static struct verify_batch *verify_filling = NULL;
+static struct verify_batch *verify_submitted = NULL;
+
+DEFINE_ALARM(rhizome_verify_flush);
+
+// called on a worker thread, no logging
+static void verify_batch_work(struct work_item *work)
+{
+  struct verify_batch *batch = (struct verify_batch *)work;
+  unsigned i;
+  for (i=0;i<batch->count;i++){
+    struct verify_item *v = &batch->items[i];
+    crypto_hash_sha512(v->hash, v->body, v->body_len);
+    v->valid = crypto_sign_verify_detached(v->signature, v->hash, crypto_hash_sha512_BYTES,
+      &v->signature[crypto_sign_BYTES]) ? -1 : 0;
+  }
+}
+
+static void verify_batch_completed(struct work_item *work)
+{
+  struct verify_batch *batch = (struct verify_batch *)work;
+  struct verify_batch **ptr = &verify_submitted;
+  while(*ptr != batch){
+    assert(*ptr);
+    ptr = &(*ptr)->_next;
+  }
+  *ptr = batch->_next;
+
+  unsigned i, failed=0;
+  for (i=0;i<batch->count;i++){
+    struct verify_item *v = &batch->items[i];
+    if (!sig_cache_find(v->hash, v->signature, sizeof v->signature))
+      sig_cache_store(v->hash, v->signature, sizeof v->signature, v->valid);
+    if (v->valid)
+      failed++;
+    free(v->body);
+  }
+  sig_cache_stats.batched += batch->count;
+  DEBUGF(rhizome, "Verified a batch of %u manifest signatures, %u failed, cache hits %u, misses %u",
+    batch->count, failed, sig_cache_stats.hits, sig_cache_stats.misses);
+  free(batch);
+}
+
+static void verify_batch_submit()
+{
+  struct verify_batch *batch = verify_filling;
+  if (!batch)
+    return;
+  verify_filling = NULL;
+  batch->_next = verify_submitted;
+  verify_submitted = batch;
+  if (worker_submit(&batch->item) == -1){
+    verify_batch_work(&batch->item);
+    verify_batch_completed(&batch->item);
+  }
+}
+
+void rhizome_verify_flush(struct sched_ent *UNUSED(alarm))
+{
+  verify_batch_submit();
+}
+
+int rhizome_manifest_queue_verify(const rhizome_manifest *m)
+{
+  if (worker_threads() == 0)
+    return 0;
+  size_t body_len = m->manifest_body_bytes;
+  // only the self-signature is queued, it must immediately follow the body
+  if (body_len == 0
+    || m->manifest_all_bytes < body_len + 1 + SIGNATURE_BLOCK_BYTES
+    || m->manifestdata[body_len] != 0x17)
+    return 0;
+  const unsigned char *sig = &m->manifestdata[body_len + 1];
+
+  if (!verify_filling){
+    if ((verify_filling = emalloc(sizeof(struct verify_batch))) == NULL)
+      return -1;
+    bzero(&verify_filling->item, sizeof verify_filling->item);
+    verify_filling->item.work = verify_batch_work;
+    verify_filling->item.completed = verify_batch_completed;
+    verify_filling->count = 0;
+  }
+  struct verify_item *v = &verify_filling->items[verify_filling->count];
+  if ((v->body = emalloc(body_len)) == NULL)
+    return -1;
+  bcopy(m->manifestdata, v->body, body_len);
+  v->body_len = body_len;
+  bcopy(sig, v->signature, sizeof v->signature);
+  verify_filling->count++;
+
+  if (verify_filling->count >= VERIFY_BATCH_SIZE){
+    verify_batch_submit();
+  }else if (!is_scheduled(&ALARM_STRUCT(rhizome_verify_flush))){
+    // give the rest of a burst a moment to arrive
+    time_ms_t now = gettime_ms();
+    RESCHEDULE(&ALARM_STRUCT(rhizome_verify_flush), now + 5, now + 5, now + 20);
+  }
+  return 1;
+}
+
+void rhizome_verify_wait()
+{
+  if (is_scheduled(&ALARM_STRUCT(rhizome_verify_flush)))
+    unschedule(&ALARM_STRUCT(rhizome_verify_flush));
+  verify_batch_submit();
+  while(verify_submitted)
+    worker_wait(&verify_submitted->item);
+}
+
+// if this signature has been queued, wait for the result instead of verifying it twice
+static void verify_wait_for(const unsigned char *sig, size_t sig_len)
+{
+  if (sig_len != SIGNATURE_BLOCK_BYTES)
+    return;
+  unsigned i;
+  if (verify_filling){
+    for (i=0;i<verify_filling->count;i++){
+      if (memcmp(verify_filling->items[i].signature, sig, sig_len)==0){
+	rhizome_verify_flush(NULL);
+	break;
+      }
+    }
+  }
+  struct verify_batch *batch = verify_submitted;
+  while(batch){
+    struct verify_batch *next = batch->_next;
+    for (i=0;i<batch->count;i++){
+      if (memcmp(batch->items[i].signature, sig, sig_len)==0){
+	worker_wait(&batch->item);
+	break;
+      }
+    }
+    batch = next;
+  }
+}
+
+static int rhizome_manifest_lookup_signature_validity(const unsigned char *hash, const unsigned char *sig, size_t sig_len)
+{
+  IN();
+  manifest_signature_block_cache *entry = sig_cache_find(hash, sig, sig_len);
+  if (!entry && (verify_filling || verify_submitted)){
+    verify_wait_for(sig, sig_len);
+    entry = sig_cache_find(hash, sig, sig_len);
+  }
+  if (entry){
+    sig_cache_stats.hits++;
+    RETURN(entry->signature_valid);
   }
-  RETURN(sig_cache[slot].signature_valid);
+  sig_cache_stats.misses++;
+  int valid = crypto_sign_verify_detached(sig, hash, crypto_hash_sha512_BYTES, &sig[crypto_sign_BYTES])
+    ? -1 : 0;
+  sig_cache_store(hash, sig, sig_len, valid);
+  RETURN(valid);
   OUT();
 }
 
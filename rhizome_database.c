@@ -36,7 +36,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "mdp_client.h"
 #include "debug.h"
 
+// Bundle IDs and SIDs are stored as binary, format them for log messages
+#define alloca_column_hex(S,C) alloca_tohex(sqlite3_column_blob((S),(C)), sqlite3_column_bytes((S),(C)))
+
 static int rhizome_delete_manifest_retry(sqlite_retry_state *retry, const rhizome_bid_t *bidp);
+static void statement_cache_clear();
 
 __thread struct rhizome_database rhizome_database = {
     .dir_path = "",
@@ -133,6 +137,177 @@ void sqlite_log(void *UNUSED(ignored), int result, const char *msg)
   WARNF("Sqlite: %d %s", result, msg);
 }
 
+#define MANIFESTS_COLUMNS \
+  "id blob not null primary key, " \
+  "version integer, " \
+  "inserttime integer, " \
+  "filesize integer, " \
+  "filehash text, " \
+  "author blob, " \
+  "bar blob, " \
+  "manifest blob, " \
+  "service text, " \
+  "name text, " \
+  "sender blob, " \
+  "recipient blob, " \
+  "tail integer, " \
+  "manifest_hash text collate nocase"
+
+// binary_key(X) converts a hex SID or Bundle ID to binary, binary values are unchanged
+static void sql_binary_key(sqlite3_context *context, int UNUSED(argc), sqlite3_value **argv)
+{
+  switch (sqlite3_value_type(argv[0])){
+    case SQLITE_BLOB:
+      if (sqlite3_value_bytes(argv[0]) == SID_SIZE){
+	sqlite3_result_value(context, argv[0]);
+	return;
+      }
+      break;
+    case SQLITE_TEXT:{
+      unsigned char binary[SID_SIZE];
+      const char *hex = (const char *)sqlite3_value_text(argv[0]);
+      if (sqlite3_value_bytes(argv[0]) == SID_SIZE * 2 && fromhexstr(binary, sizeof binary, hex) == 0){
+	sqlite3_result_blob(context, binary, sizeof binary, SQLITE_TRANSIENT);
+	return;
+      }
+    }
+    break;
+  }
+  sqlite3_result_null(context);
+}
+
+/* Older versions stored Bundle IDs and SIDs as hex text.  SQLite can't change the type of a
+ * column, so copy every row into a new table, keeping rowids so that sync and list cursors are
+ * not disturbed.  Rows without a valid Bundle ID can't be found anyway, and are dropped.
+ */
+static int upgrade_binary_keys(sqlite_retry_state *retry)
+{
+  INFO("Converting Rhizome database to binary keys");
+  if (sqlite3_create_function(rhizome_database.db, "binary_key", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+	NULL, sql_binary_key, NULL, NULL) != SQLITE_OK)
+    return WHYF("sqlite3_create_function: %s", sqlite3_errmsg(rhizome_database.db));
+  int ret = -1;
+  if (sqlite_exec_void_retry(retry, "BEGIN TRANSACTION;", END) == -1)
+    goto end;
+  if (   sqlite_exec_void_retry(retry, "CREATE TABLE MANIFESTS_BINARY(" MANIFESTS_COLUMNS ");", END) == -1
+      || sqlite_exec_void_retry(retry,
+	  "INSERT INTO MANIFESTS_BINARY(rowid, id, version, inserttime, filesize, filehash, author, bar, "
+	    "manifest, service, name, sender, recipient, tail, manifest_hash) "
+	  "SELECT rowid, binary_key(id), version, inserttime, filesize, filehash, binary_key(author), bar, "
+	    "manifest, service, name, binary_key(sender), binary_key(recipient), tail, manifest_hash "
+	  "FROM MANIFESTS WHERE binary_key(id) IS NOT NULL;", END) == -1
+      || sqlite_exec_void_retry(retry, "DROP TABLE MANIFESTS;", END) == -1
+      || sqlite_exec_void_retry(retry, "ALTER TABLE MANIFESTS_BINARY RENAME TO MANIFESTS;", END) == -1
+      || sqlite_exec_void_retry(retry, "CREATE INDEX IF NOT EXISTS bundlesizeindex ON manifests (filesize);", END) == -1
+      || sqlite_exec_void_retry(retry, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_HASH ON MANIFESTS(filehash);", END) == -1
+      || sqlite_exec_void_retry(retry, "CREATE INDEX IF NOT EXISTS IDX_MANIFEST_HASH ON MANIFESTS(manifest_hash);", END) == -1
+      || sqlite_exec_void_retry(retry, "COMMIT;", END) == -1
+  ){
+    sqlite_exec_void_retry(retry, "ROLLBACK;", END);
+    goto end;
+  }
+  ret = 0;
+end:
+  sqlite3_create_function(rhizome_database.db, "binary_key", 1, SQLITE_UTF8, NULL, NULL, NULL, NULL);
+  return ret;
+}
+
+#define SQL_MESHMS2 "'" RHIZOME_SERVICE_MESHMS2 "'"
+#define SQL_MESHMS_PLY(ROW) "(" #ROW ".service = " SQL_MESHMS2 " AND " #ROW ".sender IS NOT NULL AND " #ROW ".recipient IS NOT NULL)"
+
+// trigger statements that index the ply in NEW, if it is one
+#define SQL_MESHMS_PLY_ADD \
+    /* INSERT OR IGNORE would take on the REPLACE of the outer statement, and drop the other ply */ \
+    "INSERT INTO MESHMS_CONVERSATIONS(me, them) SELECT NEW.sender, NEW.recipient " \
+      "WHERE " SQL_MESHMS_PLY(NEW) " " \
+      "AND NOT EXISTS(SELECT 1 FROM MESHMS_CONVERSATIONS WHERE me = NEW.sender AND them = NEW.recipient); " \
+    "UPDATE MESHMS_CONVERSATIONS SET my_id = NEW.id, my_version = NEW.version, " \
+      "my_size = NEW.filesize, my_tail = NEW.tail " \
+      "WHERE " SQL_MESHMS_PLY(NEW) " AND me = NEW.sender AND them = NEW.recipient; " \
+    "INSERT INTO MESHMS_CONVERSATIONS(me, them) SELECT NEW.recipient, NEW.sender " \
+      "WHERE " SQL_MESHMS_PLY(NEW) " AND NEW.recipient != NEW.sender " \
+      "AND NOT EXISTS(SELECT 1 FROM MESHMS_CONVERSATIONS WHERE me = NEW.recipient AND them = NEW.sender); " \
+    "UPDATE MESHMS_CONVERSATIONS SET their_id = NEW.id, their_version = NEW.version, " \
+      "their_size = NEW.filesize, their_tail = NEW.tail " \
+      "WHERE " SQL_MESHMS_PLY(NEW) " AND me = NEW.recipient AND them = NEW.sender AND NEW.recipient != NEW.sender; "
+
+// trigger statements that forget the ply in OLD, if it was indexed
+#define SQL_MESHMS_PLY_REMOVE \
+    "UPDATE MESHMS_CONVERSATIONS SET my_id = NULL, my_version = NULL, my_size = NULL, my_tail = NULL " \
+      "WHERE me = OLD.sender AND them = OLD.recipient AND my_id = OLD.id; " \
+    "UPDATE MESHMS_CONVERSATIONS SET their_id = NULL, their_version = NULL, their_size = NULL, their_tail = NULL " \
+      "WHERE me = OLD.recipient AND them = OLD.sender AND their_id = OLD.id; " \
+    "DELETE FROM MESHMS_CONVERSATIONS WHERE my_id IS NULL AND their_id IS NULL " \
+      "AND ((me = OLD.sender AND them = OLD.recipient) OR (me = OLD.recipient AND them = OLD.sender)); "
+
+/* MESHMS_CONVERSATIONS has one row for each pair of identities that have exchanged MeshMS
+ * messages, in each direction, holding the details of both plies.  Listing the conversations of an
+ * identity is then a single range of the primary key.  The SQL triggers keep it in step with
+ * MANIFESTS in the same transaction, no matter which process adds, updates or removes the plies.
+ * All rows are rebuilt from MANIFESTS whenever this is run.
+ */
+static int create_meshms_conversations(sqlite_retry_state *retry)
+{
+  if (sqlite_exec_void_retry(retry, "BEGIN TRANSACTION;", END) == -1)
+    return -1;
+  if (   sqlite_exec_void_retry(retry,
+	  "CREATE TABLE IF NOT EXISTS MESHMS_CONVERSATIONS("
+	      "me blob not null, "
+	      "them blob not null, "
+	      "my_id blob, "
+	      "my_version integer, "
+	      "my_size integer, "
+	      "my_tail integer, "
+	      "their_id blob, "
+	      "their_version integer, "
+	      "their_size integer, "
+	      "their_tail integer, "
+	      "primary key (me, them)"
+	  ") WITHOUT ROWID;", END) == -1
+      || sqlite_exec_void_retry(retry,
+	  "CREATE TRIGGER IF NOT EXISTS MESHMS_PLY_ADD AFTER INSERT ON MANIFESTS "
+	  "WHEN " SQL_MESHMS_PLY(NEW) " "
+	  "BEGIN "
+	    SQL_MESHMS_PLY_ADD
+	  "END;", END) == -1
+      || sqlite_exec_void_retry(retry,
+	  "CREATE TRIGGER IF NOT EXISTS MESHMS_PLY_DELETE AFTER DELETE ON MANIFESTS "
+	  "WHEN " SQL_MESHMS_PLY(OLD) " "
+	  "BEGIN "
+	    SQL_MESHMS_PLY_REMOVE
+	  "END;", END) == -1
+      // eg, verify_bundles() rewrites every row in place
+      || sqlite_exec_void_retry(retry,
+	  "CREATE TRIGGER IF NOT EXISTS MESHMS_PLY_UPDATE "
+	  "AFTER UPDATE OF id, version, filesize, tail, service, sender, recipient ON MANIFESTS "
+	  "WHEN " SQL_MESHMS_PLY(OLD) " OR " SQL_MESHMS_PLY(NEW) " "
+	  "BEGIN "
+	    SQL_MESHMS_PLY_REMOVE
+	    SQL_MESHMS_PLY_ADD
+	  "END;", END) == -1
+      || sqlite_exec_void_retry(retry, "DELETE FROM MESHMS_CONVERSATIONS;", END) == -1
+      // index any plies that are already stored
+      || sqlite_exec_void_retry(retry,
+	  "INSERT OR REPLACE INTO MESHMS_CONVERSATIONS "
+	  "SELECT c.me, c.them, mine.id, mine.version, mine.filesize, mine.tail, "
+	    "theirs.id, theirs.version, theirs.filesize, theirs.tail "
+	  "FROM ("
+	      "SELECT sender AS me, recipient AS them FROM MANIFESTS "
+		"WHERE service = " SQL_MESHMS2 " AND sender IS NOT NULL AND recipient IS NOT NULL "
+	      "UNION SELECT recipient, sender FROM MANIFESTS "
+		"WHERE service = " SQL_MESHMS2 " AND sender IS NOT NULL AND recipient IS NOT NULL"
+	    ") c "
+	  "LEFT JOIN MANIFESTS mine ON mine.service = " SQL_MESHMS2 " AND mine.sender = c.me AND mine.recipient = c.them "
+	  "LEFT JOIN MANIFESTS theirs ON theirs.service = " SQL_MESHMS2 " AND theirs.sender = c.them AND theirs.recipient = c.me "
+	    "AND c.me != c.them;", END) == -1
+      || sqlite_exec_void_retry(retry, "COMMIT;", END) == -1
+  ){
+    sqlite_exec_void_retry(retry, "ROLLBACK;", END);
+    return -1;
+  }
+  return 0;
+}
+
 void verify_bundles()
 {
   // assume that only the manifest itself can be trusted
@@ -200,7 +375,7 @@ void verify_bundles()
       rhizome_manifest_free(m);
     }
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
 }
 
 /*
@@ -330,6 +505,23 @@ int rhizome_opendb()
 
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
 
+  // The journal mode is a property of the database file, so every process that opens the database
+  // will use the write-ahead log once the server has enabled it.
+  char journal_mode[16];
+  if (config.rhizome.wal.enable){
+    if (sqlite_exec_strbuf_retry(&retry, strbuf_local_buf(journal_mode), "PRAGMA journal_mode=WAL;", END) == -1)
+      RETURN(-1);
+    if (strcasecmp(journal_mode, "wal") == 0)
+      sqlite3_wal_autocheckpoint(rhizome_database.db, config.rhizome.wal.checkpoint_pages);
+    else
+      WARNF("Rhizome database cannot use a write-ahead log, journal_mode=%s", journal_mode);
+  }else if (serverMode != SERVER_NOT_RUNNING){
+    if (sqlite_exec_strbuf_retry(&retry, strbuf_local_buf(journal_mode), "PRAGMA journal_mode;", END) == -1)
+      RETURN(-1);
+    if (strcasecmp(journal_mode, "wal") == 0)
+      sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA journal_mode=DELETE;", END);
+  }
+
   uint64_t version;
   if (sqlite_exec_uint64_retry(&retry, &version, "PRAGMA user_version;", END) != SQLITE_ROW)
     RETURN(-1);
@@ -341,20 +533,7 @@ int rhizome_opendb()
     sqlite_exec_void_loglevel(loglevel, "PRAGMA auto_vacuum=2;", END);
     if (	sqlite_exec_void_retry(&retry, 
 		  "CREATE TABLE IF NOT EXISTS MANIFESTS("
-		      "id text not null primary key, "
-		      "version integer, "
-		      "inserttime integer, "
-		      "filesize integer, "
-		      "filehash text, "
-		      "author text, "
-		      "bar blob, "
-		      "manifest blob, "
-		      "service text, "
-		      "name text, "
-		      "sender text collate nocase, "
-		      "recipient text collate nocase, "
-		      "tail integer, "
-		      "manifest_hash text collate nocase"
+		      MANIFESTS_COLUMNS
 		  ");", END) == -1
       ||	sqlite_exec_void_retry(&retry, 
 		  "CREATE TABLE IF NOT EXISTS FILES("
@@ -424,6 +603,23 @@ int rhizome_opendb()
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=8;", END);
   }
   
+  if (version<9){
+    // Bundle IDs and SIDs are stored as binary, and the common queries are answered from an index
+    if (db_exists && upgrade_binary_keys(&retry) == -1)
+      RETURN(WHY("Failed to convert MANIFESTS to binary keys"));
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "DROP INDEX IF EXISTS IDX_MANIFESTS_ID_VERSION;", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_ID_VERSION ON MANIFESTS(id, version, filesize, filehash);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_SENDER ON MANIFESTS(service, sender, recipient, id, version, filesize, tail);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE INDEX IF NOT EXISTS IDX_MANIFESTS_RECIPIENT ON MANIFESTS(service, recipient, sender, id, version, filesize, tail);", END);
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=9;", END);
+  }
+
+  if (version<10){
+    if (create_meshms_conversations(&retry) == -1)
+      RETURN(WHY("Failed to create MeshMS conversation index"));
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=10;", END);
+  }
+
   // TODO recreate tables with collate nocase on all hex columns
 
   /* Future schema updates should be performed here. 
@@ -471,6 +667,13 @@ int rhizome_close_db()
   IN();
   if (rhizome_database.db) {
     rhizome_cache_close();
+    rhizome_batch_commit();
+    statement_cache_clear();
+    if (   serverMode != SERVER_NOT_RUNNING
+	&& config.rhizome.wal.enable
+	&& config.rhizome.wal.truncate_on_close
+	&& sqlite3_wal_checkpoint_v2(rhizome_database.db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL) != SQLITE_OK)
+      WARNF("Failed to checkpoint Rhizome database, %s", sqlite3_errmsg(rhizome_database.db));
 
     if (!sqlite3_get_autocommit(rhizome_database.db)){
       WHY("Uncommitted transaction!");
@@ -603,6 +806,105 @@ void _sqlite_retry_done(struct __sourceloc __whence, sqlite_retry_state *retry,
     retry->start = -1;
 }
 
+/* Prepared statements are kept for re-use, keyed by their SQL text, so that frequently repeated
+ * queries (eg, looking up a manifest by id and version) are only parsed once per connection.  A
+ * cached statement is lent to one caller at a time, until it is handed back by sqlite_finalize(),
+ * which resets it and clears its bindings.  If every matching statement is on loan, the caller gets
+ * a new statement that is not cached.
+ */
+#define SQLITE_STATEMENT_CACHE_SIZE 32
+
+struct statement_cache_entry {
+  sqlite3_stmt *statement;
+  uint32_t hash;
+  bool_t in_use;
+  unsigned last_used;
+};
+
+static __thread struct statement_cache_entry statement_cache[SQLITE_STATEMENT_CACHE_SIZE];
+static __thread unsigned statement_cache_clock = 0;
+
+static uint32_t statement_hash(const char *sqltext)
+{
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (; *sqltext; ++sqltext)
+    hash = (hash ^ (unsigned char)*sqltext) * 16777619u;
+  return hash;
+}
+
+static sqlite3_stmt *statement_cache_get(const char *sqltext, uint32_t hash)
+{
+  unsigned i;
+  for (i = 0; i < SQLITE_STATEMENT_CACHE_SIZE; ++i){
+    struct statement_cache_entry *e = &statement_cache[i];
+    if (e->statement && !e->in_use && e->hash == hash && strcmp(sqlite3_sql(e->statement), sqltext) == 0){
+      e->in_use = 1;
+      e->last_used = ++statement_cache_clock;
+      return e->statement;
+    }
+  }
+  return NULL;
+}
+
+static void statement_cache_put(sqlite3_stmt *statement, uint32_t hash)
+{
+  struct statement_cache_entry *victim = NULL;
+  unsigned i;
+  for (i = 0; i < SQLITE_STATEMENT_CACHE_SIZE; ++i){
+    struct statement_cache_entry *e = &statement_cache[i];
+    if (!e->statement){
+      victim = e;
+      break;
+    }
+    if (!e->in_use && (!victim || e->last_used < victim->last_used))
+      victim = e;
+  }
+  if (!victim)
+    return;
+  if (victim->statement)
+    sqlite3_finalize(victim->statement);
+  victim->statement = statement;
+  victim->hash = hash;
+  victim->in_use = 1;
+  victim->last_used = ++statement_cache_clock;
+}
+
+/* Release a statement returned by sqlite_prepare() and friends.  Every prepared statement must be
+ * released with this function, not sqlite3_finalize().
+ */
+void sqlite_finalize(sqlite3_stmt *statement)
+{
+  if (!statement)
+    return;
+  unsigned i;
+  for (i = 0; i < SQLITE_STATEMENT_CACHE_SIZE; ++i){
+    struct statement_cache_entry *e = &statement_cache[i];
+    if (e->statement == statement){
+      sqlite3_reset(statement);
+      sqlite3_clear_bindings(statement);
+      e->in_use = 0;
+      return;
+    }
+  }
+  sqlite3_finalize(statement);
+}
+
+static void statement_cache_clear()
+{
+  unsigned i;
+  for (i = 0; i < SQLITE_STATEMENT_CACHE_SIZE; ++i){
+    struct statement_cache_entry *e = &statement_cache[i];
+    if (e->statement){
+      if (e->in_use)
+	WARNF("closing Rhizome db with statement in use: %s", sqlite3_sql(e->statement));
+      sqlite3_finalize(e->statement);
+    }
+    e->statement = NULL;
+    e->in_use = 0;
+  }
+}
+
 /* Prepare an SQL command from a simple string.  Returns NULL if an error occurs (logged as an
  * error), otherwise returns a pointer to the prepared SQLite statement.
  *
@@ -624,10 +926,16 @@ sqlite3_stmt *_sqlite_prepare(struct __sourceloc __whence, int log_level, sqlite
   IN();
   sqlite3_stmt *statement = NULL;
   assert(rhizome_database.db);
+  uint32_t hash = statement_hash(sqltext);
+  if ((statement = statement_cache_get(sqltext, hash))){
+    sqlite_trace_done = 0;
+    RETURN(statement);
+  }
   while (1) {
     switch (sqlite3_prepare_v2(rhizome_database.db, sqltext, -1, &statement, NULL)) {
       case SQLITE_OK:
 	sqlite_trace_done = 0;
+	statement_cache_put(statement, hash);
 	RETURN(statement);
       case SQLITE_BUSY:
       case SQLITE_LOCKED:
@@ -637,7 +945,7 @@ sqlite3_stmt *_sqlite_prepare(struct __sourceloc __whence, int log_level, sqlite
 	// fall through...
       default:
 	LOGF(log_level, "query invalid, %s: %s", sqlite3_errmsg(rhizome_database.db), sqltext);
-	sqlite3_finalize(statement);
+	sqlite_finalize(statement);
 	RETURN(NULL);
     }
   }
@@ -705,7 +1013,7 @@ int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state
 	      FALLTHROUGH; \
 	    default: \
 	      LOGF(log_level, #FUNC "(%d) failed, %s: %s", index, sqlite3_errmsg(rhizome_database.db), sqlite3_sql(statement)); \
-	      sqlite3_finalize(statement); \
+	      sqlite_finalize(statement); \
 	      return -1; \
 	  } \
 	  break; \
@@ -716,7 +1024,7 @@ int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state
 	  BIND_RETRY(sqlite3_bind_null); \
 	} else { \
 	  LOGF(log_level, "at bind arg %u, %s%s parameter is NULL: %s", argnum, #TYP, strbuf_str(ext), sqlite3_sql(statement)); \
-	  sqlite3_finalize(statement); \
+	  sqlite_finalize(statement); \
 	  return -1; \
 	}
     switch (typ) {
@@ -848,9 +1156,8 @@ int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state
 	      if (sidp == NULL) {
 		BIND_NULL(SID_T);
 	      } else {
-		const char *sid_hex = alloca_tohex_sid_t(*sidp);
-		BIND_DEBUG(SID_T, sqlite3_bind_text, "%s,%u,SQLITE_TRANSIENT", sid_hex, SID_STRLEN);
-		BIND_RETRY(sqlite3_bind_text, sid_hex, SID_STRLEN, SQLITE_TRANSIENT);
+		BIND_DEBUG(SID_T, sqlite3_bind_blob, "%s,%u,SQLITE_TRANSIENT", alloca_tohex_sid_t(*sidp), SID_SIZE);
+		BIND_RETRY(sqlite3_bind_blob, sidp->binary, SID_SIZE, SQLITE_TRANSIENT);
 	      }
 	    }
 	    break;
@@ -860,9 +1167,8 @@ int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state
 	      if (bidp == NULL) {
 		BIND_NULL(RHIZOME_BID_T);
 	      } else {
-		const char *bid_hex = alloca_tohex_rhizome_bid_t(*bidp);
-		BIND_DEBUG(RHIZOME_BID_T, sqlite3_bind_text, "%s,%u,SQLITE_TRANSIENT", bid_hex, RHIZOME_MANIFEST_ID_STRLEN);
-		BIND_RETRY(sqlite3_bind_text, bid_hex, RHIZOME_MANIFEST_ID_STRLEN, SQLITE_TRANSIENT);
+		BIND_DEBUG(RHIZOME_BID_T, sqlite3_bind_blob, "%s,%u,SQLITE_TRANSIENT", alloca_tohex_rhizome_bid_t(*bidp), (unsigned) sizeof bidp->binary);
+		BIND_RETRY(sqlite3_bind_blob, bidp->binary, sizeof bidp->binary, SQLITE_TRANSIENT);
 	      }
 	    }
 	    break;
@@ -979,17 +1285,40 @@ sqlite3_stmt *_sqlite_prepare_bind(struct __sourceloc __whence, int log_level, s
     int ret = _sqlite_vbind(__whence, log_level, retry, statement, ap);
     va_end(ap);
     if (ret == -1) {
-      sqlite3_finalize(statement);
+      sqlite_finalize(statement);
       statement = NULL;
     }
   }
   return statement;
 }
 
+static int sqlite_column_binary(sqlite3_stmt *statement, int column, unsigned char *binary, size_t size)
+{
+  const unsigned char *blob = sqlite3_column_blob(statement, column);
+  if (!blob || (size_t)sqlite3_column_bytes(statement, column) != size)
+    return -1;
+  bcopy(blob, binary, size);
+  return 0;
+}
+
+int sqlite_column_sid(sqlite3_stmt *statement, int column, sid_t *sidp)
+{
+  return sqlite_column_binary(statement, column, sidp->binary, sizeof sidp->binary);
+}
+
+int sqlite_column_bid(sqlite3_stmt *statement, int column, rhizome_bid_t *bidp)
+{
+  return sqlite_column_binary(statement, column, bidp->binary, sizeof bidp->binary);
+}
+
+static void batch_exclude_write();
+
 int _sqlite_step(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement)
 {
   IN();
   int ret = -1;
+  if (statement && !sqlite3_stmt_readonly(statement))
+    batch_exclude_write();
   sqlite_trace_whence = &__whence;
   while (statement) {
     ret = sqlite3_step(statement);
@@ -1027,7 +1356,7 @@ int _sqlite_exec_code(struct __sourceloc __whence, int log_level, sqlite_retry_s
   int stepcode;
   while ((stepcode = _sqlite_step(__whence, log_level, retry, statement)) == SQLITE_ROW)
     ++(*rowcount);
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   if (sqlite_trace_func())
     _DEBUGF("rowcount=%d changes=%d", *rowcount, sqlite3_changes(rhizome_database.db));
   return stepcode;
@@ -1140,7 +1469,7 @@ static int _sqlite_vexec_uint64(struct __sourceloc __whence, sqlite_retry_state
   }
   if (rows > 1)
     FATALF("query unexpectedly returned %d rows", rows);
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   if (sqlite_trace_func())
     _DEBUGF("rowcount=%d changes=%d result=%"PRIu64, rows, sqlite3_changes(rhizome_database.db), *result);
   if (sqlite_code_ok(stepcode) && rows>0)
@@ -1218,7 +1547,7 @@ int _sqlite_vexec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *
   }
   if (rowcount > 1)
     WARNF("query unexpectedly returned %d rows, ignored all but first", rowcount);
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   return sqlite_code_ok(stepcode) && ret != -1 ? rowcount : -1;
 }
 
@@ -1356,7 +1685,7 @@ int rhizome_cleanup(struct rhizome_cleanup_report *report)
         && rhizome_delete_file(&filehash)==0 && report)
       ++report->deleted_stale_incoming_files;
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
 
   // Remove external payload files for old, unreferenced payloads.
   statement = sqlite_prepare_bind(&retry,
@@ -1369,7 +1698,7 @@ int rhizome_cleanup(struct rhizome_cleanup_report *report)
         && rhizome_delete_file(&filehash)==0 && report)
       ++report->deleted_orphan_files;
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
 
   // TODO Iterate through all files in RHIZOME_BLOB_SUBDIR and delete any which are no longer
   // referenced or are stale.  This could take a long time, so for scalability should be done
@@ -1458,7 +1787,176 @@ end:
  *
  * @author Andrew Bettison <andrew@servalproject.com>
  */
-enum rhizome_bundle_status rhizome_add_manifest_to_store(rhizome_manifest *m, rhizome_manifest **mout)
+/* Group commit of received bundles.
+ *
+ * When peers reconnect they may send us thousands of bundles in a burst, and committing each
+ * payload and manifest separately costs at least one fsync(2) per bundle.  So the server may open a
+ * "batch" savepoint while storing a received bundle, and keep it open until
+ * config.rhizome.commit_bundles manifests have been added or config.rhizome.commit_interval_ms has
+ * passed.  Only the payloads and manifests of received bundles, stored between
+ * rhizome_batch_begin() and rhizome_batch_end(), join the batch.  Any other write commits the batch
+ * first, so it is never held up by, or rolled back with, the received bundles.  The "RHIZOME ADD
+ * MANIFEST" log message and the rhizome_bundle_added trigger for each manifest added to the batch
+ * are deferred until the batch has been committed.
+ */
+static struct rhizome_batch {
+  bool_t open;
+  // the number of callers storing a received bundle
+  unsigned joined;
+  // the number of nested savepoints currently open within the batch
+  unsigned depth;
+  // the number of manifests added in this batch
+  unsigned bundles;
+  time_ms_t started;
+  // payload files moved into the blob directory by this batch, to remove if it is rolled back
+  rhizome_filehash_t *blobs;
+  unsigned blob_count;
+  unsigned blob_alloc;
+} batch;
+
+DEFINE_ALARM(rhizome_batch_timeout);
+
+// Called before any statement that may write to the database.
+static void batch_exclude_write()
+{
+  if (batch.open && !batch.joined && !batch.depth)
+    rhizome_batch_commit();
+}
+
+int rhizome_db_begin(sqlite_retry_state *retry)
+{
+  batch_exclude_write();
+  if (!batch.open)
+    return sqlite_exec_void_retry(retry, "BEGIN TRANSACTION;", END);
+  if (sqlite_exec_void_retry(retry, "SAVEPOINT rhizome_write;", END) == -1)
+    return -1;
+  batch.depth++;
+  return 0;
+}
+
+int rhizome_db_commit(sqlite_retry_state *retry)
+{
+  if (!batch.open)
+    return sqlite_exec_void_retry(retry, "COMMIT;", END);
+  assert(batch.depth > 0);
+  if (sqlite_exec_void_retry(retry, "RELEASE rhizome_write;", END) == -1)
+    return -1;
+  batch.depth--;
+  return 0;
+}
+
+void rhizome_db_rollback(sqlite_retry_state *retry)
+{
+  if (!batch.open){
+    sqlite_exec_void_retry(retry, "ROLLBACK;", END);
+    return;
+  }
+  assert(batch.depth > 0);
+  // rolling back to a savepoint leaves it open
+  sqlite_exec_void_retry(retry, "ROLLBACK TO rhizome_write;", END);
+  sqlite_exec_void_retry(retry, "RELEASE rhizome_write;", END);
+  batch.depth--;
+}
+
+/* Start storing the payload or manifest of a received bundle, opening a batch savepoint if group
+ * commit is enabled and one is not already open.  Every call must be matched by a call to
+ * rhizome_batch_end().  Returns 1 if a batch is open, 0 if each bundle will be committed
+ * separately, -1 on error.
+ */
+int rhizome_batch_begin()
+{
+  batch.joined++;
+  if (batch.open)
+    return 1;
+  if (serverMode == SERVER_NOT_RUNNING || config.rhizome.commit_bundles <= 1 || !rhizome_database.db)
+    return 0;
+  if (!sqlite3_get_autocommit(rhizome_database.db))
+    return 0;
+  // notice any bundles added by the CLI, so that every manifest after max_rowid that is committed
+  // with the batch is announced with it
+  rhizome_process_added_bundles(INT64_MAX);
+  // an outermost savepoint is a deferred transaction, it does not take the write lock until the
+  // first bundle is stored
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_void_retry(&retry, "SAVEPOINT rhizome_batch;", END) == -1)
+    return -1;
+  batch.open = 1;
+  batch.depth = 0;
+  batch.bundles = 0;
+  batch.blob_count = 0;
+  batch.started = gettime_ms();
+  time_ms_t commit_at = batch.started + config.rhizome.commit_interval_ms;
+  RESCHEDULE(&ALARM_STRUCT(rhizome_batch_timeout), commit_at, commit_at, commit_at + 100);
+  DEBUGF(rhizome, "Opened batch transaction");
+  return 1;
+}
+
+void rhizome_batch_end()
+{
+  assert(batch.joined > 0);
+  batch.joined--;
+}
+
+/* Record a payload file that was moved into the blob directory in the open batch, so that it can
+ * be removed again if the batch is rolled back and its FILES row with it.
+ */
+void rhizome_batch_add_blob(const rhizome_filehash_t *id)
+{
+  if (!batch.open)
+    return;
+  if (batch.blob_count >= batch.blob_alloc){
+    unsigned alloc = batch.blob_alloc ? batch.blob_alloc * 2 : 32;
+    rhizome_filehash_t *blobs = erealloc(batch.blobs, alloc * sizeof *blobs);
+    if (!blobs)
+      return;
+    batch.blobs = blobs;
+    batch.blob_alloc = alloc;
+  }
+  batch.blobs[batch.blob_count++] = *id;
+}
+
+static void process_added_bundles(uint64_t up_to_rowid, bool_t announce);
+
+/* Commit the open batch transaction, then announce the manifests it added.  Returns 0 if there is
+ * no batch open, it was committed, or it will be committed when the current transaction finishes.
+ * Returns -1 if it could not be committed and was rolled back.
+ */
+int rhizome_batch_commit()
+{
+  if (!batch.open)
+    return 0;
+  unschedule(&ALARM_STRUCT(rhizome_batch_timeout));
+  if (batch.depth){
+    // called from within a transaction, commit as soon as it is finished
+    time_ms_t now = gettime_ms();
+    RESCHEDULE(&ALARM_STRUCT(rhizome_batch_timeout), now, now, now + 100);
+    return 0;
+  }
+  batch.open = 0;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (config.rhizome.rollback_batches
+    || sqlite_exec_void_retry(&retry, "RELEASE rhizome_batch;", END) == -1){
+    sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+    // the payload files are no longer referenced by the FILES table
+    unsigned i;
+    for (i = 0; i < batch.blob_count; i++)
+      rhizome_delete_external(&batch.blobs[i]);
+    WHYF("Failed to commit batch of %u bundles, they will need to be fetched again", batch.bundles);
+    // the peers that sent them think we have them now
+    CALL_TRIGGER(batch_rollback);
+    return -1;
+  }
+  DEBUGF(rhizome, "Committed batch of %u bundles in %"PRId64"ms", batch.bundles, gettime_ms() - batch.started);
+  process_added_bundles(INT64_MAX, 1);
+  return 0;
+}
+
+void rhizome_batch_timeout(struct sched_ent *UNUSED(alarm))
+{
+  rhizome_batch_commit();
+}
+
+static enum rhizome_bundle_status add_manifest_to_store(rhizome_manifest *m, rhizome_manifest **mout, bool_t defer)
 {
   if (mout == NULL)
     DEBUGF(rhizome, "%s(m=manifest %p, mout=NULL)", __func__, m);
@@ -1499,7 +1997,7 @@ enum rhizome_bundle_status rhizome_add_manifest_to_store(rhizome_manifest *m, rh
   rhizome_manifest_to_bar(m, &bar);
 
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1)
+  if (rhizome_db_begin(&retry) == -1)
     return WHY("Failed to begin transaction");
 
   time_ms_t now = gettime_ms();
@@ -1549,12 +2047,22 @@ enum rhizome_bundle_status rhizome_add_manifest_to_store(rhizome_manifest *m, rh
     goto rollback;
   if (!sqlite_code_ok(sqlite_step_retry(&retry, stmt)))
     goto rollback;
-  sqlite3_finalize(stmt);
+  sqlite_finalize(stmt);
   stmt = NULL;
   rhizome_manifest_set_rowid(m, sqlite3_last_insert_rowid(rhizome_database.db));
   rhizome_manifest_set_inserttime(m, now);
 
-  if (sqlite_exec_void_retry(&retry, "COMMIT;", END) != -1){
+  if (rhizome_db_commit(&retry) != -1){
+    if (batch.open){
+      // stored and announced once the batch has been committed, which must happen before returning
+      // unless the caller is content to find out later
+      ++batch.bundles;
+      if ((!defer || batch.bundles >= config.rhizome.commit_bundles) && rhizome_batch_commit() == -1)
+	return RHIZOME_BUNDLE_STATUS_ERROR;
+      if (mout)
+	*mout = m;
+      return RHIZOME_BUNDLE_STATUS_NEW;
+    }
     // This message used in tests; do not modify or remove.
     INFOF("RHIZOME ADD MANIFEST service=%s bid=%s version=%"PRIu64,
 	  m->service ? m->service : "NULL",
@@ -1580,12 +2088,31 @@ enum rhizome_bundle_status rhizome_add_manifest_to_store(rhizome_manifest *m, rh
 
 rollback:
   if (stmt)
-    sqlite3_finalize(stmt);
+    sqlite_finalize(stmt);
   WHYF("Failed to store bundle bid=%s", alloca_tohex_rhizome_bid_t(m->keypair.public_key));
-  sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+  rhizome_db_rollback(&retry);
   return RHIZOME_BUNDLE_STATUS_ERROR;
 }
 
+enum rhizome_bundle_status rhizome_add_manifest_to_store(rhizome_manifest *m, rhizome_manifest **mout)
+{
+  return add_manifest_to_store(m, mout, 0);
+}
+
+/* Insert a manifest received from a peer into the open batch transaction, if there is one.  As for
+ * rhizome_add_manifest_to_store(), except that RHIZOME_BUNDLE_STATUS_NEW only means the manifest
+ * is pending, and will be stored and announced when the batch commits.  If that commit fails then
+ * the whole batch is rolled back, and the batch_rollback trigger restarts synchronisation with
+ * every peer so that they offer its bundles again.
+ */
+enum rhizome_bundle_status rhizome_add_manifest_to_batch(rhizome_manifest *m)
+{
+  rhizome_batch_begin();
+  enum rhizome_bundle_status status = add_manifest_to_store(m, NULL, 1);
+  rhizome_batch_end();
+  return status;
+}
+
 static void trigger_rhizome_bundle_added_debug(rhizome_manifest *m)
 {
   DEBUGF(rhizome, "TRIGGER rhizome_bundle_added service=%s bid=%s version=%"PRIu64,
@@ -1597,6 +2124,13 @@ static void trigger_rhizome_bundle_added_debug(rhizome_manifest *m)
 
 DEFINE_TRIGGER(bundle_add, trigger_rhizome_bundle_added_debug);
 
+static void trigger_rhizome_batch_rollback_debug()
+{
+  DEBUG(rhizome, "TRIGGER rhizome_batch_rollback");
+}
+
+DEFINE_TRIGGER(batch_rollback, trigger_rhizome_batch_rollback_debug);
+
 /* The cursor struct must be zerofilled and the query parameters optionally filled in prior to
  * calling this function.
  *
@@ -1659,7 +2193,7 @@ int rhizome_list_open(struct rhizome_list_cursor *c)
   RETURN(0);
   OUT();
 failure:
-  sqlite3_finalize(c->_statement);
+  sqlite_finalize(c->_statement);
   c->_statement = NULL;
   RETURN(-1);
   OUT();
@@ -1697,24 +2231,23 @@ int rhizome_list_next(struct rhizome_list_cursor *c)
     if ((r=sqlite_step_retry(&c->_retry, c->_statement)) != SQLITE_ROW)
       break;
     assert(sqlite3_column_count(c->_statement) == 6);
-    assert(sqlite3_column_type(c->_statement, 0) == SQLITE_TEXT);
+    assert(sqlite3_column_type(c->_statement, 0) == SQLITE_BLOB);
     assert(sqlite3_column_type(c->_statement, 1) == SQLITE_BLOB);
     assert(sqlite3_column_type(c->_statement, 2) == SQLITE_INTEGER);
     assert(sqlite3_column_type(c->_statement, 3) == SQLITE_INTEGER);
-    assert(sqlite3_column_type(c->_statement, 4) == SQLITE_TEXT || sqlite3_column_type(c->_statement, 4) == SQLITE_NULL);
+    assert(sqlite3_column_type(c->_statement, 4) == SQLITE_BLOB || sqlite3_column_type(c->_statement, 4) == SQLITE_NULL);
     assert(sqlite3_column_type(c->_statement, 5) == SQLITE_INTEGER);
 
     uint64_t q_rowid = c->_rowid_current = sqlite3_column_int64(c->_statement, 5);
-    const char *q_manifestid = (const char *) sqlite3_column_text(c->_statement, 0);
     const char *manifestblob = (char *) sqlite3_column_blob(c->_statement, 1);
     size_t manifestblobsize = sqlite3_column_bytes(c->_statement, 1); // must call after sqlite3_column_blob()
     uint64_t q_version = sqlite3_column_int64(c->_statement, 2);
     int64_t q_inserttime = sqlite3_column_int64(c->_statement, 3);
-    const char *q_author = (const char *) sqlite3_column_text(c->_statement, 4);
+    int q_author = sqlite3_column_type(c->_statement, 4) != SQLITE_NULL;
     sid_t author;
     if (q_author) {
-      if (str_to_sid_t(&author, q_author) == -1) {
-	WHYF("MANIFESTS row id=%s has invalid author column %s -- skipped", q_manifestid, alloca_str_toprint(q_author));
+      if (sqlite_column_sid(c->_statement, 4, &author) == -1) {
+	WHYF("MANIFESTS row id=%s has invalid author column -- skipped", alloca_column_hex(c->_statement, 0));
 	continue;
       }
     }
@@ -1726,12 +2259,12 @@ int rhizome_list_next(struct rhizome_list_cursor *c)
     if (   rhizome_manifest_parse(m) == -1
 	|| !rhizome_manifest_validate(m)
     ) {
-      WHYF("MANIFESTS row id=%s has invalid manifest blob -- skipped", q_manifestid);
+      WHYF("MANIFESTS row id=%s has invalid manifest blob -- skipped", alloca_column_hex(c->_statement, 0));
       continue;
     }
     if (m->version != q_version) {
       WHYF("MANIFESTS row id=%s version=%"PRIu64" does not match manifest blob version=%"PRIu64" -- skipped",
-	  q_manifestid, q_version, m->version);
+	  alloca_column_hex(c->_statement, 0), q_version, m->version);
       continue;
     }
     if (q_author)
@@ -1766,7 +2299,7 @@ void rhizome_list_release(struct rhizome_list_cursor *c)
     c->manifest = NULL;
   }
   if (c->_statement) {
-    sqlite3_finalize(c->_statement);
+    sqlite_finalize(c->_statement);
     c->_statement = NULL;
   }
 }
@@ -1826,7 +2359,6 @@ enum rhizome_bundle_status rhizome_find_duplicate(const rhizome_manifest *m, rhi
       ret = WHY("Out of manifests");
       break;
     }
-    const unsigned char *q_manifestid = sqlite3_column_text(statement, 0);
     const char *manifestblob = (char *) sqlite3_column_blob(statement, 1);
     size_t manifestblobsize = sqlite3_column_bytes(statement, 1); // must call after sqlite3_column_blob()
     memcpy(blob_m->manifestdata, manifestblob, manifestblobsize);
@@ -1834,18 +2366,17 @@ enum rhizome_bundle_status rhizome_find_duplicate(const rhizome_manifest *m, rhi
     if (   rhizome_manifest_parse(blob_m) == -1
 	|| !rhizome_manifest_validate(blob_m)
        ) {
-      WARNF("MANIFESTS row id=%s has invalid manifest blob -- skipped", q_manifestid);
+      WARNF("MANIFESTS row id=%s has invalid manifest blob -- skipped", alloca_column_hex(statement, 0));
       goto next;
     }
     if (!rhizome_manifest_verify(blob_m)) {
-      WARNF("MANIFESTS row id=%s fails verification -- skipped", q_manifestid);
+      WARNF("MANIFESTS row id=%s fails verification -- skipped", alloca_column_hex(statement, 0));
       goto next;
     }
-    const char *q_author = (const char *) sqlite3_column_text(statement, 2);
-    if (q_author) {
+    if (sqlite3_column_type(statement, 2) != SQLITE_NULL) {
       sid_t author;
-      if (str_to_sid_t(&author, q_author) == -1)
-	WARNF("MANIFESTS row id=%s has invalid author=%s -- ignored", q_manifestid, alloca_str_toprint(q_author));
+      if (sqlite_column_sid(statement, 2, &author) == -1)
+	WARNF("MANIFESTS row id=%s has invalid author -- ignored", alloca_column_hex(statement, 0));
       else
 	rhizome_manifest_set_author(blob_m, &author);
     }
@@ -1854,14 +2385,14 @@ enum rhizome_bundle_status rhizome_find_duplicate(const rhizome_manifest *m, rhi
     if (m->authorship != AUTHOR_AUTHENTIC)
       goto next;
     *found = blob_m;
-    DEBUGF(rhizome, "Found duplicate payload, %s", q_manifestid);
+    DEBUGF(rhizome, "Found duplicate payload, %s", alloca_column_hex(statement, 0));
     ret = RHIZOME_BUNDLE_STATUS_DUPLICATE;
     break;
 next:
     if (blob_m)
       rhizome_manifest_free(blob_m);
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   if (!sqlite_code_ok(r))
     ret=-1;
   return ret;
@@ -1876,21 +2407,19 @@ next:
  * Caller is responsible for allocating and freeing rhizome_manifest
  */
 static int unpack_manifest_row(rhizome_manifest *m, sqlite3_stmt *statement){
-  const char *q_id = (const char *) sqlite3_column_text(statement, 0);
   const char *q_blob = (char *) sqlite3_column_blob(statement, 1);
   uint64_t q_version = sqlite3_column_int64(statement, 2);
   int64_t q_inserttime = sqlite3_column_int64(statement, 3);
-  const char *q_author = (const char *) sqlite3_column_text(statement, 4);
   size_t q_blobsize = sqlite3_column_bytes(statement, 1); // must call after sqlite3_column_blob()
   uint64_t q_rowid = sqlite3_column_int64(statement, 5);
   memcpy(m->manifestdata, q_blob, q_blobsize);
   m->manifest_all_bytes = q_blobsize;
   if (rhizome_manifest_parse(m) == -1 || !rhizome_manifest_validate(m))
-    return WHYF("Manifest bid=%s in database but invalid", q_id);
-  if (q_author) {
+    return WHYF("Manifest bid=%s in database but invalid", alloca_column_hex(statement, 0));
+  if (sqlite3_column_type(statement, 4) != SQLITE_NULL) {
     sid_t author;
-    if (str_to_sid_t(&author, q_author) == -1)
-      WARNF("MANIFESTS row id=%s has invalid author=%s -- ignored", q_id, alloca_str_toprint(q_author));
+    if (sqlite_column_sid(statement, 4, &author) == -1)
+      WARNF("MANIFESTS row id=%s has invalid author -- ignored", alloca_column_hex(statement, 0));
     else
       rhizome_manifest_set_author(m, &author);
   }
@@ -1935,10 +2464,21 @@ enum rhizome_bundle_status rhizome_retrieve_manifest(const rhizome_bid_t *bidp,
   if (!statement)
     return RHIZOME_BUNDLE_STATUS_ERROR;
   enum rhizome_bundle_status ret = step_unpack_manifest_row(&retry, m, statement);
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   return ret;
 }
 
+// the range of Bundle IDs that start with the given prefix
+static void bid_prefix_range(const unsigned char *prefix, unsigned prefix_len, rhizome_bid_t *low, rhizome_bid_t *high)
+{
+  *low = RHIZOME_BID_ZERO;
+  *high = RHIZOME_BID_MAX;
+  if (prefix_len > sizeof low->binary)
+    prefix_len = sizeof low->binary;
+  bcopy(prefix, low->binary, prefix_len);
+  bcopy(prefix, high->binary, prefix_len);
+}
+
 /* Retrieve any manifest from the database whose Bundle ID starts with the given prefix.
  *
  * Returns RHIZOME_BUNDLE_STATUS_SAME if manifest is found
@@ -1950,19 +2490,17 @@ enum rhizome_bundle_status rhizome_retrieve_manifest(const rhizome_bid_t *bidp,
 enum rhizome_bundle_status rhizome_retrieve_manifest_by_prefix(const unsigned char *prefix, unsigned prefix_len, rhizome_manifest *m)
 {
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  const unsigned prefix_strlen = prefix_len * 2;
-  char like[prefix_strlen + 2];
-  tohex(like, prefix_strlen, prefix);
-  like[prefix_strlen] = '%';
-  like[prefix_strlen + 1] = '\0';
+  rhizome_bid_t low, high;
+  bid_prefix_range(prefix, prefix_len, &low, &high);
   sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
-      "SELECT id, manifest, version, inserttime, author, rowid FROM manifests WHERE id like ?",
-      TEXT, like,
+      "SELECT id, manifest, version, inserttime, author, rowid FROM manifests WHERE id >= ? AND id <= ?",
+      RHIZOME_BID_T, &low,
+      RHIZOME_BID_T, &high,
       END);
   if (!statement)
     return RHIZOME_BUNDLE_STATUS_ERROR;
   enum rhizome_bundle_status ret = step_unpack_manifest_row(&retry, m, statement);
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   return ret;
 }
 
@@ -1981,7 +2519,7 @@ enum rhizome_bundle_status rhizome_retrieve_manifest_by_hash_prefix(const uint8_
   if (!statement)
     return RHIZOME_BUNDLE_STATUS_ERROR;
   enum rhizome_bundle_status ret = step_unpack_manifest_row(&retry, m, statement);
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   return ret;
 }
 
@@ -2027,12 +2565,21 @@ enum rhizome_bundle_status rhizome_retrieve_bar_by_hash_prefix(const uint8_t *pr
   ret = RHIZOME_BUNDLE_STATUS_SAME;
   
 end:
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   return ret;
 }
 
 // Detect bundles added from the cmdline, and call trigger functions.
 void rhizome_process_added_bundles(uint64_t up_to_rowid) {
+  // manifests in an open batch must not be announced before they are committed
+  if (batch.open)
+    rhizome_batch_commit();
+  else
+    process_added_bundles(up_to_rowid, 0);
+}
+
+static void process_added_bundles(uint64_t up_to_rowid, bool_t announce)
+{
   assert(serverMode != SERVER_NOT_RUNNING);
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
   sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
@@ -2047,13 +2594,20 @@ void rhizome_process_added_bundles(uint64_t up_to_rowid) {
       if (rhizome_manifest_verify(m)){
 	if (max_rowid < m->rowid)
 	  max_rowid = m->rowid;
+	if (announce)
+	  // This message used in tests; do not modify or remove.
+	  INFOF("RHIZOME ADD MANIFEST service=%s bid=%s version=%"PRIu64,
+		m->service ? m->service : "NULL",
+		alloca_tohex_rhizome_bid_t(m->keypair.public_key),
+		m->version
+	      );
 	CALL_TRIGGER(bundle_add, m);
 	// Note that a trigger might cause a new bundle to be added, and max_rowid to jump
       }
     }
     rhizome_manifest_free(m);
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
 }
 
 static int rhizome_delete_manifest_retry(sqlite_retry_state *retry, const rhizome_bid_t *bidp)
@@ -2101,15 +2655,18 @@ int rhizome_delete_manifest(const rhizome_bid_t *bidp)
   return rhizome_delete_manifest_retry(&retry, bidp);
 }
 
-static enum rhizome_bundle_status is_interesting(const char *id_hex, uint64_t version, uint64_t *filesizep)
+static enum rhizome_bundle_status is_interesting(const unsigned char *prefix, unsigned prefix_len, uint64_t version, uint64_t *filesizep)
 {
   IN();
 
   // do we have this bundle [or later]?
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  rhizome_bid_t low, high;
+  bid_prefix_range(prefix, prefix_len, &low, &high);
   sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
-    "SELECT version, filesize, filehash FROM MANIFESTS WHERE id LIKE ? AND version >= ?",
-    TEXT_TOUPPER, id_hex,
+    "SELECT version, filesize, filehash FROM MANIFESTS WHERE id >= ? AND id <= ? AND version >= ?",
+    RHIZOME_BID_T, &low,
+    RHIZOME_BID_T, &high,
     INT64, version,
     END);
   if (!statement)
@@ -2165,20 +2722,17 @@ static enum rhizome_bundle_status is_interesting(const char *id_hex, uint64_t ve
   }else{
     status = RHIZOME_BUNDLE_STATUS_NEW;
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
   RETURN(status);
   OUT();
 }
 
 enum rhizome_bundle_status rhizome_is_bar_interesting(const rhizome_bar_t *bar)
 {
-  char id_hex[RHIZOME_BAR_PREFIX_BYTES *2 + 2];
-  tohex(id_hex, RHIZOME_BAR_PREFIX_BYTES * 2, rhizome_bar_prefix(bar));
-  strcat(id_hex, "%");
-  return is_interesting(id_hex, rhizome_bar_version(bar), NULL);
+  return is_interesting(rhizome_bar_prefix(bar), RHIZOME_BAR_PREFIX_BYTES, rhizome_bar_version(bar), NULL);
 }
 
 enum rhizome_bundle_status rhizome_is_interesting(const rhizome_bid_t *bid, uint64_t version, uint64_t *filesizep)
 {
-  return is_interesting(alloca_tohex_rhizome_bid_t(*bid), version, filesizep);
+  return is_interesting(bid->binary, sizeof bid->binary, version, filesizep);
 }
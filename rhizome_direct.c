@@ -639,7 +639,7 @@ int rhizome_direct_get_bars(const rhizome_bid_t *bidp_low,
 
 	/* Remember the BID so that we cant write it into bid_high so that the
 	   caller knows how far we got. */
-	str_to_rhizome_bid_t(bidp_high, (const char *)sqlite3_column_text(statement, 2));
+	sqlite_column_bid(statement, 2, bidp_high);
 
 	bars_written++;
 	break;
@@ -650,7 +650,7 @@ int rhizome_direct_get_bars(const rhizome_bid_t *bidp_low,
       }
     }
   if (statement)
-    sqlite3_finalize(statement);
+    sqlite_finalize(statement);
   statement = NULL;
   
   return bars_written;
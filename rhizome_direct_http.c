@@ -844,7 +844,7 @@ static rhizome_manifest *rhizome_direct_get_manifest(unsigned char *bid_prefix,
       while (sqlite_code_busy(ret) && sqlite_retry(&retry, "sqlite3_blob_open"));
       if (!sqlite_code_ok(ret)) {
 	WHYF("sqlite3_blob_open() failed, %s", sqlite3_errmsg(rhizome_database.db));
-	sqlite3_finalize(statement);
+	sqlite_finalize(statement);
 	return NULL;
 	
       }
@@ -873,18 +873,18 @@ static rhizome_manifest *rhizome_direct_get_manifest(unsigned char *bid_prefix,
       
       DEBUGF(rhizome_direct, "Read manifest");
       sqlite3_blob_close(blob);
-      sqlite3_finalize(statement);
+      sqlite_finalize(statement);
       return m;
 
  error:
       sqlite3_blob_close(blob);
-      sqlite3_finalize(statement);
+      sqlite_finalize(statement);
       return NULL;
     }
   else 
     {
       DEBUGF(rhizome_direct, "no matching manifests");
-      sqlite3_finalize(statement);
+      sqlite_finalize(statement);
       return NULL;
     }
 
@@ -474,7 +474,7 @@ static int rhizome_import_received_bundle(struct rhizome_manifest *m)
   DEBUGF(rhizome_rx, "manifest len=%zu has %u signatories. Associated filesize=%"PRIu64" bytes", 
 	 m->manifest_all_bytes, m->sig_count, m->filesize);
   DEBUG_dump(rhizome_rx, "manifest", m->manifestdata, m->manifest_all_bytes);
-  enum rhizome_bundle_status status = rhizome_add_manifest_to_store(m, NULL);
+  enum rhizome_bundle_status status = rhizome_add_manifest_to_batch(m);
   switch (status) {
     case RHIZOME_BUNDLE_STATUS_NEW:
       return 0;
@@ -747,7 +747,7 @@ rhizome_fetch(struct rhizome_fetch_slot *slot, rhizome_manifest *m,
   // If the payload is already available, no need to fetch, so import now.
   if (result == IMPORTED) {
     DEBUGF(rhizome_rx, "   fetch not started - payload already present, so importing instead");
-    if (rhizome_add_manifest_to_store(m, NULL) == -1)
+    if (rhizome_add_manifest_to_batch(m) == -1)
       RETURN(WHY("add manifest failed"));
   }
   RETURN(result);
@@ -1236,7 +1236,9 @@ static int rhizome_write_complete(struct rhizome_fetch_slot *slot)
     // Were fetching payload, now we have it.
     DEBUGF(rhizome_rx, "Received all of file via rhizome -- now to import it");
 
+    rhizome_batch_begin();
     enum rhizome_payload_status status = rhizome_finish_write(&slot->write_state);
+    rhizome_batch_end();
     if (status != RHIZOME_PAYLOAD_STATUS_EMPTY && status != RHIZOME_PAYLOAD_STATUS_NEW) {
       rhizome_fetch_close(slot);
       RETURN(-1);
@@ -50,7 +50,7 @@ static int rhizome_file_page(httpd_request *r, const char *remainder)
     return ret;
   // backwards compatibility, rhizome_fetch used to allow HTTP/1.0 responses only
   r->http.response.header.minor_version=0;
-  http_request_response_generated(&r->http, 200, &CONTENT_TYPE_BLOB, rhizome_payload_content);
+  rhizome_payload_response(r, 200, &CONTENT_TYPE_BLOB);
   return 1;
 }
 
@@ -93,6 +93,7 @@ static int rhizome_status_page(httpd_request *r, const char *remainder)
   strbuf_puts(b, "<html><head><meta http-equiv=\"refresh\" content=\"5\" ></head><body>");
   strbuf_sprintf(b, "%d HTTP requests<br>", current_httpd_request_count);
   strbuf_sprintf(b, "%d Bundles transferring via MDP<br>", rhizome_cache_count());
+  rhizome_cache_status_html(b);
   rhizome_fetch_status_html(b);
   strbuf_puts(b, "</body></html>");
   if (strbuf_overrun(b))
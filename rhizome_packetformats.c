@@ -147,8 +147,7 @@ uint64_t rhizome_bar_bidprefix_ll(const rhizome_bar_t *bar)
 
 /* Queue an advertisment for a single manifest */
 int rhizome_advertise_manifest(struct subscriber *dest, rhizome_manifest *m){
-  struct overlay_frame *frame = malloc(sizeof(struct overlay_frame));
-  bzero(frame,sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   frame->type = OF_TYPE_RHIZOME_ADVERT;
   frame->source = get_my_subscriber(1);
   if (dest && dest->reachable&REACHABLE)
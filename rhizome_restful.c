@@ -1017,7 +1017,7 @@ static int restful_rhizome_bid_raw_bin(httpd_request *r, const char *remainder)
   int ret = rhizome_response_content_init_filehash(r, &r->manifest->filehash);
   if (ret)
     return ret;
-  http_request_response_generated(&r->http, 200, &CONTENT_TYPE_BLOB, rhizome_payload_content);
+  rhizome_payload_response(r, 200, &CONTENT_TYPE_BLOB);
   return 1;
 }
 
@@ -1036,7 +1036,7 @@ static int restful_rhizome_bid_decrypted_bin(httpd_request *r, const char *remai
   if (ret)
     return ret;
   // TODO use Content Type from manifest (once it is implemented)
-  http_request_response_generated(&r->http, 200, &CONTENT_TYPE_BLOB, rhizome_payload_content);
+  rhizome_payload_response(r, 200, &CONTENT_TYPE_BLOB);
   return 1;
 }
 
@@ -1104,6 +1104,19 @@ int rhizome_response_content_init_payload(httpd_request *r, rhizome_manifest *m)
   FATALF("rhizome_open_decrypt_read() returned status = %d", r->payload_status);
 }
 
+/* Start sending the payload opened by one of the rhizome_response_content_init_ functions.  Payloads
+ * stored in external files that need no decryption are sent directly from the file, if they have
+ * not changed since their hash was last verified.  Any others are read and hashed as they are sent
+ * by rhizome_payload_content(), which reports any that fail.
+ */
+void rhizome_payload_response(httpd_request *r, int result, const struct mime_content_type *content_type)
+{
+  if (r->u.read_state.blob_fd != -1 && !r->u.read_state.crypt && rhizome_read_verify(&r->u.read_state))
+    http_request_response_file(&r->http, result, content_type, r->u.read_state.blob_fd);
+  else
+    http_request_response_generated(&r->http, result, content_type, rhizome_payload_content);
+}
+
 int rhizome_payload_content(struct http_request *hr, unsigned char *buf, size_t bufsz, struct http_content_generator_result *result)
 {
   // Only read multiples of 4k from disk.
@@ -1113,8 +1126,11 @@ int rhizome_payload_content(struct http_request *hr, unsigned char *buf, size_t
   // Reads the next part of the payload into the supplied buffer.
   httpd_request *r = (httpd_request *) hr;
   assert(r->u.read_state.length != RHIZOME_SIZE_UNSET);
-  assert(r->u.read_state.offset < r->u.read_state.length);
-  uint64_t remain = r->u.read_state.length - r->u.read_state.offset;
+  // Stop at the end of the requested range, not the end of the payload.
+  uint64_t end = r->http.response.header.content_range_start + r->http.response.header.content_length;
+  assert(end <= r->u.read_state.length);
+  assert(r->u.read_state.offset < end);
+  uint64_t remain = end - r->u.read_state.offset;
   size_t readlen = bufsz;
   if (remain <= bufsz)
     readlen = remain;
@@ -1126,8 +1142,8 @@ int rhizome_payload_content(struct http_request *hr, unsigned char *buf, size_t
       return -1;
     result->generated = (size_t) n;
   }
-  assert(r->u.read_state.offset <= r->u.read_state.length);
-  remain = r->u.read_state.length - r->u.read_state.offset;
+  assert(r->u.read_state.offset <= end);
+  remain = end - r->u.read_state.offset;
   result->need = remain < preferred_bufsz ? remain : preferred_bufsz;
   return remain ? 1 : 0;
 }
@@ -22,6 +22,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #endif
 
 #include <assert.h>
+#include <sys/stat.h>
 #ifdef HAVE_SYS_STATVFS_H
 #  include <sys/statvfs.h>
 #else
@@ -37,8 +38,15 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "str.h"
 #include "numeric_str.h"
 #include "debug.h"
+#include "worker.h"
 
 #define RHIZOME_BUFFER_MAXIMUM_SIZE (1024*1024)
+#define RHIZOME_JOB_CHUNK_SIZE (64*1024)
+// don't use up too much address space on 32 bit devices
+#define RHIZOME_MMAP_MAXIMUM_SIZE (sizeof(void*) > 4 ? (uint64_t)1 << 32 : 64*1024*1024)
+// limits on all mapped payloads together
+#define RHIZOME_MMAP_TOTAL_SIZE (sizeof(void*) > 4 ? (uint64_t)1 << 34 : 256*1024*1024)
+#define RHIZOME_MMAP_MAXIMUM_COUNT 256
 
 uint64_t rhizome_copy_file_to_blob(int fd, uint64_t id, size_t size);
 
@@ -111,7 +119,7 @@ static uint64_t rhizome_create_fileblob(sqlite_retry_state *retry, uint64_t id,
   return rowid;
 }
 
-static int rhizome_delete_external(const rhizome_filehash_t *id)
+int rhizome_delete_external(const rhizome_filehash_t *id)
 {
   // attempt to remove any external blob & partial hash file
   char blob_path[1024];
@@ -327,7 +335,7 @@ static enum rhizome_payload_status store_make_space(uint64_t bytes, struct rhizo
       report->deleted_expired_files++;
     db_used = external_bytes + db_page_size * (db_page_count - db_free_page_count);
   }
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
 
   if (sqlite_code_busy(stepcode))
     return RHIZOME_PAYLOAD_STATUS_BUSY;
@@ -359,6 +367,7 @@ enum rhizome_payload_status rhizome_open_write(struct rhizome_write *write, cons
 
   write->blob_fd=-1;
   write->sql_blob=NULL;
+  write->job=NULL;
   
   if (expectedHashp){
     if (rhizome_exists(expectedHashp) == RHIZOME_PAYLOAD_STATUS_STORED)
@@ -440,7 +449,7 @@ static int write_get_lock(struct rhizome_write *write_state)
     DEBUGF(rhizome_store, "Writing to new blob file %s (fd=%d)", blob_path, write_state->blob_fd);
   }else{
     // use an explicit transaction so we can delay I/O failures until COMMIT so they can be retried.
-    if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1)
+    if (rhizome_db_begin(&retry) == -1)
       return -1;
     if (write_state->blob_rowid == 0){
       write_state->blob_rowid = rhizome_create_fileblob(&retry, write_state->temp_id, write_state->file_length);
@@ -453,7 +462,7 @@ static int write_get_lock(struct rhizome_write *write_state)
   return 0;
 
 fail:
-  sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+  rhizome_db_rollback(&retry);
   return -1;
 }
 
@@ -501,8 +510,8 @@ static int write_release_lock(struct rhizome_write *write_state)
   if (write_state->sql_blob){
     ret = sqlite_blob_close(write_state->sql_blob);
     sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-    if (sqlite_exec_void_retry(&retry, "COMMIT;", END) == -1){
-      sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+    if (rhizome_db_commit(&retry) == -1){
+      rhizome_db_rollback(&retry);
       ret=-1;
     }
     write_state->sql_blob=NULL;
@@ -510,6 +519,220 @@ static int write_release_lock(struct rhizome_write *write_state)
   return ret;
 }
 
+/* Once we know that a payload is going to an external file, data that arrives in file order is
+ * handed to a worker thread to be encrypted, hashed and written, so that a large import does not
+ * stall the server.  Each write has at most one batch of chunks with the worker, so the worker
+ * always sees the data in file order.  While the worker is busy it owns blob_fd and
+ * sha512_context, the server thread only advances file_offset and written_offset as data is queued.
+ * SQLite blobs are always written by the server thread, as SQLite is not built thread safe.
+ */
+struct rhizome_store_job{
+  struct work_item item;
+  struct rhizome_write *write;
+  // chunks waiting for the worker thread
+  struct rhizome_write_buffer *queued;
+  struct rhizome_write_buffer *queued_last;
+  size_t queued_size;
+  // the encryption settings in force when the queued chunks were supplied, data copied from an
+  // existing journal is queued before the payload key has been derived
+  uint8_t queued_crypt;
+  // chunks being processed by the worker thread, and the settings used to encrypt them
+  struct rhizome_write_buffer *active;
+  uint8_t crypt;
+  uint64_t tail;
+  unsigned char key[RHIZOME_CRYPT_KEY_BYTES];
+  unsigned char nonce[crypto_box_NONCEBYTES];
+  // set by the worker thread if the data could not be written
+  const char *failed;
+  int failed_errno;
+  uint8_t error;
+};
+
+static void free_chunks(struct rhizome_write_buffer **list)
+{
+  while(*list){
+    struct rhizome_write_buffer *n=*list;
+    *list=n->_next;
+    free(n);
+  }
+}
+
+// called on a worker thread, no logging
+static void store_job_work(struct work_item *item)
+{
+  struct rhizome_store_job *job = (struct rhizome_store_job *)item;
+  struct rhizome_write *write_state = job->write;
+  struct rhizome_write_buffer *chunk;
+  for (chunk = job->active; chunk; chunk = chunk->_next){
+    if (job->crypt
+      && rhizome_crypt_xor_block(
+	  chunk->data, chunk->data_size,
+	  chunk->offset + job->tail,
+	  job->key, job->nonce)){
+      job->failed = "rhizome_crypt_xor_block";
+      job->failed_errno = 0;
+      return;
+    }
+    crypto_hash_sha512_update(&write_state->sha512_context, chunk->data, chunk->data_size);
+    if (lseek64(write_state->blob_fd, (off64_t) chunk->offset, SEEK_SET) == -1){
+      job->failed = "lseek64";
+      job->failed_errno = errno;
+      return;
+    }
+    size_t ofs = 0;
+    while (ofs < chunk->data_size){
+      ssize_t r = write(write_state->blob_fd, chunk->data + ofs, chunk->data_size - ofs);
+      if (r == -1){
+	if (errno == EINTR)
+	  continue;
+	job->failed = "write";
+	job->failed_errno = errno;
+	return;
+      }
+      ofs += (size_t)r;
+    }
+  }
+}
+
+static void store_job_start(struct rhizome_store_job *job);
+
+static void store_job_completed(struct work_item *item)
+{
+  struct rhizome_store_job *job = (struct rhizome_store_job *)item;
+  free_chunks(&job->active);
+  if (job->failed){
+    errno = job->failed_errno;
+    WHYF_perror("%s(%d)", job->failed, job->write->blob_fd);
+    job->failed = NULL;
+    job->error = 1;
+  }
+  if (job->error){
+    free_chunks(&job->queued);
+    job->queued_last = NULL;
+    job->queued_size = 0;
+    return;
+  }
+  DEBUGF(rhizome_store, "Worker processed data for id='%"PRIu64"'", job->write->temp_id);
+  store_job_start(job);
+}
+
+static void store_job_start(struct rhizome_store_job *job)
+{
+  if (!job->queued || job->error || is_worker_busy(&job->item))
+    return;
+  job->active = job->queued;
+  job->queued = job->queued_last = NULL;
+  job->queued_size = 0;
+  job->crypt = job->queued_crypt;
+  if (job->crypt){
+    struct rhizome_write *write_state = job->write;
+    job->tail = write_state->tail;
+    bcopy(write_state->key, job->key, sizeof job->key);
+    bcopy(write_state->nonce, job->nonce, sizeof job->nonce);
+  }
+  if (worker_submit(&job->item) == -1){
+    // no threads available, do the work now
+    store_job_work(&job->item);
+    store_job_completed(&job->item);
+  }
+}
+
+// wait until all queued data has been written, returns -1 if any of it failed
+static int store_job_flush(struct rhizome_write *write_state)
+{
+  struct rhizome_store_job *job = write_state->job;
+  if (!job)
+    return 0;
+  store_job_start(job);
+  while (is_worker_busy(&job->item))
+    worker_wait(&job->item);
+  return job->error ? -1 : 0;
+}
+
+static int store_job_free(struct rhizome_write *write_state)
+{
+  struct rhizome_store_job *job = write_state->job;
+  if (!job)
+    return 0;
+  int ret = store_job_flush(write_state);
+  free_chunks(&job->queued);
+  free(job);
+  write_state->job = NULL;
+  return ret;
+}
+
+// Queue in order data for a worker thread.
+// Returns 1 if the data was queued, 0 if the caller should write it, -1 on error.
+static int store_job_queue(struct rhizome_write *write_state, uint8_t *buffer, size_t data_size)
+{
+  if (worker_threads() == 0 || write_state->buffer_list || write_state->sql_blob)
+    return 0;
+  if (write_state->blob_fd == -1
+    && write_state->file_length != RHIZOME_SIZE_UNSET
+    && write_state->file_length <= config.rhizome.max_blob_size)
+    return 0;
+
+  if (   write_state->file_length != RHIZOME_SIZE_UNSET
+      && write_state->file_offset + data_size > write_state->file_length)
+    return WHYF("Too much content supplied, %"PRIu64" + %zu > %"PRIu64,
+		write_state->file_offset, data_size, write_state->file_length);
+
+  if (write_get_lock(write_state) == -1)
+    return -1;
+
+  struct rhizome_store_job *job = write_state->job;
+  if (!job){
+    if ((job = emalloc_zero(sizeof *job)) == NULL)
+      return -1;
+    job->item.work = store_job_work;
+    job->item.completed = store_job_completed;
+    job->write = write_state;
+    write_state->job = job;
+  }
+  if (job->error)
+    return -1;
+  if (job->queued_crypt != write_state->crypt){
+    if (store_job_flush(write_state) == -1)
+      return -1;
+    job->queued_crypt = write_state->crypt;
+  }
+
+  while (data_size){
+    struct rhizome_write_buffer *last = job->queued_last;
+    if (!last || last->data_size >= last->buffer_size){
+      size_t size = data_size > RHIZOME_JOB_CHUNK_SIZE ? data_size : RHIZOME_JOB_CHUNK_SIZE;
+      if ((last = emalloc(size + sizeof(struct rhizome_write_buffer))) == NULL)
+	return -1;
+      last->_next = NULL;
+      last->offset = write_state->file_offset;
+      last->buffer_size = size;
+      last->data_size = 0;
+      if (job->queued_last)
+	job->queued_last->_next = last;
+      else
+	job->queued = last;
+      job->queued_last = last;
+    }
+    size_t size = last->buffer_size - last->data_size;
+    if (size > data_size)
+      size = data_size;
+    bcopy(buffer, last->data + last->data_size, size);
+    last->data_size += size;
+    job->queued_size += size;
+    write_state->file_offset += size;
+    buffer += size;
+    data_size -= size;
+  }
+  write_state->written_offset = write_state->file_offset;
+  DEBUGF(rhizome_store, "Queued %"PRIu64" of %"PRIu64, write_state->file_offset, write_state->file_length);
+
+  store_job_start(job);
+  // limit the amount of data waiting for the worker
+  if (job->queued_size >= RHIZOME_BUFFER_MAXIMUM_SIZE)
+    worker_wait(&job->item);
+  return job->error ? -1 : 1;
+}
+
 // Write data buffers in any order, the data will be cached and streamed into the database in file order. 
 // Though there is an upper bound on the amount of cached data
 int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, uint8_t *buffer, size_t data_size)
@@ -523,6 +746,18 @@ int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, uin
       && offset + data_size > write_state->file_length)
     data_size = write_state->file_length - offset;
   
+  if (   buffer && data_size && !write_state->buffer_list
+      && offset <= write_state->file_offset
+      && offset + data_size > write_state->file_offset){
+    size_t skip = write_state->file_offset - offset;
+    int r = store_job_queue(write_state, buffer + skip, data_size - skip);
+    if (r)
+      return r == -1 ? -1 : 0;
+  }
+  // anything else must wait for the worker to finish with this write
+  if (store_job_flush(write_state) == -1)
+    return -1;
+  
   struct rhizome_write_buffer **ptr = &write_state->buffer_list;
   int ret=0;
   int should_write = 0;
@@ -707,6 +942,7 @@ int is_rhizome_write_open(const struct rhizome_write *write)
 
 void rhizome_fail_write(struct rhizome_write *write)
 {
+  store_job_free(write);
   if (write->blob_fd != -1){
     DEBUGF(rhizome_store, "Closing and removing fd %d", write->blob_fd);
     close(write->blob_fd);
@@ -754,6 +990,11 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
 
   enum rhizome_payload_status status = RHIZOME_PAYLOAD_STATUS_NEW;
   
+  if (store_job_free(write) == -1) {
+    status = RHIZOME_PAYLOAD_STATUS_ERROR;
+    goto failure;
+  }
+  
   // Once the whole file has been processed, we should finally know its length
   if (write->file_length == RHIZOME_SIZE_UNSET) {
     DEBUGF(rhizome_store, "Wrote %"PRIu64" bytes, set file_length", write->file_offset);
@@ -844,8 +1085,10 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
 
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
 
-  if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1)
-    goto dbfailure;
+  if (rhizome_db_begin(&retry) == -1){
+    status = RHIZOME_PAYLOAD_STATUS_ERROR;
+    goto failure;
+  }
 
   // attempt the insert first
   time_ms_t now = gettime_ms();
@@ -903,8 +1146,10 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
   }else
     goto dbfailure;
 
-  if (sqlite_exec_void_retry(&retry, "COMMIT;", END) == -1)
+  if (rhizome_db_commit(&retry) == -1)
     goto dbfailure;
+  if (external && status == RHIZOME_PAYLOAD_STATUS_NEW)
+    rhizome_batch_add_blob(&write->id);
 
   write->blob_rowid = 0;
   // A test case in tests/rhizomeprotocol depends on this debug message:
@@ -914,7 +1159,7 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
   return status;
 
 dbfailure:
-  sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+  rhizome_db_rollback(&retry);
   status = RHIZOME_PAYLOAD_STATUS_ERROR;
 failure:
   if (status != RHIZOME_PAYLOAD_STATUS_BUSY)
@@ -1092,6 +1337,7 @@ enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const r
   read->id = *hashp;
   read->blob_rowid = 0;
   read->blob_fd = -1;
+  read->blob_map = NULL;
   read->verified = 0;
   read->offset = 0;
   read->hash_offset = 0;
@@ -1167,9 +1413,117 @@ enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const r
   return RHIZOME_PAYLOAD_STATUS_NEW;
 }
 
+/* External blobs can be mapped into memory, so that repeated small reads (eg, serving MDP blocks
+ * from the read cache) become a copy from the page cache instead of lseek(2) and read(2).  A mapping
+ * is shared by every reader of the same payload, found by payload hash.  Payload files are never
+ * modified in place by the store, so the mapping stays valid even if the file is removed.  Anything
+ * else that truncated the file would turn a copy from the mapping into SIGBUS, so the file size is
+ * checked when it is mapped, and again by rhizome_read_verify(), but not on every copy.  Once the
+ * total size or number of mappings reaches its limit, further payloads are read from their file.
+ */
+struct rhizome_blob_map{
+  struct rhizome_blob_map *_next;
+  rhizome_filehash_t id;
+  unsigned refs;
+  unsigned char *data;
+  size_t length;
+};
+#define BLOB_MAP_BUCKETS 64
+static struct rhizome_blob_map *blob_maps[BLOB_MAP_BUCKETS];
+static unsigned blob_maps_count = 0;
+static uint64_t blob_maps_size = 0;
+
+static struct rhizome_blob_map **blob_map_bucket(const rhizome_filehash_t *id)
+{
+  return &blob_maps[(id->binary[0] | id->binary[1] << 8) & (BLOB_MAP_BUCKETS - 1)];
+}
+
+// Returns 1 if the payload is now mapped, 0 if it will be read from the file or database.
+int rhizome_read_map(struct rhizome_read *read)
+{
+  if (read->blob_map)
+    return 1;
+  if (   read->blob_fd == -1
+      || read->length == RHIZOME_SIZE_UNSET
+      || read->length == 0
+      || read->length > RHIZOME_MMAP_MAXIMUM_SIZE)
+    return 0;
+  struct rhizome_blob_map **bucket = blob_map_bucket(&read->id);
+  struct rhizome_blob_map *map;
+  for (map = *bucket; map; map = map->_next)
+    if (map->length == read->length && cmp_rhizome_filehash_t(&map->id, &read->id) == 0)
+      break;
+  if (!map){
+    if (   blob_maps_count >= RHIZOME_MMAP_MAXIMUM_COUNT
+	|| blob_maps_size + read->length > RHIZOME_MMAP_TOTAL_SIZE)
+      return 0;
+    struct stat st;
+    if (fstat(read->blob_fd, &st) == -1){
+      WARNF_perror("fstat(%d)", read->blob_fd);
+      return 0;
+    }
+    if ((uint64_t)st.st_size != read->length){
+      DEBUGF(rhizome_store, "Payload %s is %"PRIu64" bytes, expected %"PRIu64", not mapping it",
+	     alloca_tohex_rhizome_filehash_t(read->id), (uint64_t)st.st_size, read->length);
+      return 0;
+    }
+    unsigned char *addr = mmap(NULL, (size_t)read->length, PROT_READ, MAP_SHARED, read->blob_fd, 0);
+    if (addr == MAP_FAILED){
+      WARNF_perror("mmap(NULL,%"PRIu64",PROT_READ,MAP_SHARED,%d,0)", read->length, read->blob_fd);
+      return 0;
+    }
+    if ((map = emalloc_zero(sizeof *map)) == NULL){
+      munmap(addr, (size_t)read->length);
+      return 0;
+    }
+    map->id = read->id;
+    map->data = addr;
+    map->length = (size_t)read->length;
+    map->_next = *bucket;
+    *bucket = map;
+    blob_maps_count++;
+    blob_maps_size += map->length;
+    DEBUGF(rhizome_store, "Mapped %zu bytes of payload %s from fd %d", map->length, alloca_tohex_rhizome_filehash_t(map->id), read->blob_fd);
+  }
+  map->refs++;
+  read->blob_map = map;
+  return 1;
+}
+
+static void rhizome_read_unmap(struct rhizome_read *read)
+{
+  struct rhizome_blob_map *map = read->blob_map;
+  if (!map)
+    return;
+  read->blob_map = NULL;
+  assert(map->refs > 0);
+  if (--map->refs)
+    return;
+  struct rhizome_blob_map **ptr = blob_map_bucket(&map->id);
+  while (*ptr != map)
+    ptr = &(*ptr)->_next;
+  *ptr = map->_next;
+  assert(blob_maps_count > 0 && blob_maps_size >= map->length);
+  blob_maps_count--;
+  blob_maps_size -= map->length;
+  DEBUGF(rhizome_store, "Unmapping payload %s", alloca_tohex_rhizome_filehash_t(map->id));
+  if (munmap(map->data, map->length) == -1)
+    WARNF_perror("munmap(%p,%zu)", map->data, map->length);
+  free(map);
+}
+
 static ssize_t rhizome_read_retry(sqlite_retry_state *retry, struct rhizome_read *read_state, unsigned char *buffer, size_t bufsz)
 {
   IN();
+  if (read_state->blob_map) {
+    assert(read_state->offset <= read_state->length);
+    if (bufsz + read_state->offset > read_state->length)
+      bufsz = read_state->length - read_state->offset;
+    if (buffer == NULL || bufsz == 0)
+      RETURN(0);
+    bcopy(read_state->blob_map->data + read_state->offset, buffer, bufsz);
+    RETURN(bufsz);
+  }
   if (read_state->blob_fd != -1) {
     assert(read_state->offset <= read_state->length);
     if (lseek64(read_state->blob_fd, (off64_t) read_state->offset, SEEK_SET) == -1)
@@ -1264,11 +1618,60 @@ ssize_t rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, siz
   OUT();
 }
 
+// the time a file was last modified, in the same units as gettime_ms()
+static time_ms_t stat_mtime_ms(const struct stat *st)
+{
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+  return (time_ms_t)st->st_mtim.tv_sec * 1000 + st->st_mtim.tv_nsec / 1000000;
+#else
+  // only the second is known, so assume the end of it
+  return (time_ms_t)st->st_mtime * 1000 + 999;
+#endif
+}
+
+/* Payloads sent straight from their external file (eg, with sendfile(2)) never pass through the
+ * hashing in rhizome_read().  FILES.last_verified records when a payload was last known to match
+ * its hash, either when it was stored or after it was read in full, so the file can be sent
+ * directly if it has not been modified since.  Otherwise it must be sent through rhizome_read(),
+ * which hashes it as it goes and updates last_verified when it closes.
+ * Returns 1 if the external payload can be sent without reading it, 0 if not.
+ */
+int rhizome_read_verify(struct rhizome_read *read)
+{
+  if (read->verified)
+    return read->verified == 1;
+  if (read->blob_fd == -1 || read->length == RHIZOME_SIZE_UNSET)
+    return 0;
+  uint64_t last_verified = 0;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_exec_uint64_retry(&retry, &last_verified, "SELECT last_verified FROM FILES WHERE id = ?",
+	RHIZOME_FILEHASH_T, &read->id, END) != SQLITE_ROW || last_verified == 0)
+    return 0;
+  struct stat st;
+  if (fstat(read->blob_fd, &st) == -1) {
+    WHYF_perror("fstat(%d)", read->blob_fd);
+    return 0;
+  }
+  if ((uint64_t)st.st_size != read->length || stat_mtime_ms(&st) > (time_ms_t)last_verified) {
+    DEBUGF(rhizome_store, "Payload %s has changed since it was verified, reading it instead",
+	   alloca_tohex_rhizome_filehash_t(read->id));
+    // and not from a mapping of a file that may now be shorter
+    if ((uint64_t)st.st_size != read->length)
+      rhizome_read_unmap(read);
+    return 0;
+  }
+  return 1;
+}
+
 /* Read len bytes from read->offset into data, using *buffer to cache any reads */
 ssize_t rhizome_read_buffered(struct rhizome_read *read, struct rhizome_read_buffer *buffer, unsigned char *data, size_t len)
 {
+  // a mapped payload can be copied and decrypted straight into the caller's buffer
+  if (read->blob_map)
+    return rhizome_read(read, data, len);
+
   size_t bytes_copied=0;
-  
+
   while (len>0){
     //DEBUGF(rhizome_store, "len=%zu read->length=%"PRIu64" read->offset=%"PRIu64" buffer->offset=%"PRIu64"", len, read->length, read->offset, buffer->offset);
     // make sure we only attempt to read data that actually exists
@@ -1346,6 +1749,7 @@ void rhizome_read_close(struct rhizome_read *read)
     // bzero'd & never opened, or already closed
     return;
 
+  rhizome_read_unmap(read);
   if (read->blob_fd != -1) {
     DEBUGF(rhizome_store, "Closing store fd %d", read->blob_fd);
     close(read->blob_fd);
@@ -1369,64 +1773,156 @@ void rhizome_read_close(struct rhizome_read *read)
   read->tail = 0;
 }
 
+/* Payloads being served to peers in blocks (see overlay_mdp_rhizome.c) are held open, indexed by
+ * bundle id and version.  Entries are kept in least recently used order, so when too many payloads
+ * are open the entry that was used longest ago is closed first, and when too many bytes are mapped
+ * into memory the least recently used mapped entry is closed.  Idle entries are also closed when
+ * they expire.  The hash table has at least as many buckets as config.rhizome.mdp.cache_entries.
+ */
 struct cache_entry{
-  struct cache_entry *_left;
-  struct cache_entry *_right;
+  struct cache_entry *_hash_next;
+  struct cache_entry *_lru_prev;
+  struct cache_entry *_lru_next;
   rhizome_bid_t bundle_id;
   uint64_t version;
   struct rhizome_read read_state;
+  // number of bytes counted against config.rhizome.mdp.cache_size
+  uint64_t mapped;
   time_ms_t expires;
 };
-struct cache_entry *root;
 
-static struct cache_entry ** find_entry_location(struct cache_entry **ptr, const rhizome_bid_t *bundle_id, uint64_t version)
+static struct cache_entry **cache_buckets = NULL;
+static unsigned cache_bucket_count = 0;
+// most recently used first
+static struct cache_entry *cache_lru_head = NULL;
+static struct cache_entry *cache_lru_tail = NULL;
+static unsigned cache_entries = 0;
+static uint64_t cache_mapped = 0;
+static uint64_t cache_hits = 0;
+static uint64_t cache_misses = 0;
+static uint64_t cache_evictions = 0;
+
+static unsigned cache_bucket(const rhizome_bid_t *bundle_id, uint64_t version)
+{
+  // bundle ids are public keys, so any of their bytes will do
+  uint32_t h = ((uint32_t)bundle_id->binary[0] << 24 | (uint32_t)bundle_id->binary[1] << 16
+	      | (uint32_t)bundle_id->binary[2] << 8 | bundle_id->binary[3]) ^ (uint32_t)version;
+  return h & (cache_bucket_count - 1);
+}
+
+// resize the table to suit config.rhizome.mdp.cache_entries, which may change at any time
+static int cache_buckets_resize()
+{
+  unsigned size = 1;
+  while (size < config.rhizome.mdp.cache_entries && size < 0x80000000u)
+    size <<= 1;
+  if (size == cache_bucket_count)
+    return 0;
+  struct cache_entry **buckets = (struct cache_entry **)emalloc_zero(size * sizeof *buckets);
+  if (!buckets)
+    return -1;
+  free(cache_buckets);
+  cache_buckets = buckets;
+  cache_bucket_count = size;
+  struct cache_entry *entry;
+  for (entry = cache_lru_head; entry; entry = entry->_lru_next) {
+    struct cache_entry **bucket = &cache_buckets[cache_bucket(&entry->bundle_id, entry->version)];
+    entry->_hash_next = *bucket;
+    *bucket = entry;
+  }
+  return 0;
+}
+
+static struct cache_entry ** find_entry_location(const rhizome_bid_t *bundle_id, uint64_t version)
 {
+  struct cache_entry **ptr = &cache_buckets[cache_bucket(bundle_id, version)];
   while(*ptr){
     struct cache_entry *entry = *ptr;
-    int cmp = cmp_rhizome_bid_t(bundle_id, &entry->bundle_id);
-    if (cmp==0){
-      if (entry->version==version)
-	break;
-      if (version < entry->version)
-	ptr = &entry->_left;
-      else
-	ptr = &entry->_right;
-      continue;
-    }
-    if (cmp<0)
-      ptr = &entry->_left;
-    else
-      ptr = &entry->_right;
+    if (entry->version == version && cmp_rhizome_bid_t(bundle_id, &entry->bundle_id) == 0)
+      break;
+    ptr = &entry->_hash_next;
   }
   return ptr;
 }
 
-static time_ms_t close_entries(struct cache_entry **entry, time_ms_t timeout)
+static void cache_lru_unlink(struct cache_entry *entry)
 {
-  if (!*entry)
-    return 0;
-    
-  time_ms_t ret = close_entries(&(*entry)->_left, timeout);
-  time_ms_t t_right = close_entries(&(*entry)->_right, timeout);
-  if (t_right!=0 && (t_right < ret || ret==0))
-    ret=t_right;
-    
-  if ((*entry)->expires < timeout || timeout==0){
-    rhizome_read_close(&(*entry)->read_state);
-    // remember the two children
-    struct cache_entry *left=(*entry)->_left;
-    struct cache_entry *right=(*entry)->_right;
-    // free this entry
-    free(*entry);
-    // re-add both children to the tree
-    *entry=left;
-    if (right){
-      entry = find_entry_location(entry, &right->bundle_id, right->version);
-      *entry=right;
+  if (entry->_lru_prev)
+    entry->_lru_prev->_lru_next = entry->_lru_next;
+  else
+    cache_lru_head = entry->_lru_next;
+  if (entry->_lru_next)
+    entry->_lru_next->_lru_prev = entry->_lru_prev;
+  else
+    cache_lru_tail = entry->_lru_prev;
+  entry->_lru_prev = entry->_lru_next = NULL;
+}
+
+static void cache_lru_push(struct cache_entry *entry)
+{
+  entry->_lru_prev = NULL;
+  entry->_lru_next = cache_lru_head;
+  if (cache_lru_head)
+    cache_lru_head->_lru_prev = entry;
+  else
+    cache_lru_tail = entry;
+  cache_lru_head = entry;
+}
+
+static void close_entry(struct cache_entry *entry)
+{
+  struct cache_entry **ptr = find_entry_location(&entry->bundle_id, entry->version);
+  assert(*ptr == entry);
+  *ptr = entry->_hash_next;
+  cache_lru_unlink(entry);
+  assert(cache_entries > 0);
+  cache_entries--;
+  assert(cache_mapped >= entry->mapped);
+  cache_mapped -= entry->mapped;
+  rhizome_read_close(&entry->read_state);
+  free(entry);
+}
+
+// close an entry to make room for another
+static void evict_entry(struct cache_entry *entry)
+{
+  DEBUGF(rhizome_store, "Evicting cached payload for bid=%s version=%"PRIu64,
+	 alloca_tohex_rhizome_bid_t(entry->bundle_id), entry->version);
+  cache_evictions++;
+  close_entry(entry);
+}
+
+// close the least recently used mapped entries until size more bytes can be mapped, returns -1 if
+// that is not possible because nothing else is mapped
+static int evict_mapped(uint64_t size)
+{
+  struct cache_entry *entry = cache_lru_tail;
+  while (cache_mapped + size > config.rhizome.mdp.cache_size) {
+    while (entry && !entry->mapped)
+      entry = entry->_lru_prev;
+    if (!entry)
+      return -1;
+    struct cache_entry *prev = entry->_lru_prev;
+    evict_entry(entry);
+    entry = prev;
+  }
+  return 0;
+}
+
+// close entries that have expired, and return the time the next one will expire
+static time_ms_t close_entries(time_ms_t timeout)
+{
+  time_ms_t ret = 0;
+  struct cache_entry *entry = cache_lru_head;
+  while(entry){
+    struct cache_entry *next = entry->_lru_next;
+    if (entry->expires < timeout || timeout==0){
+      close_entry(entry);
+    }else{
+      if (entry->expires < ret || ret==0)
+	ret=entry->expires;
     }
-  }else{
-    if ((*entry)->expires < ret || ret==0)
-      ret=(*entry)->expires;
+    entry = next;
   }
   return ret;
 }
@@ -1434,7 +1930,7 @@ static time_ms_t close_entries(struct cache_entry **entry, time_ms_t timeout)
 // close any expired cache entries
 static void rhizome_cache_alarm(struct sched_ent *alarm)
 {
-  alarm->alarm = close_entries(&root, gettime_ms());
+  alarm->alarm = close_entries(gettime_ms());
   if (alarm->alarm){
     alarm->deadline = alarm->alarm + 1000;
     schedule(alarm);
@@ -1452,38 +1948,51 @@ static struct sched_ent cache_alarm={
 // close all cache entries
 int rhizome_cache_close()
 {
-  close_entries(&root, 0);
+  close_entries(0);
   unschedule(&cache_alarm);
   return 0;
 }
 
-static int _rhizome_cache_count(struct cache_entry *entry)
+int rhizome_cache_count()
 {
-  if (!entry)
-    return 0;
-  return 1+_rhizome_cache_count(entry->_left)+_rhizome_cache_count(entry->_right);
+  return cache_entries;
 }
 
-int rhizome_cache_count()
+int rhizome_cache_status_html(struct strbuf *b)
 {
-  return _rhizome_cache_count(root);
+  strbuf_sprintf(b, "<p>Payload cache: %u of %u open, %"PRIu64" of %"PRIu64" bytes mapped, "
+      "%"PRIu64" hits, %"PRIu64" misses, %"PRIu64" evictions",
+      cache_entries, config.rhizome.mdp.cache_entries,
+      cache_mapped, config.rhizome.mdp.cache_size,
+      cache_hits, cache_misses, cache_evictions);
+  return 0;
 }
 
 // read a block of data, caching meta data for reuse
 ssize_t rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms_t timeout, uint64_t fileOffset, unsigned char *buffer, size_t length)
 {
   // look for a cached entry
-  struct cache_entry **ptr = find_entry_location(&root, bidp, version);
-  struct cache_entry *entry = *ptr;
+  if (cache_buckets_resize() == -1)
+    return -1;
+  struct cache_entry *entry = *find_entry_location(bidp, version);
   
-  // if we don't have one yet, create one and open it
-  if (!entry){
+  if (entry){
+    cache_hits++;
+    if (entry != cache_lru_head){
+      cache_lru_unlink(entry);
+      cache_lru_push(entry);
+    }
+  }else{
+    // if we don't have one yet, create one and open it
+    cache_misses++;
     rhizome_filehash_t filehash;
     if (rhizome_database_filehash_from_id(bidp, version, &filehash) != 0){
       DEBUGF(rhizome_store, "Payload not found for bundle bid=%s version=%"PRIu64, 
 	     alloca_tohex_rhizome_bid_t(*bidp), version);
       return -1;
     }
+    while (cache_entries && cache_entries >= config.rhizome.mdp.cache_entries)
+      evict_entry(cache_lru_tail);
     entry = emalloc_zero(sizeof(struct cache_entry));
     if (entry == NULL)
       return -1;
@@ -1504,9 +2013,26 @@ ssize_t rhizome_read_cached(const rhizome_bid_t *bidp, uint64_t version, time_ms
       default:
 	FATALF("status = %d", status);
     }
+    // small random reads are cheaper from memory, if we can make room for the whole payload
+    uint64_t size = entry->read_state.length;
+    if (   entry->read_state.blob_fd != -1
+	&& size != RHIZOME_SIZE_UNSET
+	&& size <= config.rhizome.mdp.cache_size
+	&& evict_mapped(size) == 0){
+      if (rhizome_read_map(&entry->read_state) == 1){
+	entry->mapped = size;
+	cache_mapped += size;
+      }
+    }
     entry->bundle_id = *bidp;
     entry->version = version;
+    struct cache_entry **ptr = find_entry_location(bidp, version);
+    assert(*ptr == NULL);
     *ptr = entry;
+    cache_lru_push(entry);
+    cache_entries++;
+    DEBUGF(rhizome_store, "Cached payload for bid=%s version=%"PRIu64", %u open, %"PRIu64" bytes mapped",
+	   alloca_tohex_rhizome_bid_t(entry->bundle_id), entry->version, cache_entries, cache_mapped);
   }
   
   entry->read_state.offset = fileOffset;
@@ -1652,7 +2178,7 @@ uint64_t rhizome_copy_file_to_blob(int fd, uint64_t id, size_t size)
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
 
   // use an explicit transaction so we can delay I/O failures until COMMIT so they can be retried.
-  if (sqlite_exec_void_retry(&retry, "BEGIN TRANSACTION;", END) == -1)
+  if (rhizome_db_begin(&retry) == -1)
     return 0;
 
   sqlite3_blob *blob = NULL;
@@ -1688,7 +2214,7 @@ uint64_t rhizome_copy_file_to_blob(int fd, uint64_t id, size_t size)
   sqlite_blob_close(blob);
   blob = NULL;
 
-  if (sqlite_exec_void_retry(&retry, "COMMIT;", END) == -1)
+  if (rhizome_db_commit(&retry) == -1)
     goto fail;
 
   return rowid;
@@ -1696,7 +2222,7 @@ uint64_t rhizome_copy_file_to_blob(int fd, uint64_t id, size_t size)
 fail:
   if (blob)
     sqlite_blob_close(blob);
-  sqlite_exec_void_retry(&retry, "ROLLBACK;", END);
+  rhizome_db_rollback(&retry);
   return 0;
 }
 
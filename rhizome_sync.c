@@ -486,7 +486,7 @@ static void sync_send_response(struct subscriber *dest, int forwards, uint64_t t
     }
   }
 
-  sqlite3_finalize(statement);
+  sqlite_finalize(statement);
 
   // send a zero lower bound if we reached the end of our manifest list
   if (count && count < max_count && !forwards){
@@ -235,7 +235,9 @@ static int sync_complete_transfers(){
     assert(transfer->state == STATE_COMPLETING);
 
     if (transfer->write){
+      rhizome_batch_begin();
       enum rhizome_payload_status status = rhizome_finish_write(transfer->write);
+      rhizome_batch_end();
       if (status == RHIZOME_PAYLOAD_STATUS_BUSY)
 	return 1;
 
@@ -250,7 +252,7 @@ static int sync_complete_transfers(){
       }
     }
 
-    enum rhizome_bundle_status add_state = rhizome_add_manifest_to_store(transfer->manifest, NULL);
+    enum rhizome_bundle_status add_state = rhizome_add_manifest_to_batch(transfer->manifest);
     switch(add_state){
       case RHIZOME_BUNDLE_STATUS_BUSY:
 	return 1;
@@ -596,32 +598,90 @@ static void sync_peer_now_has (void * UNUSED(context), void *peer_context, void
     alloca_sync_key(key));
 }
 
-// this is probably fast enough. For huge stores, or slow storage media
-// we might need to use an alarm to slowly build this tree
-static void build_tree()
+/* Add up to 'limit' stored manifests whose rowid follows *rowid to the tree,
+ * advancing *rowid past them.  Returns the number of manifests read, so fewer
+ * than 'limit' means the whole table has been read, or -1 on error.
+ */
+int rhizome_sync_keys_load(struct sync_state *tree, uint64_t *rowid, unsigned limit)
 {
-  sync_tree = sync_alloc_state(NULL, sync_peer_has, sync_peer_does_not_have, sync_peer_now_has);
-  
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  sqlite3_stmt *statement = sqlite_prepare(&retry, "SELECT id, version, manifest_hash FROM manifests "
-    "WHERE manifests.filehash IS NULL OR EXISTS(SELECT 1 FROM files WHERE files.id = manifests.filehash);");
-  while (sqlite_step_retry(&retry, statement) == SQLITE_ROW) {
-    const char *q_id = (const char *) sqlite3_column_text(statement, 0);
-    uint64_t q_version = sqlite3_column_int64(statement, 1);
-    const char *hash = (const char *) sqlite3_column_text(statement, 2);
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+    "SELECT rowid, id, version, manifest_hash FROM manifests "
+    "WHERE rowid > ? AND (manifests.filehash IS NULL OR EXISTS(SELECT 1 FROM files WHERE files.id = manifests.filehash)) "
+    "ORDER BY rowid LIMIT ?;",
+    INT64, *rowid, INT, limit, END);
+  if (!statement)
+    return -1;
+  int count = 0;
+  int stepcode;
+  while ((stepcode = sqlite_step_retry(&retry, statement)) == SQLITE_ROW) {
+    uint64_t q_rowid = sqlite3_column_int64(statement, 0);
+    uint64_t q_version = sqlite3_column_int64(statement, 2);
+    const char *hash = (const char *) sqlite3_column_text(statement, 3);
 
     rhizome_filehash_t manifest_hash;
     if (str_to_rhizome_filehash_t(&manifest_hash, hash)==0){
       sync_key_t key;
       memcpy(key.key, manifest_hash.binary, sizeof(sync_key_t));
       DEBUGF(rhizome_sync_keys, "Adding %s:%"PRIu64" (hash %s) to tree",
-	q_id,
+	alloca_tohex(sqlite3_column_blob(statement, 1), sqlite3_column_bytes(statement, 1)),
 	q_version,
 	alloca_sync_key(&key));
-      sync_add_key(sync_tree, &key, NULL);
+      // stop before this manifest, so it will be added by the next call
+      if (sync_add_key(tree, &key, NULL) == -1){
+	sqlite_finalize(statement);
+	return -1;
+      }
     }
+    *rowid = q_rowid;
+    count++;
+  }
+  sqlite_finalize(statement);
+  return sqlite_code_ok(stepcode) ? count : -1;
+}
+
+// Reading every manifest in one go would block the event loop for seconds on
+// a large store, so the tree is filled in by an alarm, a chunk at a time.
+// Until it has been completely read, we neither advertise our keys nor
+// compare them with our neighbours.
+#define BUILD_TREE_CHUNK (1000)
+
+static uint64_t build_tree_rowid = 0;
+static bool_t tree_complete = 0;
+
+DECLARE_ALARM(sync_send_keys);
+DEFINE_ALARM(sync_build_tree);
+void sync_build_tree(struct sched_ent *alarm)
+{
+  if (!sync_tree)
+    return;
+  time_ms_t start = gettime_ms();
+  int r = rhizome_sync_keys_load(sync_tree, &build_tree_rowid, BUILD_TREE_CHUNK);
+  time_ms_t now = gettime_ms();
+  if (r == BUILD_TREE_CHUNK){
+    DEBUGF(rhizome_sync_keys, "Read manifests up to rowid %"PRIu64" in %"PRId64"ms",
+      build_tree_rowid, now - start);
+    RESCHEDULE(alarm, now, now, TIME_MS_NEVER_WILL);
+    return;
   }
-  sqlite3_finalize(statement);
+  if (r == -1){
+    // try again later, from where we left off
+    RESCHEDULE(alarm, now+1000, now+1000, TIME_MS_NEVER_WILL);
+    return;
+  }
+  DEBUG(rhizome_sync_keys, "Finished building tree");
+  tree_complete = 1;
+  if (link_has_neighbours())
+    RESCHEDULE(&ALARM_STRUCT(sync_send_keys), now, now, TIME_MS_NEVER_WILL);
+}
+
+static void build_tree()
+{
+  sync_tree = sync_alloc_state(NULL, sync_peer_has, sync_peer_does_not_have, sync_peer_now_has);
+  build_tree_rowid = 0;
+  tree_complete = 0;
+  time_ms_t now = gettime_ms();
+  RESCHEDULE(&ALARM_STRUCT(sync_build_tree), now, now, TIME_MS_NEVER_WILL);
 }
 
 DEFINE_ALARM(sync_send_keys);
@@ -629,6 +689,8 @@ void sync_send_keys(struct sched_ent *alarm)
 {
   if (!sync_tree)
     build_tree();
+  if (!tree_complete)
+    return;
   
   uint8_t buff[MDP_MTU];
   size_t len = sync_build_message(sync_tree, buff, sizeof buff);
@@ -783,7 +845,7 @@ static int process_transfer_message(struct subscriber *peer, struct rhizome_sync
 
 	switch(status){
 	  case RHIZOME_PAYLOAD_STATUS_STORED:{
-	      enum rhizome_bundle_status add_status = rhizome_add_manifest_to_store(m, NULL);
+	      enum rhizome_bundle_status add_status = rhizome_add_manifest_to_batch(m);
 	      if (add_status == RHIZOME_BUNDLE_STATUS_BUSY){
 		// don't consume the payload
 		rhizome_manifest_free(m);
@@ -820,6 +882,9 @@ static int process_transfer_message(struct subscriber *peer, struct rhizome_sync
 	  break;
 	}
 	
+	// while the payload arrives, verify the signature along with any others from this burst
+	rhizome_manifest_queue_verify(m);
+	
 	if (m->is_journal){
 	  // if we're fetching a journal bundle, copy any bytes we have of a previous version
 	  // and therefore work out what range of bytes we still need
@@ -839,10 +904,12 @@ static int process_transfer_message(struct subscriber *peer, struct rhizome_sync
 	  
 	  if (write->file_offset >= m->filesize){
 	    // no new content in the new version, we can import now
+	    rhizome_batch_begin();
 	    enum rhizome_payload_status status = rhizome_finish_write(write);
+	    rhizome_batch_end();
 
 	    if (status == RHIZOME_PAYLOAD_STATUS_NEW || status == RHIZOME_PAYLOAD_STATUS_STORED){
-	      enum rhizome_bundle_status add_state = rhizome_add_manifest_to_store(m, NULL);
+	      enum rhizome_bundle_status add_state = rhizome_add_manifest_to_batch(m);
 	      DEBUGF(rhizome_sync_keys, "Import %s = %s", 
 		alloca_sync_key(&key), rhizome_bundle_status_message_nonnull(add_state));
 	    } else {
@@ -901,6 +968,8 @@ static int process_transfer_message(struct subscriber *peer, struct rhizome_sync
 	  break;
 	}
 	rhizome_manifest_free(m);
+	// other peers are likely to ask for the same payload
+	rhizome_read_map(read);
 	
 	struct transfers *transfer = *find_and_update_transfer(peer, sync_state, &key, STATE_SEND_PAYLOAD, rank);
 	transfer->read = read;
@@ -961,6 +1030,10 @@ static int sync_keys_recv(struct internal_mdp_header *header, struct overlay_buf
   header->source->sync_version = 1;
   
   if (!header->destination){
+    if (!tree_complete){
+      DEBUG(rhizome_sync_keys, "Ignoring message, tree not built yet");
+      return 0;
+    }
     if (IF_DEBUG(rhizome_sync_keys)){
       DEBUGF(rhizome_sync_keys,"Processing message from %s", alloca_tohex_sid_t(header->source->sid));
       //dump("Raw message", ob_current_ptr(payload), ob_remaining(payload));
@@ -1046,6 +1119,7 @@ static void sync_config_changed(){
     DEBUG(rhizome_sync_keys,"Stop queueing messages");
     unschedule(&ALARM_STRUCT(sync_send_keys));
     unschedule(&ALARM_STRUCT(sync_keys_status));
+    unschedule(&ALARM_STRUCT(sync_build_tree));
 
     if (sync_tree){
       sync_free_state(sync_tree);
@@ -1066,7 +1140,15 @@ static void sync_bundle_add(rhizome_manifest *m)
   memcpy(key.key, m->manifesthash.binary, sizeof(sync_key_t));
   DEBUGF(rhizome_sync_keys, "Adding %s to tree",
     alloca_sync_key(&key));
-  sync_add_key(sync_tree, &key, NULL);
+  if (sync_add_key(sync_tree, &key, NULL) == -1){
+    // read the missing manifest again when the build alarm next fires
+    if (m->rowid <= build_tree_rowid)
+      build_tree_rowid = m->rowid - 1;
+    tree_complete = 0;
+    time_ms_t next = gettime_ms() + 1000;
+    RESCHEDULE(&ALARM_STRUCT(sync_build_tree), next, next, TIME_MS_NEVER_WILL);
+    return;
+  }
   
   if (link_has_neighbours()){
     struct sched_ent *alarm = &ALARM_STRUCT(sync_send_keys);
@@ -1079,3 +1161,22 @@ static void sync_bundle_add(rhizome_manifest *m)
 }
 
 DEFINE_TRIGGER(bundle_add, sync_bundle_add);
+
+static int restart_peer_sync(void **record, void *UNUSED(context))
+{
+  struct subscriber *peer = *record;
+  if (peer->sync_keys_state && peer->sync_keys_state->connection)
+    free_peer_sync_state(peer);
+  return 0;
+}
+
+static void sync_batch_rollback()
+{
+  // A peer only offers a bundle once, then waits until we say we have it.  So stopping the
+  // connection to each peer that has been sending us bundles makes it forget what we are missing,
+  // and start offering them again.
+  DEBUG(rhizome_sync_keys, "Restarting sync with connected peers");
+  enum_subscribers(NULL, restart_peer_sync, NULL);
+}
+
+DEFINE_TRIGGER(batch_rollback, sync_batch_rollback);
@@ -0,0 +1,510 @@
+/*
+ Serval DNA - Rhizome benchmarks
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <sodium.h>
+#include "cli.h"
+#include "conf.h"
+#include "commandline.h"
+#include "rhizome.h"
+#include "instance.h"
+#include "os.h"
+#include "mem.h"
+#include "debug.h"
+#include "sync_keys.h"
+#include "str.h"
+#include "test_cli.h"
+
+DEFINE_FEATURE(cli_rhizome_tests);
+
+int rhizome_test_begin(sqlite_retry_state *retry)
+{
+  if (create_serval_instance_dir() == -1)
+    return -1;
+  if (rhizome_opendb() == -1)
+    return -1;
+  return sqlite_exec_void_retry(retry, "BEGIN TRANSACTION;", END);
+}
+
+void rhizome_test_rollback(sqlite_retry_state *retry)
+{
+  sqlite_exec_void_retry(retry, "ROLLBACK;", END);
+}
+
+#define LOOKUP_SQL "SELECT filehash FROM MANIFESTS WHERE id = ? AND version = ?;"
+
+// look up a manifest the way we used to, parsing the query every time
+static int lookup_unprepared(const rhizome_bid_t *bid, uint64_t version)
+{
+  sqlite3_stmt *statement = NULL;
+  if (sqlite3_prepare_v2(rhizome_database.db, LOOKUP_SQL, -1, &statement, NULL) != SQLITE_OK)
+    return WHYF("query invalid, %s", sqlite3_errmsg(rhizome_database.db));
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (sqlite_bind(&retry, statement, RHIZOME_BID_T, bid, INT64, version, END) == -1)
+    return -1;
+  int stepcode = sqlite_step_retry(&retry, statement);
+  sqlite3_finalize(statement);
+  return stepcode == SQLITE_ROW ? 0 : -1;
+}
+
+static int lookup_cached(const rhizome_bid_t *bid, uint64_t version)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry, LOOKUP_SQL, RHIZOME_BID_T, bid, INT64, version, END);
+  if (!statement)
+    return -1;
+  int stepcode = sqlite_step_retry(&retry, statement);
+  sqlite_finalize(statement);
+  return stepcode == SQLITE_ROW ? 0 : -1;
+}
+
+DEFINE_CMD(app_rhizome_lookup_test, 0,
+   "Run Rhizome manifest lookup speed test",
+   "test","rhizome","lookup");
+static int app_rhizome_lookup_test(const struct cli_parsed *UNUSED(parsed), struct cli_context *context)
+{
+  const unsigned count = 1000;
+  rhizome_bid_t *bids = emalloc(sizeof(rhizome_bid_t) * count);
+  if (!bids)
+    return -1;
+  int ret = -1;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (rhizome_test_begin(&retry) == -1)
+    goto end;
+  unsigned i;
+  for (i = 0; i < count; ++i){
+    randombytes_buf(bids[i].binary, sizeof bids[i].binary);
+    if (sqlite_exec_void_retry(&retry,
+	  "INSERT INTO MANIFESTS(id, version, inserttime, filesize, service) VALUES(?, ?, ?, 0, 'test');",
+	  RHIZOME_BID_T, &bids[i], INT64, (int64_t)i, INT64, gettime_ms(), END) == -1)
+      goto rollback;
+  }
+  const char *names[] = {"unprepared", "cached"};
+  int (*lookups[])(const rhizome_bid_t *, uint64_t) = {lookup_unprepared, lookup_cached};
+  unsigned l;
+  for (l = 0; l < NELS(lookups); ++l){
+    struct test_timer timer;
+    for (test_timer_start(&timer, 500); test_timer_running(&timer); timer.count += i){
+      for (i = 0; i < 100; ++i){
+	unsigned r = (timer.count + i) % count;
+	if (lookups[l](&bids[r], r) == -1)
+	  goto rollback;
+      }
+    }
+    cli_printf(context, "%10s: %u lookups, mean time = %.2fus\n",
+	names[l], timer.count, test_timer_mean_us(&timer));
+  }
+  ret = 0;
+rollback:
+  rhizome_test_rollback(&retry);
+end:
+  free(bids);
+  return ret;
+}
+
+DEFINE_CMD(app_rhizome_sync_keys_test, 0,
+   "Time building the Rhizome sync tree from a store of <count> manifests",
+   "test","rhizome","sync-keys","[<count>]");
+static int app_rhizome_sync_keys_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *countstr;
+  if (cli_arg(parsed, "count", &countstr, cli_uint, "10000") == -1)
+    return -1;
+  unsigned count = atoi(countstr);
+  int ret = -1;
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  if (rhizome_test_begin(&retry) == -1)
+    return -1;
+  unsigned i;
+  for (i = 0; i < count; ++i){
+    rhizome_bid_t bid;
+    rhizome_filehash_t hash;
+    randombytes_buf(bid.binary, sizeof bid.binary);
+    randombytes_buf(hash.binary, sizeof hash.binary);
+    if (sqlite_exec_void_retry(&retry,
+	  "INSERT INTO MANIFESTS(id, version, inserttime, filesize, service, manifest_hash) VALUES(?, 1, ?, 0, 'test', ?);",
+	  RHIZOME_BID_T, &bid, INT64, gettime_ms(), RHIZOME_FILEHASH_T, &hash, END) == -1)
+      goto rollback;
+  }
+  unsigned chunk;
+  for (chunk = 0; chunk <= 1000; chunk += 1000){
+    struct sync_state *tree = sync_alloc_state(NULL, NULL, NULL, NULL);
+    uint64_t rowid = 0;
+    struct test_timer timer;
+    test_timer_start(&timer, 0);
+    time_ms_t longest = 0;
+    unsigned loaded = 0;
+    int r;
+    do{
+      time_ms_t t = gettime_ms();
+      r = rhizome_sync_keys_load(tree, &rowid, chunk ? chunk : count + 1);
+      t = gettime_ms() - t;
+      if (t > longest)
+	longest = t;
+      if (r > 0)
+	loaded += r;
+    }while(chunk && r == (int)chunk);
+    test_timer_stop(&timer);
+    sync_free_state(tree);
+    if (r == -1)
+      goto rollback;
+    if (chunk)
+      cli_printf(context, "chunks of %u: ", chunk);
+    else
+      cli_printf(context, "single scan: ");
+    cli_printf(context, "%u manifests in %"PRId64"ms, longest step %"PRId64"ms\n",
+      loaded, test_timer_elapsed_ms(&timer), longest);
+  }
+  ret = 0;
+rollback:
+  rhizome_test_rollback(&retry);
+  return ret;
+}
+
+// The MANIFESTS schema before and after Bundle IDs and SIDs were stored as binary
+static const char *schema_test_text[] = {
+  "CREATE TABLE MANIFESTS(id text not null primary key, version integer, inserttime integer, "
+    "filesize integer, filehash text, author text, bar blob, manifest blob, service text, name text, "
+    "sender text collate nocase, recipient text collate nocase, tail integer, manifest_hash text collate nocase);",
+  "CREATE INDEX bundlesizeindex ON MANIFESTS(filesize);",
+  "CREATE INDEX IDX_MANIFESTS_HASH ON MANIFESTS(filehash);",
+  "CREATE INDEX IDX_MANIFEST_HASH ON MANIFESTS(manifest_hash);",
+  "CREATE INDEX IDX_MANIFESTS_ID_VERSION ON MANIFESTS(id, version);",
+  NULL
+};
+// text keys with the new indexes, to separate the cost of the keys from the cost of the indexes
+static const char *schema_test_text_indexed[] = {
+  "CREATE TABLE MANIFESTS(id text not null primary key, version integer, inserttime integer, "
+    "filesize integer, filehash text, author text, bar blob, manifest blob, service text, name text, "
+    "sender text collate nocase, recipient text collate nocase, tail integer, manifest_hash text collate nocase);",
+  "CREATE INDEX bundlesizeindex ON MANIFESTS(filesize);",
+  "CREATE INDEX IDX_MANIFESTS_HASH ON MANIFESTS(filehash);",
+  "CREATE INDEX IDX_MANIFEST_HASH ON MANIFESTS(manifest_hash);",
+  "CREATE INDEX IDX_MANIFESTS_ID_VERSION ON MANIFESTS(id, version, filesize, filehash);",
+  "CREATE INDEX IDX_MANIFESTS_SENDER ON MANIFESTS(service, sender, recipient, id, version, filesize, tail);",
+  "CREATE INDEX IDX_MANIFESTS_RECIPIENT ON MANIFESTS(service, recipient, sender, id, version, filesize, tail);",
+  NULL
+};
+static const char *schema_test_binary[] = {
+  "CREATE TABLE MANIFESTS(id blob not null primary key, version integer, inserttime integer, "
+    "filesize integer, filehash text, author blob, bar blob, manifest blob, service text, name text, "
+    "sender blob, recipient blob, tail integer, manifest_hash text collate nocase);",
+  "CREATE INDEX bundlesizeindex ON MANIFESTS(filesize);",
+  "CREATE INDEX IDX_MANIFESTS_HASH ON MANIFESTS(filehash);",
+  "CREATE INDEX IDX_MANIFEST_HASH ON MANIFESTS(manifest_hash);",
+  "CREATE INDEX IDX_MANIFESTS_ID_VERSION ON MANIFESTS(id, version, filesize, filehash);",
+  "CREATE INDEX IDX_MANIFESTS_SENDER ON MANIFESTS(service, sender, recipient, id, version, filesize, tail);",
+  "CREATE INDEX IDX_MANIFESTS_RECIPIENT ON MANIFESTS(service, recipient, sender, id, version, filesize, tail);",
+  NULL
+};
+
+#define SCHEMA_TEST_LOOKUP "SELECT version, filesize, filehash FROM MANIFESTS WHERE id = ?1 AND version >= ?2;"
+#define SCHEMA_TEST_CONVERSATIONS \
+  "SELECT id, version, filesize, tail, sender, recipient FROM MANIFESTS " \
+  "WHERE service = 'MeshMS2' AND sender = ?1 " \
+  "UNION ALL SELECT id, version, filesize, tail, sender, recipient FROM MANIFESTS " \
+  "WHERE service = 'MeshMS2' AND recipient = ?1 AND sender != ?1;"
+
+static void schema_test_bind(sqlite3_stmt *statement, int index, int binary, const unsigned char *value, size_t len)
+{
+  if (binary)
+    sqlite3_bind_blob(statement, index, value, len, SQLITE_TRANSIENT);
+  else
+    sqlite3_bind_text(statement, index, alloca_tohex(value, len), len * 2, SQLITE_TRANSIENT);
+}
+
+// read a key column back into binary, the way the database layer does
+static int schema_test_column(sqlite3_stmt *statement, int column, int binary, unsigned char *value, size_t len)
+{
+  if (binary){
+    if ((size_t)sqlite3_column_bytes(statement, column) != len)
+      return -1;
+    bcopy(sqlite3_column_blob(statement, column), value, len);
+    return 0;
+  }
+  const char *hex = (const char *)sqlite3_column_text(statement, column);
+  return hex ? fromhexstr(value, len, hex) : -1;
+}
+
+static int schema_test_run(struct cli_context *context, const char *name, const char **schema, int binary,
+  unsigned count, const rhizome_bid_t *bids, const sid_t *sids, unsigned sid_count)
+{
+  sqlite3 *db = NULL;
+  sqlite3_stmt *statement = NULL;
+  int ret = -1;
+  if (sqlite3_open(":memory:", &db) != SQLITE_OK){
+    WHYF("sqlite3_open: %s", sqlite3_errmsg(db));
+    goto end;
+  }
+  unsigned i;
+  for (i = 0; schema[i]; ++i)
+    if (sqlite3_exec(db, schema[i], NULL, NULL, NULL) != SQLITE_OK)
+      goto fail;
+  if (sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK
+    || sqlite3_prepare_v2(db,
+	"INSERT INTO MANIFESTS(id, version, inserttime, filesize, filehash, author, manifest, service, "
+	"sender, recipient, tail, manifest_hash) VALUES(?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12);",
+	-1, &statement, NULL) != SQLITE_OK)
+    goto fail;
+  for (i = 0; i < count; ++i){
+    unsigned char hash[RHIZOME_FILEHASH_BYTES];
+    char hash_hex[RHIZOME_FILEHASH_STRLEN + 1];
+    unsigned char manifest[200];
+    randombytes_buf(hash, sizeof hash);
+    randombytes_buf(manifest, sizeof manifest);
+    int meshms = i & 1;
+    const sid_t *sender = &sids[(i * 7) % sid_count];
+    const sid_t *recipient = &sids[(i * 13 + 1) % sid_count];
+    sqlite3_reset(statement);
+    schema_test_bind(statement, 1, binary, bids[i].binary, sizeof bids[i].binary);
+    sqlite3_bind_int64(statement, 2, i);
+    sqlite3_bind_int64(statement, 3, gettime_ms());
+    sqlite3_bind_int64(statement, 4, 1024 + i);
+    sqlite3_bind_text(statement, 5, tohex(hash_hex, RHIZOME_FILEHASH_STRLEN, hash), -1, SQLITE_TRANSIENT);
+    schema_test_bind(statement, 6, binary, sender->binary, sizeof sender->binary);
+    sqlite3_bind_blob(statement, 7, manifest, sizeof manifest, SQLITE_TRANSIENT);
+    sqlite3_bind_text(statement, 8, meshms ? RHIZOME_SERVICE_MESHMS2 : RHIZOME_SERVICE_FILE, -1, SQLITE_STATIC);
+    if (meshms){
+      schema_test_bind(statement, 9, binary, sender->binary, sizeof sender->binary);
+      schema_test_bind(statement, 10, binary, recipient->binary, sizeof recipient->binary);
+      sqlite3_bind_int64(statement, 11, 0);
+    }else{
+      sqlite3_bind_null(statement, 9);
+      sqlite3_bind_null(statement, 10);
+      sqlite3_bind_null(statement, 11);
+    }
+    randombytes_buf(hash, sizeof hash);
+    sqlite3_bind_text(statement, 12, tohex(hash_hex, RHIZOME_FILEHASH_STRLEN, hash), -1, SQLITE_TRANSIENT);
+    if (sqlite3_step(statement) != SQLITE_DONE)
+      goto fail;
+  }
+  sqlite3_finalize(statement);
+  statement = NULL;
+  if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+    goto fail;
+
+  int64_t pages = 0, page_size = 0;
+  if (sqlite3_prepare_v2(db, "PRAGMA page_count;", -1, &statement, NULL) != SQLITE_OK
+    || sqlite3_step(statement) != SQLITE_ROW)
+    goto fail;
+  pages = sqlite3_column_int64(statement, 0);
+  sqlite3_finalize(statement);
+  if (sqlite3_prepare_v2(db, "PRAGMA page_size;", -1, &statement, NULL) != SQLITE_OK
+    || sqlite3_step(statement) != SQLITE_ROW)
+    goto fail;
+  page_size = sqlite3_column_int64(statement, 0);
+  sqlite3_finalize(statement);
+  statement = NULL;
+  cli_printf(context, "%s: %u manifests, database %"PRId64" KiB\n", name, count, pages * page_size / 1024);
+
+  // id + version lookups, as used when deciding whether an advertised bundle is interesting
+  if (sqlite3_prepare_v2(db, SCHEMA_TEST_LOOKUP, -1, &statement, NULL) != SQLITE_OK)
+    goto fail;
+  struct test_timer timer;
+  test_timer_start(&timer, 0);
+  for (i = 0; i < count && i < 10000; ++i, ++timer.count){
+    unsigned r = (i * 7919) % count;
+    sqlite3_reset(statement);
+    schema_test_bind(statement, 1, binary, bids[r].binary, sizeof bids[r].binary);
+    sqlite3_bind_int64(statement, 2, r);
+    if (sqlite3_step(statement) != SQLITE_ROW){
+      WHYF("%s: lookup of row %u failed", name, r);
+      goto end;
+    }
+  }
+  test_timer_stop(&timer);
+  sqlite3_finalize(statement);
+  statement = NULL;
+  cli_printf(context, "  %u id+version lookups in %"PRId64"ms, mean %.2fus\n",
+    timer.count, test_timer_elapsed_ms(&timer), test_timer_mean_us(&timer));
+
+  // every conversation of a set of identities, parsing keys as meshms does
+  if (sqlite3_prepare_v2(db, SCHEMA_TEST_CONVERSATIONS, -1, &statement, NULL) != SQLITE_OK)
+    goto fail;
+  unsigned identities = sid_count < 200 ? sid_count : 200;
+  unsigned rows = 0;
+  test_timer_start(&timer, 0);
+  for (i = 0; i < identities; ++i){
+    sqlite3_reset(statement);
+    schema_test_bind(statement, 1, binary, sids[i].binary, sizeof sids[i].binary);
+    int r;
+    while ((r = sqlite3_step(statement)) == SQLITE_ROW){
+      rhizome_bid_t bid;
+      sid_t sender, recipient;
+      if (schema_test_column(statement, 0, binary, bid.binary, sizeof bid.binary) == -1
+	|| schema_test_column(statement, 4, binary, sender.binary, sizeof sender.binary) == -1
+	|| schema_test_column(statement, 5, binary, recipient.binary, sizeof recipient.binary) == -1){
+	WHYF("%s: invalid conversation row", name);
+	goto end;
+      }
+      rows++;
+    }
+    if (r != SQLITE_DONE)
+      goto fail;
+  }
+  test_timer_stop(&timer);
+  sqlite3_finalize(statement);
+  statement = NULL;
+  cli_printf(context, "  conversations of %u identities (%u rows) in %"PRId64"ms, mean %.2fms\n",
+    identities, rows, test_timer_elapsed_ms(&timer), (double)test_timer_elapsed_ms(&timer) / identities);
+
+  if (sqlite3_prepare_v2(db, "EXPLAIN QUERY PLAN " SCHEMA_TEST_CONVERSATIONS, -1, &statement, NULL) != SQLITE_OK)
+    goto fail;
+  while (sqlite3_step(statement) == SQLITE_ROW)
+    cli_printf(context, "  plan: %s\n", sqlite3_column_text(statement, 3));
+  ret = 0;
+  goto end;
+fail:
+  WHYF("%s: %s", name, sqlite3_errmsg(db));
+end:
+  if (statement)
+    sqlite3_finalize(statement);
+  sqlite3_close(db);
+  return ret;
+}
+
+DEFINE_CMD(app_rhizome_schema_test, 0,
+   "Compare the size and query speed of the text and binary key MANIFESTS schemas with <count> manifests",
+   "test","rhizome","schema","[<count>]");
+static int app_rhizome_schema_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *countstr;
+  if (cli_arg(parsed, "count", &countstr, cli_uint, "100000") == -1)
+    return -1;
+  unsigned count = atoi(countstr);
+  if (count == 0)
+    return WHY("count must be positive");
+  const unsigned sid_count = 1000;
+  rhizome_bid_t *bids = emalloc(sizeof(rhizome_bid_t) * count);
+  sid_t *sids = emalloc(sizeof(sid_t) * sid_count);
+  int ret = -1;
+  if (!bids || !sids)
+    goto end;
+  randombytes_buf(bids, sizeof(rhizome_bid_t) * count);
+  randombytes_buf(sids, sizeof(sid_t) * sid_count);
+  if (schema_test_run(context, "text keys", schema_test_text, 0, count, bids, sids, sid_count) == -1
+    || schema_test_run(context, "text keys, new indexes", schema_test_text_indexed, 0, count, bids, sids, sid_count) == -1
+    || schema_test_run(context, "binary keys", schema_test_binary, 1, count, bids, sids, sid_count) == -1)
+    goto end;
+  ret = 0;
+end:
+  free(bids);
+  free(sids);
+  return ret;
+}
+
+#define VERIFY_TEST_BODY 256
+
+struct verify_test_manifest{
+  uint8_t data[VERIFY_TEST_BODY + 1 + crypto_sign_BYTES + crypto_sign_PUBLICKEYBYTES];
+};
+
+static void verify_test_load(rhizome_manifest *m, const struct verify_test_manifest *t)
+{
+  bcopy(t->data, m->manifestdata, sizeof t->data);
+  m->manifest_body_bytes = VERIFY_TEST_BODY;
+  m->manifest_all_bytes = sizeof t->data;
+}
+
+// check the signature the way rhizome_manifest_verify() does, returns 0 if valid
+static int verify_test_check(rhizome_manifest *m)
+{
+  crypto_hash_sha512(m->manifesthash.binary, m->manifestdata, m->manifest_body_bytes);
+  unsigned ofs = m->manifest_body_bytes;
+  int r = rhizome_manifest_extract_signature(m, &ofs);
+  while (m->sig_count){
+    --m->sig_count;
+    free(m->signatories[m->sig_count]);
+    m->signatories[m->sig_count] = NULL;
+  }
+  return r;
+}
+
+DEFINE_CMD(app_rhizome_verify_test, 0,
+   "Time verifying <count> manifest signatures one at a time, and in batches on worker threads",
+   "test","rhizome","verify","[<count>]");
+static int app_rhizome_verify_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *countstr;
+  if (cli_arg(parsed, "count", &countstr, cli_uint, "1000") == -1)
+    return -1;
+  unsigned count = atoi(countstr);
+  struct verify_test_manifest *manifests = emalloc(sizeof(struct verify_test_manifest) * count);
+  rhizome_manifest *m = emalloc_zero(sizeof(rhizome_manifest));
+  int ret = -1;
+  if (!manifests || !m)
+    goto end;
+  unsigned i, corrupt = 0;
+  for (i = 0; i < count; ++i){
+    uint8_t *data = manifests[i].data;
+    sign_keypair_t keypair;
+    crypto_sign_keypair(keypair.public_key.binary, keypair.binary);
+    randombytes_buf(data, VERIFY_TEST_BODY - 1);
+    data[VERIFY_TEST_BODY - 1] = '\0';
+    uint8_t hash[crypto_hash_sha512_BYTES];
+    crypto_hash_sha512(hash, data, VERIFY_TEST_BODY);
+    data[VERIFY_TEST_BODY] = 0x17;
+    crypto_sign_detached(&data[VERIFY_TEST_BODY + 1], NULL, hash, sizeof hash, keypair.binary);
+    bcopy(keypair.public_key.binary, &data[VERIFY_TEST_BODY + 1 + crypto_sign_BYTES], crypto_sign_PUBLICKEYBYTES);
+    // some forgeries, to check that both methods reject them
+    if (i % 100 == 99){
+      data[0] ^= 1;
+      corrupt++;
+    }
+  }
+
+  const char *names[] = {"serial", "batched"};
+  unsigned pass;
+  for (pass = 0; pass < NELS(names); ++pass){
+    rhizome_signature_cache_flush();
+    unsigned failed = 0;
+    // time spent waiting for worker threads, the main loop could be doing other work
+    time_ms_t waiting = 0;
+    struct test_timer timer;
+    test_timer_start(&timer, 0);
+    if (pass == 1){
+      for (i = 0; i < count; ++i){
+	verify_test_load(m, &manifests[i]);
+	if (rhizome_manifest_queue_verify(m) == -1)
+	  goto end;
+      }
+      waiting = gettime_ms();
+      rhizome_verify_wait();
+      waiting = gettime_ms() - waiting;
+    }
+    for (i = 0; i < count; ++i){
+      verify_test_load(m, &manifests[i]);
+      if (verify_test_check(m) != 0)
+	failed++;
+    }
+    test_timer_stop(&timer);
+    struct rhizome_signature_cache_stats stats;
+    rhizome_signature_cache_stats(&stats);
+    cli_printf(context, "%8s: %u signatures (%u invalid), main thread %"PRId64"ms, waiting %"PRId64"ms, %u batched, cache hit rate %.1f%%\n",
+      names[pass], count, failed, test_timer_elapsed_ms(&timer) - waiting, waiting, stats.batched,
+      stats.hits * 100.0 / (stats.hits + stats.misses));
+    if (failed != corrupt){
+      WHYF("Expected %u invalid signatures, found %u", corrupt, failed);
+      goto end;
+    }
+  }
+  ret = 0;
+end:
+  free(m);
+  free(manifests);
+  return ret;
+}
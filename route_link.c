@@ -51,9 +51,27 @@ Link state routing;
 #define FLAG_UNICAST (1<<3)
 #define FLAG_HAS_ACK (1<<4)
 #define FLAG_HAS_DROP_RATE (1<<5)
+// a record that only carries the sequence number of this link state packet
+#define FLAG_SEQUENCE (1<<6)
+// in an ack, asks the neighbour to send all of its link state again
+#define FLAG_FULL_STATE (1<<7)
 
 #define ACK_WINDOW (16)
 
+#define MAX_ROUTE_RECALCULATIONS (4)
+
+// Link state records are only sent when they change, and all of them are sent
+// again this often, or when a neighbour has missed a packet.
+#define LINK_STATE_REFRESH_MS (30000)
+#define LINK_STATE_MIN_REFRESH_MS (1000)
+// A sequence record is sent at least this often, even when nothing has changed,
+// so neighbours notice a lost final change without waiting for the next refresh.
+#define LINK_STATE_SEQUENCE_MS (5000)
+// Older neighbours, that have never sent us a sequence record, can't ask for our link state
+// or notice that they missed part of it. While we have one, all records are sent again
+// at the interval they expect.
+#define LINK_STATE_LEGACY_MS (5000)
+
 struct link{
   struct link *_left;
   struct link *_right;
@@ -62,6 +80,11 @@ struct link{
   struct link *parent;
   struct network_destination *destination;
   struct subscriber *receiver;
+  struct neighbour *neighbour;
+
+  // other links, in any neighbour's tree, with the same transmitter
+  struct link *_next_sibling;
+  struct link **_prev_sibling;
 
   // What's the last ack we've heard so we don't process nacks twice.
   int last_ack_seq;
@@ -79,6 +102,10 @@ struct link{
 
   // loop prevention;
   char calculating;
+  unsigned mark;
+
+  // does our neighbour route to this receiver through us?
+  char through_us;
 };
 
 // statistics of incoming half of network links
@@ -128,13 +155,18 @@ struct neighbour{
   char legacy_protocol;
   
   // when a neighbour is using us as a next hop *and* they are using us to send packets to one of our neighbours, 
-  // we must forward their broadcasts
-  time_ms_t routing_through_us;
+  // we must forward their broadcasts. The number of their links with through_us set.
+  unsigned routing_through_us;
 
   // which of their mdp packets have we already heard and can be dropped as duplicates?
   int mdp_ack_sequence;
   uint64_t mdp_ack_mask;
 
+  // sequence number of the last link state packet we heard from them,
+  // and should we ask them for all of their link state?
+  int link_state_sequence;
+  char request_full_state;
+
   // next link update
   time_ms_t next_neighbour_update;
   time_ms_t last_update;
@@ -163,6 +195,15 @@ struct link_state{
   struct link *link;
   char calculating;
 
+  // links, in any neighbour's tree, that name this subscriber as their transmitter
+  struct link *children;
+
+  // queue of routes that need to be recalculated
+  struct subscriber *_next_dirty;
+  char queued;
+  unsigned pass;
+  uint8_t recalculated;
+
   // when do we need to send a new link state message.
   time_ms_t next_update;
 };
@@ -170,11 +211,27 @@ struct link_state{
 DEFINE_ALARM(link_send);
 static int append_link(void **record, void *context);
 static int neighbour_find_best_link(struct neighbour *n);
+static void link_request_full_state(time_ms_t now);
 
 struct neighbour *neighbours=NULL;
 unsigned neighbour_count=0;
 int route_version=0;
 
+// Incrementing route_version forces every route to be recalculated.  When a
+// link state record changes, only the routes that could depend on it are
+// queued here, and recalculated by link_update_routes().
+static struct subscriber *dirty_routes=NULL;
+static int routes_calculated_version=-1;
+static unsigned route_pass=0;
+static unsigned routes_recalculated=0;
+static unsigned link_mark=0;
+
+// sequence number of our next link state packet, and when all link state will next be sent
+static uint8_t link_state_sequence=0;
+static time_ms_t next_full_state=0;
+static time_ms_t last_full_state=TIME_MS_NEVER_HAS;
+static time_ms_t next_sequence_state=0;
+
 struct network_destination * new_destination(struct overlay_interface *interface){
   assert(interface);
   struct network_destination *ret = emalloc_zero(sizeof(struct network_destination));
@@ -258,6 +315,8 @@ static struct neighbour *get_neighbour(struct subscriber *subscriber, char creat
     n->_next = neighbours;
     n->last_update_seq = -1;
     n->mdp_ack_sequence = -1;
+    n->link_state_sequence = -1;
+    n->request_full_state = 1;
     // TODO measure min/max rtt
     n->rtt = 120;
     n->next_neighbour_update = gettime_ms() + 10;
@@ -268,6 +327,8 @@ static struct neighbour *get_neighbour(struct subscriber *subscriber, char creat
       time_ms_t now = gettime_ms();
       RESCHEDULE(&ALARM_STRUCT(link_send), now+10, now+10, now+30);
     }
+    // they haven't heard any of our unchanged link state yet
+    link_request_full_state(gettime_ms());
     DEBUGF(linkstate, "LINK STATE; new neighbour %s", alloca_tohex_sid_t(n->subscriber->sid));
     CALL_TRIGGER(nbr_change, subscriber, 1, neighbour_count);
   }
@@ -282,6 +343,8 @@ static void free_links(struct link *link)
   link->_left=NULL;
   free_links(link->_right);
   link->_right=NULL;
+  if (link->_prev_sibling && (*link->_prev_sibling = link->_next_sibling))
+    link->_next_sibling->_prev_sibling = link->_prev_sibling;
   if (link->destination)
     release_destination_ref(link->destination);
   free(link);
@@ -295,6 +358,7 @@ static struct link *find_link(struct neighbour *neighbour, struct subscriber *re
       if (create){
         link = *link_ptr = emalloc_zero(sizeof(struct link));
         link->receiver = receiver;
+        link->neighbour = neighbour;
         link->path_version = neighbour->path_version -1;
 	link->last_ack_seq = -1;
 	link->link_version = -1;
@@ -309,6 +373,62 @@ static struct link *find_link(struct neighbour *neighbour, struct subscriber *re
   return link;
 }
 
+// move the link to the list of children of its new transmitter
+static void set_link_transmitter(struct link *link, struct subscriber *transmitter)
+{
+  if (link->transmitter == transmitter)
+    return;
+  if (link->_prev_sibling && (*link->_prev_sibling = link->_next_sibling))
+    link->_next_sibling->_prev_sibling = link->_prev_sibling;
+  link->_next_sibling = NULL;
+  link->_prev_sibling = NULL;
+  link->transmitter = transmitter;
+  link->parent = NULL;
+  struct link_state *state;
+  if (transmitter && (state = get_link_state(transmitter))){
+    if ((link->_next_sibling = state->children))
+      link->_next_sibling->_prev_sibling = &link->_next_sibling;
+    link->_prev_sibling = &state->children;
+    state->children = link;
+  }
+}
+
+// queue the route to this subscriber to be recalculated
+static void mark_route_dirty(struct subscriber *subscriber)
+{
+  if (subscriber->reachable & REACHABLE_SELF)
+    return;
+  struct link_state *state = get_link_state(subscriber);
+  if (!state)
+    return;
+  if (state->route_version == route_version)
+    state->route_version = route_version -1;
+  if (!state->queued){
+    state->queued = 1;
+    state->_next_dirty = dirty_routes;
+    dirty_routes = subscriber;
+  }
+}
+
+static void mark_path_dirty_recursive(struct neighbour *neighbour, struct subscriber *receiver)
+{
+  mark_route_dirty(receiver);
+  struct link *child = receiver->link_state ? receiver->link_state->children : NULL;
+  for (; child; child = child->_next_sibling){
+    if (child->neighbour == neighbour && child->mark != link_mark){
+      child->mark = link_mark;
+      mark_path_dirty_recursive(neighbour, child->receiver);
+    }
+  }
+}
+
+// The path score of every link below this receiver in the neighbour's tree may have changed
+static void mark_path_dirty(struct neighbour *neighbour, struct subscriber *receiver)
+{
+  link_mark++;
+  mark_path_dirty_recursive(neighbour, receiver);
+}
+
 static struct link *get_parent(struct neighbour *neighbour, struct link *link)
 {
   // root of the routing table.
@@ -378,6 +498,13 @@ static struct link * find_best_link(struct subscriber *subscriber)
   if (state->calculating)
     RETURN(NULL);
   state->calculating = 1;
+  if (state->pass != route_pass){
+    state->pass = route_pass;
+    state->recalculated = 0;
+  }
+  state->recalculated++;
+  routes_recalculated++;
+  struct subscriber *prior_next_hop = state->next_hop;
 
   struct neighbour *neighbour = neighbours;
   struct network_destination *destination = NULL;
@@ -447,6 +574,13 @@ next:
   if (changed)
     state->next_update = now+5;
 
+  // any link whose transmitter is this subscriber can only be used via our new next hop
+  if (state->next_hop != prior_next_hop){
+    struct link *child;
+    for (child = state->children; child; child = child->_next_sibling)
+      mark_route_dirty(child->receiver);
+  }
+
   RETURN(best_link);
 }
 
@@ -531,8 +665,8 @@ static int append_link(void **record, void *context)
         ALARM_STRUCT(link_send).alarm = now+5;
         return 1;
       }
-      // include information about this link every 5s
-      state->next_update = now + 5000;
+      // wait for the next full refresh
+      state->next_update = TIME_MS_NEVER_WILL;
     }
   } else {
     
@@ -550,8 +684,8 @@ static int append_link(void **record, void *context)
 	  ALARM_STRUCT(link_send).alarm = now+5;
 	  return 1;
 	}
-	// include information about this link every 5s
-	state->next_update = now + 5000;
+	// wait until it changes, or the next full refresh
+	state->next_update = TIME_MS_NEVER_WILL;
       }
     }
   }
@@ -637,9 +771,12 @@ static void clean_neighbours(time_ms_t now)
     if (!n->links || !alive){
       free_neighbour(n_ptr);
       neighbour_count--;
+      // routes through any link of this neighbour are gone, losing a neighbour is rare enough to recalculate everything
+      route_version++;
       CALL_TRIGGER(nbr_change, subscriber, 0, neighbour_count);
       if (neighbour_count==0){
 	// clean up the routing table
+	dirty_routes = NULL;
 	enum_subscribers(NULL, free_subscriber_link_state, NULL);
 	unschedule(&ALARM_STRUCT(link_send));
       }
@@ -753,7 +890,7 @@ int link_destination_has_neighbours(struct network_destination *dest)
 }
 
 static int send_legacy_self_announce_ack(struct neighbour *neighbour, struct link_in *link, time_ms_t now){
-  struct overlay_frame *frame=emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame=op_new();
   frame->type = OF_TYPE_SELFANNOUNCE_ACK;
   frame->ttl = 6;
   frame->destination = neighbour->subscriber;
@@ -841,7 +978,7 @@ static int send_neighbour_link(struct neighbour *n)
     send_legacy_self_announce_ack(n, n->best_link, now);
     n->last_update = now;
   } else {
-    struct overlay_frame *frame = emalloc_zero(sizeof(struct overlay_frame));
+    struct overlay_frame *frame = op_new();
     frame->type=OF_TYPE_DATA;
     frame->source=get_my_subscriber(1);
     frame->ttl=1;
@@ -878,6 +1015,11 @@ static int send_neighbour_link(struct neighbour *n)
       flags|=FLAG_UNICAST;
     else
       flags|=FLAG_BROADCAST;
+    if (n->request_full_state && !config.mdp.legacy_link_state){
+      DEBUGF(linkstate, "LINK STATE; asking %s for all link state", alloca_tohex_sid_t(n->subscriber->sid));
+      flags|=FLAG_FULL_STATE;
+      n->request_full_state = 0;
+    }
 
     DEBUGF(ack, "LINK STATE; Sending ack to %s for seq %d", alloca_tohex_sid_t(n->subscriber->sid), n->best_link->ack_sequence);
     struct decode_context context;
@@ -940,6 +1082,26 @@ static int link_send_neighbours()
   return 0;
 }
 
+static int refresh_link_state(void **record, void *context)
+{
+  struct subscriber *subscriber = *record;
+  time_ms_t *now = context;
+  if (subscriber->link_state && subscriber->link_state->next_update > *now)
+    subscriber->link_state->next_update = *now;
+  return 0;
+}
+
+static int has_legacy_neighbour()
+{
+  if (config.mdp.legacy_link_state)
+    return 1;
+  struct neighbour *n;
+  for (n = neighbours; n; n = n->_next)
+    if (n->link_state_sequence == -1)
+      return 1;
+  return 0;
+}
+
 // send link details
 void link_send(struct sched_ent *alarm)
 {
@@ -972,17 +1134,36 @@ void link_send(struct sched_ent *alarm)
     
     ob_limitsize(context.payload, 400);
     
-    ob_checkpoint(context.payload);
+    time_ms_t now = gettime_ms();
+    if (next_full_state <= now){
+      DEBUGF(linkstate, "LINK STATE; sending all link state records");
+      last_full_state = now;
+      next_full_state = now + (has_legacy_neighbour() ? LINK_STATE_LEGACY_MS : LINK_STATE_REFRESH_MS);
+      enum_subscribers(NULL, refresh_link_state, &now);
+    }
+
+    // Only changed records are sent between full refreshes, so number every packet.
+    // Neighbours that notice a gap will ask for everything again.
+    if (!config.mdp.legacy_link_state)
+      append_link_state(context.payload, &context.context, FLAG_SEQUENCE, NULL, header.source, -1,
+                        link_state_sequence, -1, 0, -1);
     size_t pos = ob_position(context.payload);
+    link_update_routes(0);
     enum_subscribers(NULL, append_link, &context);
     ob_rewind(context.payload);
     
-    if (ob_position(context.payload) != pos){
+    if (ob_position(context.payload) != pos || next_sequence_state <= now){
+      link_state_sequence++;
+      next_sequence_state = now + LINK_STATE_SEQUENCE_MS;
       ob_flip(context.payload);
       overlay_send_frame(&header, context.payload);
     }
     ob_free(context.payload);
   }
+  if (next_full_state < alarm->alarm)
+    alarm->alarm = next_full_state;
+  if (next_sequence_state < alarm->alarm)
+    alarm->alarm = next_sequence_state;
   time_ms_t allowed=gettime_ms()+5;
   if (alarm->alarm < allowed)
     alarm->alarm = allowed;
@@ -990,6 +1171,51 @@ void link_send(struct sched_ent *alarm)
   schedule(alarm);
 }
 
+static int update_route(void **record, void *UNUSED(context))
+{
+  struct subscriber *subscriber = *record;
+  if (subscriber->link_state)
+    find_best_link(subscriber);
+  return 0;
+}
+
+unsigned link_update_routes(bool_t all)
+{
+  unsigned start = routes_recalculated;
+  route_pass++;
+  if (all)
+    route_version++;
+  if (routes_calculated_version != route_version){
+    enum_subscribers(NULL, update_route, NULL);
+    routes_calculated_version = route_version;
+  }
+
+  // A route that keeps changing after we have recalculated it a few times
+  // during this pass is probably part of a loop, so leave it until the next pass.
+  struct subscriber *deferred = NULL;
+  while (dirty_routes){
+    struct subscriber *subscriber = dirty_routes;
+    struct link_state *state = subscriber->link_state;
+    dirty_routes = state->_next_dirty;
+    state->_next_dirty = NULL;
+    state->queued = 0;
+    if (state->route_version == route_version)
+      continue;
+    if (state->pass == route_pass && state->recalculated >= MAX_ROUTE_RECALCULATIONS){
+      state->queued = 1;
+      state->_next_dirty = deferred;
+      deferred = subscriber;
+      continue;
+    }
+    find_best_link(subscriber);
+  }
+  dirty_routes = deferred;
+  unsigned count = routes_recalculated - start;
+  if (count && IF_DEBUG(verbose))
+    DEBUGF(linkstate, "LINK STATE; recalculated %u routes%s", count, deferred ? ", some deferred" : "");
+  return count;
+}
+
 static void update_alarm(struct __sourceloc __whence, time_ms_t limit)
 {
   if (limit == 0)
@@ -1001,6 +1227,17 @@ static void update_alarm(struct __sourceloc __whence, time_ms_t limit)
   }
 }
 
+// send all of our link state again, unless we have just done so
+static void link_request_full_state(time_ms_t now)
+{
+  if (last_full_state != TIME_MS_NEVER_HAS && last_full_state + LINK_STATE_MIN_REFRESH_MS > now){
+    if (next_full_state > last_full_state + LINK_STATE_MIN_REFRESH_MS)
+      next_full_state = last_full_state + LINK_STATE_MIN_REFRESH_MS;
+  }else
+    next_full_state = now;
+  update_alarm(__WHENCE__, next_full_state);
+}
+
 int link_stop_routing(struct subscriber *subscriber)
 {
   if (subscriber->reachable!=REACHABLE_SELF)
@@ -1142,12 +1379,11 @@ int link_state_should_forward_broadcast(struct subscriber *transmitter)
   struct neighbour *neighbour = get_neighbour(transmitter, 0);
   if (!neighbour)
     return 1;
-  time_ms_t now = gettime_ms();
   // it's only safe to drop broadcasts if we know we are in this neighbours routing table,
   // and we know we are not vital to reach someone else.
   // if we aren't in their routing table as an immediate neighbour, we may be hearing this broadcast packet over an otherwise unreliable link.
   // since we're going to process it now and assume that any future copies are duplicates, its better to be safe and forward it.
-  if (neighbour->using_us && neighbour->routing_through_us < now)
+  if (neighbour->using_us && !neighbour->routing_through_us)
     return 0;
   return 1;
 }
@@ -1412,6 +1648,26 @@ static int link_receive(struct internal_mdp_header *header, struct overlay_buffe
     // jump to the position of the next record, even if there's more data we don't understand
     payload->position = start_pos + length;
 
+    if (flags & FLAG_SEQUENCE){
+      if (receiver == header->source){
+        // did we miss any changes since their last link state packet?
+        // (a sequence that jumps backwards probably means they restarted)
+        int seq_delta = (version - neighbour->link_state_sequence)&0xFF;
+        if (neighbour->link_state_sequence == -1 || seq_delta != 0){
+          if (neighbour->link_state_sequence != -1 && seq_delta != 1 && !neighbour->request_full_state){
+            DEBUGF(linkstate, "LINK STATE; sequence from %s jumped from %d to %d",
+                   alloca_tohex_sid_t(header->source->sid), neighbour->link_state_sequence, version);
+            neighbour->request_full_state = 1;
+            if (neighbour->next_neighbour_update > now + 10)
+              neighbour->next_neighbour_update = now + 10;
+            update_alarm(__WHENCE__, neighbour->next_neighbour_update);
+          }
+          neighbour->link_state_sequence = version;
+        }
+      }
+      continue;
+    }
+
     if (context.flags & DECODE_FLAG_INVALID_ADDRESS)
       continue;
 
@@ -1453,12 +1709,16 @@ static int link_receive(struct internal_mdp_header *header, struct overlay_buffe
     }
 
     struct network_destination *destination=NULL;
+    char through_us=0;
     
     if (receiver == header->source){
       // ignore other incoming links to our neighbour
       if (transmitter!=myself || interface_id==-1)
         continue;
 
+      if ((flags & FLAG_FULL_STATE) && !config.mdp.legacy_link_state)
+        link_request_full_state(now);
+
       interface = &overlay_interfaces[interface_id];
       // ignore any links claiming to be from an interface we aren't using
       if (interface->state != INTERFACE_STATE_UP)
@@ -1488,17 +1748,24 @@ static int link_receive(struct internal_mdp_header *header, struct overlay_buffe
     }else if(transmitter == myself){
       // if our neighbour starts using us to reach this receiver, we have to treat the link in our routing table as if it just died.
       transmitter = NULL;
-      if (receiver->reachable != REACHABLE_SELF){
-        // also we should forward this neighbours broadcast packets to ensure they reach this receiver.
-        // since we won't remember this link for routing purposes, we'll just use a simple timer.
-        neighbour->routing_through_us = now + 2500;
-      }
+      // also we should forward this neighbours broadcast packets to ensure they reach this receiver,
+      // until they tell us about another path to it.
+      if (receiver->reachable != REACHABLE_SELF)
+        through_us = 1;
     }
 
-    struct link *link = find_link(neighbour, receiver, transmitter?1:0);
+    struct link *link = find_link(neighbour, receiver, (transmitter || through_us)?1:0);
     if (!link)
       continue;
 
+    if (link->through_us != through_us){
+      link->through_us = through_us;
+      if (through_us)
+        neighbour->routing_through_us++;
+      else
+        neighbour->routing_through_us--;
+    }
+
     if (transmitter == myself && receiver == header->source && interface_id != -1 && destination){
       // they can hear us? we can route through them!
       
@@ -1514,6 +1781,10 @@ static int link_receive(struct internal_mdp_header *header, struct overlay_buffe
       if (neighbour->link_in_timeout < now || version<0){
 	changed = 1;
 	version++;
+	// anything they told us before the link went down may be stale
+	neighbour->request_full_state = 1;
+	// every path through this neighbour has been ignored while the link was down
+	mark_path_dirty(neighbour, receiver);
       }
       neighbour->link_in_timeout = now + interface->destination->ifconfig.reachable_timeout_ms;
 
@@ -1551,17 +1822,17 @@ static int link_receive(struct internal_mdp_header *header, struct overlay_buffe
 
     if (link->transmitter != transmitter || link->link_version != version){
       changed = 1;
-      link->transmitter = transmitter;
+      set_link_transmitter(link, transmitter);
       link->link_version = version & 0xFF;
       link->drop_rate = drop_rate;
       // TODO other link attributes...
+      mark_path_dirty(neighbour, receiver);
     }
   }
 
   send_please_explain(&context, myself, header->source);
 
   if (changed){
-    route_version++;
     neighbour->path_version ++;
     if (ALARM_STRUCT(link_send).alarm>now+5){
       RESCHEDULE(&ALARM_STRUCT(link_send), now+5, now+5, now+25);
@@ -1616,7 +1887,7 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   if (link->transmitter != get_my_subscriber(1))
     changed = 1;
 
-  link->transmitter = get_my_subscriber(1);
+  set_link_transmitter(link, get_my_subscriber(1));
   link->link_version = 1;
   link->destination = interface->destination;
 
@@ -1631,8 +1902,8 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   neighbour->link_in_timeout = now + link->destination->ifconfig.reachable_timeout_ms;
 
   if (changed){
-    route_version++;
     neighbour->path_version ++;
+    mark_path_dirty(neighbour, frame->source);
     if (ALARM_STRUCT(link_send).alarm>now+5){
       RESCHEDULE(&ALARM_STRUCT(link_send), now+5, now+5, now+25);
     }
@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define __SERVAL_DNA__ROUTE_LINK_H
 
 #include <stdint.h> // for uint8_t
+#include "lang.h" // for bool_t
 
 struct strbuf;
 struct overlay_interface;
@@ -45,6 +46,11 @@ int link_unicast_ack(struct subscriber *subscriber, struct overlay_interface *in
 void link_explained(struct subscriber *subscriber);
 int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now);
 
+// Recalculate the routes that may have changed since link state was last
+// received, or every route if 'all' is set.  Returns the number of routes
+// recalculated.
+unsigned link_update_routes(bool_t all);
+
 DECLARE_TRIGGER(nbr_change, struct subscriber *neighbour, uint8_t found, unsigned count);
 DECLARE_TRIGGER(link_change, struct subscriber *subscriber, int prior_reachable);
 
@@ -177,6 +177,8 @@ int mdp_send_external_packet(struct overlay_interface *interface, struct socket_
 int overlay_forward_payload(struct overlay_frame *f);
 int packetOkOverlay(struct overlay_interface *interface,unsigned char *packet, size_t len,
 		    struct socket_address *recvaddr);
+int packetOkOverlayBuffer(struct overlay_interface *interface, struct overlay_buffer *b,
+		    struct socket_address *recvaddr);
 int parseMdpPacketHeader(struct decode_context *context, struct overlay_frame *frame, 
 			 struct overlay_buffer *buffer, struct subscriber **nexthop);
 int parseEnvelopeHeader(struct decode_context *context, struct overlay_interface *interface, 
@@ -200,6 +202,7 @@ int _overlay_payload_enqueue(struct __sourceloc whence, struct overlay_frame *p)
 #define overlay_payload_enqueue(P) _overlay_payload_enqueue(__WHENCE__,P)
 int overlay_queue_remaining(int queue);
 int overlay_queue_schedule_next(time_ms_t next_allowed_packet);
+void overlay_queue_status_html(struct strbuf *b);
 int overlay_send_tick_packet(struct network_destination *destination);
 int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *destination, uint32_t ack_mask, int ack_seq);
 
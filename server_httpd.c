@@ -33,6 +33,7 @@ DECLARE_HANDLER("/", root_page);
 DECLARE_HANDLER("/static/", static_page);
 DECLARE_HANDLER("/interface/", interface_page);
 DECLARE_HANDLER("/neighbour/", neighbour_page);
+DECLARE_HANDLER("/queues", queue_page);
 DECLARE_HANDLER("/favicon.ico", fav_icon_header);
 
 static int root_page(httpd_request *r, const char *remainder)
@@ -60,6 +61,7 @@ static int root_page(httpd_request *r, const char *remainder)
   }
   strbuf_puts(b, "Neighbours;<br />");
   link_neighbour_short_status_html(b, "/neighbour");
+  strbuf_puts(b, "<a href=\"/queues\">Transmit Queues</a><br />");
   if (is_rhizome_http_enabled()){
     strbuf_puts(b, "<a href=\"/rhizome/status\">Rhizome Status</a><br />");
   }
@@ -120,6 +122,23 @@ static int interface_page(httpd_request *r, const char *remainder)
 }
 
 
+static int queue_page(httpd_request *r, const char *remainder)
+{
+  if (*remainder)
+    return 404;
+  if (r->http.verb != HTTP_VERB_GET)
+    return 405;
+  char buf[8*1024];
+  strbuf b=strbuf_local_buf(buf);
+  strbuf_puts(b, "<html><head><meta http-equiv=\"refresh\" content=\"5\" ></head><body>");
+  overlay_queue_status_html(b);
+  strbuf_puts(b, "</body></html>");
+  if (strbuf_overrun(b))
+    return -1;
+  http_request_response_static(&r->http, 200, &CONTENT_TYPE_HTML, buf, strbuf_len(b));
+  return 1;
+}
+
 static int static_file_generator(struct http_request *hr, unsigned char *buf, size_t bufsz, struct http_content_generator_result *result)
 {
   struct httpd_request *r=(struct httpd_request *)hr;
@@ -122,6 +122,7 @@ SERVAL_DAEMON_SOURCES = \
 	server_httpd.c \
 	vomp.c \
 	vomp_console.c \
+	worker.c \
         fec-3.0.1/ccsds_tables.c \
 	fec-3.0.1/decode_rs_8.c \
 	fec-3.0.1/encode_rs_8.c \
@@ -138,6 +139,15 @@ SERVAL_DAEMON_SWIFT_SOURCES = \
 	swift_cli_stdio.swift \
 	swift_log.swift
 
+# Commands that exercise and benchmark the daemon, which are only linked into
+# the serval-tests executable, never into servald.
+SERVAL_DAEMON_TEST_SOURCES = \
+	keyring_test_cli.c \
+	meshms_test_cli.c \
+	overlay_test_cli.c \
+	rhizome_test_cli.c \
+	sync_keys_test_cli.c
+
 MDP_CLIENT_SOURCES = \
 	mdp_client.c
 
@@ -164,6 +174,7 @@ ALL_SOURCES = \
 	$(SQLITE3_SOURCES) \
 	$(SERVAL_DAEMON_SOURCES) \
 	$(SERVAL_DAEMON_JNI_SOURCES) \
+	$(SERVAL_DAEMON_TEST_SOURCES) \
 	$(SIMULATOR_SOURCES) \
 	$(MONITOR_CLIENT_SRCS) \
 	$(CLIENT_ONLY_SOURCES) \
@@ -36,14 +36,39 @@ typedef struct {
 #define QUEUED 2
 #define DONT_SEND 3
 
+// Fields used while walking the tree come first, so that they share a cache line
 struct node{
-  struct node *transmit_next;
-  struct node *transmit_prev;
   key_message_t message;
   uint8_t send_state;
   uint8_t sent_count;
-  void *context;
-  struct node *children[NODE_CHILDREN];
+  // only leaf nodes, with prefix_len == KEY_LEN_BITS, have a context, and they never have children
+  union{
+    struct node *children[NODE_CHILDREN];
+    void *context;
+  };
+  struct node *transmit_next;
+  struct node *transmit_prev;
+  struct node_slab *slab;
+};
+
+// Nodes are carved out of slabs owned by each sync_state, rather than being
+// malloc'd one at a time, so that a large tree doesn't fragment the heap and
+// nodes that were added together stay close together in memory.
+// Slabs with free nodes are kept at the head of the list, full slabs at the
+// tail, and a slab is returned to the heap as soon as all of its nodes have
+// been released.
+#define NODES_PER_SLAB 256
+
+struct node_slab{
+  struct node_slab *next;
+  struct node_slab *prev;
+  // nodes currently in use
+  unsigned used;
+  // nodes handed out from the end of nodes[] so far
+  unsigned carved;
+  // released nodes, linked through children[0]
+  struct node *free_nodes;
+  struct node nodes[NODES_PER_SLAB];
 };
 
 struct sync_peer_state{
@@ -69,6 +94,8 @@ struct sync_state{
   struct sync_peer_state *peers;
   struct node *root;
   struct node *transmit_ptr;
+  struct node_slab *slabs;
+  struct node_slab *slabs_tail;
 };
 
 
@@ -140,6 +167,81 @@ static int cmp_message(const key_message_t *first, const key_message_t *second)
   return ret;
 }
 
+static void slab_unlink(struct sync_state *state, struct node_slab *slab)
+{
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    state->slabs = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+  else
+    state->slabs_tail = slab->prev;
+  slab->next = slab->prev = NULL;
+}
+
+static void slab_push_head(struct sync_state *state, struct node_slab *slab)
+{
+  slab->prev = NULL;
+  slab->next = state->slabs;
+  if (state->slabs)
+    state->slabs->prev = slab;
+  else
+    state->slabs_tail = slab;
+  state->slabs = slab;
+}
+
+static void slab_push_tail(struct sync_state *state, struct node_slab *slab)
+{
+  slab->next = NULL;
+  slab->prev = state->slabs_tail;
+  if (state->slabs_tail)
+    state->slabs_tail->next = slab;
+  else
+    state->slabs = slab;
+  state->slabs_tail = slab;
+}
+
+// Returns NULL if there is no memory for another slab
+static struct node *alloc_node(struct sync_state *state)
+{
+  struct node_slab *slab = state->slabs;
+  if (!slab || slab->used == NODES_PER_SLAB){
+    if ((slab = emalloc(sizeof(struct node_slab))) == NULL)
+      return NULL;
+    slab->used = slab->carved = 0;
+    slab->free_nodes = NULL;
+    slab_push_head(state, slab);
+  }
+  struct node *node = slab->free_nodes;
+  if (node)
+    slab->free_nodes = node->children[0];
+  else
+    node = &slab->nodes[slab->carved++];
+  if (++slab->used == NODES_PER_SLAB && slab->next){
+    slab_unlink(state, slab);
+    slab_push_tail(state, slab);
+  }
+  bzero(node, sizeof *node);
+  node->slab = slab;
+  return node;
+}
+
+static void release_node(struct sync_state *state, struct node *node)
+{
+  struct node_slab *slab = node->slab;
+  assert(slab->used > 0);
+  node->children[0] = slab->free_nodes;
+  slab->free_nodes = node;
+  if (--slab->used == 0 && slab != state->slabs){
+    slab_unlink(state, slab);
+    free(slab);
+  }else if (slab->used == NODES_PER_SLAB - 1 && slab != state->slabs){
+    slab_unlink(state, slab);
+    slab_push_head(state, slab);
+  }
+}
+
 // XOR all existing children of *node, into this destination key.
 static void xor_children(struct node *node, key_message_t *dest)
 {
@@ -154,9 +256,19 @@ static void xor_children(struct node *node, key_message_t *dest)
   }
 }
 
-// Add a new key into the state tree, XOR'ing the key into each parent node
-static struct node *add_key(struct node **root, const sync_key_t *key, void *context, uint8_t stored)
+// Add a new key into the state tree, XOR'ing the key into each parent node.
+// Returns NULL, leaving the tree unchanged, if there is no memory for the new nodes.
+static struct node *add_key(struct sync_state *state, struct node **root, const sync_key_t *key, void *context, uint8_t stored)
 {
+  // at most one new parent node is needed, allocate it before touching the tree
+  struct node *leaf = alloc_node(state);
+  if (!leaf)
+    return NULL;
+  struct node *spare = alloc_node(state);
+  if (!spare){
+    release_node(state, leaf);
+    return NULL;
+  }
   uint8_t prefix_len = 0;
   struct node **node = root;
   uint8_t min_prefix_len = prefix_len;
@@ -191,7 +303,9 @@ static struct node *add_key(struct node **root, const sync_key_t *key, void *con
     }
     
     // if there is a mismatch in the range of prefix bits, we need to create a new node to represent the new range.
-    struct node *parent = emalloc_zero(sizeof(struct node));
+    struct node *parent = spare;
+    assert(parent);
+    spare = NULL;
     parent->message.min_prefix_len = min_prefix_len;
     parent->message.prefix_len = prefix_len;
     parent->message.stored = stored;
@@ -208,8 +322,10 @@ static struct node *add_key(struct node **root, const sync_key_t *key, void *con
     
     *node = parent;
   }
+  if (spare)
+    release_node(state, spare);
   // create final leaf node
-  *node = emalloc_zero(sizeof(struct node));
+  *node = leaf;
   (*node)->message.key = *key;
   (*node)->message.min_prefix_len = min_prefix_len;
   (*node)->message.prefix_len = KEY_LEN_BITS;
@@ -223,12 +339,13 @@ static void free_node(struct sync_state *state, struct node *node)
 {
   if (!node)
     return;
-  unsigned i;
-  for (i=0;i<NODE_CHILDREN;i++)
-    free_node(state, node->children[i]);
+  if (node->message.prefix_len != KEY_LEN_BITS){
+    unsigned i;
+    for (i=0;i<NODE_CHILDREN;i++)
+      free_node(state, node->children[i]);
+  }
   
   if (node->transmit_next){
-    assert(state);
     assert(node->transmit_prev);
     
     if (node->transmit_next == node){
@@ -242,7 +359,7 @@ static void free_node(struct sync_state *state, struct node *node)
     }
   }
   
-  free(node);
+  release_node(state, node);
 }
 
 static void remove_key(struct sync_state *state, struct node **root, const sync_key_t *key)
@@ -347,27 +464,28 @@ int sync_has_transmit_queued(const struct sync_state *state)
 }
 
 // returns NULL if the node already exists
-static struct node * add_key_if_missing(struct node **root, const key_message_t *message, uint8_t stored)
+static struct node * add_key_if_missing(struct sync_state *state, struct node **root, const key_message_t *message, uint8_t stored)
 {
   assert(message->prefix_len == KEY_LEN_BITS);
   if (find_message(*root, message)!=NULL)
     return NULL;
-  return add_key(root, &message->key, NULL, stored);
+  return add_key(state, root, &message->key, NULL, stored);
 }
 
-void sync_add_key(struct sync_state *state, const sync_key_t *key, void *context)
+int sync_add_key(struct sync_state *state, const sync_key_t *key, void *context)
 {
   key_message_t message = MESSAGE_FROM_KEY(key);
   struct node *node = (struct node *)find_message(state->root, &message);
   if (node){
     node->message.stored = 1;
     node->context = context;
-    return;
+    return 0;
   }
   
+  if (!add_key(state, &state->root, key, context, 1))
+    return WHY("Failed to add key to sync tree");
   state->key_count++;
   state->progress=0;
-  add_key(&state->root, key, context, 1);
   
   struct sync_peer_state *peer_state = state->peers;
   while(peer_state){
@@ -377,6 +495,7 @@ void sync_add_key(struct sync_state *state, const sync_key_t *key, void *context
     }
     peer_state = peer_state->next;
   }
+  return 0;
 }
 
 void sync_free_peer_state(struct sync_state *state, void *peer_context){
@@ -404,20 +523,15 @@ struct sync_state* sync_alloc_state(void *context, peer_has has, peer_does_not_h
 
 // clear all memory used by this state
 void sync_free_state(struct sync_state *state){
-  while(state->transmit_ptr){
-    struct node *p = state->transmit_ptr;
-    state->transmit_ptr = state->transmit_ptr->transmit_next;
-    p->transmit_next=NULL;
-    p->transmit_prev=NULL;
+  // every node lives in one of our slabs, so there's no need to walk the trees
+  while(state->slabs){
+    struct node_slab *slab = state->slabs;
+    state->slabs = slab->next;
+    free(slab);
   }
-  
-  free_node(NULL, state->root);
     
   while(state->peers){
     struct sync_peer_state *peer_state = state->peers;
-    
-    free_node(NULL, peer_state->root);
-    
     state->peers = peer_state->next;
     free(peer_state);
   }
@@ -542,7 +656,9 @@ static unsigned peer_is_missing(struct sync_state *state, struct sync_peer_state
     return 0;
   }
   
-  add_key(&peer->root, &node->message.key, node->context, 1);
+  // if there's no memory to remember this, we'll try again the next time the peer mentions it
+  if (!add_key(state, &peer->root, &node->message.key, node->context, 1))
+    return 0;
   peer->send_count ++;
   state->progress=0;
   if (state->has_not)
@@ -573,7 +689,7 @@ static void peer_add_key(struct sync_state *state, struct sync_peer_state *peer_
   if (message->prefix_len != KEY_LEN_BITS || !message->stored)
     return;
     
-  struct node *node = add_key_if_missing(&peer_state->root, message, 0);
+  struct node *node = add_key_if_missing(state, &peer_state->root, message, 0);
   
   if (node){
     //Yay, they told us something we didn't know.
@@ -785,10 +901,12 @@ static int recv_key(struct sync_state *state, struct sync_peer_state *peer_state
 	}
 	
 	// queue the transmission of all child nodes of this node
-        unsigned i;
-	for (i=0;i<NODE_CHILDREN;i++){
-	  if (node->children[i])
-	    queue_node(state, node->children[i], 0);
+	if (node->message.prefix_len != KEY_LEN_BITS){
+	  unsigned i;
+	  for (i=0;i<NODE_CHILDREN;i++){
+	    if (node->children[i])
+	      queue_node(state, node->children[i], 0);
+	  }
 	}
       }
       return 0;
@@ -32,7 +32,8 @@ void sync_free_peer_state(struct sync_state *state, void *peer_context);
 
 // tell the sync process that we now have key, with callback context
 // if the key is already present, the context will be updated
-void sync_add_key(struct sync_state *state, const sync_key_t *key, void *key_context);
+// returns -1 if there was no memory to add the key
+int sync_add_key(struct sync_state *state, const sync_key_t *key, void *key_context);
 int sync_key_exists(const struct sync_state *state, const sync_key_t *key);
 int sync_has_transmit_queued(const struct sync_state *state);
 
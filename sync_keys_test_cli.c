@@ -0,0 +1,138 @@
+/*
+ Serval DNA - sync key benchmarks
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <sodium.h>
+#include <time.h>
+#include "feature.h"
+#include "cli.h"
+#include "commandline.h"
+#include "mem.h"
+#include "debug.h"
+#include "sync_keys.h"
+#include "constants.h"
+
+DEFINE_FEATURE(cli_sync_keys_tests);
+
+struct sync_sim_node{
+  struct sync_state *state;
+  unsigned key_count;
+  // keys our peers have told us about, added once their message is processed
+  sync_key_t *pending;
+  unsigned pending_count;
+  unsigned pending_size;
+};
+
+static void sync_sim_peer_has(void *context, void *UNUSED(peer_context), const sync_key_t *key)
+{
+  struct sync_sim_node *node = context;
+  if (node->pending_count >= node->pending_size){
+    node->pending_size = node->pending_size ? node->pending_size * 2 : 64;
+    node->pending = erealloc(node->pending, sizeof(sync_key_t) * node->pending_size);
+  }
+  node->pending[node->pending_count++] = *key;
+}
+
+static void sync_sim_add_key(struct sync_sim_node *node, const sync_key_t *key)
+{
+  if (sync_key_exists(node->state, key))
+    return;
+  if (sync_add_key(node->state, key, NULL) == 0)
+    node->key_count++;
+}
+
+DEFINE_CMD(app_sync_reconcile_test, 0,
+   "Simulate <peers> neighbours reconciling <keys> common and <unique> differing sync keys",
+   "test","sync-keys","reconcile","[<peers>]","[<keys>]","[<unique>]");
+static int app_sync_reconcile_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *peersstr, *keysstr, *uniquestr;
+  if (   cli_arg(parsed, "peers", &peersstr, cli_uint, "4") == -1
+      || cli_arg(parsed, "keys", &keysstr, cli_uint, "10000") == -1
+      || cli_arg(parsed, "unique", &uniquestr, cli_uint, "100") == -1)
+    return -1;
+  unsigned peers = atoi(peersstr);
+  unsigned keys = atoi(keysstr);
+  unsigned unique = atoi(uniquestr);
+  if (peers < 2)
+    return WHY("Need at least two peers");
+  struct sync_sim_node nodes[peers];
+  bzero(nodes, sizeof nodes);
+
+  clock_t start = clock();
+  unsigned i, j;
+  for (i = 0; i < peers; ++i)
+    nodes[i].state = sync_alloc_state(&nodes[i], sync_sim_peer_has, NULL, NULL);
+  for (i = 0; i < keys; ++i){
+    sync_key_t key;
+    randombytes_buf(key.key, sizeof key.key);
+    for (j = 0; j < peers; ++j)
+      sync_sim_add_key(&nodes[j], &key);
+  }
+  for (j = 0; j < peers; ++j){
+    for (i = 0; i < unique; ++i){
+      sync_key_t key;
+      randombytes_buf(key.key, sizeof key.key);
+      sync_sim_add_key(&nodes[j], &key);
+    }
+  }
+  clock_t built = clock();
+
+  // every round, each peer broadcasts one packet to all of the others
+  const unsigned total = keys + unique * peers;
+  unsigned rounds = 0, messages = 0, complete = 0;
+  size_t bytes = 0;
+  while (complete < peers && rounds < 100000){
+    rounds++;
+    for (i = 0; i < peers; ++i){
+      uint8_t buff[MDP_MTU];
+      size_t len = sync_build_message(nodes[i].state, buff, sizeof buff);
+      if (len == 0)
+	continue;
+      messages++;
+      bytes += len;
+      for (j = 0; j < peers; ++j){
+	if (j == i)
+	  continue;
+	sync_recv_message(nodes[j].state, &nodes[i], buff, len);
+	unsigned k;
+	for (k = 0; k < nodes[j].pending_count; ++k)
+	  sync_sim_add_key(&nodes[j], &nodes[j].pending[k]);
+	nodes[j].pending_count = 0;
+      }
+    }
+    for (complete = 0, i = 0; i < peers; ++i)
+      if (nodes[i].key_count == total)
+	complete++;
+  }
+  clock_t end = clock();
+
+  for (i = 0; i < peers; ++i){
+    sync_free_state(nodes[i].state);
+    free(nodes[i].pending);
+  }
+  clock_t freed = clock();
+
+  cli_printf(context, "%u peers, %u keys each, %u differing: %s after %u rounds\n",
+    peers, keys + unique, unique, complete == peers ? "reconciled" : "NOT reconciled", rounds);
+  cli_printf(context, "messages: %u, bytes: %zu\n", messages, bytes);
+  cli_printf(context, "cpu time: build %.1fms, reconcile %.1fms, free %.1fms\n",
+    (built - start) * 1000.0 / CLOCKS_PER_SEC,
+    (end - built) * 1000.0 / CLOCKS_PER_SEC,
+    (freed - end) * 1000.0 / CLOCKS_PER_SEC);
+  return complete == peers ? 0 : 1;
+}
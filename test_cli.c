@@ -25,6 +25,7 @@
 #include <fcntl.h>
 #include <poll.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 
 #include "cli.h"
 #include "serval_types.h"
@@ -36,9 +37,51 @@
 #include "str.h"
 #include "debug.h"
 #include "nibble_tree.h"
+#include "fdqueue.h"
+#include "socket.h"
+#include "net.h"
+#include "constants.h"
+#include "test_cli.h"
 
 DEFINE_FEATURE(cli_tests);
 
+void test_timer_start(struct test_timer *timer, time_ms_t duration_ms)
+{
+  timer->count = 0;
+  timer->start = gettime_ms();
+  timer->until = timer->start + duration_ms;
+  timer->stop = timer->start;
+}
+
+int test_timer_running(struct test_timer *timer)
+{
+  time_ms_t now = gettime_ms();
+  if (now < timer->until)
+    return 1;
+  timer->stop = now;
+  return 0;
+}
+
+void test_timer_stop(struct test_timer *timer)
+{
+  timer->stop = gettime_ms();
+}
+
+time_ms_t test_timer_elapsed_ms(const struct test_timer *timer)
+{
+  return timer->stop - timer->start;
+}
+
+double test_timer_mean_us(const struct test_timer *timer)
+{
+  return timer->count ? (timer->stop - timer->start) * 1000.0 / timer->count : 0;
+}
+
+double test_timer_per_second(const struct test_timer *timer)
+{
+  return timer->stop > timer->start ? timer->count * 1000.0 / (timer->stop - timer->start) : 0;
+}
+
 DEFINE_CMD(app_byteorder_test, 0,
   "Run byte order handling test",
   "test","byteorder");
@@ -253,6 +296,248 @@ static int app_mem_test(const struct cli_parsed *UNUSED(parsed), struct cli_cont
   return 0;
 }
 
+static void fdqueue_test_callback(struct sched_ent *alarm)
+{
+  (*(unsigned *)alarm->context)++;
+}
+
+DEFINE_CMD(app_fdqueue_test, 0,
+   "Run IO event loop speed test",
+   "test","fdqueue");
+static int app_fdqueue_test(const struct cli_parsed *UNUSED(parsed), struct cli_context *context)
+{
+  // one handle is always readable, all the others are idle
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max){
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+  const char *backends[] = {"poll", "epoll"};
+  unsigned b;
+  for (b = 0; b < NELS(backends); ++b){
+    if (fd_select_backend(backends[b]) == -1)
+      continue;
+    unsigned n;
+    for (n = 10; n <= 1000; n *= 10){
+      int idle[2], active[2];
+      if (pipe(idle) == -1)
+	return WHY_perror("pipe");
+      if (pipe(active) == -1){
+	WHY_perror("pipe");
+	close(idle[0]);
+	close(idle[1]);
+	return -1;
+      }
+      int ret = 0;
+      struct sched_ent *alarms = NULL;
+      if (write(active[1], "x", 1) != 1)
+	ret = WHY_perror("write");
+      else if ((alarms = emalloc_zero(sizeof(struct sched_ent) * n)) == NULL)
+	ret = -1;
+      else{
+	struct profile_total stats = {.name = "fdqueue_test"};
+	unsigned calls = 0, i, watched = 0;
+	for (i = 0; i < n; ++i)
+	  alarms[i].poll.fd = -1;
+	for (i = 0; i < n; ++i){
+	  alarms[i].poll.fd = i ? dup(idle[0]) : active[0];
+	  alarms[i].poll.events = POLLIN;
+	  alarms[i].function = fdqueue_test_callback;
+	  alarms[i].context = &calls;
+	  alarms[i].stats = &stats;
+	  alarms[i]._poll_index = -1;
+	  if (alarms[i].poll.fd == -1){
+	    WHY_perror("dup");
+	    break;
+	  }
+	  if (watch(&alarms[i]) == -1)
+	    break;
+	  watched++;
+	}
+	if (watched == n){
+	  struct test_timer timer;
+	  for (test_timer_start(&timer, 200); test_timer_running(&timer); timer.count++)
+	    fd_poll();
+	  cli_printf(context, "%s: %4u watched fds, %u loops, %u callbacks, mean loop time = %.2fus\n",
+	      fd_backend_name(), n, timer.count, calls, test_timer_mean_us(&timer));
+	}
+	for (i = 0; i < watched; ++i)
+	  unwatch(&alarms[i]);
+	// alarms[0] holds the read end of the active pipe, closed below
+	for (i = 1; i < n; ++i)
+	  if (alarms[i].poll.fd != -1)
+	    close(alarms[i].poll.fd);
+	free(alarms);
+	if (watched != n)
+	  ret = WHYF("Could only watch %u of %u file descriptors", watched, n);
+      }
+      close(idle[0]);
+      close(idle[1]);
+      close(active[0]);
+      close(active[1]);
+      if (ret == -1)
+	return -1;
+    }
+  }
+  return 0;
+}
+
+#define DGRAM_TEST_RECEIVERS_MAX 32
+#define DGRAM_TEST_BATCH 16
+
+// send each packet to every receiver, then read everything back, one system call per packet
+static unsigned dgram_test_single(int tx, int *rx, struct socket_address *addrs, unsigned receivers, uint8_t *packet, size_t len)
+{
+  unsigned i, r, received = 0;
+  for (i = 0; i < DGRAM_TEST_BATCH; ++i)
+    for (r = 0; r < receivers; ++r)
+      sendto(tx, packet, len, 0, &addrs[r].addr, addrs[r].addrlen);
+  for (r = 0; r < receivers; ++r){
+    uint8_t buf[2048];
+    while (recv(rx[r], buf, sizeof buf, 0) > 0)
+      received++;
+  }
+  return received;
+}
+
+#if defined(HAVE_SENDMMSG) && defined(HAVE_RECVMMSG)
+// the same, but with one sendmmsg() per packet and one recvmmsg() per receiver
+static unsigned dgram_test_batched(int tx, int *rx, struct socket_address *addrs, unsigned receivers, uint8_t *packet, size_t len)
+{
+  struct iovec iov = {.iov_base = packet, .iov_len = len};
+  struct mmsghdr msgs[DGRAM_TEST_RECEIVERS_MAX];
+  unsigned i, r, received = 0;
+  bzero(msgs, sizeof msgs);
+  for (r = 0; r < receivers; ++r){
+    msgs[r].msg_hdr.msg_name = &addrs[r].addr;
+    msgs[r].msg_hdr.msg_namelen = addrs[r].addrlen;
+    msgs[r].msg_hdr.msg_iov = &iov;
+    msgs[r].msg_hdr.msg_iovlen = 1;
+  }
+  for (i = 0; i < DGRAM_TEST_BATCH; ++i)
+    sendmmsg(tx, msgs, receivers, 0);
+  static uint8_t bufs[DGRAM_TEST_BATCH][2048];
+  struct iovec riov[DGRAM_TEST_BATCH];
+  struct mmsghdr rmsgs[DGRAM_TEST_BATCH];
+  bzero(rmsgs, sizeof rmsgs);
+  for (i = 0; i < DGRAM_TEST_BATCH; ++i){
+    riov[i].iov_base = bufs[i];
+    riov[i].iov_len = sizeof bufs[i];
+    rmsgs[i].msg_hdr.msg_iov = &riov[i];
+    rmsgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  for (r = 0; r < receivers; ++r){
+    int n;
+    while ((n = recvmmsg(rx[r], rmsgs, DGRAM_TEST_BATCH, MSG_DONTWAIT, NULL)) > 0)
+      received += n;
+  }
+  return received;
+}
+#endif
+
+DEFINE_CMD(app_dgram_test, 0,
+   "Run local datagram socket throughput test",
+   "test","dgram","[<receivers>]");
+static int app_dgram_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  const char *receiversstr;
+  if (cli_arg(parsed, "receivers", &receiversstr, cli_uint, "4") == -1)
+    return -1;
+  unsigned receivers = atoi(receiversstr);
+  if (receivers < 1 || receivers > DGRAM_TEST_RECEIVERS_MAX)
+    return WHYF("Number of receivers must be between 1 and %u", DGRAM_TEST_RECEIVERS_MAX);
+  char folder[] = "/tmp/serval-dgram-XXXXXX";
+  if (!mkdtemp(folder))
+    return WHY_perror("mkdtemp");
+  int ret = -1;
+  int tx = -1;
+  int rx[DGRAM_TEST_RECEIVERS_MAX];
+  struct socket_address addrs[DGRAM_TEST_RECEIVERS_MAX];
+  unsigned r, bound = 0;
+  for (r = 0; r < receivers; ++r, ++bound){
+    if (make_local_sockaddr(&addrs[r], "%s/%u", folder, r) == -1
+      || (rx[r] = esocket(AF_UNIX, SOCK_DGRAM, 0)) == -1)
+      goto end;
+    if (socket_bind(rx[r], &addrs[r]) == -1){
+      close(rx[r]);
+      goto end;
+    }
+    set_nonblock(rx[r]);
+  }
+  if ((tx = esocket(AF_UNIX, SOCK_DGRAM, 0)) == -1)
+    goto end;
+  set_nonblock(tx);
+
+  uint8_t packet[MDP_OVERLAY_MTU];
+  bzero(packet, sizeof packet);
+  const char *names[] = {"single", "batched"};
+  unsigned (*tests[])(int, int *, struct socket_address *, unsigned, uint8_t *, size_t) = {
+    dgram_test_single,
+#if defined(HAVE_SENDMMSG) && defined(HAVE_RECVMMSG)
+    dgram_test_batched,
+#endif
+  };
+  unsigned t;
+  for (t = 0; t < NELS(tests); ++t){
+    struct test_timer timer;
+    for (test_timer_start(&timer, 500); test_timer_running(&timer); )
+      timer.count += tests[t](tx, rx, addrs, receivers, packet, sizeof packet);
+    cli_printf(context, "%8s: %u receivers, %u packets received, %.0f packets/s\n",
+	names[t], receivers, timer.count, test_timer_per_second(&timer));
+  }
+  ret = 0;
+end:
+  if (tx != -1)
+    close(tx);
+  for (r = 0; r < bound; ++r)
+    socket_unlink_close(rx[r]);
+  rmdir(folder);
+  return ret;
+}
+
+static void schedule_test_callback(struct sched_ent *UNUSED(alarm))
+{
+}
+
+DEFINE_CMD(app_schedule_test, 0,
+   "Run alarm scheduling speed test",
+   "test","schedule");
+static int app_schedule_test(const struct cli_parsed *UNUSED(parsed), struct cli_context *context)
+{
+  unsigned n;
+  for (n = 10; n <= 10000; n *= 10){
+    struct profile_total stats = {.name = "schedule_test"};
+    struct sched_ent *alarms = emalloc_zero(sizeof(struct sched_ent) * n);
+    if (!alarms)
+      return -1;
+    time_ms_t now = gettime_ms();
+    unsigned i;
+    for (i = 0; i < n; ++i){
+      alarms[i].function = schedule_test_callback;
+      alarms[i].stats = &stats;
+      alarms[i]._poll_index = -1;
+      alarms[i].poll.fd = -1;
+      time_ms_t when = now + 60000 + random() % 60000;
+      RESCHEDULE(&alarms[i], when, when, when + random() % 1000);
+    }
+    // reschedule random alarms, as timers are constantly pushed back by network activity
+    struct test_timer timer;
+    for (test_timer_start(&timer, 200); test_timer_running(&timer); timer.count += i){
+      for (i = 0; i < 1000; ++i){
+	struct sched_ent *alarm = &alarms[random() % n];
+	time_ms_t when = now + 60000 + random() % 60000;
+	RESCHEDULE(alarm, when, when, when + random() % 1000);
+      }
+    }
+    for (i = 0; i < n; ++i)
+      unschedule(&alarms[i]);
+    free(alarms);
+    cli_printf(context, "%5u scheduled alarms, %u reschedules, mean time = %.3fus\n",
+	n, timer.count, test_timer_mean_us(&timer));
+  }
+  return 0;
+}
+
 DEFINE_CMD(app_config_test, 0,
    "Load a test config file and log various fields",
    "config","test","<file>");
@@ -395,12 +680,10 @@ static void delete_current_node(tree_iterator *it) {
   DEBUGF(verbose, "deleted %s", alloca_tohex(data.binary, sizeof data.binary));
 }
 
-DEFINE_CMD(app_nibble_tree_test, 0,
-  "Run nibble tree test",
-  "test","nibble-tree");
-static int app_nibble_tree_test(const struct cli_parsed *UNUSED(parsed), struct cli_context *UNUSED(context))
+static int nibble_tree_test(bool_t sparse)
 {
-  struct tree_root root = {.index_size_bytes = sizeof(struct data)};
+  DEBUGF(verbose, "testing %s nodes", sparse ? "sparse" : "dense");
+  struct tree_root root = {.index_size_bytes = sizeof(struct data), .sparse = sparse};
   struct tree_statistics stats;
   tree_iterator it;
   // Creation.
@@ -529,3 +812,77 @@ static int app_nibble_tree_test(const struct cli_parsed *UNUSED(parsed), struct
   tree_iterator_free(&it);
   return 0;
 }
+
+DEFINE_CMD(app_nibble_tree_test, 0,
+  "Run nibble tree test",
+  "test","nibble-tree");
+static int app_nibble_tree_test(const struct cli_parsed *UNUSED(parsed), struct cli_context *UNUSED(context))
+{
+  if (nibble_tree_test(0) == -1)
+    return -1;
+  return nibble_tree_test(1);
+}
+
+struct bench_record {
+  size_t binary_size_bits;
+  uint8_t key[32];
+};
+
+static void *create_bench_record(void *UNUSED(context), const uint8_t *binary, size_t binary_size_bytes)
+{
+  struct bench_record *r = (struct bench_record *) emalloc_zero(sizeof(struct bench_record));
+  if (r)
+    memcpy(r->key, binary, binary_size_bytes);
+  return r;
+}
+
+DEFINE_CMD(app_nibble_tree_benchmark, 0,
+  "Measure the memory used by, and lookup rate of, dense and sparse nibble trees",
+  "test","nibble-tree","benchmark");
+static int app_nibble_tree_benchmark(const struct cli_parsed *UNUSED(parsed), struct cli_context *context)
+{
+  const unsigned sizes[] = {1000, 10000, 100000};
+  const char *modes[] = {"dense", "sparse"};
+  unsigned s, mode;
+  for (s = 0; s < NELS(sizes); ++s) {
+    unsigned count = sizes[s];
+    uint8_t (*keys)[32] = emalloc(count * sizeof *keys);
+    if (!keys)
+      return -1;
+    unsigned i, j;
+    for (i = 0; i < count; ++i)
+      for (j = 0; j < sizeof keys[i]; ++j)
+	keys[i][j] = random();
+    for (mode = 0; mode < NELS(modes); ++mode) {
+      struct tree_root root = {.index_size_bytes = sizeof keys[0], .sparse = mode};
+      for (i = 0; i < count; ++i)
+	if (tree_find(&root, NULL, keys[i], sizeof keys[i], create_bench_record, NULL) != TREE_FOUND) {
+	  free(keys);
+	  return WHY("Failed to insert record");
+	}
+      struct tree_statistics stats = tree_compute_statistics(&root);
+      struct test_timer timer;
+      for (test_timer_start(&timer, 250); test_timer_running(&timer); timer.count += count) {
+	for (i = 0; i < count; ++i) {
+	  void *record;
+	  if (tree_find(&root, &record, keys[i], sizeof keys[i], NULL, NULL) != TREE_FOUND) {
+	    free(keys);
+	    return WHY("Failed to find record");
+	  }
+	}
+      }
+      tree_iterator it;
+      void **record;
+      for (tree_iterator_start(&it, &root); (record = tree_iterator_get_node(&it)); ) {
+	free(*record);
+	*record = NULL;
+      }
+      tree_iterator_free(&it);
+      cli_printf(context, "%s %u: %zu nodes, %zu bytes (%.1f per record), depth %zu, %.0f lookups per second\n",
+	modes[mode], count, stats.node_count, stats.node_bytes, (double) stats.node_bytes / count,
+	stats.maximum_depth, test_timer_per_second(&timer));
+    }
+    free(keys);
+  }
+  return 0;
+}
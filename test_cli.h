@@ -0,0 +1,63 @@
+/*
+ Serval testing command line functions
+ Copyright (C) 2018 Flinders University
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __SERVAL_DNA__TEST_CLI_H
+#define __SERVAL_DNA__TEST_CLI_H
+
+#include "os.h"
+#include "lang.h"
+
+/* Timing shared by the "test" benchmark commands.  A timer either measures one
+ * stretch of work between test_timer_start() and test_timer_stop(), or repeats
+ * some work until a duration has passed:
+ *
+ *      struct test_timer timer;
+ *      for (test_timer_start(&timer, 500); test_timer_running(&timer); timer.count += 100)
+ *        ... 100 operations ...
+ *
+ * in which case the operations are counted so that the mean time or rate of
+ * each can be reported.
+ */
+struct test_timer {
+  time_ms_t start;
+  time_ms_t stop;
+  time_ms_t until;
+  unsigned count;
+};
+
+void test_timer_start(struct test_timer *timer, time_ms_t duration_ms);
+int test_timer_running(struct test_timer *timer);
+void test_timer_stop(struct test_timer *timer);
+time_ms_t test_timer_elapsed_ms(const struct test_timer *timer);
+double test_timer_mean_us(const struct test_timer *timer);
+double test_timer_per_second(const struct test_timer *timer);
+
+/* Open the Rhizome database of the instance and begin a transaction, so that
+ * the rows a benchmark inserts are discarded again by rhizome_test_rollback().
+ */
+struct sqlite_retry_state;
+int rhizome_test_begin(struct sqlite_retry_state *retry);
+void rhizome_test_rollback(struct sqlite_retry_state *retry);
+
+/* Write new keyring slots without PIN tags, as versions before tagging did, so
+ * that a benchmark can compare unlocking both kinds.  Defined in keyring.c.
+ */
+void keyring_test_write_untagged(bool_t untagged);
+
+#endif // __SERVAL_DNA__TEST_CLI_H
@@ -26,6 +26,12 @@ void test_features()
   USE_FEATURE(cli_log);
   USE_FEATURE(cli_vomp_console);
   USE_FEATURE(cli_tests);
+  USE_FEATURE(cli_keyring_tests);
+  USE_FEATURE(cli_meshms_tests);
+  USE_FEATURE(cli_overlay_tests);
+  USE_FEATURE(cli_rhizome_tests);
+  USE_FEATURE(cli_sync_keys_tests);
+  USE_FEATURE(http_server);
   USE_FEATURE(log_output_console);
 }
 
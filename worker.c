@@ -0,0 +1,335 @@
+/*
+Serval DNA worker threads
+Copyright (C) 2016 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include "worker.h"
+#include "fdqueue.h"
+#include "conf.h"
+#include "net.h"
+#include "log.h"
+#include "lang.h"
+#include "server.h"
+
+#define WORK_IDLE     0
+#define WORK_QUEUED   1
+#define WORK_RUNNING  2
+#define WORK_DONE     3
+
+/* All of the state below is shared with the worker threads, and is protected
+ * by worker_lock.  Work items are handed back to the main thread through a
+ * pipe, so that completion can be processed like any other IO event.
+ */
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t worker_done = PTHREAD_COND_INITIALIZER;
+static struct work_item *queue_head = NULL;
+static struct work_item **queue_tail = &queue_head;
+// urgent items are queued in order ahead of all others, this is the end of them
+static struct work_item **urgent_tail = &queue_head;
+static struct work_item *done_head = NULL;
+static struct work_item **done_tail = &done_head;
+static unsigned thread_count = 0;
+static unsigned threads_idle = 0;
+static unsigned threads_running = 0;
+// set while fork() waits for running items, so that no more are started
+static uint8_t forking = 0;
+static uint8_t notified = 0;
+static int notify_pipe[2] = {-1, -1};
+
+// the process that started the current threads, threads do not survive fork()
+static pid_t worker_pid = 0;
+
+DEFINE_ALARM(worker_completed);
+
+unsigned worker_threads()
+{
+  return config.server.worker_threads;
+}
+
+static void *worker_main(void *UNUSED(context))
+{
+  pthread_mutex_lock(&worker_lock);
+  while(1){
+    while(!queue_head || forking){
+      threads_idle++;
+      pthread_cond_wait(&worker_wake, &worker_lock);
+      threads_idle--;
+    }
+    struct work_item *item = queue_head;
+    queue_head = item->_next;
+    if (!queue_head)
+      queue_tail = &queue_head;
+    if (urgent_tail == &item->_next)
+      urgent_tail = &queue_head;
+    item->_next = NULL;
+    item->_state = WORK_RUNNING;
+    threads_running++;
+    pthread_mutex_unlock(&worker_lock);
+
+    item->work(item);
+
+    pthread_mutex_lock(&worker_lock);
+    threads_running--;
+    item->_state = WORK_DONE;
+    *done_tail = item;
+    done_tail = &item->_next;
+    pthread_cond_broadcast(&worker_done);
+    if (!notified){
+      // the pipe is non-blocking, if it is full the main thread will wake anyway
+      if (write(notify_pipe[1], "", 1) == 1)
+	notified = 1;
+    }
+  }
+  return NULL;
+}
+
+// remove an item from the done list, must hold worker_lock
+static void take_done(struct work_item *item)
+{
+  struct work_item **ptr = &done_head;
+  while(*ptr != item){
+    assert(*ptr);
+    ptr = &(*ptr)->_next;
+  }
+  *ptr = item->_next;
+  if (!*ptr)
+    done_tail = ptr;
+  item->_next = NULL;
+}
+
+void worker_completed(struct sched_ent *alarm)
+{
+  if (alarm->poll.revents & POLLIN){
+    char buf[32];
+    while(read(alarm->poll.fd, buf, sizeof buf) > 0)
+      ;
+  }
+  // completed callbacks may wait for or submit other items, so only take one at a time
+  while(1){
+    pthread_mutex_lock(&worker_lock);
+    notified = 0;
+    struct work_item *item = done_head;
+    if (item)
+      take_done(item);
+    pthread_mutex_unlock(&worker_lock);
+    if (!item)
+      break;
+    item->_state = WORK_IDLE;
+    item->completed(item);
+  }
+}
+
+/* Hold the lock across fork(), so that the child inherits consistent queues.  Items that are
+ * running are allowed to finish first, as the child has none of the parent's threads to finish
+ * them.  Queued items stay queued in both processes; the child runs them on its own threads once
+ * it submits more work, or in worker_wait().  Idle threads may have been waiting on the
+ * conditions, so the child starts again with fresh ones.
+ */
+static void worker_atfork_prepare()
+{
+  pthread_mutex_lock(&worker_lock);
+  forking = 1;
+  while(threads_running)
+    pthread_cond_wait(&worker_done, &worker_lock);
+}
+
+static void worker_atfork_parent()
+{
+  forking = 0;
+  if (queue_head)
+    pthread_cond_broadcast(&worker_wake);
+  pthread_mutex_unlock(&worker_lock);
+}
+
+static void worker_atfork_child()
+{
+  pthread_mutex_init(&worker_lock, NULL);
+  pthread_cond_init(&worker_wake, NULL);
+  pthread_cond_init(&worker_done, NULL);
+  forking = 0;
+  thread_count = 0;
+  threads_idle = 0;
+  threads_running = 0;
+  notified = 0;
+}
+
+static int worker_start()
+{
+  if (worker_pid == getpid())
+    return 0;
+
+  if (!worker_pid){
+    int r = pthread_atfork(worker_atfork_prepare, worker_atfork_parent, worker_atfork_child);
+    if (r)
+      return WHYF("pthread_atfork: %s", strerror(r));
+  }else{
+    // forked from the process that started the threads, the pipe is shared with the parent
+    if (is_watching(&ALARM_STRUCT(worker_completed)))
+      unwatch(&ALARM_STRUCT(worker_completed));
+    if (notify_pipe[0]!=-1){
+      close(notify_pipe[0]);
+      close(notify_pipe[1]);
+      notify_pipe[0] = notify_pipe[1] = -1;
+    }
+  }
+
+  if (pipe(notify_pipe) == -1)
+    return WHY_perror("pipe");
+  if (set_nonblock(notify_pipe[0]) == -1 || set_nonblock(notify_pipe[1]) == -1){
+    close(notify_pipe[0]);
+    close(notify_pipe[1]);
+    notify_pipe[0] = notify_pipe[1] = -1;
+    return -1;
+  }
+  ALARM_STRUCT(worker_completed).poll.fd = notify_pipe[0];
+  ALARM_STRUCT(worker_completed).poll.events = POLLIN;
+  watch(&ALARM_STRUCT(worker_completed));
+  worker_pid = getpid();
+  // items inherited from our parent may have finished before the fork
+  if (done_head && write(notify_pipe[1], "", 1) == 1)
+    notified = 1;
+  return 0;
+}
+
+// must hold worker_lock, returns an error number
+static int worker_spawn()
+{
+  // signals should only ever be delivered to the main thread
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_t thread;
+  int r = pthread_create(&thread, NULL, worker_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (r == 0){
+    pthread_detach(thread);
+    thread_count++;
+  }
+  return r;
+}
+
+static int submit(struct work_item *item, uint8_t urgent)
+{
+  assert(item->_state == WORK_IDLE);
+  unsigned max_threads = worker_threads();
+  if (max_threads == 0)
+    return -1;
+  if (worker_start() == -1)
+    return -1;
+
+  pthread_mutex_lock(&worker_lock);
+  int err = 0;
+  if (threads_idle == 0 && thread_count < max_threads)
+    err = worker_spawn();
+  if (thread_count == 0){
+    pthread_mutex_unlock(&worker_lock);
+    return WHYF("pthread_create: %s", strerror(err));
+  }
+  // start any items inherited from our parent too
+  if (queue_head)
+    pthread_cond_broadcast(&worker_wake);
+  item->_state = WORK_QUEUED;
+  if (urgent){
+    item->_next = *urgent_tail;
+    *urgent_tail = item;
+    if (queue_tail == urgent_tail)
+      queue_tail = &item->_next;
+    urgent_tail = &item->_next;
+  }else{
+    item->_next = NULL;
+    *queue_tail = item;
+    queue_tail = &item->_next;
+  }
+  pthread_cond_signal(&worker_wake);
+  pthread_mutex_unlock(&worker_lock);
+
+  if (err)
+    WARNF("pthread_create: %s, continuing with %u worker threads", strerror(err), thread_count);
+  return 0;
+}
+
+int worker_submit(struct work_item *item)
+{
+  return submit(item, 0);
+}
+
+int worker_submit_urgent(struct work_item *item)
+{
+  return submit(item, 1);
+}
+
+// remove an item from the queue, must hold worker_lock
+static void take_queued(struct work_item *item)
+{
+  struct work_item **ptr = &queue_head;
+  while(*ptr != item){
+    assert(*ptr);
+    ptr = &(*ptr)->_next;
+  }
+  *ptr = item->_next;
+  if (!*ptr)
+    queue_tail = ptr;
+  if (urgent_tail == &item->_next)
+    urgent_tail = ptr;
+  item->_next = NULL;
+}
+
+int worker_wait(struct work_item *item)
+{
+  if (item->_state == WORK_IDLE)
+    return 0;
+  pthread_mutex_lock(&worker_lock);
+  if (item->_state == WORK_QUEUED && thread_count == 0){
+    // queued before we were forked, and there are no threads here to run it
+    take_queued(item);
+    pthread_mutex_unlock(&worker_lock);
+    item->work(item);
+  }else{
+    while(item->_state != WORK_DONE)
+      pthread_cond_wait(&worker_done, &worker_lock);
+    take_done(item);
+    pthread_mutex_unlock(&worker_lock);
+  }
+  item->_state = WORK_IDLE;
+  item->completed(item);
+  return 0;
+}
+
+// finish all outstanding work, so that the server can stop watching the notification pipe,
+// which a forked daemon may have inherited from the process that started the threads
+static void worker_shutdown()
+{
+  while(1){
+    pthread_mutex_lock(&worker_lock);
+    while(!done_head && !queue_head && threads_running)
+      pthread_cond_wait(&worker_done, &worker_lock);
+    struct work_item *item = done_head ? done_head : queue_head;
+    pthread_mutex_unlock(&worker_lock);
+    if (!item)
+      break;
+    worker_wait(item);
+  }
+  if (is_watching(&ALARM_STRUCT(worker_completed)))
+    unwatch(&ALARM_STRUCT(worker_completed));
+}
+DEFINE_TRIGGER(shutdown, worker_shutdown);
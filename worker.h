@@ -0,0 +1,68 @@
+/*
+Serval DNA worker threads
+Copyright (C) 2016 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef __SERVAL_DNA__WORKER_H
+#define __SERVAL_DNA__WORKER_H
+
+#include <stdint.h>
+
+/* A small pool of threads for CPU or disk bound work (hashing, encryption,
+ * large file writes) that would otherwise stall the main loop.
+ *
+ * The work function runs on a worker thread, so it must only touch the memory
+ * owned by its item; it must not log, use the database, or call any scheduler
+ * function.  The completed function is always called on the thread that
+ * submitted the item, either from the completion alarm in fd_poll(), or from
+ * worker_wait().  Nothing else in the daemon ever needs to take a lock.
+ */
+
+struct work_item;
+
+typedef void (*WORK_FUNCP)(struct work_item *item);
+
+struct work_item{
+  struct work_item *_next;
+  uint8_t _state;
+  WORK_FUNCP work;
+  WORK_FUNCP completed;
+};
+
+/* Return the number of worker threads allowed by config, zero if all work
+ * should be done by the caller.
+ */
+unsigned worker_threads();
+
+/* Queue an item for processing, returns -1 if the item could not be queued,
+ * in which case the caller should do the work itself.
+ */
+int worker_submit(struct work_item *item);
+
+/* As worker_submit(), but the item is started before any that are not urgent,
+ * for work that the main thread is about to wait for.
+ */
+int worker_submit_urgent(struct work_item *item);
+
+/* Block until a submitted item has been processed, then call its completed
+ * function.  Returns 0 immediately if the item is not queued.
+ */
+int worker_wait(struct work_item *item);
+
+#define is_worker_busy(X) ((X)->_state != 0)
+
+#endif // __SERVAL_DNA__WORKER_H